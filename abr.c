@@ -0,0 +1,143 @@
+/*
+ * Adaptive bitrate
+ *
+ * Every ABR_INTERVAL_US the output backlog (bytes written by the encoder but
+ * not yet read by the consumer) is converted to time at the current bitrate.
+ * More than abr_backlog_ms for ABR_DOWN_SAMPLES samples in a row cuts the
+ * bitrate to 70%, or to 90% of the measured send rate if that is lower, down
+ * to the floor; at the floor, with abr_fps_step set, the frame rate is halved
+ * instead. Less than a quarter of abr_backlog_ms for ABR_UP_SAMPLES samples
+ * in a row first restores the frame rate, then raises the bitrate by 10% up
+ * to the ceiling. In between nothing changes, and every change restarts both
+ * counts, so the controller does not oscillate around one threshold.
+ *
+ * The controller is under a lock: the control socket's bitrate command
+ * restarts it on the capture thread while the thread draining the encoder
+ * (the OMX callback's, in raw mode) updates it.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "abr.h"
+#include "stats.h"
+
+#define ABR_INTERVAL_US    500000
+#define ABR_DOWN_SAMPLES   2
+#define ABR_UP_SAMPLES     6
+#define ABR_MAX_DIVISOR    4
+
+int abr, abr_min, abr_max, abr_backlog_ms = 300, abr_fps_step;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int      current, floor_bps, ceiling_bps, divisor = 1;
+static int      congested, clear;
+static int64_t  last_us;
+static uint64_t last_written;
+static unsigned long downs, ups;
+
+void abr_start(int bitrate)
+{
+	pthread_mutex_lock(&lock);
+	current = bitrate;
+	ceiling_bps = abr_max ? abr_max : bitrate;
+	floor_bps = abr_min ? abr_min : ceiling_bps / 8;
+	if (current > ceiling_bps)
+		current = ceiling_bps;
+	if (current < floor_bps)
+		current = floor_bps;
+	divisor = 1;
+	congested = clear = 0;
+	last_us = 0;
+	stats_event("abr: start at %d kbps, floor %d kbps, ceiling %d kbps, backlog limit %d ms%s",
+		current / 1000, floor_bps / 1000, ceiling_bps / 1000, abr_backlog_ms, abr_fps_step ? ", fps step-down" : "");
+	pthread_mutex_unlock(&lock);
+}
+
+static int update(int64_t now_us, size_t backlog, uint64_t written, int *bitrate, int *frame_divisor)
+{
+	int send_bps, backlog_ms, previous = current, previous_divisor = divisor;
+	const char *why;
+
+	if (!last_us) {
+		last_us = now_us;
+		last_written = written;
+		return 0;
+	}
+	if (now_us - last_us < ABR_INTERVAL_US || current <= 0)
+		return 0;
+
+	send_bps = (written - last_written) * 8 * 1000000 / (now_us - last_us);
+	backlog_ms = (int64_t)backlog * 8 * 1000 / current;
+	last_us = now_us;
+	last_written = written;
+
+	if (backlog_ms > abr_backlog_ms) {
+		clear = 0;
+		if (++congested < ABR_DOWN_SAMPLES)
+			return 0;
+		if (current > floor_bps) {
+			int target = current / 10 * 7;
+			if (send_bps > 0 && send_bps < current && send_bps / 10 * 9 < target)
+				target = send_bps / 10 * 9;
+			current = target > floor_bps ? target : floor_bps;
+			why = "down";
+		}
+		else if (abr_fps_step && divisor < ABR_MAX_DIVISOR) {
+			divisor *= 2;
+			why = "fps down";
+		}
+		else
+			return 0;
+		downs++;
+	}
+	else if (backlog_ms < abr_backlog_ms / 4) {
+		congested = 0;
+		if (++clear < ABR_UP_SAMPLES)
+			return 0;
+		if (divisor > 1) {
+			divisor /= 2;
+			why = "fps up";
+		}
+		else if (current < ceiling_bps) {
+			current += current / 10 > ceiling_bps / 20 ? current / 10 : ceiling_bps / 20;
+			if (current > ceiling_bps)
+				current = ceiling_bps;
+			why = "up";
+		}
+		else
+			return 0;
+		ups++;
+	}
+	else {
+		congested = clear = 0;
+		return 0;
+	}
+
+	congested = clear = 0;
+	stats_event("abr: %s, %d -> %d kbps, fps 1/%d -> 1/%d, backlog %d ms, send rate %d kbps",
+		why, previous / 1000, current / 1000, previous_divisor, divisor, backlog_ms, send_bps / 1000);
+	*bitrate = current;
+	*frame_divisor = divisor;
+	return 1;
+}
+
+/* returns 1 and the new settings when the encoder should change */
+int abr_update(int64_t now_us, size_t backlog, uint64_t written, int *bitrate, int *frame_divisor)
+{
+	int changed;
+
+	pthread_mutex_lock(&lock);
+	changed = update(now_us, backlog, written, bitrate, frame_divisor);
+	pthread_mutex_unlock(&lock);
+	return changed;
+}
+
+void abr_report(FILE *out)
+{
+	if (!abr)
+		return;
+	pthread_mutex_lock(&lock);
+	fprintf(out, "abr: %lu steps down, %lu up, ending at %d kbps, fps 1/%d\n", downs, ups, current / 1000, divisor);
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,18 @@
+/*
+ * Adaptive bitrate
+ */
+
+#ifndef ABR_H
+#define ABR_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern int abr, abr_min, abr_max, abr_backlog_ms, abr_fps_step;
+
+void abr_start(int bitrate);
+int abr_update(int64_t now_us, size_t backlog, uint64_t written, int *bitrate, int *divisor);
+void abr_report(FILE *out);
+
+#endif /* ABR_H */
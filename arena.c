@@ -0,0 +1,249 @@
+/*
+ * Slab arena for compressed (MJPEG) frames
+ *
+ * The driver's sizeimage is a worst case that real MJPEG frames rarely come
+ * near, so instead of sizing every frame buffer from it, blocks are carved
+ * out of slabs whose slot size is learned from the first frames seen and
+ * raised when too many frames overflow it. Slabs are mapped on demand up to
+ * a hard cap. A frame that does not fit a slot gets a block of its own, and a
+ * frame that would take the arena over its cap is refused (dropped).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define ARENA_WARMUP      16    /* frames sampled before the first slab */
+#define ARENA_SLAB_SLOTS  8
+#define ARENA_WINDOW      64    /* allocations between slot size reviews */
+#define ARENA_HDR         64    /* block header, keeps payloads cache line aligned */
+
+struct slab {
+	struct slab  *next;
+	size_t        slot_size;    /* including the block header */
+	size_t        length;       /* mapped bytes */
+	unsigned int  used;
+	void         *free;         /* free slots, linked through their first word */
+};
+
+struct block {
+	struct slab  *slab;         /* NULL if the block was malloc()ed */
+	size_t        size;
+};
+
+struct arena {
+	size_t        cap, max_block;
+	size_t        slot_size;    /* for new slabs, 0 while learning */
+	size_t        resident, peak;
+	struct slab  *slabs;
+	unsigned int  nslabs;
+	size_t        samples[ARENA_WARMUP];
+	unsigned int  nsamples;
+	unsigned int  window, window_oversize;
+	unsigned long allocs, oversize, refused;
+};
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+static int cmp_size(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void account(struct arena *arena, long bytes)
+{
+	arena->resident += bytes;
+	if (arena->resident > arena->peak)
+		arena->peak = arena->resident;
+}
+
+static void *block_alloc(struct arena *arena, size_t size)
+{
+	struct block *block;
+
+	if (arena->resident + ARENA_HDR + size > arena->cap ||
+		posix_memalign((void **)&block, ARENA_HDR, ARENA_HDR + size)) {
+		arena->refused++;
+		return NULL;
+	}
+	block->slab = NULL;
+	block->size = size;
+	account(arena, ARENA_HDR + size);
+
+	return (uint8_t *)block + ARENA_HDR;
+}
+
+static struct slab *slab_create(struct arena *arena)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t length = round_up(ARENA_HDR + ARENA_SLAB_SLOTS * arena->slot_size, page);
+	struct slab *slab;
+	uint8_t *slot;
+	unsigned int i;
+
+	if (arena->resident + length > arena->cap)
+		return NULL;
+
+	slab = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED)
+		return NULL;
+
+	slab->slot_size = arena->slot_size;
+	slab->length = length;
+	slab->used = 0;
+	slab->free = NULL;
+	for (i = 0; i < ARENA_SLAB_SLOTS; i++) {
+		slot = (uint8_t *)slab + ARENA_HDR + (ARENA_SLAB_SLOTS - 1 - i) * slab->slot_size;
+		*(void **)slot = slab->free;
+		slab->free = slot;
+	}
+
+	slab->next = arena->slabs;
+	arena->slabs = slab;
+	arena->nslabs++;
+	account(arena, length);
+
+	return slab;
+}
+
+static void slab_destroy(struct arena *arena, struct slab *slab)
+{
+	struct slab **link;
+
+	for (link = &arena->slabs; *link != slab; link = &(*link)->next)
+		;
+	*link = slab->next;
+	arena->nslabs--;
+	arena->resident -= slab->length;
+	munmap(slab, slab->length);
+}
+
+/* slot size from the 90th percentile of the sampled frames plus a quarter headroom */
+static void learn_slot_size(struct arena *arena)
+{
+	qsort(arena->samples, ARENA_WARMUP, sizeof(arena->samples[0]), cmp_size);
+	arena->slot_size = round_up(ARENA_HDR + arena->samples[ARENA_WARMUP * 9 / 10] * 5 / 4, 4096);
+	if (arena->slot_size > ARENA_HDR + arena->max_block)
+		arena->slot_size = round_up(ARENA_HDR + arena->max_block, ARENA_HDR);
+}
+
+/* more than one in eight frames oversize: use bigger slots for new slabs and drop the empty small ones */
+static void review_slot_size(struct arena *arena)
+{
+	struct slab *slab, *next;
+
+	if (arena->window_oversize * 8 > arena->window &&
+		arena->slot_size < ARENA_HDR + arena->max_block) {
+		arena->slot_size = round_up(arena->slot_size * 3 / 2, 4096);
+		if (arena->slot_size > ARENA_HDR + arena->max_block)
+			arena->slot_size = round_up(ARENA_HDR + arena->max_block, ARENA_HDR);
+
+		for (slab = arena->slabs; slab; slab = next) {
+			next = slab->next;
+			if (!slab->used && slab->slot_size < arena->slot_size)
+				slab_destroy(arena, slab);
+		}
+	}
+	arena->window = arena->window_oversize = 0;
+}
+
+struct arena *arena_create(size_t cap, size_t max_block)
+{
+	struct arena *arena = calloc(1, sizeof(*arena));
+
+	if (arena) {
+		arena->cap = cap;
+		arena->max_block = max_block;
+	}
+	return arena;
+}
+
+void arena_destroy(struct arena *arena)
+{
+	while (arena->slabs)
+		slab_destroy(arena, arena->slabs);
+	free(arena);
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct slab *slab, *best = NULL;
+	struct block *block;
+
+	arena->allocs++;
+
+	if (!arena->slot_size) {
+		arena->samples[arena->nsamples++] = size;
+		if (arena->nsamples == ARENA_WARMUP)
+			learn_slot_size(arena);
+		return block_alloc(arena, size);
+	}
+
+	if (++arena->window == ARENA_WINDOW)
+		review_slot_size(arena);
+
+	if (ARENA_HDR + size > arena->slot_size) {
+		arena->oversize++;
+		arena->window_oversize++;
+	}
+
+	/* tightest slab with a free slot the frame fits in */
+	for (slab = arena->slabs; slab; slab = slab->next)
+		if (slab->free && ARENA_HDR + size <= slab->slot_size &&
+			(!best || slab->slot_size < best->slot_size))
+			best = slab;
+
+	if (!best && ARENA_HDR + size <= arena->slot_size)
+		best = slab_create(arena);
+
+	if (!best)
+		return block_alloc(arena, size);
+
+	block = best->free;
+	best->free = *(void **)block;
+	best->used++;
+	block->slab = best;
+	block->size = size;
+
+	return (uint8_t *)block + ARENA_HDR;
+}
+
+void arena_free(struct arena *arena, void *ptr)
+{
+	struct block *block = (struct block *)((uint8_t *)ptr - ARENA_HDR);
+	struct slab *slab = block->slab;
+
+	if (!slab) {
+		arena->resident -= ARENA_HDR + block->size;
+		free(block);
+		return;
+	}
+
+	*(void **)block = slab->free;
+	slab->free = block;
+	if (--slab->used == 0 && slab->slot_size < arena->slot_size)
+		slab_destroy(arena, slab);
+}
+
+/* payload bytes per slot, 0 while the frame size distribution is still being sampled */
+size_t arena_slot_size(const struct arena *arena)
+{
+	return arena->slot_size ? arena->slot_size - ARENA_HDR : 0;
+}
+
+void arena_report(const struct arena *arena, FILE *out)
+{
+	fprintf(out, "frame arena: %lu bytes/slot, %u slabs, resident %lu KB (peak %lu KB, cap %lu KB), "
+		"%lu frames, %lu oversize, %lu refused; worst case frame %lu KB\n",
+		(unsigned long)arena_slot_size(arena), arena->nslabs,
+		(unsigned long)arena->resident >> 10, (unsigned long)arena->peak >> 10, (unsigned long)arena->cap >> 10,
+		arena->allocs, arena->oversize, arena->refused, (unsigned long)arena->max_block >> 10);
+}
@@ -0,0 +1,22 @@
+/*
+ * Slab arena for compressed (MJPEG) frames
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct arena;
+
+struct arena *arena_create(size_t cap, size_t max_block);
+void arena_destroy(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free(struct arena *arena, void *ptr);
+
+size_t arena_slot_size(const struct arena *arena);
+void arena_report(const struct arena *arena, FILE *out);
+
+#endif /* ARENA_H */
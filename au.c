@@ -0,0 +1,57 @@
+/*
+ * Refcounted encoded access units
+ *
+ * An access unit is copied out of the encoder buffers once; everything that
+ * keeps it past the write to stdout (the GOP cache, sinks) takes a reference
+ * instead of a copy. References are taken and dropped from any thread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "au.h"
+
+struct au *au_new(size_t capacity)
+{
+	struct au *au;
+
+	if ((au = malloc(sizeof(*au) + capacity)) == NULL)
+		return NULL;
+	au->refs = 1;
+	au->flags = 0;
+	au->timestamp = 0;
+	au->size = 0;
+	au->capacity = capacity;
+	return au;
+}
+
+/* only while the caller holds the one reference; returns the possibly moved unit, NULL if out of memory */
+struct au *au_append(struct au *au, const void *data, size_t length)
+{
+	if (au->size + length > au->capacity) {
+		size_t capacity = au->capacity * 2 > au->size + length ? au->capacity * 2 : au->size + length;
+		struct au *grown;
+
+		if ((grown = realloc(au, sizeof(*au) + capacity)) == NULL) {
+			free(au);
+			return NULL;
+		}
+		au = grown;
+		au->capacity = capacity;
+	}
+	memcpy(au->data + au->size, data, length);
+	au->size += length;
+	return au;
+}
+
+struct au *au_ref(struct au *au)
+{
+	__sync_add_and_fetch(&au->refs, 1);
+	return au;
+}
+
+void au_unref(struct au *au)
+{
+	if (au && __sync_sub_and_fetch(&au->refs, 1) == 0)
+		free(au);
+}
@@ -0,0 +1,27 @@
+/*
+ * Refcounted encoded access units
+ */
+
+#ifndef AU_H
+#define AU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AU_KEYFRAME   1
+#define AU_CONFIG     2     /* SPS/PPS */
+
+struct au {
+	int           refs;
+	unsigned int  flags;
+	int64_t       timestamp;    /* capture time, CLOCK_MONOTONIC us */
+	size_t        size, capacity;
+	unsigned char data[];
+};
+
+struct au *au_new(size_t capacity);
+struct au *au_append(struct au *au, const void *data, size_t length);
+struct au *au_ref(struct au *au);
+void au_unref(struct au *au);
+
+#endif /* AU_H */
@@ -0,0 +1,172 @@
+/*
+ * bufpool-bench: capture buffers from malloc(), as before bufpool.c, against
+ * the page aligned pool on normal pages, with hugepages and prefaulted
+ *
+ *   bufpool-bench [-b BUFFERS] [-s BYTES] [-f FRAMES]
+ *
+ * For each way of getting the buffers it reports the time to set them up,
+ * the first frame written into each one (what read() or the driver's first
+ * DMA pays in page faults), pinning each buffer the way USERPTR QBUF does
+ * (mlock/munlock stands in for the driver's get_user_pages) and the steady
+ * state per frame: a frame copied in and scanned end to end, as the MJPEG
+ * filter does. Minor page faults are counted alongside. Without reserved
+ * hugepages the hugepage pool falls back to transparent hugepages, as
+ * capture-encode --hugepages does.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "bufpool.h"
+#include "rt.h"
+
+#define MAX_BUFFERS   32
+
+enum backing { MALLOC, POOL, POOL_HUGE, POOL_PREFAULT, BACKINGS };
+static const char *backing_names[BACKINGS] = { "malloc", "pool", "pool huge", "pool prefault" };
+static volatile unsigned int markers_seen;  /* so the scan is not optimized away */
+
+static int64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000000 + now.tv_nsec;
+}
+
+static long minor_faults(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt;
+}
+
+/* the MJPEG filter's pass over every byte of the frame */
+static unsigned int scan(const unsigned char *p, size_t size)
+{
+	unsigned int markers = 0;
+	size_t i;
+
+	for (i = 0; i + 1 < size; i++)
+		markers += p[i] == 0xff && p[i + 1] != 0;
+	return markers;
+}
+
+static void run(enum backing b, int count, size_t size, int frames, const unsigned char *frame)
+{
+	void *buffers[MAX_BUFFERS];
+	struct bufpool *pool = NULL;
+	int64_t t, setup, first, pin = 0, steady;
+	long faults, first_faults, steady_faults;
+	unsigned int markers = 0;
+	int i, pinned = 1;
+
+	hugepages = b == POOL_HUGE;
+	prefault_buffers = b == POOL_PREFAULT;
+
+	t = now_ns();
+	if (b == MALLOC) {
+		for (i = 0; i < count; i++)
+			if ((buffers[i] = malloc(size)) == NULL) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+	}
+	else {
+		if ((pool = bufpool_create(count, size)) == NULL) {
+			perror("bufpool_create");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < count; i++)
+			buffers[i] = bufpool_buffer(pool, i);
+	}
+	setup = now_ns() - t;
+
+	faults = minor_faults();
+	t = now_ns();
+	for (i = 0; i < count; i++)
+		memcpy(buffers[i], frame, size);
+	first = now_ns() - t;
+	first_faults = minor_faults() - faults;
+
+	for (i = 0; i < count && pinned; i++) {
+		t = now_ns();
+		if (mlock(buffers[i], size) < 0 || munlock(buffers[i], size) < 0)
+			pinned = 0;
+		pin += now_ns() - t;
+	}
+
+	faults = minor_faults();
+	t = now_ns();
+	for (i = 0; i < frames; i++) {
+		memcpy(buffers[i % count], frame, size);
+		markers += scan(buffers[i % count], size);
+	}
+	steady = now_ns() - t;
+	steady_faults = minor_faults() - faults;
+
+	printf("%-13s setup %8.1f us, first frame %7.1f us (%5ld faults), pin %6.1f us, frame %7.1f us (%ld faults)",
+		backing_names[b], setup / 1000.0, first / 1000.0 / count, first_faults / count,
+		pinned ? pin / 1000.0 / count : 0.0, steady / 1000.0 / frames, steady_faults);
+	if (!pinned)
+		printf(", mlock: %s", strerror(errno));
+	printf("\n");
+	markers_seen = markers;
+	if (pool)
+		bufpool_destroy(pool);
+	else
+		for (i = 0; i < count; i++)
+			free(buffers[i]);
+}
+
+int main(int argc, char **argv)
+{
+	int c, count = 4, frames = 500;
+	long size = 1920 * 1080 * 2;
+	unsigned char *frame;
+	enum backing b;
+	size_t i;
+
+	while ((c = getopt(argc, argv, "b:s:f:")) != -1)
+		switch (c) {
+		case 'b':
+			count = atoi(optarg);
+			break;
+		case 's':
+			size = atol(optarg);
+			break;
+		case 'f':
+			frames = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b BUFFERS] [-s BYTES] [-f FRAMES]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	if (count < 1 || count > MAX_BUFFERS || size < 1 || frames < 1) {
+		fprintf(stderr, "buffers 1..%d, bytes and frames above 0\n", MAX_BUFFERS);
+		return EXIT_FAILURE;
+	}
+
+	if ((frame = malloc(size)) == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	/* an 0xff every 97 bytes or so, as in entropy coded JPEG data */
+	for (i = 0; i < (size_t)size; i++)
+		frame[i] = i % 97 ? (unsigned char)(i * 7) : 0xff;
+
+	printf("%d buffers of %ld bytes, %d frames\n", count, size, frames);
+	for (b = MALLOC; b < BACKINGS; b++)
+		run(b, count, size, frames, frame);
+	free(frame);
+	return EXIT_SUCCESS;
+}
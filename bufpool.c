@@ -0,0 +1,98 @@
+/*
+ * Hugepage / page aligned capture buffer pool
+ *
+ * All buffers of a pool live in one anonymous mapping, each starting on a
+ * page (and so cache line) boundary. With --hugepages the mapping is tried
+ * with MAP_HUGETLB first; otherwise, or when no hugepages are reserved, it
+ * falls back to normal pages with MADV_HUGEPAGE so transparent hugepages
+ * can back it. Fewer, larger pages mean fewer pages for the driver to pin
+ * on USERPTR QBUF and fewer TLB misses on the per-frame copy and scan.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bufpool.h"
+#include "rt.h"
+
+#define HUGEPAGE_SIZE (2UL << 20)
+
+int hugepages;
+
+struct bufpool {
+	void         *base;
+	size_t        length;   /* mapped bytes */
+	size_t        stride;   /* distance between buffer starts */
+	unsigned int  count;
+	const char   *backing;
+};
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+struct bufpool *bufpool_create(unsigned int count, size_t size)
+{
+	struct bufpool *pool = calloc(1, sizeof(*pool));
+	int populate = prefault_buffers ? MAP_POPULATE : 0;
+
+	if (!pool)
+		return NULL;
+
+	pool->count = count;
+	pool->stride = round_up(size, sysconf(_SC_PAGESIZE));
+	pool->base = MAP_FAILED;
+
+	if (hugepages) {
+		pool->length = round_up(count * pool->stride, HUGEPAGE_SIZE);
+		pool->base = mmap(NULL, pool->length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+		if (pool->base == MAP_FAILED)
+			fprintf(stderr, "no hugepages for %lu KB of capture buffers (%s), using normal pages\n",
+				(unsigned long)pool->length >> 10, strerror(errno));
+		else
+			pool->backing = "hugetlb";
+	}
+
+	if (pool->base == MAP_FAILED) {
+		pool->length = count * pool->stride;
+		pool->base = mmap(NULL, pool->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+		if (pool->base == MAP_FAILED) {
+			free(pool);
+			return NULL;
+		}
+		pool->backing = "pages";
+#ifdef MADV_HUGEPAGE
+		if (hugepages && pool->length >= HUGEPAGE_SIZE && 0 == madvise(pool->base, pool->length, MADV_HUGEPAGE))
+			pool->backing = "transparent hugepages";
+#endif
+	}
+
+	return pool;
+}
+
+void *bufpool_buffer(const struct bufpool *pool, unsigned int i)
+{
+	return i < pool->count ? (char *)pool->base + i * pool->stride : NULL;
+}
+
+void bufpool_destroy(struct bufpool *pool)
+{
+	if (pool) {
+		munmap(pool->base, pool->length);
+		free(pool);
+	}
+}
+
+void bufpool_describe(const struct bufpool *pool, FILE *out)
+{
+	fprintf(out, "capture buffer pool: %u x %lu bytes page aligned, %lu KB %s%s\n",
+		pool->count, (unsigned long)pool->stride, (unsigned long)pool->length >> 10, pool->backing,
+		prefault_buffers ? ", prefaulted" : "");
+}
@@ -0,0 +1,20 @@
+/*
+ * Hugepage / page aligned capture buffer pool
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct bufpool;
+
+extern int hugepages;
+
+struct bufpool *bufpool_create(unsigned int count, size_t size);
+void *bufpool_buffer(const struct bufpool *pool, unsigned int i);
+void bufpool_destroy(struct bufpool *pool);
+void bufpool_describe(const struct bufpool *pool, FILE *out);
+
+#endif /* BUFPOOL_H */
@@ -30,6 +30,26 @@
 #include "bcm_host.h"
 #include "ilclient.h"
 
+#include "arena.h"
+#include "rt.h"
+#include "stats.h"
+#include "bufpool.h"
+#include "output.h"
+#include "abr.h"
+#include "control.h"
+#include "gop.h"
+#include "sink.h"
+#include "server.h"
+#include "shmout.h"
+#include "capture.h"
+#include "encoder.h"
+#include "decode.h"
+#include "motion.h"
+#include "preroll.h"
+#include "segment.h"
+#include "mp4.h"
+#include "hls.h"
+
 /*
 * MJPEG/AVI1 to JPEG/JFIF bitstream format filter
 * Copyright (c) 2010 Adrian Daerr and Nicolas George
@@ -205,6 +225,28 @@ static int mjpeg2jpeg_filter(/*AVBitStreamFilterContext *bsfc,
 	return output_size;
 }
 
+/* mjpeg2jpeg_filter() writing to dst instead of in place; with dst NULL it only sizes the output */
+static int mjpeg2jpeg_copy(uint8_t *dst, const uint8_t *buf, int buf_size)
+{
+	int input_skip;
+
+	if (buf_size < 12 || memcmp("AVI1", buf + 6, 4)) {
+		fprintf(stderr, "input is not MJPEG/AVI1\n");
+		return -1;
+	}
+	input_skip = (buf[4] << 8) + buf[5] + 4;
+	if (buf_size < input_skip) {
+		fprintf(stderr, "input is truncated\n");
+		return -1;
+	}
+	if (dst) {
+		dst = append(dst, jpeg_header, sizeof(jpeg_header));
+		dst = append_dht_segment(dst);
+		append(dst, buf + input_skip, buf_size - input_skip);
+	}
+	return buf_size - input_skip + sizeof(jpeg_header) + dht_segment_size;
+}
+
 //AVBitStreamFilter ff_mjpeg2jpeg_bsf = {
 //	.name = "mjpeg2jpeg",
 //	.filter = mjpeg2jpeg_filter,
@@ -221,24 +263,26 @@ enum io_method {
 struct buffer {
 	void   *start;
 	size_t  length;
+	struct bufpool *pool;   /* set on the first buffer of each pool, which owns it */
 };
 
 static char            *dev_name = "/dev/video0", 
                        *test_encode_filename = "test.h264";
 char                   *write_media_file = NULL;
 static enum io_method   io = IO_METHOD_MMAP;
-static int              fd = -1;
-static struct buffer   *buffers;
-static unsigned int     n_buffers;
+static struct capture   camera, cameras[CAMERA_MAX - 1];
+static char            *camera_specs[CAMERA_MAX - 1];
+static int              camera_specs_count;
+static const struct encoder *encoder = &encoder_omx;
 static int              output, force_format, fps, fps_cur, fps_avg, encode, tst_enc, m2jpeg = 1;
 int                     psips, bitrate, codec = 5/* H.264/AVC */;
-static struct timespec  start, end;
-static double           fps_total;
-static int              fps_count;
+int                     inflight = 3;
+int                     control_rate = -1, idr_period = -1, avc_profile, avc_level, qp_min, qp_max, qp_i, qp_p, slices, low_latency;
+int                     capture_buffers, adaptive_buffers;
+unsigned int            arena_mb;
 static int              frame_count = 1000000;
 //static int              img_width = 640, img_height = 480;
 //static OMX_COLOR_FORMATTYPE  img_fmt = OMX_COLOR_FormatYUV420PackedPlanar;
-static struct v4l2_format    v4l2_fmt;
 
 void time_diff(struct timespec *start, struct timespec *end, struct timespec *result)
 {
@@ -269,17 +313,17 @@ static int xioctl(int fh, unsigned long int request, void *arg)
 	return r;
 }
 
-static void process_image(const void *p, int size)
+static void process_image(struct capture *cap, const void *p, int size)
 {
 	if (output) {
 		fwrite(p, size, 1, stdout);
 		fflush(stdout);
 	}
 	if (fps) {
-		clock_gettime(CLOCK_MONOTONIC, &end);
-		if (start.tv_sec + start.tv_nsec > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &cap->end);
+		if (cap->start.tv_sec + cap->start.tv_nsec > 0) {
 			struct timespec diff;
-			time_diff(&start, &end, &diff);
+			time_diff(&cap->start, &cap->end, &diff);
 			//fprintf(stderr, "%ld.%09ld ", diff.tv_sec, diff.tv_nsec);
 			double fps_current  = 1000000000.0 / (1000000000.0 * diff.tv_sec + diff.tv_nsec);
 			if (fps_cur) {
@@ -287,12 +331,193 @@ static void process_image(const void *p, int size)
 				fflush(stderr);
 			}
 			if (fps_avg) {
-				fps_total += fps_current;
-				fps_count++;
+				cap->fps_total += fps_current;
+				cap->fps_count++;
 			}
 		}
-		start = end;
+		cap->start = cap->end;
+	}
+}
+
+/* Nominal capture frame rate, 0 if the driver does not report it */
+unsigned int capture_frame_rate(struct capture *cap)
+{
+	struct v4l2_streamparm parm;
+
+	CLEAR(parm);
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (-1 == xioctl(cap->fd, VIDIOC_G_PARM, &parm) ||
+		parm.parm.capture.timeperframe.numerator == 0)
+		return 0;
+
+	return (parm.parm.capture.timeperframe.denominator + parm.parm.capture.timeperframe.numerator / 2) /
+		parm.parm.capture.timeperframe.numerator;
+}
+
+/*
+ * Change the capture frame rate while streaming. Returns the rate the driver
+ * settled on, 0 if it refused (many UVC cameras only accept VIDIOC_S_PARM
+ * with the stream off, and the stream is not stopped for this).
+ */
+unsigned int capture_set_frame_rate(struct capture *cap, unsigned int rate)
+{
+	struct v4l2_streamparm parm;
+
+	CLEAR(parm);
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	parm.parm.capture.timeperframe.numerator = 1;
+	parm.parm.capture.timeperframe.denominator = rate;
+
+	if (-1 == xioctl(cap->fd, VIDIOC_S_PARM, &parm))
+		return 0;
+
+	if ((rate = capture_frame_rate(cap)) != 0 && cap->frame_period_us)
+		cap->frame_period_us = 1000000L / rate;
+	return rate;
+}
+
+#define DEFAULT_CAPTURE_BUFFERS 4
+#define MAX_CAPTURE_BUFFERS     32
+
+static void report_buffers(struct capture *cap, const char *what)
+{
+	unsigned long footprint = 0;
+	unsigned int i;
+
+	for (i = 0; i < (io == IO_METHOD_READ ? 1 : cap->n_buffers); ++i)
+		footprint += cap->buffers[i].length;
+
+	fprintf(stderr, "capture buffers %s: %u x %lu bytes = %lu KB%s\n", what,
+		io == IO_METHOD_READ ? 1 : cap->n_buffers, (unsigned long)cap->buffers[0].length, footprint >> 10,
+		cap->buffers_external ? " (shared with the decoder)" : "");
+}
+
+static void pool_buffers(struct capture *cap, unsigned int first, unsigned int count, size_t length)
+{
+	struct bufpool *pool = bufpool_create(count, length);
+	unsigned int i;
+
+	if (!pool) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	bufpool_describe(pool, stderr);
+
+	for (i = 0; i < count; ++i) {
+		cap->buffers[first + i].start = bufpool_buffer(pool, i);
+		cap->buffers[first + i].length = length;
+		cap->buffers[first + i].pool = i == 0 ? pool : NULL;
+	}
+}
+
+/*
+ * Add buffers to a streaming queue with VIDIOC_CREATE_BUFS. Only buffers the
+ * capture code owns can be added; buffers borrowed from an OMX port are fixed.
+ */
+static int grow_buffers(struct capture *cap, unsigned int count)
+{
+	struct v4l2_create_buffers create;
+	struct buffer *grown;
+	unsigned int i;
+
+	CLEAR(create);
+	create.count = count;
+	create.memory = io == IO_METHOD_MMAP ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+	create.format = cap->v4l2_fmt;
+
+	if (-1 == xioctl(cap->fd, VIDIOC_CREATE_BUFS, &create) || create.count == 0)
+		return 0;
+
+	grown = realloc(cap->buffers, (create.index + create.count) * sizeof(*cap->buffers));
+	if (!grown) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	cap->buffers = grown;
+	memset(cap->buffers + create.index, 0, create.count * sizeof(*cap->buffers));
+	if (io == IO_METHOD_USERPTR)
+		pool_buffers(cap, create.index, create.count, cap->buffers[0].length);
+
+	for (i = create.index; i < create.index + create.count; ++i) {
+		struct v4l2_buffer buf;
+
+		CLEAR(buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = create.memory;
+		buf.index = i;
+
+		if (io == IO_METHOD_MMAP) {
+			if (-1 == xioctl(cap->fd, VIDIOC_QUERYBUF, &buf))
+				errno_exit("VIDIOC_QUERYBUF");
+
+			cap->buffers[i].length = buf.length;
+			cap->buffers[i].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, buf.m.offset);
+
+			if (MAP_FAILED == cap->buffers[i].start)
+				errno_exit("mmap");
+		} else {
+			buf.m.userptr = (unsigned long)cap->buffers[i].start;
+			buf.length = cap->buffers[i].length;
+		}
+
+		if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
+			errno_exit("VIDIOC_QBUF");
+	}
+	cap->n_buffers = create.index + create.count;
+
+	return 1;
+}
+
+/*
+ * Adaptive capture depth: a frame dequeued later than 3/4 of the frame period
+ * after the driver stamped it, or a gap in the driver sequence numbers, means
+ * the queue nearly ran dry. A few of those in a row grow the queue by two.
+ */
+static void adapt_buffers(struct capture *cap, const struct v4l2_buffer *buf)
+{
+	struct timespec now;
+	long lateness_us;
+
+	if (!cap->frame_period_us ||
+		(buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lateness_us = (now.tv_sec - buf->timestamp.tv_sec) * 1000000L +
+		now.tv_nsec / 1000 - buf->timestamp.tv_usec;
+	if (lateness_us > cap->lateness_max_us)
+		cap->lateness_max_us = lateness_us;
+
+	if (lateness_us * 4 > cap->frame_period_us * 3 || (cap->sequence && buf->sequence > cap->sequence + 1))
+		cap->buffers_late++;
+	else if (cap->buffers_late)
+		cap->buffers_late--;
+	cap->sequence = buf->sequence;
+
+	if (cap->buffers_settle) {
+		cap->buffers_settle--;
+		return;
+	}
+	if (cap->buffers_late < 3 || cap->n_buffers >= MAX_CAPTURE_BUFFERS)
+		return;
+
+	if (cap->buffers_external) {
+		fprintf(stderr, "\nDQBUF lateness %.1f ms of %.1f ms frame period; consider --buffers %u\n",
+			lateness_us / 1000.0, cap->frame_period_us / 1000.0, cap->n_buffers + 2);
+		cap->adaptive = 0;
+		return;
 	}
+
+	if (!grow_buffers(cap, 2)) {
+		fprintf(stderr, "\n%s cannot add capture buffers (%d, %s), adaptive mode off\n", cap->dev_name, errno, strerror(errno));
+		cap->adaptive = 0;
+		return;
+	}
+	fprintf(stderr, "\nDQBUF lateness %.1f ms of %.1f ms frame period, ", lateness_us / 1000.0, cap->frame_period_us / 1000.0);
+	report_buffers(cap, "grown");
+	cap->buffers_late = 0;
+	cap->buffers_settle = 2 * cap->n_buffers;
 }
 
 #define SWITCH_ERRNO(str) switch (errno) { \
@@ -305,21 +530,26 @@ static void process_image(const void *p, int size)
 				errno_exit(str); \
 			}
 
-static OMX_BUFFERHEADERTYPE *read_frame(OMX_BUFFERHEADERTYPE *buf_list)
+static OMX_BUFFERHEADERTYPE *read_frame(struct capture *cap, OMX_BUFFERHEADERTYPE *buf_list)
 {
 	struct v4l2_buffer buf;
+	struct timespec t;
 	unsigned int i;
 	void *out_buf;
 
 	switch (io) {
 	case IO_METHOD_READ:
-		out_buf = buf_list == NULL ? buffers[0].start : buf_list->pBuffer;
-		int size = read(fd, out_buf, buffers[0].length);
+		out_buf = buf_list == NULL ? cap->buffers[0].start : buf_list->pBuffer;
+		int size = read(cap->fd, out_buf, cap->buffers[0].length);
 		if (-1 == size)
 			SWITCH_ERRNO("read")
-		if (v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG && m2jpeg)
+		stats_dqbuf(cap->stats);
+		if (cap->v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG && m2jpeg) {
+			stats_timer_start(&t);
 			size = mjpeg2jpeg_filter(out_buf, size);
-		process_image(out_buf, size);
+			stats_timer_stop(cap->stats, STATS_FILTER, &t);
+		}
+		process_image(cap, out_buf, size);
 		if (buf_list != NULL)
 			buf_list->nFilledLen = size;
 		return buf_list;
@@ -329,15 +559,21 @@ static OMX_BUFFERHEADERTYPE *read_frame(OMX_BUFFERHEADERTYPE *buf_list)
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory = V4L2_MEMORY_MMAP;
 
-		if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
+		if (-1 == xioctl(cap->fd, VIDIOC_DQBUF, &buf))
 			SWITCH_ERRNO("VIDIOC_DQBUF")
+		stats_dqbuf(cap->stats);
 
-		assert(buf.index < n_buffers);
+		assert(buf.index < cap->n_buffers);
 
-		process_image(buffers[buf.index].start, buf.bytesused);
+		process_image(cap, cap->buffers[buf.index].start, buf.bytesused);
 
-		if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+		stats_timer_start(&t);
+		if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
 			errno_exit("VIDIOC_QBUF");
+		stats_timer_stop(cap->stats, STATS_QBUF, &t);
+
+		if (cap->adaptive)
+			adapt_buffers(cap, &buf);
 		break;
 
 	case IO_METHOD_USERPTR:
@@ -345,30 +581,41 @@ static OMX_BUFFERHEADERTYPE *read_frame(OMX_BUFFERHEADERTYPE *buf_list)
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory = V4L2_MEMORY_USERPTR;
 
-		if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
+		if (-1 == xioctl(cap->fd, VIDIOC_DQBUF, &buf))
 			SWITCH_ERRNO("VIDIOC_DQBUF")
+		stats_dqbuf(cap->stats);
 
-		for (i = 0; i < n_buffers; ++i)
-			if (buf.m.userptr == (unsigned long)buffers[i].start && 
-				buf.length == buffers[i].length)
+		for (i = 0; i < cap->n_buffers; ++i)
+			if (buf.m.userptr == (unsigned long)cap->buffers[i].start && 
+				buf.length == cap->buffers[i].length)
 				break;
 
-		assert(i < n_buffers);
+		assert(i < cap->n_buffers);
 
-		if (v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG && m2jpeg)
+		if (cap->v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG && m2jpeg) {
+			stats_timer_start(&t);
 			buf.bytesused = mjpeg2jpeg_filter((void *)buf.m.userptr, buf.bytesused);
+			stats_timer_stop(cap->stats, STATS_FILTER, &t);
+		}
 
 		uint bytesused = buf.bytesused;
 
-		process_image((void *)buf.m.userptr, buf.bytesused);
+		process_image(cap, (void *)buf.m.userptr, buf.bytesused);
 
-		if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+		/* when deferred, the buffer goes back to the driver in release_frame() */
+		stats_timer_start(&t);
+		if (!cap->requeue_deferred && -1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
 			errno_exit("VIDIOC_QBUF");
+		if (!cap->requeue_deferred)
+			stats_timer_stop(cap->stats, STATS_QBUF, &t);
+
+		if (cap->adaptive)
+			adapt_buffers(cap, &buf);
 		
 		if (buf_list != NULL) {
 			while (buf_list != NULL) {
-				if (buf_list->pBuffer == buffers[i].start &&
-					buf_list->nAllocLen >= buffers[i].length) {
+				if (buf_list->pBuffer == cap->buffers[i].start &&
+					buf_list->nAllocLen >= cap->buffers[i].length) {
 					buf_list->nFilledLen = bytesused;
 					return buf_list;
 				}
@@ -381,19 +628,19 @@ static OMX_BUFFERHEADERTYPE *read_frame(OMX_BUFFERHEADERTYPE *buf_list)
 	return NULL;
 }
 
-OMX_BUFFERHEADERTYPE *capture_frame(OMX_BUFFERHEADERTYPE *buf_list)
+OMX_BUFFERHEADERTYPE *capture_frame(struct capture *cap, OMX_BUFFERHEADERTYPE *buf_list)
 {
 	for (;;) {
 		fd_set fds;
 		struct timeval tv;
 
 		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
+		FD_SET(cap->fd, &fds);
 		/* Timeout. */
 		tv.tv_sec = 5;
 		tv.tv_usec = 0;
 
-		switch (select(fd + 1, &fds, NULL, NULL, &tv)) {
+		switch (select(cap->fd + 1, &fds, NULL, NULL, &tv)) {
 		case -1:
 			if (EINTR == errno)
 				continue;
@@ -403,30 +650,179 @@ OMX_BUFFERHEADERTYPE *capture_frame(OMX_BUFFERHEADERTYPE *buf_list)
 			exit(EXIT_FAILURE);
 		}
 
-		return read_frame(buf_list);
+		return read_frame(cap, buf_list);
 
 		/* EAGAIN - continue select loop. */
 	}
 }
 
-static inline void report_fps_avg()
+/*
+ * Non-blocking MMAP capture for the frame arena: the frame is copied (and
+ * MJPEG filtered on the way) into an arena block and the driver buffer goes
+ * straight back to the queue. Returns the frame size, 0 if no frame was
+ * ready, -1 if the frame was dropped because the arena is full.
+ */
+int capture_frame_arena(struct capture *cap, struct arena *arena, void **frame)
+{
+	struct v4l2_buffer buf;
+	struct timespec t;
+	int convert = cap->v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG && m2jpeg;
+	int size;
+
+	assert(io == IO_METHOD_MMAP);
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+
+	if (-1 == xioctl(cap->fd, VIDIOC_DQBUF, &buf))
+		SWITCH_ERRNO("VIDIOC_DQBUF")
+	stats_dqbuf(cap->stats);
+
+	assert(buf.index < cap->n_buffers);
+
+	stats_timer_start(&t);
+	size = convert ? mjpeg2jpeg_copy(NULL, cap->buffers[buf.index].start, buf.bytesused) : buf.bytesused;
+	if (size > 0 && (*frame = arena_alloc(arena, size)) != NULL) {
+		if (convert)
+			mjpeg2jpeg_copy(*frame, cap->buffers[buf.index].start, buf.bytesused);
+		else
+			memcpy(*frame, cap->buffers[buf.index].start, size);
+		stats_timer_stop(cap->stats, STATS_FILTER, &t);
+		process_image(cap, *frame, size);
+	}
+	else
+		size = -1;
+
+	stats_timer_start(&t);
+	if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
+		errno_exit("VIDIOC_QBUF");
+	stats_timer_stop(cap->stats, STATS_QBUF, &t);
+
+	if (cap->adaptive)
+		adapt_buffers(cap, &buf);
+
+	return size;
+}
+
+/*
+ * Keep dequeued USERPTR buffers away from the driver until the consumer
+ * hands them back with release_frame(), so a buffer still being read by the
+ * encoder cannot be overwritten by the next capture.
+ */
+void capture_defer_requeue(struct capture *cap, int deferred)
+{
+	cap->requeue_deferred = deferred;
+}
+
+void release_frame(struct capture *cap, OMX_BUFFERHEADERTYPE *buf_hdr)
+{
+	struct v4l2_buffer buf;
+	struct timespec t;
+	unsigned int i;
+
+	if (io != IO_METHOD_USERPTR || !cap->requeue_deferred)
+		return;
+
+	for (i = 0; i < cap->n_buffers; ++i)
+		if (cap->buffers[i].start == buf_hdr->pBuffer)
+			break;
+
+	assert(i < cap->n_buffers);
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_USERPTR;
+	buf.index = i;
+	buf.m.userptr = (unsigned long)cap->buffers[i].start;
+	buf.length = cap->buffers[i].length;
+
+	stats_timer_start(&t);
+	if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
+		errno_exit("VIDIOC_QBUF");
+	stats_timer_stop(cap->stats, STATS_QBUF, &t);
+}
+
+/*
+ * MMAP capture for a consumer that takes the driver buffer itself (the V4L2
+ * M2M encoder): returns the index of the filled buffer, which stays away
+ * from the driver until release_frame_index(), or -1 if no frame was ready.
+ */
+int capture_frame_index(struct capture *cap, void **data, unsigned int *size)
+{
+	struct v4l2_buffer buf;
+
+	assert(io == IO_METHOD_MMAP);
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+
+	if (-1 == xioctl(cap->fd, VIDIOC_DQBUF, &buf)) {
+		if (EAGAIN == errno)
+			return -1;
+		errno_exit("VIDIOC_DQBUF");
+	}
+	stats_dqbuf(cap->stats);
+
+	assert(buf.index < cap->n_buffers);
+
+	*data = cap->buffers[buf.index].start;
+	*size = buf.bytesused;
+	process_image(cap, *data, *size);
+	return buf.index;
+}
+
+void release_frame_index(struct capture *cap, int index)
+{
+	struct v4l2_buffer buf;
+	struct timespec t;
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+
+	stats_timer_start(&t);
+	if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
+		errno_exit("VIDIOC_QBUF");
+	stats_timer_stop(cap->stats, STATS_QBUF, &t);
+}
+
+/* DMABUF fd for MMAP capture buffer index, -1 if the driver cannot export it */
+int capture_export_buffer(struct capture *cap, int index, size_t *length)
+{
+	struct v4l2_exportbuffer exp;
+
+	CLEAR(exp);
+	exp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	exp.index = index;
+	exp.flags = O_RDONLY | O_CLOEXEC;
+
+	if (io != IO_METHOD_MMAP || -1 == xioctl(cap->fd, VIDIOC_EXPBUF, &exp))
+		return -1;
+	*length = cap->buffers[index].length;
+	return exp.fd;
+}
+
+static inline void report_fps_avg(struct capture *cap)
 {
-	fprintf(stderr, "%sAverage frame rate: %.2f fps\n", fps_cur ? "\n" : "", fps_total / fps_count);
+	fprintf(stderr, "%sAverage frame rate: %.2f fps\n", fps_cur ? "\n" : "", cap->fps_total / cap->fps_count);
 	fflush(stderr);
 }
 
-static void mainloop(void)
+static void mainloop(struct capture *cap)
 {
 	unsigned int count = frame_count;
 
 	while (count-- > 0)
-		capture_frame(NULL);
+		capture_frame(cap, NULL);
 
 	if (fps_avg)
-		report_fps_avg();
+		report_fps_avg(cap);
 }
 
-void stop_capturing(void)
+void stop_capturing(struct capture *cap)
 {
 	enum v4l2_buf_type type;
 
@@ -438,24 +834,37 @@ void stop_capturing(void)
 	case IO_METHOD_MMAP:
 	case IO_METHOD_USERPTR:
 		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
+		if (-1 == xioctl(cap->fd, VIDIOC_STREAMOFF, &type))
 			errno_exit("VIDIOC_STREAMOFF");
 		break;
 	}
 }
 
-void start_capturing(void)
+void start_capturing(struct capture *cap)
 {
 	unsigned int i;
 	enum v4l2_buf_type type;
+	struct timespec t;
+
+	/* the threads it starts from here on set themselves up, see rt.c */
+	rt_setup_thread(RT_THREAD_CAPTURE);
+
+	report_buffers(cap, "chosen");
+	if (cap->adaptive) {
+		unsigned int rate = capture_frame_rate(cap);
+		cap->frame_period_us = rate ? 1000000L / rate : 0;
+		if (!cap->frame_period_us)
+			fprintf(stderr, "%s does not report its frame rate, adaptive buffer count disabled\n", cap->dev_name);
+	}
 
+	stats_timer_start(&t);
 	switch (io) {
 	case IO_METHOD_READ:
 		/* Nothing to do. */
 		break;
 
 	case IO_METHOD_MMAP:
-		for (i = 0; i < n_buffers; ++i) {
+		for (i = 0; i < cap->n_buffers; ++i) {
 			struct v4l2_buffer buf;
 
 			CLEAR(buf);
@@ -463,130 +872,131 @@ void start_capturing(void)
 			buf.memory = V4L2_MEMORY_MMAP;
 			buf.index = i;
 
-			if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+			if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
 				errno_exit("VIDIOC_QBUF");
 		}
 		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+		if (-1 == xioctl(cap->fd, VIDIOC_STREAMON, &type))
 			errno_exit("VIDIOC_STREAMON");
 		break;
 
 	case IO_METHOD_USERPTR:
-		for (i = 0; i < n_buffers; ++i) {
+		for (i = 0; i < cap->n_buffers; ++i) {
 			struct v4l2_buffer buf;
 
 			CLEAR(buf);
 			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 			buf.memory = V4L2_MEMORY_USERPTR;
 			buf.index = i;
-			buf.m.userptr = (unsigned long)buffers[i].start;
-			buf.length = buffers[i].length;
+			buf.m.userptr = (unsigned long)cap->buffers[i].start;
+			buf.length = cap->buffers[i].length;
 
-			if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+			if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
 				errno_exit("VIDIOC_QBUF");
 		}
 		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+		if (-1 == xioctl(cap->fd, VIDIOC_STREAMON, &type))
 			errno_exit("VIDIOC_STREAMON");
 		break;
 	}
+	stats_timer_stop(cap->stats, STATS_SETUP, &t);
 }
 
-void uninit_device(int external_buffers)
+void uninit_device(struct capture *cap, int external_buffers)
 {
 	unsigned int i;
 
+	if (cap->adaptive && cap->frame_period_us)
+		fprintf(stderr, "%sworst DQBUF lateness %.1f ms of %.1f ms frame period\n", fps_cur ? "\n" : "",
+			cap->lateness_max_us / 1000.0, cap->frame_period_us / 1000.0);
+	report_buffers(cap, "final");
+	stats_report(stderr);
+
 	switch (io) {
 	case IO_METHOD_READ:
-		if (buffers[0].start)
-			free(buffers[0].start);
+		bufpool_destroy(cap->buffers[0].pool);
 		break;
 
 	case IO_METHOD_MMAP:
-		for (i = 0; i < n_buffers; ++i)
-			if (-1 == munmap(buffers[i].start, buffers[i].length))
+		for (i = 0; i < cap->n_buffers; ++i)
+			if (-1 == munmap(cap->buffers[i].start, cap->buffers[i].length))
 				errno_exit("munmap");
 		break;
 
 	case IO_METHOD_USERPTR:
 		if (!external_buffers)
-			for (i = 0; i < n_buffers; ++i)
-				free(buffers[i].start);
+			for (i = 0; i < cap->n_buffers; ++i)
+				bufpool_destroy(cap->buffers[i].pool);
 		break;
 	}
 
-	free(buffers);
+	free(cap->buffers);
 }
 
-static void init_read(unsigned int buffer_size, int external_buffers)
+static void init_read(struct capture *cap, unsigned int buffer_size, int external_buffers)
 {
-	buffers = calloc(1, sizeof(*buffers));
+	cap->buffers = calloc(1, sizeof(*cap->buffers));
 
-	if (!buffers) {
+	if (!cap->buffers) {
 		fprintf(stderr, "Out of memory\n");
 		exit(EXIT_FAILURE);
 	}
 
-	buffers[0].length = buffer_size;
-	if (!external_buffers) {
-		buffers[0].start = malloc(buffer_size);
-
-		if (!buffers[0].start) {
-			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-	}
+	cap->buffers[0].length = buffer_size;
+	cap->buffers_external = external_buffers;
+	if (!external_buffers)
+		pool_buffers(cap, 0, 1, buffer_size);
 }
 
-static void init_mmap(void)
+static void init_mmap(struct capture *cap)
 {
 	struct v4l2_requestbuffers req;
 
 	CLEAR(req);
-	req.count = 4;
+	req.count = capture_buffers ? capture_buffers : DEFAULT_CAPTURE_BUFFERS;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_MMAP;
 
-	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+	if (-1 == xioctl(cap->fd, VIDIOC_REQBUFS, &req)) {
 		if (EINVAL == errno) {
 			fprintf(stderr, "%s does not support "
-				 "memory mapping\n", dev_name);
+				 "memory mapping\n", cap->dev_name);
 			exit(EXIT_FAILURE);
 		} else
 			errno_exit("VIDIOC_REQBUFS");
 	}
 
 	if (req.count < 2) {
-		fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name);
+		fprintf(stderr, "Insufficient buffer memory on %s\n", cap->dev_name);
 		exit(EXIT_FAILURE);
 	}
 
-	buffers = calloc(req.count, sizeof(*buffers));
+	cap->buffers = calloc(req.count, sizeof(*cap->buffers));
 
-	if (!buffers) {
+	if (!cap->buffers) {
 		fprintf(stderr, "Out of memory\n");
 		exit(EXIT_FAILURE);
 	}
 
-	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+	for (cap->n_buffers = 0; cap->n_buffers < req.count; ++cap->n_buffers) {
 		struct v4l2_buffer buf;
 
 		CLEAR(buf);
 		buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory      = V4L2_MEMORY_MMAP;
-		buf.index       = n_buffers;
+		buf.index       = cap->n_buffers;
 
-		if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
+		if (-1 == xioctl(cap->fd, VIDIOC_QUERYBUF, &buf))
 			errno_exit("VIDIOC_QUERYBUF");
 
-		buffers[n_buffers].length = buf.length;
-		buffers[n_buffers].start = mmap(NULL /* start anywhere */,
+		cap->buffers[cap->n_buffers].length = buf.length;
+		cap->buffers[cap->n_buffers].start = mmap(NULL /* start anywhere */,
 			buf.length,
 			PROT_READ | PROT_WRITE /* required */,
 			MAP_SHARED /* recommended */,
-			fd, buf.m.offset);
+			cap->fd, buf.m.offset);
 
-		if (MAP_FAILED == buffers[n_buffers].start)
+		if (MAP_FAILED == cap->buffers[cap->n_buffers].start)
 			errno_exit("mmap");
 	}
 }
@@ -594,7 +1004,7 @@ static void init_mmap(void)
 static uint buffer_count(OMX_BUFFERHEADERTYPE *external_buffers)
 {
 	if (!external_buffers)
-		return 4;
+		return capture_buffers ? capture_buffers : DEFAULT_CAPTURE_BUFFERS;
 	uint cnt = 0;
 	do {
 		cnt++;
@@ -602,7 +1012,7 @@ static uint buffer_count(OMX_BUFFERHEADERTYPE *external_buffers)
 	return cnt;
 }
 
-static void init_userp(unsigned int buffer_size, OMX_BUFFERHEADERTYPE *external_buffers)
+static void init_userp(struct capture *cap, unsigned int buffer_size, OMX_BUFFERHEADERTYPE *external_buffers)
 {
 	struct v4l2_requestbuffers req;
 
@@ -613,68 +1023,69 @@ static void init_userp(unsigned int buffer_size, OMX_BUFFERHEADERTYPE *external_
 	req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_USERPTR;
 
-	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+	if (-1 == xioctl(cap->fd, VIDIOC_REQBUFS, &req)) {
 		if (EINVAL == errno) {
-			fprintf(stderr, "%s does not support user pointer i/o\n", dev_name);
+			fprintf(stderr, "%s does not support user pointer i/o\n", cap->dev_name);
 			exit(EXIT_FAILURE);
 		} else
 			errno_exit("VIDIOC_REQBUFS");
 	}
 
-	buffers = calloc(buffers_count, sizeof(*buffers));
+	cap->buffers = calloc(buffers_count, sizeof(*cap->buffers));
 
-	if (!buffers) {
+	if (!cap->buffers) {
 		fprintf(stderr, "Out of memory\n");
 		exit(EXIT_FAILURE);
 	}
+	cap->buffers_external = external_buffers != NULL;
+	if (!external_buffers)
+		pool_buffers(cap, 0, buffers_count, buffer_size);
 
-	for (n_buffers = 0; n_buffers < /*4*/buffers_count; ++n_buffers) {
-		buffers[n_buffers].length = buffer_size;
+	for (cap->n_buffers = 0; cap->n_buffers < /*4*/buffers_count; ++cap->n_buffers) {
+		cap->buffers[cap->n_buffers].length = buffer_size;
 		if (external_buffers) {
-			buffers[n_buffers].start = external_buffers->pBuffer;
+			cap->buffers[cap->n_buffers].start = external_buffers->pBuffer;
 			external_buffers = external_buffers->pAppPrivate;
 		}
-		else
-			buffers[n_buffers].start = malloc(buffer_size);
 
-		if (!buffers[n_buffers].start) {
+		if (!cap->buffers[cap->n_buffers].start) {
 			fprintf(stderr, "Out of memory\n");
 			exit(EXIT_FAILURE);
 		}
 	}
 }
 
-unsigned int init_device(void)
+unsigned int init_device(struct capture *cap)
 {
-	struct v4l2_capability cap;
+	struct v4l2_capability caps;
 	struct v4l2_cropcap cropcap;
 	struct v4l2_crop crop;
 
-	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
+	if (-1 == xioctl(cap->fd, VIDIOC_QUERYCAP, &caps)) {
 		if (EINVAL == errno) {
-			fprintf(stderr, "%s is no V4L2 device\n", dev_name);
+			fprintf(stderr, "%s is no V4L2 device\n", cap->dev_name);
 			exit(EXIT_FAILURE);
 		} else
 			errno_exit("VIDIOC_QUERYCAP");
 	}
 
-	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-		fprintf(stderr, "%s is no video capture device\n", dev_name);
+	if (!(caps.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+		fprintf(stderr, "%s is no video capture device\n", cap->dev_name);
 		exit(EXIT_FAILURE);
 	}
 
 	switch (io) {
 	case IO_METHOD_READ:
-		if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-			fprintf(stderr, "%s does not support read i/o\n", dev_name);
+		if (!(caps.capabilities & V4L2_CAP_READWRITE)) {
+			fprintf(stderr, "%s does not support read i/o\n", cap->dev_name);
 			exit(EXIT_FAILURE);
 		}
 		break;
 
 	case IO_METHOD_MMAP:
 	case IO_METHOD_USERPTR:
-		if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-			fprintf(stderr, "%s does not support streaming i/o\n", dev_name);
+		if (!(caps.capabilities & V4L2_CAP_STREAMING)) {
+			fprintf(stderr, "%s does not support streaming i/o\n", cap->dev_name);
 			exit(EXIT_FAILURE);
 		}
 		break;
@@ -685,11 +1096,11 @@ unsigned int init_device(void)
 	CLEAR(cropcap);
 	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-	if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
+	if (0 == xioctl(cap->fd, VIDIOC_CROPCAP, &cropcap)) {
 		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		crop.c = cropcap.defrect; /* reset to default */
 
-		if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop))
+		if (-1 == xioctl(cap->fd, VIDIOC_S_CROP, &crop))
 			switch (errno) {
 			case EINVAL:
 				/* Cropping not supported. */
@@ -702,78 +1113,131 @@ unsigned int init_device(void)
 		/* Errors ignored. */
 	}
 
-	CLEAR(v4l2_fmt);
-	v4l2_fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	CLEAR(cap->v4l2_fmt);
+	cap->v4l2_fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	if (force_format) {
-		v4l2_fmt.fmt.pix.width       = 640;
-		v4l2_fmt.fmt.pix.height      = 480;
-		v4l2_fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-		v4l2_fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+		cap->v4l2_fmt.fmt.pix.width       = 640;
+		cap->v4l2_fmt.fmt.pix.height      = 480;
+		cap->v4l2_fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+		cap->v4l2_fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
 
-		if (-1 == xioctl(fd, VIDIOC_S_FMT, &v4l2_fmt))
+		if (-1 == xioctl(cap->fd, VIDIOC_S_FMT, &cap->v4l2_fmt))
 			errno_exit("VIDIOC_S_FMT");
 
 		/* Note VIDIOC_S_FMT may change width and height. */
 	} else {
 		/* Preserve original settings as set by v4l2-ctl for example */
-		if (-1 == xioctl(fd, VIDIOC_G_FMT, &v4l2_fmt))
+		if (-1 == xioctl(cap->fd, VIDIOC_G_FMT, &cap->v4l2_fmt))
 			errno_exit("VIDIOC_G_FMT");
 	}
 
-	return v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG && m2jpeg ?
-		mjpeg2jpeg_filter(NULL, v4l2_fmt.fmt.pix.sizeimage) : v4l2_fmt.fmt.pix.sizeimage;
+	return cap->v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG && m2jpeg ?
+		mjpeg2jpeg_filter(NULL, cap->v4l2_fmt.fmt.pix.sizeimage) : cap->v4l2_fmt.fmt.pix.sizeimage;
 }
 
-void init_buffers(unsigned int buffer_size, OMX_BUFFERHEADERTYPE *external_buffers)
+/* Map the negotiated capture format onto an OMX color format for video_encode port 200 */
+OMX_COLOR_FORMATTYPE capture_omx_format(struct capture *cap, OMX_U32 *width, OMX_U32 *height, OMX_S32 *stride)
 {
+	*width = cap->v4l2_fmt.fmt.pix.width;
+	*height = cap->v4l2_fmt.fmt.pix.height;
+	*stride = cap->v4l2_fmt.fmt.pix.bytesperline;
+
+	switch (cap->v4l2_fmt.fmt.pix.pixelformat) {
+	case V4L2_PIX_FMT_YUV420: return OMX_COLOR_FormatYUV420PackedPlanar;
+	case V4L2_PIX_FMT_NV12:   return OMX_COLOR_FormatYUV420PackedSemiPlanar;
+	case V4L2_PIX_FMT_YUYV:   return OMX_COLOR_FormatYCbYCr;
+	case V4L2_PIX_FMT_YVYU:   return OMX_COLOR_FormatYCrYCb;
+	case V4L2_PIX_FMT_UYVY:   return OMX_COLOR_FormatCbYCrY;
+	case V4L2_PIX_FMT_VYUY:   return OMX_COLOR_FormatCrYCbY;
+	default:                  return OMX_COLOR_FormatUnused;
+	}
+}
+
+void init_buffers(struct capture *cap, unsigned int buffer_size, OMX_BUFFERHEADERTYPE *external_buffers)
+{
+	struct timespec t;
+
+	stats_timer_start(&t);
 	switch (io) {
 	case IO_METHOD_READ:
 		fprintf(stderr, "capture method: IO_METHOD_READ\n");
-		init_read(buffer_size, external_buffers != NULL);
+		init_read(cap, buffer_size, external_buffers != NULL);
 		break;
 
 	case IO_METHOD_MMAP:
 		fprintf(stderr, "capture method: IO_METHOD_MMAP\n");
-		init_mmap();
+		init_mmap(cap);
 		break;
 
 	case IO_METHOD_USERPTR:
 		fprintf(stderr, "capture method: IO_METHOD_USERPTR\n");
-		init_userp(buffer_size, external_buffers);
+		init_userp(cap, buffer_size, external_buffers);
 		break;
 	}
+
+	for (unsigned int i = 0; i < (io == IO_METHOD_READ ? 1 : cap->n_buffers); ++i)
+		rt_prefault(cap->buffers[i].start, cap->buffers[i].length);
+	stats_timer_stop(cap->stats, STATS_SETUP, &t);
 }
 
-void close_device(void)
+void capture_init(struct capture *cap, const char *dev_name)
 {
-	if (-1 == close(fd))
+	memset(cap, 0, sizeof(*cap));
+	cap->dev_name = dev_name;
+	cap->fd = -1;
+	cap->adaptive = adaptive_buffers;
+	cap->stats = stats_camera(dev_name);
+}
+
+void close_device(struct capture *cap)
+{
+	if (-1 == close(cap->fd))
 		errno_exit("close");
 
-	fd = -1;
+	cap->fd = -1;
 }
 
-void open_device(void)
+void open_device(struct capture *cap)
 {
 	struct stat st;
 
-	if (-1 == stat(dev_name, &st)) {
-		fprintf(stderr, "Cannot identify '%s': %d, %s\n", dev_name, errno, strerror(errno));
+	if (-1 == stat(cap->dev_name, &st)) {
+		fprintf(stderr, "Cannot identify '%s': %d, %s\n", cap->dev_name, errno, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
 	if (!S_ISCHR(st.st_mode)) {
-		fprintf(stderr, "%s is no device\n", dev_name);
+		fprintf(stderr, "%s is no device\n", cap->dev_name);
 		exit(EXIT_FAILURE);
 	}
 
-	fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+	cap->fd = open(cap->dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
 
-	if (-1 == fd) {
-		fprintf(stderr, "Cannot open '%s': %d, %s\n", dev_name, errno, strerror(errno));
+	if (-1 == cap->fd) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", cap->dev_name, errno, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 }
 
+/* Peek at the device format to choose between the MJPEG and raw encode pipelines, before the device is
+ * opened for capture: it opens and closes cap->fd itself. Once init_device() has run, test v4l2_fmt instead. */
+int capture_is_mjpeg(struct capture *cap)
+{
+	if (force_format)
+		return 0; /* YUYV */
+
+	open_device(cap);
+
+	CLEAR(cap->v4l2_fmt);
+	cap->v4l2_fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (-1 == xioctl(cap->fd, VIDIOC_G_FMT, &cap->v4l2_fmt))
+		errno_exit("VIDIOC_G_FMT");
+
+	close_device(cap);
+
+	return cap->v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG;
+}
+
 static void usage(FILE *fp, int argc, char **argv)
 {
 	fprintf(fp,
@@ -813,10 +1277,166 @@ static void usage(FILE *fp, int argc, char **argv)
 		 "                          11 = OMX_VIDEO_CodingSorenson,   /**< Sorenson */\n"
 		 "                          12 = OMX_VIDEO_CodingTheora,     /**< Theora */\n"
 		 "                          13 = OMX_VIDEO_CodingMVC,        /**< H.264/MVC */\n"
+		 "     --rate_control MODE  Encoder rate control: off, vbr, cbr, vbr_skip, cbr_skip [vbr when --bitrate is set]\n"
+		 "     --idr_period N       Frames from one IDR to the next (GOP length), 0 for the first frame only\n"
+		 "     --profile NAME       H.264 profile: baseline, main, high\n"
+		 "     --level N            H.264 level: 1, 1b, 1.1 ... 4, 4.1, 4.2, 5, 5.1\n"
+		 "     --qp_min N           Lowest QP rate control may use\n"
+		 "     --qp_max N           Highest QP rate control may use\n"
+		 "     --qp_i N             I frame QP when rate control is off\n"
+		 "     --qp_p N             P frame QP when rate control is off\n"
+		 "     --slices N           Slices per picture\n"
+		 "     --low_latency        Cyclic intra refresh instead of periodic IDR, no reordering, NALs written as encoded;\n"
+		 "                          implies --latency and --no_aggregate\n"
+		 "     --latency            Report capture-to-output latency on exit\n"
+		 "     --no_aggregate       Write encoder buffers as they come instead of one write per access unit\n"
+		 "     --au_index FILE      Write offset, size, timestamp and keyframe flag of every access unit to FILE\n"
+		 "     --idr_index FILE     Scan stdout's Annex B stream into an IDR seek index in FILE (see h264-index -d)\n"
+		 "     --abr                Adapt the bitrate to the output backlog (needs rate control; try | pv -L 100k)\n"
+		 "     --abr_min BPS        Adaptive bitrate floor [1/8 of the ceiling]\n"
+		 "     --abr_max BPS        Adaptive bitrate ceiling [--bitrate]\n"
+		 "     --abr_backlog MS     Output backlog that counts as congestion [%i]\n"
+		 "     --abr_fps_step       Halve the frame rate (down to 1/4) when congested at the floor\n"
+		 "     --control PATH       Take runtime commands on Unix socket PATH, one per line:\n"
+		 "                          idr | bitrate BPS | fps N | record FILE | record off | trigger | sink add|remove SPEC | stats\n"
+		 "     --gop_cache KB       Keep the stream since the last keyframe, up to KB, so recordings start at once;\n"
+		 "                          0 disables [%i]\n"
+		 "     --sink SPEC          Also send the stream to file:PATH | fd:N | udp:HOST:PORT | unix:PATH,\n"
+		 "                          optionally followed by ,queue=KB and ,drop=gop|close; repeatable\n"
+		 "     --sink_queue KB      Default sink queue bound before its drop policy applies [%i]\n"
+		 "     --serve PATH         Serve the stream to any number of local clients on Unix socket PATH\n"
+		 "                          (read it with stream-client PATH)\n"
+		 "     --serve_queue KB     Client queue bound; a client further behind resumes at the next keyframe [%i]\n"
+		 "     --shm PATH           Publish the stream into a shared memory ring handed out on Unix socket PATH\n"
+		 "                          (read it with stream-client -m PATH or the shmring.h reader)\n"
+		 "     --shm_kb KB          Shared memory ring size [%i]\n"
+		 "     --preroll DIR        Keep the last --preroll_sec of the stream in memory; a trigger (control socket\n"
+		 "                          trigger, or motion with --motion, which then leaves no frame out) records it\n"
+		 "                          and the live stream into DIR/YYYYmmdd-HHMMSS.h264 until --postroll_sec after\n"
+		 "                          the last trigger\n"
+		 "     --preroll_kb KB      Pre-roll ring bound [%i]\n"
+		 "     --preroll_sec S      Pre-roll length [%i]\n"
+		 "     --postroll_sec S     Post-roll length [%i]\n"
+		 "     --segments DIR       Also record into DIR/seg-YYYYmmdd-HHMMSS-mmm.h264 segments cut at keyframes,\n"
+		 "                          preallocated and written in 1 MB batches off the capture thread\n"
+		 "     --segment_sec S      New segment at the first keyframe S seconds into one [%i]\n"
+		 "     --segment_mb MB      ... or once it has MB megabytes, 0 for no size bound [%i]\n"
+		 "     --segment_keep N     Keep the newest N segments, earlier runs' included, 0 for all [%i]\n"
+		 "     --mp4 SPEC           Also write H.264 as fragmented MP4: - for stdout (instead of Annex B), DIR/ for\n"
+		 "                          DIR/init.mp4 and a DIR/NNNNNNNN.m4s file per fragment, or a single FILE\n"
+		 "     --mp4_frag gop|frame A fragment per GOP or per frame [gop]\n"
+		 "     --hls DIR            Also publish H.264 as HLS for a web server: DIR/index.m3u8, init.mp4 and fMP4\n"
+		 "                          segments cut at keyframes; DIR best on a tmpfs\n"
+		 "     --hls_sec S          Segment length, at least, up to the next keyframe [%i]\n"
+		 "     --hls_part MS        Low-latency HLS parts of at most MS milliseconds, 0 for none [%i]\n"
+		 "     --hls_list N         Segments in the playlist [%i]\n"
+		 "     --hls_target S       Target duration, fixed for the stream; a segment a GOP would take past it is\n"
+		 "                          cut at a frame that is not a keyframe; 0 for hls_sec + 1 [%i]\n"
+		 "     --inflight N         Frames in flight through the encoder for raw (YUV) capture [%i]\n"
+		 "     --buffers N          Number of capture buffers (MJPEG encode: image_decode input buffers) [%i]\n"
+		 "     --adaptive_buffers   Add capture buffers when DQBUF lateness approaches the frame period\n"
+		 "     --arena MB           MJPEG encode: stage frames in a right-sized arena capped at MB (uses --mmap)\n"
+		 "     --cpu_capture N      Pin the capture thread to cpu N\n"
+		 "     --cpu_omx N          Pin the OMX callback thread to cpu N\n"
+		 "     --cpu_output N       Pin the encoded stream output thread to cpu N\n"
+		 "     --rt_prio P          Run the capture thread SCHED_FIFO at priority P\n"
+		 "     --mlock              Lock all process memory (mlockall)\n"
+		 "     --prefault           Touch every capture buffer page before streaming\n"
+		 "     --jitter             Report a DQBUF-to-DQBUF interval histogram\n"
+		 "     --hugepages          Back --userp/--read capture buffers with hugepages when available\n"
+		 "     --timing             Report buffer setup, QBUF and MJPEG filter/copy times\n"
+		 "     --encoder omx|m2m[:DEV]|null\n"
+		 "                          Encode raw (YUV) capture with OMX video_encode or the V4L2 memory-to-memory\n"
+		 "                          encoder DEV [%s], e.g. vicodec; m2m shares the capture buffers as DMABUF;\n"
+		 "                          null encodes nothing and sends bitrate-sized filler (--mmap, any format)\n"
+		 "     --camera DEV,out=SPEC\n"
+		 "                          With -n, also encode camera DEV on the same OMX client (or null encoder)\n"
+		 "                          and send its stream to sink SPEC (see --sink); repeatable, up to %i cameras\n"
+		 "                          in all\n"
+		 "     --decode_threads N   Decode MJPEG capture in software on N threads into I420 for either encoder,\n"
+		 "                          instead of OMX image_decode (uses --mmap; width a multiple of 16)\n"
+		 "     --motion             Encode only while there is motion, and --motion_idle frames otherwise\n"
+		 "     --motion_zone X,Y,W,H[,PCT]\n"
+		 "                          Look for motion in this rectangle, in percent of the frame, and call it motion\n"
+		 "                          when PCT%% of it changes [1]; repeatable, up to %i zones [whole frame]\n"
+		 "     --motion_threshold N Mean luma difference of an 8x8 block of 1/8 size pixels that counts as changed [%i]\n"
+		 "     --motion_hold MS     Keep encoding this long after the last motion [%i]\n"
+		 "     --motion_idle FPS    Frames per second encoded without motion, 0 for none [%g]\n"
+		 "     --motion_idle_idr    Encode those idle frames as keyframes\n"
 		 "",
-		 argv[0], dev_name, frame_count, test_encode_filename/*, img_fmt, img_width, img_height*/, bitrate, codec);
+		 argv[0], dev_name, frame_count, test_encode_filename/*, img_fmt, img_width, img_height*/, bitrate, codec, abr_backlog_ms, gop_cache_kb, sink_queue_kb, serve_queue_kb, shm_kb, preroll_kb, preroll_sec, postroll_sec,
+		 segment_sec, segment_mb, segment_keep, hls_sec, hls_part_ms, hls_list, hls_target, inflight, DEFAULT_CAPTURE_BUFFERS, m2m_device, CAMERA_MAX,
+		 MOTION_ZONES, motion_threshold, motion_hold_ms, motion_idle_fps);
 }
 
+/* long-only options */
+enum {
+	OPT_RATE_CONTROL = 256,
+	OPT_IDR_PERIOD,
+	OPT_PROFILE,
+	OPT_LEVEL,
+	OPT_QP_MIN,
+	OPT_QP_MAX,
+	OPT_QP_I,
+	OPT_QP_P,
+	OPT_SLICES,
+	OPT_LOW_LATENCY,
+	OPT_LATENCY,
+	OPT_NO_AGGREGATE,
+	OPT_AU_INDEX,
+	OPT_IDR_INDEX,
+	OPT_ABR,
+	OPT_ABR_MIN,
+	OPT_ABR_MAX,
+	OPT_ABR_BACKLOG,
+	OPT_ABR_FPS_STEP,
+	OPT_CONTROL,
+	OPT_GOP_CACHE,
+	OPT_SINK,
+	OPT_SINK_QUEUE,
+	OPT_SERVE,
+	OPT_SERVE_QUEUE,
+	OPT_SHM,
+	OPT_SHM_KB,
+	OPT_PREROLL,
+	OPT_PREROLL_KB,
+	OPT_PREROLL_SEC,
+	OPT_POSTROLL_SEC,
+	OPT_SEGMENTS,
+	OPT_SEGMENT_SEC,
+	OPT_SEGMENT_MB,
+	OPT_SEGMENT_KEEP,
+	OPT_MP4,
+	OPT_MP4_FRAG,
+	OPT_HLS,
+	OPT_HLS_SEC,
+	OPT_HLS_PART,
+	OPT_HLS_LIST,
+	OPT_HLS_TARGET,
+	OPT_INFLIGHT,
+	OPT_BUFFERS,
+	OPT_ADAPTIVE_BUFFERS,
+	OPT_ARENA,
+	OPT_CPU_CAPTURE,
+	OPT_CPU_OMX,
+	OPT_CPU_OUTPUT,
+	OPT_RT_PRIO,
+	OPT_MLOCK,
+	OPT_PREFAULT,
+	OPT_JITTER,
+	OPT_HUGEPAGES,
+	OPT_TIMING,
+	OPT_ENCODER,
+	OPT_CAMERA,
+	OPT_DECODE_THREADS,
+	OPT_MOTION,
+	OPT_MOTION_ZONE,
+	OPT_MOTION_THRESHOLD,
+	OPT_MOTION_HOLD,
+	OPT_MOTION_IDLE,
+	OPT_MOTION_IDLE_IDR,
+};
+
 static const char short_options[] = "d:hmruofc:pat:n"/*"i:x:y:"*/"zib:w:e:";
 
 static const struct option
@@ -841,6 +1461,70 @@ long_options[] = {
 	{ "bitrate",     required_argument, NULL, 'b' },
 	{ "write_media", required_argument, NULL, 'w' },
 	{ "codec",       required_argument, NULL, 'e' },
+	{ "rate_control", required_argument, NULL, OPT_RATE_CONTROL },
+	{ "idr_period",  required_argument, NULL, OPT_IDR_PERIOD },
+	{ "profile",     required_argument, NULL, OPT_PROFILE },
+	{ "level",       required_argument, NULL, OPT_LEVEL },
+	{ "qp_min",      required_argument, NULL, OPT_QP_MIN },
+	{ "qp_max",      required_argument, NULL, OPT_QP_MAX },
+	{ "qp_i",        required_argument, NULL, OPT_QP_I },
+	{ "qp_p",        required_argument, NULL, OPT_QP_P },
+	{ "slices",      required_argument, NULL, OPT_SLICES },
+	{ "low_latency", no_argument,       NULL, OPT_LOW_LATENCY },
+	{ "latency",     no_argument,       NULL, OPT_LATENCY },
+	{ "no_aggregate", no_argument,      NULL, OPT_NO_AGGREGATE },
+	{ "au_index",    required_argument, NULL, OPT_AU_INDEX },
+	{ "idr_index",   required_argument, NULL, OPT_IDR_INDEX },
+	{ "abr",         no_argument,       NULL, OPT_ABR },
+	{ "abr_min",     required_argument, NULL, OPT_ABR_MIN },
+	{ "abr_max",     required_argument, NULL, OPT_ABR_MAX },
+	{ "abr_backlog", required_argument, NULL, OPT_ABR_BACKLOG },
+	{ "abr_fps_step", no_argument,      NULL, OPT_ABR_FPS_STEP },
+	{ "control",     required_argument, NULL, OPT_CONTROL },
+	{ "gop_cache",   required_argument, NULL, OPT_GOP_CACHE },
+	{ "sink",        required_argument, NULL, OPT_SINK },
+	{ "sink_queue",  required_argument, NULL, OPT_SINK_QUEUE },
+	{ "serve",       required_argument, NULL, OPT_SERVE },
+	{ "serve_queue", required_argument, NULL, OPT_SERVE_QUEUE },
+	{ "shm",         required_argument, NULL, OPT_SHM },
+	{ "shm_kb",      required_argument, NULL, OPT_SHM_KB },
+	{ "preroll",     required_argument, NULL, OPT_PREROLL },
+	{ "preroll_kb",  required_argument, NULL, OPT_PREROLL_KB },
+	{ "preroll_sec", required_argument, NULL, OPT_PREROLL_SEC },
+	{ "postroll_sec", required_argument, NULL, OPT_POSTROLL_SEC },
+	{ "segments",    required_argument, NULL, OPT_SEGMENTS },
+	{ "segment_sec", required_argument, NULL, OPT_SEGMENT_SEC },
+	{ "segment_mb",  required_argument, NULL, OPT_SEGMENT_MB },
+	{ "segment_keep", required_argument, NULL, OPT_SEGMENT_KEEP },
+	{ "mp4",         required_argument, NULL, OPT_MP4 },
+	{ "mp4_frag",    required_argument, NULL, OPT_MP4_FRAG },
+	{ "hls",         required_argument, NULL, OPT_HLS },
+	{ "hls_sec",     required_argument, NULL, OPT_HLS_SEC },
+	{ "hls_part",    required_argument, NULL, OPT_HLS_PART },
+	{ "hls_list",    required_argument, NULL, OPT_HLS_LIST },
+	{ "hls_target",  required_argument, NULL, OPT_HLS_TARGET },
+	{ "inflight",    required_argument, NULL, OPT_INFLIGHT },
+	{ "buffers",     required_argument, NULL, OPT_BUFFERS },
+	{ "adaptive_buffers", no_argument,  NULL, OPT_ADAPTIVE_BUFFERS },
+	{ "arena",       required_argument, NULL, OPT_ARENA },
+	{ "cpu_capture", required_argument, NULL, OPT_CPU_CAPTURE },
+	{ "cpu_omx",     required_argument, NULL, OPT_CPU_OMX },
+	{ "cpu_output",  required_argument, NULL, OPT_CPU_OUTPUT },
+	{ "rt_prio",     required_argument, NULL, OPT_RT_PRIO },
+	{ "mlock",       no_argument,       NULL, OPT_MLOCK },
+	{ "prefault",    no_argument,       NULL, OPT_PREFAULT },
+	{ "jitter",      no_argument,       NULL, OPT_JITTER },
+	{ "hugepages",   no_argument,       NULL, OPT_HUGEPAGES },
+	{ "timing",      no_argument,       NULL, OPT_TIMING },
+	{ "encoder",     required_argument, NULL, OPT_ENCODER },
+	{ "camera",      required_argument, NULL, OPT_CAMERA },
+	{ "decode_threads", required_argument, NULL, OPT_DECODE_THREADS },
+	{ "motion",      no_argument,       NULL, OPT_MOTION },
+	{ "motion_zone", required_argument, NULL, OPT_MOTION_ZONE },
+	{ "motion_threshold", required_argument, NULL, OPT_MOTION_THRESHOLD },
+	{ "motion_hold", required_argument, NULL, OPT_MOTION_HOLD },
+	{ "motion_idle", required_argument, NULL, OPT_MOTION_IDLE },
+	{ "motion_idle_idr", no_argument,   NULL, OPT_MOTION_IDLE_IDR },
 	{ 0, 0, 0, 0 }
 };
 
@@ -848,10 +1532,53 @@ extern int
 video_encode_test(char *outputfilename);
 
 extern int
-capture_encode_loop(int frames, OMX_U32 frameWidth, OMX_U32 frameHeight, uint frameRate, OMX_COLOR_FORMATTYPE colorFormat, unsigned int bufsize);
+parse_control_rate(const char *name),
+parse_avc_profile(const char *name),
+parse_avc_level(const char *name);
+
+static int parse_name(int value, const char *opt)
+{
+	if (value < 0) {
+		fprintf(stderr, "unknown %s '%s'\n", opt, optarg);
+		exit(EXIT_FAILURE);
+	}
+	return value;
+}
+
+extern int
+capture_encode_loop(struct capture *cap, int frames);
 
 extern int
-capture_encode_jpeg_loop(int frames/*, OMX_U32 frameWidth, OMX_U32 frameHeight, uint frameRate, OMX_COLOR_FORMATTYPE colorFormat, unsigned int bufsize*/);
+capture_encode_jpeg_loop(struct capture *cap, int frames/*, OMX_U32 frameWidth, OMX_U32 frameHeight, uint frameRate, OMX_COLOR_FORMATTYPE colorFormat, unsigned int bufsize*/);
+
+/*
+ * Daemon mode: start the --camera ones, each on a thread of its own, before
+ * -d takes over the main thread. Each follows -d's settings; io is shared, so
+ * a raw (YUV) camera needs it to be --userp, which a raw -d or no --arena gives,
+ * and an MJPEG one decoded in software needs --mmap, which an MJPEG -d gives.
+ * The null encoder takes any camera on --mmap.
+ */
+static void start_cameras(void)
+{
+	for (int i = 0; i < camera_specs_count; i++) {
+		char *out = strstr(camera_specs[i], ",out=");
+		int raw;
+
+		*out = '\0';
+		capture_init(&cameras[i], camera_specs[i]);
+		raw = !capture_is_mjpeg(&cameras[i]);
+		if (encoder == &encoder_omx && raw && io != IO_METHOD_USERPTR) {
+			fprintf(stderr, "%s: raw capture needs --userp, not with --arena or --read\n", camera_specs[i]);
+			exit(EXIT_FAILURE);
+		}
+		if (encoder == &encoder_omx && !raw && decode_threads && io != IO_METHOD_MMAP) {
+			fprintf(stderr, "%s: MJPEG decode needs --mmap, not with raw capture on %s\n", camera_specs[i], dev_name);
+			exit(EXIT_FAILURE);
+		}
+		if (encoder->camera(&cameras[i], out + 5, frame_count, raw || decode_threads) < 0)
+			exit(EXIT_FAILURE);
+	}
+}
 
 int main(int argc, char **argv)
 {
@@ -968,6 +1695,282 @@ int main(int argc, char **argv)
 				errno_exit(optarg);
 			break;
 
+		case OPT_RATE_CONTROL:
+			control_rate = parse_name(parse_control_rate(optarg), "--rate_control");
+			break;
+
+		case OPT_PROFILE:
+			avc_profile = parse_name(parse_avc_profile(optarg), "--profile");
+			break;
+
+		case OPT_LEVEL:
+			avc_level = parse_name(parse_avc_level(optarg), "--level");
+			break;
+
+		case OPT_IDR_PERIOD:
+		case OPT_QP_MIN:
+		case OPT_QP_MAX:
+		case OPT_QP_I:
+		case OPT_QP_P:
+		case OPT_SLICES:
+		case OPT_ABR_MIN:
+		case OPT_ABR_MAX:
+		case OPT_ABR_BACKLOG:
+		case OPT_GOP_CACHE:
+		case OPT_SINK_QUEUE:
+		case OPT_SERVE_QUEUE:
+		case OPT_SHM_KB:
+		case OPT_PREROLL_KB:
+		case OPT_PREROLL_SEC:
+		case OPT_POSTROLL_SEC:
+		case OPT_SEGMENT_SEC:
+		case OPT_SEGMENT_MB:
+		case OPT_SEGMENT_KEEP:
+		case OPT_HLS_SEC:
+		case OPT_HLS_PART:
+		case OPT_HLS_LIST:
+		case OPT_HLS_TARGET: {
+			int value;
+			errno = 0;
+			value = strtol(optarg, NULL, 0);
+			if (errno)
+				errno_exit(optarg);
+			*(c == OPT_IDR_PERIOD ? &idr_period : c == OPT_QP_MIN ? &qp_min : c == OPT_QP_MAX ? &qp_max :
+				c == OPT_QP_I ? &qp_i : c == OPT_QP_P ? &qp_p : c == OPT_SLICES ? &slices :
+				c == OPT_ABR_MIN ? &abr_min : c == OPT_ABR_MAX ? &abr_max : c == OPT_ABR_BACKLOG ? &abr_backlog_ms :
+				c == OPT_GOP_CACHE ? &gop_cache_kb : c == OPT_SINK_QUEUE ? &sink_queue_kb :
+				c == OPT_SERVE_QUEUE ? &serve_queue_kb : c == OPT_SHM_KB ? &shm_kb : c == OPT_PREROLL_KB ? &preroll_kb :
+				c == OPT_PREROLL_SEC ? &preroll_sec : c == OPT_POSTROLL_SEC ? &postroll_sec :
+				c == OPT_SEGMENT_SEC ? &segment_sec : c == OPT_SEGMENT_MB ? &segment_mb : c == OPT_SEGMENT_KEEP ? &segment_keep :
+				c == OPT_HLS_SEC ? &hls_sec : c == OPT_HLS_PART ? &hls_part_ms : c == OPT_HLS_LIST ? &hls_list : &hls_target) = value;
+			break;
+		}
+
+		case OPT_LOW_LATENCY:
+			low_latency = 1;
+			latency = 1;
+			aggregate = 0;
+			break;
+
+		case OPT_NO_AGGREGATE:
+			aggregate = 0;
+			break;
+
+		case OPT_AU_INDEX:
+			au_index_file = optarg;
+			break;
+
+		case OPT_IDR_INDEX:
+			idr_index_file = optarg;
+			break;
+
+		case OPT_ABR:
+			abr = 1;
+			break;
+
+		case OPT_ABR_FPS_STEP:
+			abr_fps_step = 1;
+			break;
+
+		case OPT_CONTROL:
+			control_path = optarg;
+			break;
+
+		case OPT_SERVE:
+			serve_path = optarg;
+			break;
+
+		case OPT_SHM:
+			shm_path = optarg;
+			break;
+
+		case OPT_PREROLL:
+			preroll_dir = optarg;
+			break;
+
+		case OPT_SEGMENTS:
+			segment_dir = optarg;
+			break;
+
+		case OPT_MP4:
+			mp4_spec = optarg;
+			break;
+
+		case OPT_HLS:
+			hls_dir = optarg;
+			break;
+
+		case OPT_MP4_FRAG:
+			mp4_per_frame = parse_name(!strcmp(optarg, "frame") ? 1 : !strcmp(optarg, "gop") ? 0 : -1, "--mp4_frag");
+			break;
+
+		case OPT_SINK:
+			if (sink_specs_count == SINK_MAX) {
+				fprintf(stderr, "At most %d sinks\n", SINK_MAX);
+				exit(EXIT_FAILURE);
+			}
+			sink_specs[sink_specs_count++] = optarg;
+			break;
+
+		case OPT_LATENCY:
+			latency = 1;
+			break;
+
+		case OPT_INFLIGHT:
+			errno = 0;
+			inflight = strtol(optarg, NULL, 0);
+			if (errno)
+				errno_exit(optarg);
+			if (inflight < 1) {
+				fprintf(stderr, "--inflight must be at least 1\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_BUFFERS:
+			errno = 0;
+			capture_buffers = strtol(optarg, NULL, 0);
+			if (errno)
+				errno_exit(optarg);
+			if (capture_buffers < 2 || capture_buffers > MAX_CAPTURE_BUFFERS) {
+				fprintf(stderr, "--buffers must be between 2 and %d\n", MAX_CAPTURE_BUFFERS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_ADAPTIVE_BUFFERS:
+			adaptive_buffers++;
+			break;
+
+		case OPT_ARENA:
+			errno = 0;
+			arena_mb = strtol(optarg, NULL, 0);
+			if (errno)
+				errno_exit(optarg);
+			break;
+
+		case OPT_CPU_CAPTURE:
+		case OPT_CPU_OMX:
+		case OPT_CPU_OUTPUT:
+		case OPT_RT_PRIO: {
+			int value;
+			errno = 0;
+			value = strtol(optarg, NULL, 0);
+			if (errno)
+				errno_exit(optarg);
+			*(c == OPT_CPU_CAPTURE ? &cpu_capture : c == OPT_CPU_OMX ? &cpu_omx : c == OPT_CPU_OUTPUT ? &cpu_output : &rt_priority) = value;
+			break;
+		}
+
+		case OPT_MLOCK:
+			lock_memory++;
+			break;
+
+		case OPT_PREFAULT:
+			prefault_buffers++;
+			break;
+
+		case OPT_JITTER:
+			jitter++;
+			break;
+
+		case OPT_HUGEPAGES:
+			hugepages++;
+			break;
+
+		case OPT_TIMING:
+			timing++;
+			break;
+
+		case OPT_ENCODER:
+			if (!strcmp(optarg, encoder_omx.name))
+				encoder = &encoder_omx;
+			else if (!strncmp(optarg, encoder_m2m.name, 3) && (optarg[3] == '\0' || optarg[3] == ':')) {
+				encoder = &encoder_m2m;
+				if (optarg[3])
+					m2m_device = optarg + 4;
+			}
+			else if (!strcmp(optarg, encoder_null.name))
+				encoder = &encoder_null;
+			else {
+				fprintf(stderr, "unknown --encoder '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_CAMERA:
+			if (camera_specs_count == CAMERA_MAX - 1) {
+				fprintf(stderr, "At most %d cameras\n", CAMERA_MAX);
+				exit(EXIT_FAILURE);
+			}
+			if (strstr(optarg, ",out=") == NULL) {
+				fprintf(stderr, "--camera needs DEV,out=SPEC\n");
+				exit(EXIT_FAILURE);
+			}
+			camera_specs[camera_specs_count++] = optarg;
+			break;
+
+		case OPT_DECODE_THREADS:
+			errno = 0;
+			decode_threads = strtol(optarg, NULL, 0);
+			if (errno)
+				errno_exit(optarg);
+			if (decode_threads < 0 || decode_threads > DECODE_WORKERS_MAX) {
+				fprintf(stderr, "--decode_threads takes 0 to %d\n", DECODE_WORKERS_MAX);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_MOTION:
+			motion = 1;
+			break;
+
+		case OPT_MOTION_ZONE:
+			if (motion_add_zone(optarg) < 0) {
+				fprintf(stderr, "--motion_zone takes X,Y,W,H[,PCT] in percent, inside the frame, up to %d of them\n", MOTION_ZONES);
+				exit(EXIT_FAILURE);
+			}
+			motion = 1;
+			break;
+
+		case OPT_MOTION_THRESHOLD:
+		case OPT_MOTION_HOLD: {
+			char *end;
+			long value;
+			errno = 0;
+			value = strtol(optarg, &end, 0);
+			if (errno)
+				errno_exit(optarg);
+			if (end == optarg || *end || value < 0 || value > (c == OPT_MOTION_THRESHOLD ? 255 : 3600000)) {
+				fprintf(stderr, c == OPT_MOTION_THRESHOLD ? "--motion_threshold takes 0 to 255\n" :
+					"--motion_hold takes 0 to 3600000 ms\n");
+				exit(EXIT_FAILURE);
+			}
+			*(c == OPT_MOTION_THRESHOLD ? &motion_threshold : &motion_hold_ms) = value;
+			motion = 1;
+			break;
+		}
+
+		case OPT_MOTION_IDLE: {
+			char *end;
+			errno = 0;
+			motion_idle_fps = strtod(optarg, &end);
+			if (errno)
+				errno_exit(optarg);
+			/* the negated test turns NaN away too */
+			if (end == optarg || *end || !(motion_idle_fps >= 0 && motion_idle_fps <= 1000)) {
+				fprintf(stderr, "--motion_idle takes 0 to 1000 frames per second\n");
+				exit(EXIT_FAILURE);
+			}
+			motion = 1;
+			break;
+		}
+
+		case OPT_MOTION_IDLE_IDR:
+			motion_idle_idr = 1;
+			motion = 1;
+			break;
+
 		default:
 			usage(stderr, argc, argv);
 			exit(EXIT_FAILURE);
@@ -975,11 +1978,15 @@ int main(int argc, char **argv)
 	}
 
 	if (encode) {
-		if (io == IO_METHOD_MMAP)
+		if (arena_mb)
+			io = IO_METHOD_MMAP; // frames are copied out of the driver buffers
+		else if (io == IO_METHOD_MMAP)
 			io = IO_METHOD_USERPTR; // default for --encode
 		output = 0;
 	}
 
+	rt_lock_memory();
+
 	if (tst_enc) {
 		bcm_host_init();
 		int res = video_encode_test(test_encode_filename);
@@ -987,21 +1994,76 @@ int main(int argc, char **argv)
 		return res;
 	}
 
-	if (encode) {
-		capture_encode_jpeg_loop(frame_count/*, img_width, img_height, 14, img_fmt, bufsize*/); // OMX_COLOR_FormatYUV420PackedPlanar); // 10, OMX_COLOR_FormatYUV422PackedPlanar);
+	capture_init(&camera, dev_name);
+	if (camera_specs_count && !encode) {
+		fprintf(stderr, "--camera needs -n\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (encode && encoder != &encoder_omx && write_media_file) {
+		fprintf(stderr, "--encoder %s does not go with --write_media\n", encoder->name);
+		exit(EXIT_FAILURE);
+	}
+	if (encode && !encoder->camera && camera_specs_count) {
+		fprintf(stderr, "--encoder %s does not go with --camera\n", encoder->name);
+		exit(EXIT_FAILURE);
+	}
+	/* the Annex B stream they follow goes to /dev/null, stdout being the fMP4 writer's */
+	if (mp4_spec && !strcmp(mp4_spec, "-") && (abr || idr_index_file || au_index_file)) {
+		fprintf(stderr, "--mp4 - does not go with --abr, --idr_index or --au_index\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (encode && encoder == &encoder_null) {
+		arena_mb = 0;
+		io = IO_METHOD_MMAP; // frames go straight back to the driver, whatever their format
+		start_cameras();
+		encoder->encode_loop(&camera, frame_count);
+		if (fps_avg)
+			report_fps_avg(&camera);
+	}
+	else if (encode && !capture_is_mjpeg(&camera)) {
+		if (encoder != &encoder_omx) {
+			arena_mb = 0;
+			io = IO_METHOD_MMAP; // the encoder takes the driver's own buffers
+		}
+		else if (arena_mb) {
+			arena_mb = 0; // raw frames are captured straight into the encoder buffers
+			io = IO_METHOD_USERPTR;
+		}
+		start_cameras();
+		encoder->encode_loop(&camera, frame_count);
+		if (fps_avg)
+			report_fps_avg(&camera);
+	}
+	else if (encode && decode_threads) {
+		arena_mb = 0;
+		io = IO_METHOD_MMAP; // frames are decoded straight out of the driver buffers
+		start_cameras();
+		encoder->encode_loop(&camera, frame_count);
+		if (fps_avg)
+			report_fps_avg(&camera);
+	}
+	else if (encode) {
+		if (encoder != &encoder_omx) {
+			fprintf(stderr, "--encoder %s needs raw (YUV) capture, -f forces it, or --decode_threads\n", encoder->name);
+			exit(EXIT_FAILURE);
+		}
+		start_cameras();
+		capture_encode_jpeg_loop(&camera, frame_count/*, img_width, img_height, 14, img_fmt, bufsize*/); // OMX_COLOR_FormatYUV420PackedPlanar); // 10, OMX_COLOR_FormatYUV422PackedPlanar);
 		if (fps_avg)
-			report_fps_avg();
+			report_fps_avg(&camera);
 	}
 	else {
-		open_device();
-		unsigned int bufsize = init_device();
+		open_device(&camera);
+		unsigned int bufsize = init_device(&camera);
 		fprintf(stderr, "capture buffer size: %d\n", bufsize);
-		init_buffers(bufsize, NULL);
-		start_capturing();
-		mainloop();
-		stop_capturing();
-		uninit_device(0);
-		close_device();
+		init_buffers(&camera, bufsize, NULL);
+		start_capturing(&camera);
+		mainloop(&camera);
+		stop_capturing(&camera);
+		uninit_device(&camera, 0);
+		close_device(&camera);
 	}
 	fprintf(stderr, "\n");
 
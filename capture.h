@@ -0,0 +1,60 @@
+/*
+ * V4L2 capture device, one per camera
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <time.h>
+#include <linux/videodev2.h>
+
+#include "ilclient.h"
+
+#include "arena.h"
+
+#define CAMERA_MAX  8     /* -d and up to CAMERA_MAX - 1 --camera */
+
+struct buffer;
+struct stats_camera;
+
+struct capture {
+	const char            *dev_name;
+	int                    fd;
+	struct buffer         *buffers;
+	unsigned int           n_buffers;
+	int                    requeue_deferred;
+	int                    buffers_external;
+	int                    adaptive;           /* --adaptive_buffers, until it gives up on this device */
+	unsigned int           buffers_late, buffers_settle, lateness_max_us;
+	__u32                  sequence;
+	long                   frame_period_us;
+	struct timespec        start, end;
+	double                 fps_total;
+	int                    fps_count;
+	struct v4l2_format     v4l2_fmt;
+	struct stats_camera   *stats;              /* its DQBUF intervals and timers */
+};
+
+void capture_init(struct capture *cap, const char *dev_name);
+void open_device(struct capture *cap);
+void close_device(struct capture *cap);
+unsigned int init_device(struct capture *cap);
+void init_buffers(struct capture *cap, unsigned int buffer_size, OMX_BUFFERHEADERTYPE *external_buffers);
+void uninit_device(struct capture *cap, int external_buffers);
+void start_capturing(struct capture *cap);
+void stop_capturing(struct capture *cap);
+
+OMX_BUFFERHEADERTYPE *capture_frame(struct capture *cap, OMX_BUFFERHEADERTYPE *buf_list);
+int capture_frame_arena(struct capture *cap, struct arena *arena, void **frame);
+void capture_defer_requeue(struct capture *cap, int deferred);
+void release_frame(struct capture *cap, OMX_BUFFERHEADERTYPE *buf_hdr);
+int capture_frame_index(struct capture *cap, void **data, unsigned int *size);
+void release_frame_index(struct capture *cap, int index);
+int capture_export_buffer(struct capture *cap, int index, size_t *length);
+
+unsigned int capture_frame_rate(struct capture *cap);
+unsigned int capture_set_frame_rate(struct capture *cap, unsigned int rate);
+OMX_COLOR_FORMATTYPE capture_omx_format(struct capture *cap, OMX_U32 *width, OMX_U32 *height, OMX_S32 *stride);
+int capture_is_mjpeg(struct capture *cap);
+
+#endif /* CAPTURE_H */
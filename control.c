@@ -0,0 +1,167 @@
+/*
+ * Runtime control socket
+ *
+ * A Unix-domain stream socket at control_path takes one text command per line
+ * and answers each with a line starting "ok" or "error", e.g.
+ *
+ *   echo idr | socat - UNIX-CONNECT:/tmp/capture-encode.sock
+ *
+ * Nothing here blocks: control_poll() is called from the capture loop once
+ * per frame, accepts new connections and runs the complete lines received so
+ * far, so a command takes effect within a frame period without the stream
+ * ever stopping.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+#define CONTROL_CLIENTS   4
+#define CONTROL_LINE      256
+#define CONTROL_ARGS      8
+
+char *control_path;
+
+struct client {
+	int    fd;
+	size_t length;
+	char   line[CONTROL_LINE];
+};
+
+static int                listen_fd = -1;
+static struct client      clients[CONTROL_CLIENTS];
+static control_handler_fn run_command;
+
+void control_open(control_handler_fn handler)
+{
+	struct sockaddr_un addr;
+	int i;
+
+	if (!control_path)
+		return;
+
+	run_command = handler;
+	for (i = 0; i < CONTROL_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(control_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "control socket path '%s' is too long\n", control_path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, control_path);
+	unlink(control_path);
+
+	if (-1 == (listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) ||
+		-1 == bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+		-1 == listen(listen_fd, CONTROL_CLIENTS)) {
+		fprintf(stderr, "Cannot open control socket '%s': %d, %s\n", control_path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "control socket: %s\n", control_path);
+}
+
+static void drop_client(struct client *c)
+{
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void run_line(struct client *c, char *line, int64_t received_us)
+{
+	char *argv[CONTROL_ARGS + 1], *save, *text = NULL;
+	size_t length = 0;
+	int argc = 0;
+	FILE *reply;
+
+	for (argv[argc] = strtok_r(line, " \t\r", &save); argv[argc] && argc < CONTROL_ARGS; argv[argc] = strtok_r(NULL, " \t\r", &save))
+		argc++;
+	if (!argc)
+		return;
+
+	if ((reply = open_memstream(&text, &length)) == NULL)
+		return;
+	run_command(argc, argv, received_us, reply);
+	fclose(reply);
+
+	/* replies are short and the client is waiting for them; a client gone away must not SIGPIPE the stream */
+	if (send(c->fd, text, length, MSG_NOSIGNAL) < 0)
+		drop_client(c);
+	free(text);
+}
+
+static void read_client(struct client *c)
+{
+	struct timespec now;
+	char *nl;
+	ssize_t n;
+
+	while ((n = recv(c->fd, c->line + c->length, CONTROL_LINE - 1 - c->length, MSG_DONTWAIT)) > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		c->length += n;
+		c->line[c->length] = '\0';
+		while ((nl = strchr(c->line, '\n')) != NULL) {
+			*nl = '\0';
+			run_line(c, c->line, now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000);
+			if (c->fd < 0)
+				return;
+			c->length -= nl + 1 - c->line;
+			memmove(c->line, nl + 1, c->length + 1);
+		}
+		if (c->length == CONTROL_LINE - 1) {
+			send(c->fd, "error line too long\n", 20, MSG_NOSIGNAL);
+			drop_client(c);
+			return;
+		}
+	}
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		drop_client(c);
+}
+
+void control_poll(void)
+{
+	int fd, i;
+
+	if (listen_fd < 0)
+		return;
+
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		for (i = 0; i < CONTROL_CLIENTS && clients[i].fd >= 0; i++)
+			;
+		if (i == CONTROL_CLIENTS) {
+			send(fd, "error too many control connections\n", 35, MSG_NOSIGNAL);
+			close(fd);
+			continue;
+		}
+		clients[i].fd = fd;
+		clients[i].length = 0;
+	}
+
+	for (i = 0; i < CONTROL_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			read_client(&clients[i]);
+}
+
+void control_close(void)
+{
+	int i;
+
+	if (listen_fd < 0)
+		return;
+	for (i = 0; i < CONTROL_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			drop_client(&clients[i]);
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(control_path);
+}
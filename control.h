@@ -0,0 +1,20 @@
+/*
+ * Runtime control socket
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* run one command; received_us is when it arrived (CLOCK_MONOTONIC), for command-to-effect latency */
+typedef void (*control_handler_fn)(int argc, char **argv, int64_t received_us, FILE *reply);
+
+extern char *control_path;
+
+void control_open(control_handler_fn handler);
+void control_poll(void);
+void control_close(void);
+
+#endif /* CONTROL_H */
@@ -0,0 +1,521 @@
+/*
+ * Software MJPEG decode
+ *
+ * A pool of worker threads decoding MJPEG frames with libjpeg(-turbo) into
+ * planar I420, as an alternative to the GPU's image_decode. Frames go in with
+ * decoder_submit() in capture order, are decoded on whichever worker is free
+ * and come back out of decoder_next() in the order they went in, so a slow
+ * frame holds back the ones behind it rather than letting them overtake.
+ *
+ * Decoding stays in the YCbCr domain: raw_data_out hands over the component
+ * planes as they are in the file. 4:2:0 is copied as is, 4:2:2 (what most UVC
+ * cameras send) keeps every other chroma row, grey frames get neutral chroma.
+ * The width must be a multiple of 16 so MCU rows fit the stride; rows past
+ * slice_height go to a scratch row.
+ *
+ * A frame the decoder cannot use (corrupt, truncated, other size or sampling)
+ * comes back with status -1 for the caller to drop. Each worker keeps its own
+ * thread CPU time, so the report has the fps one core sustains.
+ *
+ * scaled_decode() is the same decode on the calling thread, for previews and
+ * analytics: at 1/2, 1/4 or 1/8 libjpeg scales the IDCT down (at 1/8 to the
+ * DC coefficient alone) rather than decode in full and downscale. What it
+ * cannot skip is the Huffman decoding of every coefficient; jpeg-bench shows
+ * what each scale costs.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <jpeglib.h>
+
+#include "decode.h"
+
+#define DECODE_JOBS       32    /* frames submitted and not yet returned */
+
+#define SCALED_SCRATCH    (1 + 4 * DCTSIZE)    /* rows: one to discard, two planes of chroma to decimate */
+
+/* rows of a component's block once scaled: 8 at full size, down to 1 at 1/8 */
+#if JPEG_LIB_VERSION >= 70
+#define SCALED_BLOCK(comp)   ((comp)->DCT_v_scaled_size)
+#else
+#define SCALED_BLOCK(comp)   ((comp)->DCT_scaled_size)
+#endif
+
+int decode_threads;
+
+struct decode_error {
+	struct jpeg_error_mgr   mgr;
+	jmp_buf                 jump;
+};
+
+struct worker {
+	struct decoder         *decoder;
+	pthread_t               thread;
+	int                     started;
+	unsigned char          *scratch;
+	unsigned long           frames;
+	int64_t                 cpu_us;
+};
+
+struct scaled_decoder {
+	struct jpeg_decompress_struct cinfo;
+	struct decode_error     err;
+	unsigned char          *frame, *scratch;
+	size_t                  frame_size, scratch_size;
+};
+
+struct decoder {
+	unsigned int            width, height, stride, slice_height;
+	int                     workers, event_fd;
+	struct worker           worker[DECODE_WORKERS_MAX];
+	pthread_mutex_t         lock;
+	pthread_cond_t          cond;
+
+	/* under lock: jobs [head, next) are being decoded or done, [next, tail) waiting for a worker */
+	struct decode_job       jobs[DECODE_JOBS];
+	int                     done[DECODE_JOBS];
+	unsigned int            head, next, tail;
+	int                     stopping;
+	unsigned long           frames, failed, full;
+	unsigned int            queued_max;
+	int64_t                 first_us, last_us;
+};
+
+static int64_t now_us(clockid_t clock)
+{
+	struct timespec now;
+
+	clock_gettime(clock, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+static void decode_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((struct decode_error *)cinfo->err)->jump, 1);
+}
+
+/* corrupt data warnings are counted as failed frames, not printed per frame */
+static void decode_output_message(j_common_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+/* 4:2:0 and 4:2:2 YCbCr, with two luma columns to a chroma one, or grey: what I420 is made from */
+static int sampling_supported(struct jpeg_decompress_struct *cinfo)
+{
+	jpeg_component_info *c = cinfo->comp_info;
+
+	if (cinfo->num_components == 1)
+		return 1;
+	return cinfo->num_components == 3 && cinfo->jpeg_color_space == JCS_YCbCr &&
+		c[0].h_samp_factor == 2 && c[1].h_samp_factor == 1 && c[2].h_samp_factor == 1 &&
+		c[2].v_samp_factor == c[1].v_samp_factor && c[0].v_samp_factor <= 2 &&
+		(c[0].v_samp_factor == c[1].v_samp_factor || c[0].v_samp_factor == 2 * c[1].v_samp_factor);
+}
+
+/*
+ * The started decompress's raw planes into I420 at Y, at the scaled size;
+ * rows past slice_height go to scratch. Scaled down, libjpeg can hand over
+ * 4:2:0 chroma at twice the resolution I420 wants (it upsamples in the IDCT),
+ * which is then decimated from the chroma rows further into scratch.
+ */
+static void read_planes(struct jpeg_decompress_struct *cinfo, unsigned char *Y,
+	unsigned int stride, unsigned int slice_height, unsigned char *scratch)
+{
+	JSAMPROW y[2 * DCTSIZE], u[2 * DCTSIZE], v[2 * DCTSIZE];
+	JSAMPARRAY planes[3] = { y, u, v };
+	jpeg_component_info *c = cinfo->comp_info;
+	unsigned char *U = Y + (size_t)stride * slice_height;
+	unsigned char *V = U + (size_t)(stride / 2) * (slice_height / 2);
+	unsigned char *wide = scratch + stride;
+	int grey = cinfo->num_components == 1;
+	unsigned int ys = SCALED_BLOCK(&c[0]), cs = grey ? ys : SCALED_BLOCK(&c[1]);
+	unsigned int cv = grey ? 1 : c[1].v_samp_factor;
+	unsigned int rows = c[0].v_samp_factor * ys, crows = cv * cs;
+	/* chroma samples from the file to one of I420's, across and down: 1 or 2 */
+	unsigned int hstep = grey ? 1 : c[1].h_samp_factor * cs * 2 / (c[0].h_samp_factor * ys);
+	unsigned int vstep = crows * 2 / rows;
+	unsigned int line, i, x;
+	int out[2 * DCTSIZE];
+
+	while ((line = cinfo->output_scanline) < cinfo->output_height) {
+		for (i = 0; i < rows; i++)
+			y[i] = line + i < slice_height ? Y + (size_t)(line + i) * stride : scratch;
+		for (i = 0; !grey && i < crows; i++) {
+			unsigned int row = line * crows / rows + i;
+
+			out[i] = row % vstep || row / vstep >= slice_height / 2 ? -1 : (int)(row / vstep);
+			if (hstep == 2) {
+				u[i] = wide + (size_t)i * stride;
+				v[i] = wide + (size_t)(crows + i) * stride;
+			}
+			else {
+				u[i] = out[i] >= 0 ? U + (size_t)out[i] * (stride / 2) : scratch;
+				v[i] = out[i] >= 0 ? V + (size_t)out[i] * (stride / 2) : scratch;
+			}
+		}
+		if (jpeg_read_raw_data(cinfo, planes, rows) == 0)
+			break;
+		for (i = 0; hstep == 2 && i < crows; i++)
+			for (x = 0; out[i] >= 0 && x < stride / 2; x++) {
+				U[(size_t)out[i] * (stride / 2) + x] = u[i][2 * x];
+				V[(size_t)out[i] * (stride / 2) + x] = v[i][2 * x];
+			}
+	}
+	jpeg_finish_decompress(cinfo);
+
+	if (grey)
+		memset(U, 128, (size_t)(stride / 2) * (slice_height / 2) * 2);
+}
+
+static int decode_frame(struct decoder *d, struct worker *w, struct jpeg_decompress_struct *cinfo,
+	struct decode_error *err, struct decode_job *job)
+{
+	if (setjmp(err->jump)) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+
+	jpeg_mem_src(cinfo, (unsigned char *)job->jpeg, job->size);
+	jpeg_read_header(cinfo, TRUE);
+
+	if (cinfo->image_width != d->width || cinfo->image_height != d->height || !sampling_supported(cinfo)) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+
+	cinfo->raw_data_out = TRUE;
+	cinfo->do_fancy_upsampling = FALSE;
+	cinfo->dct_method = JDCT_IFAST;
+	jpeg_start_decompress(cinfo);
+	read_planes(cinfo, job->dst, d->stride, d->slice_height, w->scratch);
+	return 0;
+}
+
+static void decompress_init(struct jpeg_decompress_struct *cinfo, struct decode_error *err)
+{
+	cinfo->err = jpeg_std_error(&err->mgr);
+	err->mgr.error_exit = decode_error_exit;
+	err->mgr.output_message = decode_output_message;
+	jpeg_create_decompress(cinfo);
+}
+
+static void *decode_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct decoder *d = w->decoder;
+	struct jpeg_decompress_struct cinfo;
+	struct decode_error err;
+	struct decode_job *job;
+	uint64_t one = 1;
+	unsigned int slot;
+	int64_t start;
+	int status;
+
+	decompress_init(&cinfo, &err);
+
+	pthread_mutex_lock(&d->lock);
+	for (;;) {
+		while (!d->stopping && d->next == d->tail)
+			pthread_cond_wait(&d->cond, &d->lock);
+		if (d->next == d->tail)
+			break;
+		slot = d->next++ % DECODE_JOBS;
+		job = &d->jobs[slot];
+		pthread_mutex_unlock(&d->lock);
+
+		start = now_us(CLOCK_THREAD_CPUTIME_ID);
+		status = decode_frame(d, w, &cinfo, &err, job);
+		w->cpu_us += now_us(CLOCK_THREAD_CPUTIME_ID) - start;
+		w->frames++;
+
+		pthread_mutex_lock(&d->lock);
+		job->status = status;
+		d->done[slot] = 1;
+		d->frames++;
+		if (status < 0)
+			d->failed++;
+		d->last_us = now_us(CLOCK_MONOTONIC);
+		if (write(d->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("decoder eventfd");
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	jpeg_destroy_decompress(&cinfo);
+	return NULL;
+}
+
+/*
+ * Starts workers threads decoding width x height frames into I420 with the
+ * given luma stride and slice height (chroma at half of each).
+ */
+struct decoder *decoder_new(int workers, unsigned int width, unsigned int height,
+	unsigned int stride, unsigned int slice_height)
+{
+	struct decoder *d;
+	int i, err = 0;
+
+	if (width % 16 || stride < width || stride % 2 || slice_height < height) {
+		fprintf(stderr, "MJPEG decode: %ux%u in stride %u, slice height %u is not supported (width must be a multiple of 16)\n",
+			width, height, stride, slice_height);
+		return NULL;
+	}
+	if (workers < 1)
+		workers = 1;
+	if (workers > DECODE_WORKERS_MAX)
+		workers = DECODE_WORKERS_MAX;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		return NULL;
+	d->width = width;
+	d->height = height;
+	d->stride = stride;
+	d->slice_height = slice_height;
+	d->workers = workers;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	if ((d->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		perror("eventfd");
+		free(d);
+		return NULL;
+	}
+
+	for (i = 0; i < workers; i++) {
+		struct worker *w = &d->worker[i];
+
+		w->decoder = d;
+		if ((w->scratch = malloc(stride)) == NULL ||
+		    (err = pthread_create(&w->thread, NULL, decode_worker, w)) != 0) {
+			fprintf(stderr, "cannot start MJPEG decode worker %d: %s\n", i, w->scratch ? strerror(err) : "out of memory");
+			decoder_free(d, NULL);
+			return NULL;
+		}
+		w->started = 1;
+	}
+	fprintf(stderr, "MJPEG decode: %d workers, %ux%u into I420 stride %u, slice height %u\n",
+		workers, width, height, stride, slice_height);
+	return d;
+}
+
+size_t decoder_frame_size(struct decoder *d)
+{
+	return (size_t)d->stride * d->slice_height + 2 * (size_t)(d->stride / 2) * (d->slice_height / 2);
+}
+
+/* readable when a frame is done; decoder_next() reads it */
+int decoder_fd(struct decoder *d)
+{
+	return d->event_fd;
+}
+
+/* returns 0, or -1 if DECODE_JOBS frames are already in the decoder */
+int decoder_submit(struct decoder *d, const void *jpeg, size_t size, void *dst,
+	int64_t timestamp, int index, void *arg)
+{
+	struct decode_job *job;
+	unsigned int slot;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->tail - d->head == DECODE_JOBS) {
+		d->full++;
+		pthread_mutex_unlock(&d->lock);
+		return -1;
+	}
+	slot = d->tail % DECODE_JOBS;
+	job = &d->jobs[slot];
+	job->jpeg = jpeg;
+	job->size = size;
+	job->dst = dst;
+	job->timestamp = timestamp;
+	job->index = index;
+	job->arg = arg;
+	job->status = 0;
+	d->done[slot] = 0;
+	d->tail++;
+	if (d->tail - d->head > d->queued_max)
+		d->queued_max = d->tail - d->head;
+	if (d->first_us == 0)
+		d->first_us = now_us(CLOCK_MONOTONIC);
+	pthread_cond_signal(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+/* returns 1 with the oldest frame if it is done, 0 if it is not (or none is in) */
+int decoder_next(struct decoder *d, struct decode_job *job)
+{
+	uint64_t count;
+	unsigned int slot;
+
+	/* clear the event before looking, so a frame finishing after the look wakes the next poll */
+	if (read(d->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("decoder eventfd");
+
+	pthread_mutex_lock(&d->lock);
+	slot = d->head % DECODE_JOBS;
+	if (d->head == d->tail || !d->done[slot]) {
+		pthread_mutex_unlock(&d->lock);
+		return 0;
+	}
+	*job = d->jobs[slot];
+	d->done[slot] = 0;
+	d->head++;
+	pthread_mutex_unlock(&d->lock);
+	return 1;
+}
+
+/* frames submitted and not yet returned */
+int decoder_pending(struct decoder *d)
+{
+	int n;
+
+	pthread_mutex_lock(&d->lock);
+	n = d->tail - d->head;
+	pthread_mutex_unlock(&d->lock);
+	return n;
+}
+
+void decoder_report(struct decoder *d, FILE *out)
+{
+	int64_t cpu_us = 0;
+	double seconds;
+	int i;
+
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < d->workers; i++)
+		cpu_us += d->worker[i].cpu_us;
+	seconds = (d->last_us - d->first_us) / 1000000.0;
+	fprintf(out, "MJPEG decode: %d workers, %lu frames (%lu failed, %lu with the queue full), %.1f fps, "
+		"%.1f fps per core (%.2f ms cpu per frame), %u queued at most\n",
+		d->workers, d->frames, d->failed, d->full,
+		d->frames > 1 && seconds > 0 ? (d->frames - 1) / seconds : 0.0,
+		cpu_us ? d->frames * 1000000.0 / cpu_us : 0.0,
+		d->frames ? cpu_us / 1000.0 / d->frames : 0.0, d->queued_max);
+	for (i = 0; i < d->workers && d->workers > 1; i++)
+		fprintf(out, "  worker %d: %lu frames, %.2f s cpu\n", i, d->worker[i].frames, d->worker[i].cpu_us / 1000000.0);
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* waits for the frames already submitted, then stops the workers; reports to out unless NULL */
+void decoder_free(struct decoder *d, FILE *out)
+{
+	int i;
+
+	if (d == NULL)
+		return;
+
+	pthread_mutex_lock(&d->lock);
+	d->stopping = 1;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+	for (i = 0; i < d->workers; i++) {
+		if (d->worker[i].started)
+			pthread_join(d->worker[i].thread, NULL);
+		free(d->worker[i].scratch);
+	}
+
+	if (out)
+		decoder_report(d, out);
+	close(d->event_fd);
+	pthread_cond_destroy(&d->cond);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
+
+static int ensure(unsigned char **buf, size_t *size, size_t needed)
+{
+	unsigned char *p;
+
+	if (needed <= *size)
+		return 0;
+	if ((p = realloc(*buf, needed)) == NULL)
+		return -1;
+	*buf = p;
+	*size = needed;
+	return 0;
+}
+
+struct scaled_decoder *scaled_decoder_new(void)
+{
+	struct scaled_decoder *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return NULL;
+	decompress_init(&s->cinfo, &s->err);
+	return s;
+}
+
+/*
+ * Decodes a JPEG frame of any size at 1/scale (1, 2, 4 or 8) with the IDCT
+ * scaled down to match; at 1/8 that is the DC coefficient of each block.
+ * The planes stay valid until the next call; returns 0 or -1.
+ */
+int scaled_decode(struct scaled_decoder *s, const void *jpeg, size_t size, int scale, struct decode_planes *out)
+{
+	struct jpeg_decompress_struct *cinfo = &s->cinfo;
+	unsigned int mcus, width, height, stride, slice_height;
+
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+		return -1;
+
+	if (setjmp(s->err.jump)) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+
+	jpeg_mem_src(cinfo, (unsigned char *)jpeg, size);
+	jpeg_read_header(cinfo, TRUE);
+	if (!sampling_supported(cinfo)) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+
+	/* whole 16 pixel wide MCUs in every row, so raw data never runs past the stride */
+	mcus = (cinfo->image_width + 15) / 16;
+	cinfo->raw_data_out = TRUE;
+	cinfo->do_fancy_upsampling = FALSE;
+	cinfo->dct_method = JDCT_IFAST;
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = scale;
+	jpeg_calc_output_dimensions(cinfo);
+	width = cinfo->output_width;
+	height = cinfo->output_height;
+	stride = mcus * 16 / scale;
+	slice_height = (height + 1) & ~1;
+	if (ensure(&s->frame, &s->frame_size, (size_t)stride * slice_height * 3 / 2) < 0 ||
+	    ensure(&s->scratch, &s->scratch_size, (size_t)stride * SCALED_SCRATCH) < 0) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	}
+
+	jpeg_start_decompress(cinfo);
+	read_planes(cinfo, s->frame, stride, slice_height, s->scratch);
+
+	out->width = width;
+	out->height = height;
+	out->stride = stride;
+	out->y = s->frame;
+	out->u = out->y + (size_t)stride * slice_height;
+	out->v = out->u + (size_t)(stride / 2) * (slice_height / 2);
+	return 0;
+}
+
+void scaled_decoder_free(struct scaled_decoder *s)
+{
+	if (s == NULL)
+		return;
+	jpeg_destroy_decompress(&s->cinfo);
+	free(s->frame);
+	free(s->scratch);
+	free(s);
+}
@@ -0,0 +1,51 @@
+/*
+ * Software MJPEG decode
+ */
+
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DECODE_WORKERS_MAX  16
+
+extern int decode_threads;
+
+struct decoder;
+struct scaled_decoder;
+
+struct decode_job {
+	const void  *jpeg;
+	size_t       size;
+	void        *dst;               /* I420 frame of decoder_frame_size() bytes */
+	int64_t      timestamp;         /* capture time, us */
+	int          index;             /* capture buffer */
+	void        *arg;               /* the encoder's buffer */
+	int          status;            /* 0 decoded, -1 corrupt or not 4:2:x at the capture size */
+};
+
+struct decoder *decoder_new(int workers, unsigned int width, unsigned int height,
+	unsigned int stride, unsigned int slice_height);
+size_t decoder_frame_size(struct decoder *d);
+int decoder_fd(struct decoder *d);
+int decoder_submit(struct decoder *d, const void *jpeg, size_t size, void *dst,
+	int64_t timestamp, int index, void *arg);
+int decoder_next(struct decoder *d, struct decode_job *job);
+int decoder_pending(struct decoder *d);
+void decoder_report(struct decoder *d, FILE *out);
+void decoder_free(struct decoder *d, FILE *out);
+
+/* reduced size planes for previews and analytics, I420 like a full decode */
+struct decode_planes {
+	unsigned int    width, height;     /* luma; chroma is half of each, rounded up */
+	unsigned int    stride;            /* luma; chroma stride / 2 */
+	unsigned char  *y, *u, *v;
+};
+
+struct scaled_decoder *scaled_decoder_new(void);
+int scaled_decode(struct scaled_decoder *s, const void *jpeg, size_t size, int scale, struct decode_planes *out);
+void scaled_decoder_free(struct scaled_decoder *s);
+
+#endif /* DECODE_H */
@@ -36,10 +36,35 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <time.h>
 #include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/resource.h>
 
 #include "bcm_host.h"
 #include "ilclient.h"
 
+#include "arena.h"
+#include "capture.h"
+#include "encoder.h"
+#include "rt.h"
+#include "stats.h"
+#include "output.h"
+#include "abr.h"
+#include "control.h"
+#include "gop.h"
+#include "sink.h"
+#include "server.h"
+#include "shmout.h"
+#include "decode.h"
+#include "motion.h"
+#include "preroll.h"
+#include "segment.h"
+#include "mp4.h"
+#include "hls.h"
+
 #define NUMFRAMES 300
 #define WIDTH     640
 #define PITCH     ((WIDTH+31)&~31)
@@ -113,6 +138,35 @@ get_time_diff(struct timespec *start, struct timespec *result) {
 	time_diff(start, &cur_time, result);
 }
 
+// buffer timestamps carry the CLOCK_MONOTONIC capture time in microseconds through to the encoder output
+static OMX_TICKS
+omx_ticks_from_us(int64_t us) {
+	OMX_TICKS ticks;
+#ifdef OMX_SKIP64BIT
+	ticks.nLowPart = (OMX_U32)us;
+	ticks.nHighPart = (OMX_U32)(us >> 32);
+#else
+	ticks = us;
+#endif
+	return ticks;
+}
+
+static OMX_TICKS
+omx_ticks_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return omx_ticks_from_us(now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000);
+}
+
+static int64_t
+omx_ticks_us(OMX_TICKS ticks) {
+#ifdef OMX_SKIP64BIT
+	return ((int64_t)ticks.nHighPart << 32) | ticks.nLowPart;
+#else
+	return ticks;
+#endif
+}
+
 static void
 wait_timeout(__time_t sec, __suseconds_t usec) {
 	struct timeval timeout;
@@ -337,9 +391,6 @@ video_encode_test(char *outputfilename)
 	return status;
 }
 
-extern OMX_BUFFERHEADERTYPE *
-capture_frame(OMX_BUFFERHEADERTYPE *buf_list);
-
 #define OMX_ERR_EXIT(fmt_str) {\
 		fprintf(stderr, fmt_str, __FUNCTION__, __LINE__, r);\
 		exit(1);\
@@ -362,159 +413,6 @@ capture_frame(OMX_BUFFERHEADERTYPE *buf_list);
 	(var_ptr)->nVersion.nVersion = OMX_VERSION;\
 	(var_ptr)->nPortIndex = (port);
 
-int
-capture_encode_loop(int frames, OMX_U32 frameWidth, OMX_U32 frameHeight, uint frameRate, OMX_COLOR_FORMATTYPE colorFormat, unsigned int bufsize) {
-	OMX_VIDEO_PARAM_PORTFORMATTYPE format;
-	OMX_PARAM_PORTDEFINITIONTYPE def;
-	COMPONENT_T *video_encode = NULL;
-	COMPONENT_T *list[5];
-	OMX_BUFFERHEADERTYPE *buf;
-	OMX_BUFFERHEADERTYPE *out;
-	OMX_ERRORTYPE r;
-	int r_il = 0;
-	ILCLIENT_T *client;
-	int status = 0;
-	int framenumber = 0;
-
-	memset(list, 0, sizeof(list));
-
-	if ((client = ilclient_init()) == NULL) {
-		fprintf(stderr, "ilclient_init() for video_encode failed!\n");
-		return -3;
-	}
-
-	if ((r = OMX_Init()) != OMX_ErrorNone) {
-		ilclient_destroy(client);
-		fprintf(stderr, "OMX_Init() for video_encode failed with %x!\n", r);
-		return -4;
-	}
-
-	// create video_encode
-	if ((r_il = ilclient_create_component(client, &video_encode, "video_encode", 
-		ILCLIENT_DISABLE_ALL_PORTS | ILCLIENT_ENABLE_INPUT_BUFFERS | ILCLIENT_ENABLE_OUTPUT_BUFFERS)) != 0)
-		ILC_ERR_EXIT("%s:%d: ilclient_create_component() for video_encode failed (%d)!\n")
-
-	list[0] = video_encode;
-
-	// get current settings of video_encode component from port 200
-	INIT_OMX_TYPE(def, OMX_PARAM_PORTDEFINITIONTYPE, 200)
-
-	if ((r = OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamPortDefinition, &def)) != OMX_ErrorNone)
-		OMX_ERR_EXIT("%s:%d: OMX_GetParameter() for video_encode port 200 failed with %x!\n")
-
-	print_def(&def, stderr);
-	// Port 200: in 1/1 115200 16 enabled,not pop.,not cont. 320x240 320x240 @1966080 20
-
-	def.nBufferSize = bufsize;
-	def.format.video.nFrameWidth = frameWidth;
-	def.format.video.nFrameHeight = frameHeight;
-	def.format.video.xFramerate = frameRate << 16; // 30 << 16;
-	def.format.video.nSliceHeight = def.format.video.nFrameHeight;
-	def.format.video.nStride = def.format.video.nFrameWidth;
-	def.format.video.eColorFormat = colorFormat; // OMX_COLOR_FormatYUV420PackedPlanar;
-
-	print_def(&def, stderr);
-
-	if ((r = OMX_SetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamPortDefinition, &def)) != OMX_ErrorNone)
-		OMX_ERR_EXIT("%s:%d: OMX_SetParameter() for video_encode port 200 failed with %x!\n")
-
-	INIT_OMX_TYPE(format, OMX_VIDEO_PARAM_PORTFORMATTYPE, 201)
-	format.eCompressionFormat = OMX_VIDEO_CodingAVC; // OMX_VIDEO_CodingMPEG4 fails, see https://github.com/raspberrypi/firmware/issues/162
-
-	fprintf(stderr, "OMX_SetParameter for video_encode:201...\n");
-	if ((r = OMX_SetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoPortFormat, &format)) != OMX_ErrorNone)
-		OMX_ERR_EXIT("%s:%d: OMX_SetParameter() for format for video_encode port 201 failed with %x!\n")
-
-	OMX_VIDEO_PARAM_BITRATETYPE bitrateType;
-	// set current bitrate to 1Mbit
-	INIT_OMX_TYPE(bitrateType, OMX_VIDEO_PARAM_BITRATETYPE, 201)
-	bitrateType.eControlRate = OMX_Video_ControlRateVariable;
-	bitrateType.nTargetBitrate = 1000000;
-
-	if ((r = OMX_SetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoBitrate, &bitrateType)) != OMX_ErrorNone)
-		OMX_ERR_EXIT("%s:%d: OMX_SetParameter() for bitrate for video_encode port 201 failed with %x!\n")
-
-	// get current bitrate
-	INIT_OMX_TYPE(bitrateType, OMX_VIDEO_PARAM_BITRATETYPE, 201)
-
-	if ((r = OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoBitrate, &bitrateType)) != OMX_ErrorNone)
-		OMX_ERR_EXIT("%s:%d: OMX_GetParameter() for bitrate for video_encode port 201 failed with %x!\n")
-	fprintf(stderr, "Current Bitrate=%u\n",bitrateType.nTargetBitrate);
-
-	fprintf(stderr, "encode to idle...\n");
-	if (ilclient_change_component_state(video_encode, OMX_StateIdle) == -1)
-		fprintf(stderr, "%s:%d: ilclient_change_component_state(video_encode, OMX_StateIdle) failed", __FUNCTION__, __LINE__);
-
-	fprintf(stderr, "enabling port buffers for 200...\n");
-	if ((r_il = ilclient_enable_port_buffers(video_encode, 200, NULL, NULL, NULL)) != 0)
-		ILC_ERR_EXIT("%s:%d: enabling port buffers for 200 failed (%d)!\n")
-
-	fprintf(stderr, "enabling port buffers for 201...\n");
-	if ((r_il = ilclient_enable_port_buffers(video_encode, 201, NULL, NULL, NULL)) != 0)
-		ILC_ERR_EXIT("%s:%d: enabling port buffers for 201 failed (%d)!\n")
-
-	fprintf(stderr, "encode to executing...\n");
-	ilclient_change_component_state(video_encode, OMX_StateExecuting);
-
-	fprintf(stderr, "looping for buffers...\n");
-	do {
-		buf = ilclient_get_input_buffer(video_encode, 200, 1);
-		if (buf == NULL) {
-			fprintf(stderr, "Doh, no buffers for me!\n");
-		}
-		else {
-			/* fill it */
-			//generate_test_card(buf->pBuffer, &buf->nFilledLen, framenumber++);
-			capture_frame(buf);
-			framenumber++;
-
-			if ((r = OMX_EmptyThisBuffer(ILC_GET_HANDLE(video_encode), buf)) != OMX_ErrorNone)
-				fprintf(stderr, "Error emptying buffer: %x\n", r);
-
-			out = ilclient_get_output_buffer(video_encode, 201, 1);
-
-			if ((r = OMX_FillThisBuffer(ILC_GET_HANDLE(video_encode), out)) != OMX_ErrorNone)
-				fprintf(stderr, "Error filling buffer: %x\n", r);
-
-			if (out != NULL) {
-				if (out->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
-					int i;
-					for (i = 0; i < out->nFilledLen; i++)
-						fprintf(stderr, "%x ", out->pBuffer[i]);
-					fprintf(stderr, "\n");
-				}
-
-				size_t res = fwrite(out->pBuffer, 1, out->nFilledLen, stdout);
-				if (res != out->nFilledLen)
-					fprintf(stderr, "fwrite: Error emptying buffer: %d\n", res);
-				//else
-				//	fprintf(stderr, "Writing frame %d/%d\n", framenumber, frames);
-
-				out->nFilledLen = 0;
-			}
-			else
-				fprintf(stderr, "Not getting it :(\n");
-		}
-	}
-	while (framenumber < frames);
-
-	fprintf(stderr, "Teardown.\n");
-
-	fprintf(stderr, "disabling port buffers for 200 and 201...\n");
-	ilclient_disable_port_buffers(video_encode, 200, NULL, NULL, NULL);
-	ilclient_disable_port_buffers(video_encode, 201, NULL, NULL, NULL);
-
-	ilclient_state_transition(list, OMX_StateIdle);
-	ilclient_state_transition(list, OMX_StateLoaded);
-
-	ilclient_cleanup_components(list);
-
-	OMX_Deinit();
-
-	ilclient_destroy(client);
-	return status;
-}
-
 static void
 get_portdef(OMX_PARAM_PORTDEFINITIONTYPE *portdef_ptr, COMPONENT_T *comp, OMX_U32 port, int image) {
 	INIT_OMX_TYPE_PTR(portdef_ptr, OMX_PARAM_PORTDEFINITIONTYPE, port)
@@ -558,6 +456,9 @@ disable_port_buffers(COMPONENT_T *comp, OMX_U32 port) {
 #define INFO_PRINT_2(x,y,z)
 #endif /* INFO */
 
+extern int
+capture_buffers;
+
 static int
 image_decode_init(COMPONENT_T *image_decode, uint bufsize) {
 
@@ -569,6 +470,9 @@ image_decode_init(COMPONENT_T *image_decode, uint bufsize) {
 	// set image_decode input buffer size and image format - port 320
 	if (portdef.nBufferSize < bufsize)
 		portdef.nBufferSize = bufsize;
+	// these buffers double as the capture buffers
+	if (capture_buffers)
+		portdef.nBufferCountActual = capture_buffers > portdef.nBufferCountMin ? capture_buffers : portdef.nBufferCountMin;
 	//portdef.nBufferCountMin = portdef.nBufferCountActual = 1;
 	portdef.format.image.eCompressionFormat = OMX_IMAGE_CodingJPEG;
 	set_portdef(&portdef, image_decode, 320, 1);
@@ -620,12 +524,361 @@ write_media_set_input_video_format(OMX_PARAM_PORTDEFINITIONTYPE *portdef_ptr, CO
 }
 
 extern int
-psips, bitrate, codec;
+psips, bitrate, codec, inflight;
+
+extern int
+control_rate, idr_period, avc_profile, avc_level, qp_min, qp_max, qp_i, qp_p, slices, low_latency;
 
 extern char *write_media_file;
 
-static void 
-video_encode_init(COMPONENT_T *video_encode) {
+struct omx_name {
+	const char *name;
+	int         value;
+};
+
+static const struct omx_name control_rate_names[] = {
+	{ "off",      OMX_Video_ControlRateDisable },
+	{ "vbr",      OMX_Video_ControlRateVariable },
+	{ "cbr",      OMX_Video_ControlRateConstant },
+	{ "vbr_skip", OMX_Video_ControlRateVariableSkipFrames },
+	{ "cbr_skip", OMX_Video_ControlRateConstantSkipFrames },
+	{ NULL, 0 }
+};
+
+static const struct omx_name avc_profile_names[] = {
+	{ "baseline", OMX_VIDEO_AVCProfileBaseline },
+	{ "main",     OMX_VIDEO_AVCProfileMain },
+	{ "high",     OMX_VIDEO_AVCProfileHigh },
+	{ NULL, 0 }
+};
+
+static const struct omx_name avc_level_names[] = {
+	{ "1",   OMX_VIDEO_AVCLevel1 },  { "1b",  OMX_VIDEO_AVCLevel1b }, { "1.1", OMX_VIDEO_AVCLevel11 },
+	{ "1.2", OMX_VIDEO_AVCLevel12 }, { "1.3", OMX_VIDEO_AVCLevel13 }, { "2",   OMX_VIDEO_AVCLevel2 },
+	{ "2.1", OMX_VIDEO_AVCLevel21 }, { "2.2", OMX_VIDEO_AVCLevel22 }, { "3",   OMX_VIDEO_AVCLevel3 },
+	{ "3.1", OMX_VIDEO_AVCLevel31 }, { "3.2", OMX_VIDEO_AVCLevel32 }, { "4",   OMX_VIDEO_AVCLevel4 },
+	{ "4.1", OMX_VIDEO_AVCLevel41 }, { "4.2", OMX_VIDEO_AVCLevel42 }, { "5",   OMX_VIDEO_AVCLevel5 },
+	{ "5.1", OMX_VIDEO_AVCLevel51 },
+	{ NULL, 0 }
+};
+
+static int
+omx_value(const struct omx_name *names, const char *name) {
+	for (; names->name; names++)
+		if (!strcmp(names->name, name))
+			return names->value;
+	return -1;
+}
+
+static const char *
+omx_name(const struct omx_name *names, int value) {
+	for (; names->name; names++)
+		if (names->value == value)
+			return names->name;
+	return "?";
+}
+
+// option parsers for capture-encode.c, -1 if the name is unknown
+int parse_control_rate(const char *name) { return omx_value(control_rate_names, name); }
+int parse_avc_profile(const char *name)  { return omx_value(avc_profile_names, name); }
+int parse_avc_level(const char *name)    { return omx_value(avc_level_names, name); }
+
+// encoder tuning is best effort: a setting the firmware rejects is reported and left at its default
+static void
+set_encode_param(COMPONENT_T *video_encode, OMX_INDEXTYPE index, void *param, const char *what) {
+	OMX_ERRORTYPE r;
+	if ((r = OMX_SetParameter(ILC_GET_HANDLE(video_encode), index, param)) != OMX_ErrorNone)
+		fprintf(stderr, "OMX_SetParameter() for %s for video_encode port 201 failed with %x, left at default\n", what, r);
+}
+
+static void
+video_encode_set_avc(COMPONENT_T *video_encode) {
+	OMX_ERRORTYPE r;
+	// low latency: a single IDR up front, cyclic intra refresh instead of IDR spikes
+	int idrPeriod = idr_period < 0 && low_latency ? 0 : idr_period;
+
+	// GOP length: frames from one IDR to the next, every I frame is an IDR
+	if (idrPeriod >= 0) {
+		OMX_VIDEO_CONFIG_AVCINTRAPERIOD intraPeriod;
+		INIT_OMX_TYPE(intraPeriod, OMX_VIDEO_CONFIG_AVCINTRAPERIOD, 201)
+		intraPeriod.nIDRPeriod = 1;
+		intraPeriod.nPFrames = idrPeriod ? idrPeriod - 1 : 0xFFFFFFFF;
+		if (OMX_SetConfig(ILC_GET_HANDLE(video_encode), OMX_IndexConfigVideoAVCIntraPeriod, &intraPeriod) != OMX_ErrorNone) {
+			OMX_PARAM_U32TYPE u32;
+			INIT_OMX_TYPE(u32, OMX_PARAM_U32TYPE, 201)
+			u32.nU32 = idrPeriod;
+			if ((r = OMX_SetConfig(ILC_GET_HANDLE(video_encode), OMX_IndexConfigBrcmVideoIntraPeriod, &u32)) != OMX_ErrorNone)
+				fprintf(stderr, "OMX_SetConfig() for intra period for video_encode port 201 failed with %x, left at default\n", r);
+		}
+	}
+
+	// profile and level
+	if (avc_profile || avc_level) {
+		OMX_VIDEO_PARAM_PROFILELEVELTYPE profileLevel;
+		INIT_OMX_TYPE(profileLevel, OMX_VIDEO_PARAM_PROFILELEVELTYPE, 201)
+		OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoProfileLevelCurrent, &profileLevel);
+		if (avc_profile)
+			profileLevel.eProfile = avc_profile;
+		if (avc_level)
+			profileLevel.eLevel = avc_level;
+		set_encode_param(video_encode, OMX_IndexParamVideoProfileLevelCurrent, &profileLevel, "profile/level");
+	}
+
+	// QP bounds for rate control, fixed QPs when rate control is off
+	if (qp_min || qp_max) {
+		OMX_PARAM_U32TYPE u32;
+		if (qp_min) {
+			INIT_OMX_TYPE(u32, OMX_PARAM_U32TYPE, 201)
+			u32.nU32 = qp_min;
+			set_encode_param(video_encode, OMX_IndexParamBrcmVideoEncodeMinQuant, &u32, "min QP");
+		}
+		if (qp_max) {
+			INIT_OMX_TYPE(u32, OMX_PARAM_U32TYPE, 201)
+			u32.nU32 = qp_max;
+			set_encode_param(video_encode, OMX_IndexParamBrcmVideoEncodeMaxQuant, &u32, "max QP");
+		}
+	}
+	if (qp_i || qp_p) {
+		OMX_VIDEO_PARAM_QUANTIZATIONTYPE quantization;
+		INIT_OMX_TYPE(quantization, OMX_VIDEO_PARAM_QUANTIZATIONTYPE, 201)
+		OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoQuantization, &quantization);
+		if (qp_i)
+			quantization.nQpI = qp_i;
+		if (qp_p)
+			quantization.nQpP = qp_p;
+		set_encode_param(video_encode, OMX_IndexParamVideoQuantization, &quantization, "quantization");
+	}
+
+	OMX_PARAM_PORTDEFINITIONTYPE portdef;
+	INIT_OMX_TYPE(portdef, OMX_PARAM_PORTDEFINITIONTYPE, 200)
+	OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamPortDefinition, &portdef);
+	OMX_U32 mbCols = (portdef.format.video.nFrameWidth + 15) / 16;
+	OMX_U32 mbRows = (portdef.format.video.nFrameHeight + 15) / 16;
+
+	// slices: split the picture into slices of whole macroblock rows; low latency: no B frames, no reordering
+	if (slices > 0 || low_latency) {
+		OMX_VIDEO_PARAM_AVCTYPE avc;
+		INIT_OMX_TYPE(avc, OMX_VIDEO_PARAM_AVCTYPE, 201)
+		OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoAvc, &avc);
+		if (slices > 0)
+			avc.nSliceHeaderSpacing = (mbRows + slices - 1) / slices * mbCols;
+		if (low_latency)
+			avc.nBFrames = 0;
+		set_encode_param(video_encode, OMX_IndexParamVideoAvc, &avc, slices > 0 ? "slices" : "B frames");
+	}
+
+	if (low_latency) {
+		OMX_VIDEO_PARAM_INTRAREFRESHTYPE intraRefresh;
+		OMX_CONFIG_PORTBOOLEANTYPE portBoolType;
+		OMX_U32 fps = portdef.format.video.xFramerate >> 16;
+
+		// refresh the whole picture about once a second
+		INIT_OMX_TYPE(intraRefresh, OMX_VIDEO_PARAM_INTRAREFRESHTYPE, 201)
+		intraRefresh.eRefreshMode = OMX_VIDEO_IntraRefreshCyclic;
+		intraRefresh.nCirMBs = (mbCols * mbRows + (fps ? fps : 30) - 1) / (fps ? fps : 30);
+		set_encode_param(video_encode, OMX_IndexParamVideoIntraRefresh, &intraRefresh, "cyclic intra refresh");
+
+		INIT_OMX_TYPE(portBoolType, OMX_CONFIG_PORTBOOLEANTYPE, 201)
+		portBoolType.bEnabled = OMX_TRUE;
+		set_encode_param(video_encode, OMX_IndexParamBrcmVideoAVCLowLatencyHRD, &portBoolType, "low latency HRD");
+
+		// one NAL per 201 out buffer, so every slice can be written as soon as it is encoded
+		INIT_OMX_TYPE(portBoolType, OMX_CONFIG_PORTBOOLEANTYPE, 201)
+		portBoolType.bEnabled = OMX_TRUE;
+		set_encode_param(video_encode, OMX_IndexParamBrcmNALSSeparate, &portBoolType, "NAL separation");
+	}
+}
+
+// read back what the encoder actually uses
+static void
+video_encode_print_avc(COMPONENT_T *video_encode) {
+	OMX_VIDEO_CONFIG_AVCINTRAPERIOD intraPeriod;
+	OMX_VIDEO_PARAM_PROFILELEVELTYPE profileLevel;
+	OMX_VIDEO_PARAM_QUANTIZATIONTYPE quantization;
+	OMX_VIDEO_PARAM_AVCTYPE avc;
+	OMX_VIDEO_PARAM_INTRAREFRESHTYPE intraRefresh;
+	OMX_PARAM_U32TYPE minQuant, maxQuant;
+
+	INIT_OMX_TYPE(intraPeriod, OMX_VIDEO_CONFIG_AVCINTRAPERIOD, 201)
+	if (OMX_GetConfig(ILC_GET_HANDLE(video_encode), OMX_IndexConfigVideoAVCIntraPeriod, &intraPeriod) == OMX_ErrorNone)
+		fprintf(stderr, "Current IDR period=%u P frames=%u\n", intraPeriod.nIDRPeriod, intraPeriod.nPFrames);
+	else {
+		OMX_PARAM_U32TYPE u32;
+		INIT_OMX_TYPE(u32, OMX_PARAM_U32TYPE, 201)
+		if (OMX_GetConfig(ILC_GET_HANDLE(video_encode), OMX_IndexConfigBrcmVideoIntraPeriod, &u32) == OMX_ErrorNone)
+			fprintf(stderr, "Current Intra period=%u\n", u32.nU32);
+	}
+
+	INIT_OMX_TYPE(profileLevel, OMX_VIDEO_PARAM_PROFILELEVELTYPE, 201)
+	if (OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoProfileLevelCurrent, &profileLevel) == OMX_ErrorNone)
+		fprintf(stderr, "Current Profile=%s Level=%s\n",
+			omx_name(avc_profile_names, profileLevel.eProfile), omx_name(avc_level_names, profileLevel.eLevel));
+
+	INIT_OMX_TYPE(minQuant, OMX_PARAM_U32TYPE, 201)
+	INIT_OMX_TYPE(maxQuant, OMX_PARAM_U32TYPE, 201)
+	if (OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamBrcmVideoEncodeMinQuant, &minQuant) == OMX_ErrorNone &&
+		OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamBrcmVideoEncodeMaxQuant, &maxQuant) == OMX_ErrorNone)
+		fprintf(stderr, "Current QP min=%u max=%u\n", minQuant.nU32, maxQuant.nU32);
+
+	INIT_OMX_TYPE(quantization, OMX_VIDEO_PARAM_QUANTIZATIONTYPE, 201)
+	if (OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoQuantization, &quantization) == OMX_ErrorNone)
+		fprintf(stderr, "Current QP I=%u P=%u\n", quantization.nQpI, quantization.nQpP);
+
+	INIT_OMX_TYPE(avc, OMX_VIDEO_PARAM_AVCTYPE, 201)
+	if (OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoAvc, &avc) == OMX_ErrorNone)
+		fprintf(stderr, "Current Slice spacing=%u MBs B frames=%u\n", avc.nSliceHeaderSpacing, avc.nBFrames);
+
+	INIT_OMX_TYPE(intraRefresh, OMX_VIDEO_PARAM_INTRAREFRESHTYPE, 201)
+	if (OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoIntraRefresh, &intraRefresh) == OMX_ErrorNone &&
+		intraRefresh.nCirMBs)
+		fprintf(stderr, "Current Cyclic intra refresh=%u MBs/frame\n", intraRefresh.nCirMBs);
+}
+
+extern unsigned int
+arena_mb;
+
+#define ARENA_QUEUE 256
+
+struct arena_frame {
+	OMX_U8   *data;
+	int       size, offset;
+	OMX_TICKS captured;
+};
+
+/*
+ * One camera's pipeline: its capture device, OMX components and counters.
+ * All pipelines share the one OMX client, whose callbacks find the pipeline
+ * by component. Camera 0 (-d) runs on the main thread and has the output
+ * stage, the control socket and ABR; every --camera runs on a thread of its
+ * own and sends its stream to a sink of its own.
+ */
+struct pipeline {
+	int                   index;
+	struct capture       *cap;
+	const char           *write_media;      // camera 0's --write_media
+	const char           *out_spec;         // other cameras: sink spec for the stream
+	struct sink          *sink;
+	struct au            *building;
+	size_t                lastunitsize;
+	int                   raw, frames;
+	volatile int          draining;         // raw capture: 201 out buffers drained by the callback
+	volatile int          stop;
+	int                   running;          // other cameras: thread started and not joined yet
+	pthread_t             thread;
+
+	COMPONENT_T          *comp[5];
+	TUNNEL_T              tunnel[4];
+	OMX_U32               port[5][2][3];
+	COMPONENT_T          *videoencode;      // for the output stage and runtime control
+	OMX_BUFFERHEADERTYPE *inputbufferlist;
+	OMX_U8               *swap;
+	int                   framenumber, outframenumber, copybuffernumber;
+	int                   torndown;
+
+	int                   framedivisor, skippedframes;
+	unsigned int          skipcount;
+	OMX_U32               encodeframerate;  // port 200 frame rate (Q16) before any step-down
+
+	struct arena         *arena;
+	struct arena_frame    arenaqueue[ARENA_QUEUE];
+	unsigned int          arenahead, arenatail;
+	int                   droppedframes;
+
+	struct decoder       *decoder;          // MJPEG capture decoded in software into the 200 in buffers
+	struct motion        *motion;           // --motion: idle frames left out
+
+	struct timespec       firstcapturetime, lastouttime;
+	uint64_t              outbytes;
+};
+
+static struct pipeline    _pipelines[CAMERA_MAX];
+static int                _cameras = 1;     // camera 0 and the --camera ones started so far
+static ILCLIENT_T        *_client;
+static int                _clientusers;
+static pthread_mutex_t    _clientlock = PTHREAD_MUTEX_INITIALIZER;
+
+static OMX_ERRORTYPE request_idr(struct pipeline *p, int64_t received_us);
+
+// frame rate step-down: only every framedivisor-th captured frame is encoded; of those, with --motion,
+// only the ones the motion gate lets through, a keyframe when motion starts. With --preroll camera 0
+// encodes them all and motion triggers a recording instead
+static int
+skip_frame(struct pipeline *p, const void *frame, size_t size) {
+	if (p->framedivisor > 1 && p->skipcount++ % p->framedivisor) {
+		p->skippedframes++;
+		return 1;
+	}
+	if (p->motion && p->index == 0 && preroll_dir) {
+		motion_gate(p->motion, &p->cap->v4l2_fmt.fmt.pix, frame, size);
+		if (motion_active(p->motion))
+			preroll_trigger();
+	}
+	else if (p->motion) {
+		switch (motion_gate(p->motion, &p->cap->v4l2_fmt.fmt.pix, frame, size)) {
+		case MOTION_SKIP:
+			return 1;
+		case MOTION_IDR:
+			if (p->videoencode)
+				request_idr(p, 0);
+			break;
+		case MOTION_ENCODE:
+			break;
+		}
+	}
+	// a GOP longer than an HLS segment
+	if (p->index == 0 && p->videoencode && hls_dir) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (hls_keyframe_due(now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000))
+			request_idr(p, 0);
+	}
+	return 0;
+}
+
+// apply the adaptive bitrate decision, if any, for the current output backlog
+static void
+adapt_bitrate(struct pipeline *p, COMPONENT_T *video_encode) {
+	struct timespec now;
+	int bitrate, divisor;
+	OMX_ERRORTYPE r;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!abr_update(now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000, output_backlog(), output_written(), &bitrate, &divisor))
+		return;
+
+	OMX_VIDEO_CONFIG_BITRATETYPE bitrateType;
+	INIT_OMX_TYPE(bitrateType, OMX_VIDEO_CONFIG_BITRATETYPE, 201)
+	bitrateType.nEncodeBitrate = bitrate;
+	if ((r = OMX_SetConfig(ILC_GET_HANDLE(video_encode), OMX_IndexConfigVideoBitrate, &bitrateType)) != OMX_ErrorNone)
+		fprintf(stderr, "OMX_SetConfig() for bitrate for video_encode port 201 failed with %x\n", r);
+
+	if (divisor != p->framedivisor) {
+		p->framedivisor = divisor;
+		if (p->encodeframerate) {
+			OMX_CONFIG_FRAMERATETYPE framerateType;
+			INIT_OMX_TYPE(framerateType, OMX_CONFIG_FRAMERATETYPE, 201)
+			framerateType.xEncodeFramerate = p->encodeframerate / divisor;
+			if ((r = OMX_SetConfig(ILC_GET_HANDLE(video_encode), OMX_IndexConfigVideoFramerate, &framerateType)) != OMX_ErrorNone)
+				fprintf(stderr, "OMX_SetConfig() for frame rate for video_encode port 201 failed with %x\n", r);
+		}
+	}
+}
+
+#define VIDEO_ENCODE_OUT_BUFFERS 8   // enough for the output stage to hold an access unit in slices/NALs
+
+// called from the output thread once a 201 out buffer is written; only camera 0 has the output stage
+static void
+release_output_buffer(void *piece) {
+	OMX_BUFFERHEADERTYPE *out = piece;
+	OMX_ERRORTYPE r;
+	out->nFilledLen = 0;
+	DEBUG_PRINT("send emptied 201 out buffer to video_encode processor\n")
+	if ((r = OMX_FillThisBuffer(ILC_GET_HANDLE(_pipelines[0].videoencode), out)) != OMX_ErrorNone)
+		fprintf(stderr, "Error filling 201 out buffer: %x\n", r);
+}
+
+static void
+video_encode_init(struct pipeline *p, COMPONENT_T *video_encode) {
 
 	OMX_VIDEO_PARAM_PORTFORMATTYPE format;
 	OMX_ERRORTYPE r;
@@ -658,11 +911,43 @@ video_encode_init(COMPONENT_T *video_encode) {
 	r = OMX_SetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoPortFormat, &format);
 	vc_assert(r == OMX_ErrorNone);
 
+	p->videoencode = video_encode;
+	if (!p->write_media) {
+		// 201 out buffers are written to stdout by the output stage
+		OMX_PARAM_PORTDEFINITIONTYPE portdef;
+		get_portdef(&portdef, video_encode, 201, VC_FALSE);
+		if (portdef.nBufferCountActual < VIDEO_ENCODE_OUT_BUFFERS) {
+			portdef.nBufferCountActual = VIDEO_ENCODE_OUT_BUFFERS;
+			set_portdef(&portdef, video_encode, 201, VC_FALSE);
+		}
+		if (p->index > 0) {
+			// other cameras: copied out of the 201 buffers into a sink of their own
+			if ((p->sink = sink_new(p->out_spec)) == NULL) {
+				fprintf(stderr, "Cannot open sink '%s' for %s: %d, %s\n", p->out_spec, p->cap->dev_name, errno, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+		else {
+			output_open(mp4_raw_fd(), release_output_buffer, portdef.nBufferCountActual);
+			for (int i = 0; i < sink_specs_count; i++)
+				if (sink_add(sink_specs[i], 0) < 0) {
+					fprintf(stderr, "Cannot open sink '%s': %d, %s\n", sink_specs[i], errno, strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+			server_open();
+			shmout_open();
+			preroll_open();
+			segment_open();
+			mp4_open();
+			hls_open();
+		}
+	}
+
 	OMX_VIDEO_PARAM_BITRATETYPE bitrateType;
-	if (bitrate) {
+	if (bitrate || control_rate >= 0) {
 		// set current bitrate to 1Mbit // 0 that means that the output will either use VBR, or no rate control at all
 		INIT_OMX_TYPE(bitrateType, OMX_VIDEO_PARAM_BITRATETYPE, 201)
-		bitrateType.eControlRate = OMX_Video_ControlRateVariable;
+		bitrateType.eControlRate = control_rate >= 0 ? control_rate : OMX_Video_ControlRateVariable;
 		bitrateType.nTargetBitrate = bitrate; // 1000000; // 0;
 		r = OMX_SetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoBitrate, &bitrateType);
 		vc_assert(r == OMX_ErrorNone);
@@ -670,32 +955,61 @@ video_encode_init(COMPONENT_T *video_encode) {
 	// get current bitrate
 	INIT_OMX_TYPE(bitrateType, OMX_VIDEO_PARAM_BITRATETYPE, 201)
 	OMX_GetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamVideoBitrate, &bitrateType);
-	fprintf(stderr, "Current Bitrate=%u\n", bitrateType.nTargetBitrate);
+	fprintf(stderr, "Current Bitrate=%u Rate control=%s\n", bitrateType.nTargetBitrate, omx_name(control_rate_names, bitrateType.eControlRate));
+
+	if (p->index == 0 && abr && (p->write_media || !bitrateType.nTargetBitrate || bitrateType.eControlRate == OMX_Video_ControlRateDisable)) {
+		fprintf(stderr, "adaptive bitrate needs rate control and stdout output, disabled\n");
+		abr = 0;
+	}
+	OMX_PARAM_PORTDEFINITIONTYPE portdef;
+	get_portdef(&portdef, video_encode, 200, VC_FALSE);
+	p->encodeframerate = portdef.format.video.xFramerate;
+	p->framedivisor = 1;
+	if (p->index == 0 && abr)
+		abr_start(bitrateType.nTargetBitrate);
 
 	// set psips
 	if (psips) {
 		OMX_CONFIG_PORTBOOLEANTYPE portBoolType;
 		INIT_OMX_TYPE(portBoolType, OMX_CONFIG_PORTBOOLEANTYPE, 201)
+		portBoolType.bEnabled = OMX_TRUE;
 		r = OMX_SetParameter(ILC_GET_HANDLE(video_encode), OMX_IndexParamBrcmVideoAVCInlineHeaderEnable, &portBoolType);
 		vc_assert(r == OMX_ErrorNone);
 	}
+
+	if (format.eCompressionFormat == OMX_VIDEO_CodingAVC) {
+		video_encode_set_avc(video_encode);
+		video_encode_print_avc(video_encode);
+	}
 }
 
-static COMPONENT_T *_comp[5];
-static TUNNEL_T     _tunnel[4];
-static int          _copybuffernumber;
+// the pipeline a component belongs to, for the callbacks of the shared client
+static struct pipeline *
+pipeline_of(COMPONENT_T *comp) {
+	for (int i = 0; i < CAMERA_MAX; i++)
+		for (int c = 0; c < 5 && _pipelines[i].comp[c]; c++)
+			if (_pipelines[i].comp[c] == comp)
+				return &_pipelines[i];
+	return NULL;
+}
 
 static void
 capture_encode_jpeg_error_callback(void *userdata, COMPONENT_T *comp, OMX_U32 error) {
-	INFO_PRINT_2("Error: 0x%X (%s)\n", error, comp == _tunnel->source ? "image_decode" : comp == _tunnel->sink ? "video_encode" : "write_media");
+#ifdef INFO
+	struct pipeline *p = pipeline_of(comp);
+#endif /* INFO */
+	rt_setup_thread(RT_THREAD_OMX);
+	INFO_PRINT_2("Error: 0x%X (%s)\n", error, p == NULL ? "unknown" : p->raw || comp == p->tunnel->sink ? "video_encode" : comp == p->tunnel->source ? "image_decode" : "write_media");
 }
 
-static void 
+static void
 capture_encode_jpeg_port_settings_callback(void *userdata, COMPONENT_T *comp, OMX_U32 port) {
+	struct pipeline *p = pipeline_of(comp);
+	rt_setup_thread(RT_THREAD_OMX);
 
 	DEBUG_PRINT_1("port settings changed event - port %d\n", port)
 
-	if (port == 321 && comp == /*image_decode*/_tunnel->source) {
+	if (p != NULL && !p->raw && port == 321 && comp == /*image_decode*/p->tunnel->source) {
 		int r_il;
 		OMX_PARAM_PORTDEFINITIONTYPE portdef;
 
@@ -704,14 +1018,14 @@ capture_encode_jpeg_port_settings_callback(void *userdata, COMPONENT_T *comp, OM
 		get_portdef(&portdef, comp, 321, VC_TRUE);
 
 		// set video_encode input image format - port 200
-		video_encode_set_input_image_format(&portdef, /*video_encode*/_tunnel->sink, portdef.format.image.nFrameWidth, portdef.format.image.nFrameHeight, portdef.format.image.eColorFormat);
+		video_encode_set_input_image_format(&portdef, /*video_encode*/p->tunnel->sink, portdef.format.image.nFrameWidth, portdef.format.image.nFrameHeight, portdef.format.image.eColorFormat);
 
-		video_encode_init(/*video_encode*/_tunnel->sink);
+		video_encode_init(p, /*video_encode*/p->tunnel->sink);
 
 #ifdef TUNNEL
 		fprintf(stderr, "setup 321 -> 200 tunnel\n");
 		// setup tunnel
-		if ((r_il = ilclient_setup_tunnel(_tunnel, 0, 0)) != 0)
+		if ((r_il = ilclient_setup_tunnel(p->tunnel, 0, 0)) != 0)
 			fprintf(stderr, "Error setting up tunnel: %d\n", r_il);
 #else
 		// create image_decode output buffers - port 321
@@ -721,20 +1035,20 @@ capture_encode_jpeg_port_settings_callback(void *userdata, COMPONENT_T *comp, OM
 
 		// create video_encode input buffers - port 200
 		DEBUG_PRINT("create video_encode input buffers - port 200\n")
-		if ((r_il = ilclient_enable_port_buffers(/*video_encode*/_tunnel->sink, 200, NULL, NULL, NULL)) != 0)
+		if ((r_il = ilclient_enable_port_buffers(/*video_encode*/p->tunnel->sink, 200, NULL, NULL, NULL)) != 0)
 			ILC_ERR_EXIT("%s:%d: enabling port buffers for 200 failed (%d)!\n")
 
 		// create video_encode output buffers - port 201
 		DEBUG_PRINT("create video_encode output buffers - port 201\n")
-		if ((r_il = ilclient_enable_port_buffers(/*video_encode*/_tunnel->sink, 201, NULL, NULL, NULL)) != 0)
+		if ((r_il = ilclient_enable_port_buffers(/*video_encode*/p->tunnel->sink, 201, NULL, NULL, NULL)) != 0)
 			ILC_ERR_EXIT("%s:%d: enabling port buffers for 201 failed (%d)!\n")
 #endif /* TUNNEL */
 
-		if (write_media_file) {
+		if (p->write_media) {
 
-			get_portdef(&portdef, /*video_encode*/(_tunnel + 1)->source, 201, VC_FALSE);
+			get_portdef(&portdef, /*video_encode*/(p->tunnel + 1)->source, 201, VC_FALSE);
 
-			write_media_set_input_video_format(&portdef, /*write_media*/(_tunnel + 1)->sink, portdef.format.video.nFrameWidth, portdef.format.video.nFrameHeight, portdef.format.video.eCompressionFormat);
+			write_media_set_input_video_format(&portdef, /*write_media*/(p->tunnel + 1)->sink, portdef.format.video.nFrameWidth, portdef.format.video.nFrameHeight, portdef.format.video.eCompressionFormat);
 
 			OMX_ERRORTYPE r;
 			typedef struct _OMX_PARAM_CONTENTURITYPE
@@ -745,34 +1059,32 @@ capture_encode_jpeg_port_settings_callback(void *userdata, COMPONENT_T *comp, OM
 			} _OMX_PARAM_CONTENTURITYPE;
 			_OMX_PARAM_CONTENTURITYPE contentUri;
 			INIT_OMX_TYPE_NO_PORT(contentUri, _OMX_PARAM_CONTENTURITYPE)
-			strcpy((char *)contentUri.contentURI, write_media_file);
-			contentUri.nSize -= (500 - strlen(write_media_file));
-			if ((r = OMX_SetParameter(ILC_GET_HANDLE(/*write_media*/(_tunnel + 1)->sink), OMX_IndexParamContentURI, &contentUri)) != OMX_ErrorNone)
+			strcpy((char *)contentUri.contentURI, p->write_media);
+			contentUri.nSize -= (500 - strlen(p->write_media));
+			if ((r = OMX_SetParameter(ILC_GET_HANDLE(/*write_media*/(p->tunnel + 1)->sink), OMX_IndexParamContentURI, &contentUri)) != OMX_ErrorNone)
 				OMX_ERR_EXIT("%s:%d: OMX_SetParameter() for content URI for write_media failed with %x!\n")
 
 #ifdef TUNNEL
 			fprintf(stderr, "setup 201 -> 171 tunnel\n");
 			// setup tunnel
-			if ((r_il = ilclient_setup_tunnel(_tunnel + 1, 0, 0)) != 0)
+			if ((r_il = ilclient_setup_tunnel(p->tunnel + 1, 0, 0)) != 0)
 				fprintf(stderr, "Error setting up tunnel: %d\n", r_il);
 #else
 			// create write_media input buffers - port 171
 			DEBUG_PRINT("create write_media input buffers - port 171\n")
-			if ((r_il = ilclient_enable_port_buffers(/*write_media*/(_tunnel + 1)->sink, 171, NULL, NULL, NULL)) != 0)
+			if ((r_il = ilclient_enable_port_buffers(/*write_media*/(p->tunnel + 1)->sink, 171, NULL, NULL, NULL)) != 0)
 				ILC_ERR_EXIT("%s:%d: enabling port buffers for 171 failed (%d)!\n")
 #endif /* TUNNEL */
 		}
 
 		// move all components except image_decode to executing
-		fprintf(stderr, "move video_encode %sto executing\n", write_media_file ? "and write_media " : "");
-		ilclient_state_transition(_comp + 1, OMX_StateExecuting);
+		fprintf(stderr, "move video_encode %sto executing\n", p->write_media ? "and write_media " : "");
+		ilclient_state_transition(p->comp + 1, OMX_StateExecuting);
 	}
 }
 
-static OMX_U8  *_swap;
-
 static OMX_BUFFERHEADERTYPE *
-tunnel_buffer(TUNNEL_T *tunnel, int *copybuffernumber, int block) {
+tunnel_buffer(struct pipeline *p, TUNNEL_T *tunnel, int *copybuffernumber, int block) {
 #ifndef TUNNEL
 	OMX_ERRORTYPE r;
 	OMX_BUFFERHEADERTYPE *buf;
@@ -793,12 +1105,13 @@ tunnel_buffer(TUNNEL_T *tunnel, int *copybuffernumber, int block) {
 		DEBUG_PRINT_3("7. copy buffer %d->%d (%d bytes)\n", tunnel->source_port, tunnel->sink_port, out->nFilledLen)
 
 		//memcpy(buf->pBuffer, out->pBuffer, out->nFilledLen);
-		_swap = buf->pBuffer;
+		p->swap = buf->pBuffer;
 		buf->pBuffer = out->pBuffer;
-		out->pBuffer = _swap;
-		_swap = NULL;
+		out->pBuffer = p->swap;
+		p->swap = NULL;
 
 		buf->nFilledLen = out->nFilledLen;
+		buf->nTimeStamp = out->nTimeStamp;
 		out->nFilledLen = 0;
 		if (copybuffernumber) {
 			(*copybuffernumber)++;
@@ -840,20 +1153,30 @@ tunnel_buffer(TUNNEL_T *tunnel, int *copybuffernumber, int block) {
 }
 
 static void
-wait_tunnel_buffer(TUNNEL_T *tunnel, int *copybuffernumber) {
-	while (tunnel_buffer(tunnel, copybuffernumber, VC_FALSE) != NULL)
+wait_tunnel_buffer(struct pipeline *p, TUNNEL_T *tunnel, int *copybuffernumber) {
+	while (tunnel_buffer(p, tunnel, copybuffernumber, VC_FALSE) != NULL)
 		wait_timeout(0, 5);
 }
 
+static void drain_output_buffers(struct pipeline *p, COMPONENT_T *video_encode);
+
 static void
 capture_encode_jpeg_fill_buffer_done_callback(void *data, COMPONENT_T *comp) {
-	if (comp == /*image_decode*/_tunnel->source)
-		tunnel_buffer(_tunnel, &_copybuffernumber, VC_FALSE);
-	else if (write_media_file && comp == /*video_encode*/(_tunnel + 1)->source)
-		tunnel_buffer(_tunnel + 1, NULL, VC_FALSE);
+	struct pipeline *p = pipeline_of(comp);
+	rt_setup_thread(RT_THREAD_OMX);
+	if (p == NULL)
+		return;
+	if (p->raw) {
+		if (p->draining)
+			drain_output_buffers(p, comp);
+	}
+	else if (comp == /*image_decode*/p->tunnel->source)
+		tunnel_buffer(p, p->tunnel, &p->copybuffernumber, VC_FALSE);
+	else if (p->write_media && comp == /*video_encode*/(p->tunnel + 1)->source)
+		tunnel_buffer(p, p->tunnel + 1, NULL, VC_FALSE);
 }
 
-static uint 
+static uint
 buffer_list_count(OMX_BUFFERHEADERTYPE *list)
 {
 	uint cnt = 0;
@@ -907,192 +1230,644 @@ wait_for_StateExecuting(COMPONENT_T *comp) {
 		wait_timeout(0, 5);
 }
 
-extern void 
-close_device(void),
-open_device(void), 
-uninit_device(int external_buffers), 
-init_buffers(unsigned int buffer_size, OMX_BUFFERHEADERTYPE *external_buffers),
-stop_capturing(void), 
-start_capturing(void);
-
-extern unsigned int 
-init_device(void);
-
-static ILCLIENT_T           *_client;
-static OMX_U32               _port[5][2][3];
-static OMX_BUFFERHEADERTYPE *_inputbufferlist;
-static int                   _framenumber, _outframenumber;
-static int                   _torndown;
+static void capture_encode_teardown(void);
+
+static void
+intHandler(int dummy) { exit(0); }
+
+/*
+ * The OMX client is shared by all cameras: the first pipeline to start brings
+ * it up (and registers the teardown), the last one to stop takes it down.
+ */
+static int
+client_open(void) {
+	static int registered;
+	OMX_ERRORTYPE r;
+	int status = 0;
+
+	pthread_mutex_lock(&_clientlock);
+	if (_clientusers == 0) {
+		bcm_host_init();
+
+		if ((_client = ilclient_init()) == NULL) {
+			fprintf(stderr, "ilclient_init() for video_encode failed!\n");
+			status = -3;
+		}
+		else if ((r = OMX_Init()) != OMX_ErrorNone) {
+			ilclient_destroy(_client);
+			_client = NULL;
+			fprintf(stderr, "OMX_Init() for video_encode failed with %x!\n", r);
+			status = -4;
+		}
+		else {
+			// set set_port_settings_callback
+			ilclient_set_port_settings_callback(_client, capture_encode_jpeg_port_settings_callback, NULL);
+			// set fill_buffer_done_callback
+			ilclient_set_fill_buffer_done_callback(_client, capture_encode_jpeg_fill_buffer_done_callback, NULL);
+			// set error_callback
+			ilclient_set_error_callback(_client, capture_encode_jpeg_error_callback, NULL);
+		}
+	}
+	if (status == 0)
+		_clientusers++;
+	pthread_mutex_unlock(&_clientlock);
+
+	if (status == 0 && !registered) {
+		registered = 1;
+		atexit(capture_encode_teardown);
+		signal(SIGINT, intHandler);
+	}
+	return status;
+}
+
+static void
+client_close(void) {
+	pthread_mutex_lock(&_clientlock);
+	if (_clientusers > 0 && --_clientusers == 0) {
+		// remove callback functions
+		ilclient_set_fill_buffer_done_callback(_client, NULL, NULL);
+		ilclient_set_port_settings_callback(_client, NULL, NULL);
+		ilclient_set_error_callback(_client, NULL, NULL);
+
+		OMX_Deinit();
+
+		ilclient_destroy(_client);
+		_client = NULL;
+
+		bcm_host_deinit();
+	}
+	pthread_mutex_unlock(&_clientlock);
+}
+
+static int
+create_component(COMPONENT_T **comp, char *name, ILCLIENT_CREATE_FLAGS_T flags) {
+	int r_il;
+	pthread_mutex_lock(&_clientlock);
+	r_il = ilclient_create_component(_client, comp, name, flags);
+	pthread_mutex_unlock(&_clientlock);
+	return r_il;
+}
+
+static struct pipeline *
+pipeline_init(int index, struct capture *cap, const char *out_spec, int frames, int raw) {
+	struct pipeline *p = &_pipelines[index];
+
+	memset(p, 0, sizeof(*p));
+	p->index = index;
+	p->cap = cap;
+	p->write_media = index == 0 ? write_media_file : NULL;
+	p->out_spec = out_spec;
+	p->frames = frames;
+	p->raw = raw;
+	p->framedivisor = 1;
+	if (motion && (p->motion = motion_new(cap->dev_name)) == NULL) {
+		perror("motion_new");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static int
+capture_arena_frame(struct pipeline *p, int block, struct timespec *capture_time) {
+	void *frame;
+	int size;
+
+	while ((size = capture_frame_arena(p->cap, p->arena, &frame)) == 0 && block)
+		wait_timeout(0, 1000);
+
+	if (size > 0 && skip_frame(p, frame, size)) {
+		arena_free(p->arena, frame);
+		size = 0;
+	}
+	if (size > 0 && p->arenatail - p->arenahead == ARENA_QUEUE) {
+		arena_free(p->arena, frame);
+		size = -1;
+	}
+	if (size > 0) {
+		struct arena_frame *af = &p->arenaqueue[p->arenatail++ % ARENA_QUEUE];
+		af->data = frame;
+		af->size = size;
+		af->offset = 0;
+		af->captured = omx_ticks_now();
+		p->framenumber++;
+		clock_gettime(CLOCK_MONOTONIC, capture_time);
+		if (p->framenumber == 1)
+			p->firstcapturetime = *capture_time;
+		INFO_PRINT_2("captured frame %d (%d bytes)\n", p->framenumber, size)
+	}
+	else if (size < 0)
+		p->droppedframes++;
+
+	return size;
+}
+
+/* hand staged frames to image_decode; a frame bigger than the input buffers goes in pieces, EOS on the last */
+static int
+feed_arena_frames(struct pipeline *p, COMPONENT_T *image_decode) {
+	OMX_BUFFERHEADERTYPE *buf;
+	OMX_ERRORTYPE r;
+	int fed = 0;
+
+	while (p->arenahead != p->arenatail && (buf = ilclient_get_input_buffer(image_decode, 320, 0)) != NULL) {
+		struct arena_frame *af = &p->arenaqueue[p->arenahead % ARENA_QUEUE];
+		int len = af->size - af->offset;
+
+		if (len > buf->nAllocLen)
+			len = buf->nAllocLen;
+		memcpy(buf->pBuffer, af->data + af->offset, len);
+		buf->nOffset = 0;
+		buf->nFilledLen = len;
+		buf->nTimeStamp = af->captured;
+		af->offset += len;
+		buf->nFlags = af->offset == af->size ? OMX_BUFFERFLAG_EOS : 0;
+		if (af->offset == af->size) {
+			arena_free(p->arena, af->data);
+			p->arenahead++;
+		}
+
+		DEBUG_PRINT("3. send filled 320 in buffer to image_decode processor\n")
+		if ((r = OMX_EmptyThisBuffer(ILC_GET_HANDLE(image_decode), buf)) != OMX_ErrorNone)
+			fprintf(stderr, "Error emptying buffer: %x\n", r);
+		fed++;
+	}
+	return fed;
+}
 
 static void
-release_input_buffers(void) {
+release_input_buffers(struct pipeline *p) {
 	OMX_BUFFERHEADERTYPE *buf;
 	OMX_ERRORTYPE r;
 
 	// release empty port 320 input buffers back to image_decode processor
 	DEBUG_PRINT("release empty port 320 input buffers back to image_decode processor\n")
-	while (_inputbufferlist) {
+	while (p->inputbufferlist) {
 		/* take a buffer out of inputbufferlist */
-		buf = buffer_list_get_buf_remove(&_inputbufferlist, _inputbufferlist);
+		buf = buffer_list_get_buf_remove(&p->inputbufferlist, p->inputbufferlist);
 		DEBUG_PRINT_1("buffer 0x%x ", (unsigned int)buf)
 		/* release it */
-		if ((r = OMX_EmptyThisBuffer(ILC_GET_HANDLE(_comp[0]), buf)) != OMX_ErrorNone)
+		if ((r = OMX_EmptyThisBuffer(ILC_GET_HANDLE(p->comp[0]), buf)) != OMX_ErrorNone)
 			fprintf(stderr, "Error emptying buffer: %x\n", r);
 		DEBUG_PRINT("released\n")
 	}
 }
 
 static void
-capture_encode_jpeg_teardown(void) {
-	if (_torndown) {
-		fprintf(stderr, "Torn down.\n");
+pipeline_report(struct pipeline *p, FILE *out) {
+	struct timespec diff;
+	double seconds;
+
+	time_diff(&p->firstcapturetime, &p->lastouttime, &diff);
+	seconds = diff.tv_sec + diff.tv_nsec / 1000000000.0;
+	fprintf(out, "camera %d %s: %d frames in, %d out, %d skipped, %d dropped, %llu bytes, %.2f fps sustained\n",
+		p->index, p->cap->dev_name, p->framenumber, p->outframenumber, p->skippedframes, p->droppedframes,
+		(unsigned long long)p->outbytes, p->outframenumber > 1 && seconds > 0 ? (p->outframenumber - 1) / seconds : 0.0);
+}
+
+static void
+pipeline_teardown(struct pipeline *p) {
+	if (p->cap == NULL || p->torndown)
 		return;
+
+	p->draining = 0;
+	if (p->index == 0) {
+		control_close();
+
+		// write out what the encoder already produced before the stats are reported
+		output_close();
+		output_report(stderr);
+		sink_close_all(stderr);
+		server_report(stderr);
+		server_close();
+		shmout_report(stderr);
+		shmout_close();
+		preroll_report(stderr);
+		preroll_close();
+		segment_close();
+		segment_report(stderr);
+		mp4_close();
+		mp4_report(stderr);
+		hls_close();
+		hls_report(stderr);
+	}
+	else if (p->sink) {
+		au_unref(p->building);
+		p->building = NULL;
+		sink_free(p->sink, stderr);
+		p->sink = NULL;
 	}
 
-	stop_capturing();
-	uninit_device(1);
-	close_device();
+	stop_capturing(p->cap);
+	uninit_device(p->cap, p->decoder == NULL);
+	close_device(p->cap);
 
-	fprintf(stderr, "\r          \ninput frames: %d\ncopied frames: %d\noutput frames: %d\n\n", _framenumber, _copybuffernumber, _outframenumber);
+	if (_cameras > 1)
+		fprintf(stderr, "\r          \ncamera %d %s", p->index, p->cap->dev_name);
+	fprintf(stderr, "\r          \ninput frames: %d\ncopied frames: %d\noutput frames: %d\n\n", p->framenumber, p->copybuffernumber, p->outframenumber);
 
-	fprintf(stderr, "Teardown.\n");
+	if (p->skippedframes)
+		fprintf(stderr, "skipped frames (frame rate step-down): %d\n", p->skippedframes);
+	if (p->index == 0)
+		abr_report(stderr);
 
-	// remove callback functions
-	ilclient_set_fill_buffer_done_callback(_client, NULL, NULL);
-	ilclient_set_port_settings_callback(_client, NULL, NULL);
-	ilclient_set_error_callback(_client, NULL, NULL);
+	if (p->decoder) {
+		fprintf(stderr, "dropped frames: %d\n", p->droppedframes);
+		decoder_free(p->decoder, stderr);
+		p->decoder = NULL;
+	}
+	motion_free(p->motion, stderr);
+	p->motion = NULL;
+
+	if (p->arena) {
+		fprintf(stderr, "dropped frames: %d\n", p->droppedframes);
+		while (p->arenahead != p->arenatail)
+			arena_free(p->arena, p->arenaqueue[p->arenahead++ % ARENA_QUEUE].data);
+		arena_report(p->arena, stderr);
+		arena_destroy(p->arena);
+		p->arena = NULL;
+	}
+
+	fprintf(stderr, "Teardown.\n");
 
 	// release empty port 320 input buffers back to image_decode processor
-	release_input_buffers();
+	release_input_buffers(p);
 
-	for (int i_comp = 0; i_comp < 5 && _comp[i_comp]; i_comp++)
+	for (int i_comp = 0; i_comp < 5 && p->comp[i_comp]; i_comp++)
 		for (int i_port_inout = 0; i_port_inout < 2; i_port_inout++)
-			for (int i_port = 0; i_port < 3 && _port[i_comp][i_port_inout][i_port]; i_port++)
-				disable_port_buffers(_comp[i_comp], _port[i_comp][i_port_inout][i_port]);
+			for (int i_port = 0; i_port < 3 && p->port[i_comp][i_port_inout][i_port]; i_port++)
+				disable_port_buffers(p->comp[i_comp], p->port[i_comp][i_port_inout][i_port]);
 
 #ifdef TUNNEL
-	ilclient_disable_tunnel(_tunnel);
-	ilclient_teardown_tunnels(_tunnel);
+	ilclient_disable_tunnel(p->tunnel);
+	ilclient_teardown_tunnels(p->tunnel);
 #endif /* TUNNEL */
 
-	ilclient_state_transition(_comp, OMX_StateIdle);
-	ilclient_state_transition(_comp, OMX_StateLoaded);
+	ilclient_state_transition(p->comp, OMX_StateIdle);
+	ilclient_state_transition(p->comp, OMX_StateLoaded);
 
-	ilclient_cleanup_components(_comp);
+	ilclient_cleanup_components(p->comp);
+	memset(p->comp, 0, sizeof(p->comp));
 
-	if (_swap)
-		free(_swap);
+	if (p->swap)
+		free(p->swap);
 
-	OMX_Deinit();
+	client_close();
+
+	p->torndown = 1;
+}
 
-	ilclient_destroy(_client);
+/* other cameras stop first, each tears its own pipeline down; then camera 0 and the per-camera report */
+static void
+capture_encode_teardown(void) {
+	struct rusage usage;
+	int i;
 
-	bcm_host_deinit();
+	if (_pipelines[0].torndown) {
+		fprintf(stderr, "Torn down.\n");
+		return;
+	}
 
-	_torndown = 1;
+	for (i = 1; i < _cameras; i++)
+		if (_pipelines[i].running && !pthread_equal(_pipelines[i].thread, pthread_self())) {
+			_pipelines[i].stop = 1;
+			pthread_join(_pipelines[i].thread, NULL);
+			_pipelines[i].running = 0;
+		}
+	pipeline_teardown(&_pipelines[0]);
+
+	if (_cameras > 1) {
+		for (i = 0; i < _cameras; i++)
+			if (_pipelines[i].cap)
+				pipeline_report(&_pipelines[i], stderr);
+		getrusage(RUSAGE_SELF, &usage);
+		fprintf(stderr, "%d cameras on one OMX client: %.2f s cpu (%.2f s per camera), %ld KB max resident\n", _cameras,
+			usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0,
+			(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0) / _cameras,
+			usage.ru_maxrss);
+	}
 }
 
-static void 
-intHandler(int dummy) { exit(0); }
+/* other cameras: copy a 201 buffer into the access unit being built, hand finished units to the camera's sink */
+static void
+camera_piece(struct pipeline *p, OMX_BUFFERHEADERTYPE *out) {
+	int config = (out->nFlags & OMX_BUFFERFLAG_CODECCONFIG) != 0;
 
-int
-capture_encode_jpeg_loop(int frames/*, OMX_U32 frameWidth, OMX_U32 frameHeight, uint frameRate, OMX_COLOR_FORMATTYPE colorFormat, uint bufsize*/) {
-	COMPONENT_T *video_encode = NULL, *image_decode = NULL;
-	COMPONENT_T *write_media = NULL;
-	OMX_BUFFERHEADERTYPE *buf;
+	if (p->building && p->building->size && ((p->building->flags & AU_CONFIG) != 0) != config) {
+		sink_put(p->sink, p->building);
+		au_unref(p->building);
+		p->building = NULL;
+	}
+	if (!p->building) {
+		if ((p->building = au_new(config ? out->nFilledLen : p->lastunitsize + p->lastunitsize / 4 + 4096)) == NULL)
+			return;
+		p->building->flags = config ? AU_CONFIG : 0;
+		p->building->timestamp = omx_ticks_us(out->nTimeStamp);
+	}
+	if (out->nFlags & OMX_BUFFERFLAG_SYNCFRAME)
+		p->building->flags |= AU_KEYFRAME;
+	if ((p->building = au_append(p->building, out->pBuffer + out->nOffset, out->nFilledLen)) != NULL &&
+		!config && (out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME)) {
+		p->lastunitsize = p->building->size;
+		sink_put(p->sink, p->building);
+		au_unref(p->building);
+		p->building = NULL;
+	}
+}
+
+/*
+ * Hand every 201 out buffer video_encode has ready to the output stage, which
+ * writes it to stdout (a whole access unit per write when aggregating) and
+ * gives it back to video_encode. Empty buffers go straight back, and so do
+ * the buffers of the other cameras once copied for their sinks.
+ */
+static void
+drain_output_buffers(struct pipeline *p, COMPONENT_T *video_encode) {
 	OMX_BUFFERHEADERTYPE *out;
 	OMX_ERRORTYPE r;
-	int r_il = 0;
-	int status = 0;
-	struct timespec diff;
 
-	memset(_comp, 0, sizeof(_comp));
-	memset(_port, 0, sizeof(_port));
-	_framenumber = _outframenumber = _copybuffernumber = 0;
-	_torndown = 0;
+	while ((out = ilclient_get_output_buffer(video_encode, 201, 0)) != NULL) {
+		if (out->nFilledLen > 0) {
+#ifdef DEBUG
+			if (out->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+				int i;
+				for (i = 0; i < out->nFilledLen; i++)
+					fprintf(stderr, "%x ", out->pBuffer[i]);
+				fprintf(stderr, "\n");
+			}
+#endif
+			DEBUG_PRINT_3("camera %d: %d bytes to the %s\n", p->index, out->nFilledLen, p->index ? "sink" : "output stage")
+			if ((out->nFlags & (OMX_BUFFERFLAG_ENDOFFRAME | OMX_BUFFERFLAG_CODECCONFIG)) == OMX_BUFFERFLAG_ENDOFFRAME) {
+				p->outframenumber++;
+				clock_gettime(CLOCK_MONOTONIC, &p->lastouttime);
+				INFO_PRINT_2("output frame %d (%d bytes)\n", p->outframenumber, out->nFilledLen)
+			}
+			p->outbytes += out->nFilledLen;
+			if (p->index == 0) {
+				output_piece(out, out->pBuffer + out->nOffset, out->nFilledLen, omx_ticks_us(out->nTimeStamp),
+					(out->nFlags & OMX_BUFFERFLAG_CODECCONFIG ? OUTPUT_CONFIG :
+						out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME ? OUTPUT_END : 0) |
+					(out->nFlags & OMX_BUFFERFLAG_SYNCFRAME ? OUTPUT_KEYFRAME : 0));
+				continue;
+			}
+			camera_piece(p, out);
+			out->nFilledLen = 0;
+		}
+
+		DEBUG_PRINT("send emptied 201 out buffer to video_encode processor\n")
+		if ((r = OMX_FillThisBuffer(ILC_GET_HANDLE(video_encode), out)) != OMX_ErrorNone)
+			fprintf(stderr, "Error filling 201 out buffer: %x\n", r);
+	}
+	if (p->index > 0)
+		return;
+	output_flush();
 
-	bcm_host_init();
+	if (abr)
+		adapt_bitrate(p, video_encode);
+}
 
-	if ((_client = ilclient_init()) == NULL) {
-		fprintf(stderr, "ilclient_init() for video_encode failed!\n");
-		return -3;
+static double
+elapsed_ms(int64_t since_us) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000 - since_us) / 1000.0;
+}
+
+// the next frame encoded as a keyframe; a control command's (received_us set) is timed up to the output stage
+static OMX_ERRORTYPE
+request_idr(struct pipeline *p, int64_t received_us) {
+	OMX_CONFIG_PORTBOOLEANTYPE portBoolType;
+	OMX_ERRORTYPE r;
+	INIT_OMX_TYPE(portBoolType, OMX_CONFIG_PORTBOOLEANTYPE, 201)
+	portBoolType.bEnabled = OMX_TRUE;
+	if ((r = OMX_SetConfig(ILC_GET_HANDLE(p->videoencode), OMX_IndexConfigBrcmVideoRequestIFrame, &portBoolType)) == OMX_ErrorNone &&
+		received_us && p->index == 0 && !write_media_file)
+		output_watch_keyframe(received_us);
+	return r;
+}
+
+/*
+ * Control socket commands, run from the capture loop between frames. The time
+ * from command to effect goes to the stats event log: for idr and record
+ * when the keyframe is written, for bitrate and fps when the driver and
+ * encoder have taken the new setting. They act on camera 0; stats also
+ * reports the other cameras.
+ */
+static void
+capture_encode_command(int argc, char **argv, int64_t received_us, FILE *reply) {
+	struct pipeline *p = &_pipelines[0];
+	OMX_ERRORTYPE r;
+
+	if (p->videoencode == NULL)
+		fprintf(reply, "error encoder not running yet\n");
+
+	else if (!strcmp(argv[0], "idr") && argc == 1) {
+		if ((r = request_idr(p, received_us)) != OMX_ErrorNone)
+			fprintf(reply, "error OMX_SetConfig() for IDR request failed with %x\n", r);
+		else
+			fprintf(reply, "ok\n");
 	}
 
-	if ((r = OMX_Init()) != OMX_ErrorNone) {
-		ilclient_destroy(_client);
-		fprintf(stderr, "OMX_Init() for video_encode failed with %x!\n", r);
-		return -4;
+	else if (!strcmp(argv[0], "bitrate") && argc == 2) {
+		OMX_VIDEO_CONFIG_BITRATETYPE bitrateType;
+		char *end;
+		long value;
+		errno = 0;
+		value = strtol(argv[1], &end, 0);
+		INIT_OMX_TYPE(bitrateType, OMX_VIDEO_CONFIG_BITRATETYPE, 201)
+		bitrateType.nEncodeBitrate = value;
+		if (errno || end == argv[1] || *end || value <= 0 || value > INT_MAX)
+			fprintf(reply, "error bitrate '%s' is not a positive number of bits per second\n", argv[1]);
+		else if ((r = OMX_SetConfig(ILC_GET_HANDLE(p->videoencode), OMX_IndexConfigVideoBitrate, &bitrateType)) != OMX_ErrorNone)
+			fprintf(reply, "error OMX_SetConfig() for bitrate failed with %x\n", r);
+		else {
+			// adaptive bitrate carries on from the new setting
+			if (abr)
+				abr_start(bitrateType.nEncodeBitrate);
+			stats_event("control: bitrate %u applied %.1f ms after the command", bitrateType.nEncodeBitrate, elapsed_ms(received_us));
+			fprintf(reply, "ok %u\n", bitrateType.nEncodeBitrate);
+		}
 	}
 
-	open_device();
+	else if (!strcmp(argv[0], "fps") && argc == 2) {
+		unsigned int rate;
+		char *end;
+		long value;
+		errno = 0;
+		value = strtol(argv[1], &end, 0);
+		// the encoder takes it in Q16
+		if (errno || end == argv[1] || *end || value <= 0 || value > 0xffff)
+			fprintf(reply, "error fps '%s' is not a frame rate from 1 to 65535\n", argv[1]);
+		else if ((rate = capture_set_frame_rate(p->cap, value)) == 0)
+			fprintf(reply, "error capture device refused the frame rate while streaming, unchanged\n");
+		else {
+			OMX_CONFIG_FRAMERATETYPE framerateType;
+			p->encodeframerate = rate << 16;
+			INIT_OMX_TYPE(framerateType, OMX_CONFIG_FRAMERATETYPE, 201)
+			framerateType.xEncodeFramerate = p->encodeframerate / p->framedivisor;
+			if ((r = OMX_SetConfig(ILC_GET_HANDLE(p->videoencode), OMX_IndexConfigVideoFramerate, &framerateType)) != OMX_ErrorNone)
+				fprintf(stderr, "OMX_SetConfig() for frame rate for video_encode port 201 failed with %x\n", r);
+			stats_event("control: frame rate %u applied %.1f ms after the command", rate, elapsed_ms(received_us));
+			fprintf(reply, "ok %u\n", rate);
+		}
+	}
+
+	else if (!strcmp(argv[0], "record") && argc == 2) {
+		if (write_media_file)
+			fprintf(reply, "error already writing to %s\n", write_media_file);
+		else if (!strcmp(argv[1], "off")) {
+			sink_record_stop();
+			fprintf(reply, "ok\n");
+		}
+		else if (sink_record(argv[1], received_us) < 0)
+			fprintf(reply, "error %s: %s\n", argv[1], strerror(errno));
+		else {
+			// the recording starts from the GOP cache; without one, start it on a fresh keyframe
+			if (!gop_cached())
+				request_idr(p, received_us);
+			fprintf(reply, "ok\n");
+		}
+	}
+
+	else if (!strcmp(argv[0], "trigger") && argc == 1) {
+		int started = preroll_trigger();
+		if (started < 0)
+			fprintf(reply, "error no --preroll\n");
+		else
+			fprintf(reply, "ok %s\n", started ? "extended" : "started");
+	}
+
+	else if (!strcmp(argv[0], "sink") && argc == 3 && (!strcmp(argv[1], "add") || !strcmp(argv[1], "remove"))) {
+		if (write_media_file)
+			fprintf(reply, "error already writing to %s\n", write_media_file);
+		else if ((argv[1][0] == 'a' ? sink_add(argv[2], received_us) : sink_remove(argv[2])) < 0)
+			fprintf(reply, "error %s: %s\n", argv[2], strerror(errno));
+		else
+			fprintf(reply, "ok\n");
+	}
+
+	else if (!strcmp(argv[0], "stats") && argc == 1) {
+		fprintf(reply, "ok\ninput frames: %d\noutput frames: %d\n", p->framenumber, p->outframenumber);
+		if (p->skippedframes)
+			fprintf(reply, "skipped frames (frame rate step-down): %d\n", p->skippedframes);
+		output_report(reply);
+		sink_report(reply);
+		server_report(reply);
+		shmout_report(reply);
+		preroll_report(reply);
+		segment_report(reply);
+		mp4_report(reply);
+		hls_report(reply);
+		abr_report(reply);
+		stats_report(reply);
+		if (_cameras > 1)
+			for (int i = 0; i < _cameras; i++) {
+				pipeline_report(&_pipelines[i], reply);
+				if (_pipelines[i].sink)
+					sink_report_one(_pipelines[i].sink, reply);
+			}
+		for (int i = 0; i < _cameras; i++)
+			if (_pipelines[i].motion)
+				motion_report(_pipelines[i].motion, reply);
+	}
+
+	else
+		fprintf(reply, "error usage: idr | bitrate BPS | fps N | record FILE | record off | trigger | sink add|remove SPEC | stats\n");
+}
 
-	atexit(capture_encode_jpeg_teardown);
-	signal(SIGINT, intHandler);
+static int
+run_jpeg(struct pipeline *p) {
+	COMPONENT_T *video_encode = NULL, *image_decode = NULL;
+	COMPONENT_T *write_media = NULL;
+	OMX_BUFFERHEADERTYPE *buf;
+	OMX_ERRORTYPE r;
+	int r_il = 0;
+	int status = 0;
+	int frames = p->frames;
+	struct timespec diff;
+
+	if ((status = client_open()) != 0)
+		return status;
+
+	open_device(p->cap);
 
 	// create image_decode
-	if ((r_il = ilclient_create_component(_client, &image_decode, "image_decode", ILCLIENT_DISABLE_ALL_PORTS
+	if ((r_il = create_component(&image_decode, "image_decode", ILCLIENT_DISABLE_ALL_PORTS
 		| ILCLIENT_ENABLE_INPUT_BUFFERS
 #ifndef TUNNEL
 		| ILCLIENT_ENABLE_OUTPUT_BUFFERS
 #endif /* TUNNEL */
 		)) != 0)
 		ILC_ERR_EXIT("%s:%d: ilclient_create_component() for image_decode failed (%d)!\n")
-	_comp[0] = image_decode;
-	_port[0][0][0] = 320;
-	_port[0][1][0] = 321;
+	p->comp[0] = image_decode;
+	p->port[0][0][0] = 320;
+	p->port[0][1][0] = 321;
 
 	// create video_encode
-	if ((r_il = ilclient_create_component(_client, &video_encode, "video_encode", ILCLIENT_DISABLE_ALL_PORTS
+	if ((r_il = create_component(&video_encode, "video_encode", ILCLIENT_DISABLE_ALL_PORTS
 #ifndef TUNNEL
 		| ILCLIENT_ENABLE_INPUT_BUFFERS
 		| ILCLIENT_ENABLE_OUTPUT_BUFFERS
 #endif /* TUNNEL */
 		)) != 0)
 		ILC_ERR_EXIT("%s:%d: ilclient_create_component() for video_encode failed (%d)!\n")
-	_comp[1] = video_encode;
-	_port[1][0][0] = 200;
-	_port[1][1][0] = 201;
+	p->comp[1] = video_encode;
+	p->port[1][0][0] = 200;
+	p->port[1][1][0] = 201;
 
 	// create tunnel 321 -> 200
-	set_tunnel(_tunnel, image_decode, 321, video_encode, 200);
+	set_tunnel(p->tunnel, image_decode, 321, video_encode, 200);
 
-	if (write_media_file) {
+	if (p->write_media) {
 
 		// create write_media
-		if ((r_il = ilclient_create_component(_client, &write_media, "write_media", ILCLIENT_DISABLE_ALL_PORTS
+		if ((r_il = create_component(&write_media, "write_media", ILCLIENT_DISABLE_ALL_PORTS
 #ifndef TUNNEL
 			| ILCLIENT_ENABLE_INPUT_BUFFERS
 #endif /* TUNNEL */
 			)) != 0)
 			ILC_ERR_EXIT("%s:%d: ilclient_create_component() for write_media failed (%d)!\n")
-		_comp[2] = write_media;
-		_port[2][0][0] = 170; // audio
-		_port[2][0][1] = 171; // video
+		p->comp[2] = write_media;
+		p->port[2][0][0] = 170; // audio
+		p->port[2][0][1] = 171; // video
 
 		// create tunnel 201 -> 171
-		set_tunnel(_tunnel + 1, video_encode, 201, write_media, 171);
+		set_tunnel(p->tunnel + 1, video_encode, 201, write_media, 171);
 	}
 
-	// set set_port_settings_callback
-	ilclient_set_port_settings_callback(_client, capture_encode_jpeg_port_settings_callback, NULL);
-	// set fill_buffer_done_callback
-	ilclient_set_fill_buffer_done_callback(_client, capture_encode_jpeg_fill_buffer_done_callback, NULL);
-	// set error_callback
-	ilclient_set_error_callback(_client, capture_encode_jpeg_error_callback, NULL);
-
 	// move components to idle
-	ilclient_state_transition(_comp, OMX_StateIdle);
+	ilclient_state_transition(p->comp, OMX_StateIdle);
 
-	unsigned int bufsize = init_device();
+	unsigned int bufsize = init_device(p->cap);
 	fprintf(stderr, "capture buffer size: %d\n", bufsize);
 
+	p->inputbufferlist = NULL;
+	int capturing_initialized = 0;
+	struct timespec capture_time;
+
+	if (arena_mb) {
+		if ((p->arena = arena_create((size_t)arena_mb << 20, bufsize)) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		// sample the frame size distribution before sizing the image_decode input buffers
+		init_buffers(p->cap, bufsize, NULL);
+		start_capturing(p->cap);
+		capturing_initialized = 1;
+		while (!arena_slot_size(p->arena) && p->framenumber < frames && !p->stop)
+			capture_arena_frame(p, VC_TRUE, &capture_time);
+		if (arena_slot_size(p->arena))
+			bufsize = arena_slot_size(p->arena);
+		fprintf(stderr, "image_decode input buffer size: %d\n", bufsize);
+	}
+
 	int inputbuffernumber = image_decode_init(image_decode, bufsize);
 
-	_inputbufferlist = NULL;
-	int capturing_initialized = 0;
+	if (p->index == 0)
+		control_open(capture_encode_command);
 
 	do {
-		struct timespec capture_time;
+		if (p->index == 0)
+			control_poll();
 
 		//DEBUG_PRINT("1. move image_decode to executing\n")
 		//ilclient_change_component_state(image_decode, OMX_StateExecuting);
@@ -1101,36 +1876,48 @@ capture_encode_jpeg_loop(int frames/*, OMX_U32 frameWidth, OMX_U32 frameHeight,
 		//if ((buf = ilclient_get_input_buffer(image_decode, 320, 0)) != NULL) {
 		//	vc_assert(buf->nAllocLen >= bufsize);
 		//
-		if (get_input_buffers(image_decode, 320, 0, inputbuffernumber, &_inputbufferlist) == inputbuffernumber) {
+		if (p->arena) {
+			// capture whenever the driver has a frame, the arena absorbs decoder stalls
+			int captured = p->framenumber < frames && capture_arena_frame(p, VC_FALSE, &capture_time) != 0;
+			if (!feed_arena_frames(p, image_decode) && !captured && p->framenumber < frames)
+				wait_timeout(0, 1000);
+		}
+		else if (get_input_buffers(image_decode, 320, 0, inputbuffernumber, &p->inputbufferlist) == inputbuffernumber) {
 
-			if (_framenumber < frames) {
+			if (p->framenumber < frames) {
 
 				if (!capturing_initialized) {
 					DEBUG_PRINT("initialize buffers and start capturing\n")
-					init_buffers(bufsize, _inputbufferlist);
-					start_capturing();
+					init_buffers(p->cap, bufsize, p->inputbufferlist);
+					start_capturing(p->cap);
 					capturing_initialized = 1;
 				}
 
 				/* fill it */
 				//generate_test_card(buf->pBuffer, &buf->nFilledLen, framenumber++);
-				buf = capture_frame(_inputbufferlist);
-
-				/* take a buffer out of inputbufferlist */
-				buffer_list_get_buf_remove(&_inputbufferlist, buf);
-
-				buf->nFlags = OMX_BUFFERFLAG_EOS;
-				_framenumber++;
-				clock_gettime(CLOCK_MONOTONIC, &capture_time);
-				INFO_PRINT_2("captured frame %d (%d bytes)\n", _framenumber, buf->nFilledLen)
-
-				DEBUG_PRINT("3. send filled 320 in buffer to image_decode processor\n")
-				if ((r = OMX_EmptyThisBuffer(ILC_GET_HANDLE(image_decode), buf)) != OMX_ErrorNone)
-					fprintf(stderr, "Error emptying buffer: %x\n", r);
+				buf = capture_frame(p->cap, p->inputbufferlist);
+
+				/* frame rate step-down or no motion: a skipped frame's buffer stays in inputbufferlist */
+				if (!skip_frame(p, buf->pBuffer, buf->nFilledLen)) {
+					/* take a buffer out of inputbufferlist */
+					buffer_list_get_buf_remove(&p->inputbufferlist, buf);
+
+					buf->nFlags = OMX_BUFFERFLAG_EOS;
+					buf->nTimeStamp = omx_ticks_now();
+					p->framenumber++;
+					clock_gettime(CLOCK_MONOTONIC, &capture_time);
+					if (p->framenumber == 1)
+						p->firstcapturetime = capture_time;
+					INFO_PRINT_2("captured frame %d (%d bytes)\n", p->framenumber, buf->nFilledLen)
+
+					DEBUG_PRINT("3. send filled 320 in buffer to image_decode processor\n")
+					if ((r = OMX_EmptyThisBuffer(ILC_GET_HANDLE(image_decode), buf)) != OMX_ErrorNone)
+						fprintf(stderr, "Error emptying buffer: %x\n", r);
+				}
 			}
 		}
 
-		if (_framenumber >= frames) {
+		if (p->framenumber >= frames) {
 			get_time_diff(&capture_time, &diff);
 			wait_timeout(0, 1000);
 			fprintf(stderr, "\r%.2f ", (1000000000.0 * diff.tv_sec + diff.tv_nsec) / 1000000000.0);
@@ -1140,60 +1927,340 @@ capture_encode_jpeg_loop(int frames/*, OMX_U32 frameWidth, OMX_U32 frameHeight,
 		DEBUG_PRINT("check video_encode component is in the right state to accept buffers\n")
 		wait_for_StateExecuting(video_encode);
 
-		wait_tunnel_buffer(_tunnel, &_copybuffernumber);
+		wait_tunnel_buffer(p, p->tunnel, &p->copybuffernumber);
 
-		if (write_media_file) {
+		if (p->write_media) {
 
 			// check write_media component is in the right state to accept buffers
 			DEBUG_PRINT("check write_media component is in the right state to accept buffers\n")
 			wait_for_StateExecuting(write_media);
 
-			wait_tunnel_buffer(_tunnel + 1, NULL);
+			wait_tunnel_buffer(p, p->tunnel + 1, NULL);
 		}
 		else {
 
-			DEBUG_PRINT("10. get 201 out buffers from video_encode queue\n")
-			while ((out = ilclient_get_output_buffer(video_encode, 201, 0)) != NULL && out->nFilledLen == 0) {
-				DEBUG_PRINT("11. send empty 201 out buffer to video_encode processor\n")
-				if ((r = OMX_FillThisBuffer(ILC_GET_HANDLE(video_encode), out)) != OMX_ErrorNone) {
-					fprintf(stderr, "Error filling 201 out buffer: %x\n", r);
-				}
-			}
-			if (out != NULL) {
+			DEBUG_PRINT("10. write 201 out buffers from video_encode to stdout\n")
+			drain_output_buffers(p, video_encode);
+		}
+	}
+	while (!p->stop && (p->framenumber < frames || /*out != NULL ||*/ diff.tv_sec < 1));
 
-#ifdef DEBUG
-				if (out->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
-					int i;
-					for (i = 0; i < out->nFilledLen; i++)
-						fprintf(stderr, "%x ", out->pBuffer[i]);
-					fprintf(stderr, "\n");
-				}
-#endif
+	return status;
+}
 
-				DEBUG_PRINT_1("12. write frame to stdout (%d bytes)\n", out->nFilledLen)
-				if ((r = fwrite(out->pBuffer, 1, out->nFilledLen, stdout)) != out->nFilledLen) {
-					fprintf(stderr, "fwrite: Error writing buffer to stdout: %d!\n", r);
-				}
-				else {
-					_outframenumber++;
-					INFO_PRINT_2("output frame %d (%d bytes)\n", _outframenumber, out->nFilledLen)
-				}
-				fflush(stdout);
-				out->nFilledLen = 0;
+// MJPEG capture decoded in software: camera frames go to the decoder with a free 200 in buffer to decode into
+// and, decoded, to video_encode in capture order; with no buffer free or the decoder full a frame is dropped
+static void
+decode_frames(struct pipeline *p, COMPONENT_T *video_encode, int *maxinflight) {
+	struct pollfd fds[2];
+	struct decode_job job;
+	struct timespec now;
+	OMX_BUFFERHEADERTYPE *buf;
+	OMX_ERRORTYPE r;
+	void *data;
+	unsigned int size;
+	int index, framesinflight = 0;
+
+	fds[0].fd = p->cap->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = decoder_fd(p->decoder);
+	fds[1].events = POLLIN;
+
+	while ((p->framenumber < p->frames && !p->stop) || decoder_pending(p->decoder) > 0) {
+		if (p->index == 0)
+			control_poll();
+
+		// buffers consumed by video_encode are free for the decoder again
+		while ((buf = ilclient_get_input_buffer(video_encode, 200, VC_FALSE)) != NULL) {
+			buf->pAppPrivate = p->inputbufferlist;
+			p->inputbufferlist = buf;
+			framesinflight--;
+		}
 
-				DEBUG_PRINT("13. send emptied 201 out buffer to video_encode processor\n")
-				if ((r = OMX_FillThisBuffer(ILC_GET_HANDLE(video_encode), out)) != OMX_ErrorNone)
-					fprintf(stderr, "Error filling 201 out buffer: %x\n", r);
+		while (decoder_next(p->decoder, &job)) {
+			release_frame_index(p->cap, job.index);
+			buf = job.arg;
+			if (job.status < 0) {
+				p->droppedframes++;
+				buf->pAppPrivate = p->inputbufferlist;
+				p->inputbufferlist = buf;
+				continue;
 			}
+			buf->nOffset = 0;
+			buf->nFilledLen = decoder_frame_size(p->decoder);
+			buf->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
+			buf->nTimeStamp = omx_ticks_from_us(job.timestamp);
+			if ((r = OMX_EmptyThisBuffer(ILC_GET_HANDLE(video_encode), buf)) != OMX_ErrorNone)
+				fprintf(stderr, "Error emptying buffer: %x\n", r);
+			else if (++framesinflight > *maxinflight)
+				*maxinflight = framesinflight;
+		}
+
+		// done capturing, only waiting for the decoder
+		if (p->framenumber >= p->frames || p->stop) {
+			if (decoder_pending(p->decoder) > 0)
+				poll(&fds[1], 1, 100);
+			continue;
+		}
+
+		if (poll(fds, 2, 5000) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+		if (!(fds[0].revents & POLLIN) && !(fds[1].revents & POLLIN)) {
+			fprintf(stderr, "select timeout\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!(fds[0].revents & POLLIN) || (index = capture_frame_index(p->cap, &data, &size)) < 0)
+			continue;
+
+		/* frame rate step-down or no motion: a skipped frame goes straight back to the capture queue */
+		if (skip_frame(p, data, size)) {
+			release_frame_index(p->cap, index);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((buf = p->inputbufferlist) == NULL ||
+		    decoder_submit(p->decoder, data, size, buf->pBuffer, now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000, index, buf) < 0) {
+			p->droppedframes++;
+			release_frame_index(p->cap, index);
+			continue;
+		}
+		p->inputbufferlist = buf->pAppPrivate;
+
+		if (p->framenumber++ == 0)
+			p->firstcapturetime = now;
+		INFO_PRINT_2("captured frame %d (%d bytes)\n", p->framenumber, size)
+	}
+}
+
+/*
+ * Raw (YUV) capture straight into video_encode port 200 buffers. Up to
+ * inflight frames are outstanding at once: every port 200 buffer not held by
+ * the encoder stays queued on the capture device, and encoded output is
+ * collected from the fill buffer done callback, so capture of frame N+1
+ * overlaps encode of frame N.
+ */
+static int
+run_raw(struct pipeline *p) {
+	COMPONENT_T *video_encode = NULL;
+	OMX_PARAM_PORTDEFINITIONTYPE portdef;
+	OMX_BUFFERHEADERTYPE *buf;
+	OMX_COLOR_FORMATTYPE colorFormat;
+	OMX_U32 frameWidth, frameHeight, sliceHeight;
+	OMX_S32 stride;
+	uint frameRate;
+	OMX_ERRORTYPE r;
+	int r_il = 0;
+	int status = 0;
+	int frames = p->frames;
+	int inputbuffernumber, framesinflight = 0, maxinflight = 0;
+	struct timespec diff;
+
+	if ((status = client_open()) != 0)
+		return status;
+
+	open_device(p->cap);
+
+	unsigned int capturesize = init_device(p->cap), bufsize = capturesize;
+	fprintf(stderr, "capture buffer size: %d\n", capturesize);
+
+	if (p->cap->v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG) {
+		// decoded in software into I420 at the stride and slice height video_encode wants
+		frameWidth = p->cap->v4l2_fmt.fmt.pix.width;
+		frameHeight = p->cap->v4l2_fmt.fmt.pix.height;
+		stride = (frameWidth + 31) & ~31;
+		sliceHeight = (frameHeight + 15) & ~15;
+		colorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
+		if ((p->decoder = decoder_new(decode_threads, frameWidth, frameHeight, stride, sliceHeight)) == NULL)
+			exit(1);
+		bufsize = decoder_frame_size(p->decoder);
+	}
+	else if ((colorFormat = capture_omx_format(p->cap, &frameWidth, &frameHeight, &stride)) == OMX_COLOR_FormatUnused) {
+		fprintf(stderr, "%s: capture format is not supported by video_encode\n", p->cap->dev_name);
+		exit(1);
+	}
+	else
+		sliceHeight = frameHeight;
+
+	// create video_encode
+	if ((r_il = create_component(&video_encode, "video_encode",
+		ILCLIENT_DISABLE_ALL_PORTS | ILCLIENT_ENABLE_INPUT_BUFFERS | ILCLIENT_ENABLE_OUTPUT_BUFFERS)) != 0)
+		ILC_ERR_EXIT("%s:%d: ilclient_create_component() for video_encode failed (%d)!\n")
+	p->comp[0] = video_encode;
+	p->port[0][0][0] = 200;
+	p->port[0][1][0] = 201;
+
+	// set video_encode input image format and buffer count - port 200
+	get_portdef(&portdef, video_encode, 200, VC_FALSE);
+	portdef.format.video.nFrameWidth =  frameWidth;
+	portdef.format.video.nFrameHeight = frameHeight;
+	portdef.format.video.nSliceHeight = sliceHeight;
+	portdef.format.video.nStride =      stride;
+	portdef.format.video.eColorFormat = colorFormat;
+	if ((frameRate = capture_frame_rate(p->cap)) != 0)
+		portdef.format.video.xFramerate = frameRate << 16;
+	if (portdef.nBufferSize < bufsize)
+		portdef.nBufferSize = bufsize;
+	portdef.nBufferCountActual = inflight > portdef.nBufferCountMin ? inflight : portdef.nBufferCountMin;
+	set_portdef(&portdef, video_encode, 200, VC_FALSE);
+	inputbuffernumber = portdef.nBufferCountActual;
+
+	video_encode_init(p, video_encode);
+
+	fprintf(stderr, "encode to idle...\n");
+	if (ilclient_change_component_state(video_encode, OMX_StateIdle) == -1)
+		fprintf(stderr, "%s:%d: ilclient_change_component_state(video_encode, OMX_StateIdle) failed", __FUNCTION__, __LINE__);
+
+	fprintf(stderr, "enabling port buffers for 200...\n");
+	if ((r_il = ilclient_enable_port_buffers(video_encode, 200, NULL, NULL, NULL)) != 0)
+		ILC_ERR_EXIT("%s:%d: enabling port buffers for 200 failed (%d)!\n")
+
+	fprintf(stderr, "enabling port buffers for 201...\n");
+	if ((r_il = ilclient_enable_port_buffers(video_encode, 201, NULL, NULL, NULL)) != 0)
+		ILC_ERR_EXIT("%s:%d: enabling port buffers for 201 failed (%d)!\n")
+
+	fprintf(stderr, "encode to executing...\n");
+	ilclient_change_component_state(video_encode, OMX_StateExecuting);
+	wait_for_StateExecuting(video_encode);
+
+	// hand all 201 out buffers to video_encode, from now on they are drained by the callback
+	drain_output_buffers(p, video_encode);
+	p->draining = 1;
+
+	// all 200 in buffers start out queued on the capture device
+	p->inputbufferlist = NULL;
+	get_input_buffers(video_encode, 200, VC_TRUE, inputbuffernumber, &p->inputbufferlist);
+	if (p->decoder)
+		// MJPEG: the driver's own buffers, each held until its frame is decoded
+		init_buffers(p->cap, capturesize, NULL);
+	else {
+		capture_defer_requeue(p->cap, 1);
+		init_buffers(p->cap, bufsize, p->inputbufferlist);
+	}
+	start_capturing(p->cap);
+	fprintf(stderr, "frames in flight: %d\n", inputbuffernumber);
+
+	if (p->index == 0)
+		control_open(capture_encode_command);
+
+	if (p->decoder)
+		decode_frames(p, video_encode, &maxinflight);
+
+	while (!p->decoder && p->framenumber < frames && !p->stop) {
+		int block = p->inputbufferlist == NULL;
+
+		if (p->index == 0)
+			control_poll();
+
+		// buffers consumed by video_encode go back to the capture queue; block only if the queue ran dry
+		while ((buf = ilclient_get_input_buffer(video_encode, 200, block)) != NULL) {
+			release_frame(p->cap, buf);
+			buf->pAppPrivate = p->inputbufferlist;
+			p->inputbufferlist = buf;
+			framesinflight--;
+			block = VC_FALSE;
+		}
+
+		if ((buf = capture_frame(p->cap, p->inputbufferlist)) == NULL)
+			continue;
+
+		/* frame rate step-down or no motion: a skipped frame goes straight back to the capture queue */
+		if (skip_frame(p, buf->pBuffer, buf->nFilledLen)) {
+			release_frame(p->cap, buf);
+			continue;
 		}
+
+		/* take a buffer out of inputbufferlist */
+		buffer_list_get_buf_remove(&p->inputbufferlist, buf);
+
+		if (p->framenumber++ == 0)
+			clock_gettime(CLOCK_MONOTONIC, &p->firstcapturetime);
+		buf->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
+		buf->nTimeStamp = omx_ticks_now();
+		INFO_PRINT_2("captured frame %d (%d bytes)\n", p->framenumber, buf->nFilledLen)
+
+		if ((r = OMX_EmptyThisBuffer(ILC_GET_HANDLE(video_encode), buf)) != OMX_ErrorNone)
+			fprintf(stderr, "Error emptying buffer: %x\n", r);
+		else if (++framesinflight > maxinflight)
+			maxinflight = framesinflight;
+	}
+
+	// let the encoder finish the frames still in flight
+	get_input_buffers(video_encode, 200, VC_TRUE, inputbuffernumber, &p->inputbufferlist);
+	do {
+		wait_timeout(0, 1000);
+		get_time_diff(&p->lastouttime, &diff);
 	}
-	while (_framenumber < frames || /*out != NULL ||*/ diff.tv_sec < 1);
+	while (p->outframenumber < p->framenumber && diff.tv_sec < 1);
+	p->draining = 0;
+
+	time_diff(&p->firstcapturetime, &p->lastouttime, &diff);
+	fprintf(stderr, "\r          \n%s in-flight depth %d (max reached %d): %d frames in %.2f s, %.2f fps sustained\n",
+		p->cap->dev_name, inputbuffernumber, maxinflight, p->outframenumber,
+		diff.tv_sec + diff.tv_nsec / 1000000000.0,
+		p->outframenumber / (diff.tv_sec + diff.tv_nsec / 1000000000.0));
+
+	return status;
+}
+
+int
+capture_encode_jpeg_loop(struct capture *cap, int frames) {
+	int status = run_jpeg(pipeline_init(0, cap, NULL, frames, 0));
+
+	if (status == 0)
+		capture_encode_teardown();
+	return status;
+}
 
-	capture_encode_jpeg_teardown();
+int
+capture_encode_loop(struct capture *cap, int frames) {
+	int status = run_raw(pipeline_init(0, cap, NULL, frames, 1));
 
+	if (status == 0)
+		capture_encode_teardown();
 	return status;
 }
 
+static void *
+camera_thread(void *arg) {
+	struct pipeline *p = arg;
+
+	if ((p->raw ? run_raw(p) : run_jpeg(p)) == 0)
+		pipeline_teardown(p);
+	return NULL;
+}
+
+/*
+ * Daemon mode: start another camera on a thread of its own, sharing the OMX
+ * client, with its stream going to the sink out_spec. It runs until it has
+ * its frames or camera 0 is done.
+ */
+int
+capture_encode_camera(struct capture *cap, const char *out_spec, int frames, int raw) {
+	struct pipeline *p;
+	int err;
+
+	if (_cameras == CAMERA_MAX) {
+		fprintf(stderr, "At most %d cameras\n", CAMERA_MAX);
+		return -1;
+	}
+	p = pipeline_init(_cameras, cap, out_spec, frames, raw);
+	if ((err = pthread_create(&p->thread, NULL, camera_thread, p)) != 0) {
+		fprintf(stderr, "cannot start the thread for %s: %s\n", cap->dev_name, strerror(err));
+		p->cap = NULL;
+		return -1;
+	}
+	p->running = 1;
+	_cameras++;
+	return 0;
+}
+
+const struct encoder encoder_omx = { "omx", capture_encode_loop, capture_encode_camera };
+
 //int
 //main(int argc, char **argv) {
 //	if (argc < 2) {
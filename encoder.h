@@ -0,0 +1,29 @@
+/*
+ * Encoder backends for raw (YUV) capture
+ *
+ * omx is the video_encode component through ilclient (encode.c); m2m is a
+ * V4L2 memory-to-memory encoder such as the Pi's bcm2835-codec or the
+ * kernel's vicodec (m2m.c); null encodes nothing and stands in for either
+ * (null.c). Each runs the capture loop and hands the encoded stream to the
+ * output stage. --write_media needs omx, --camera omx or null (camera, the
+ * backends that run more than one), and MJPEG capture needs omx unless
+ * --decode_threads decodes it in software (decode.c) for omx or m2m.
+ */
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "capture.h"
+
+struct encoder {
+	const char  *name;
+	int        (*encode_loop)(struct capture *cap, int frames);
+	/* daemon mode: another camera with its stream going to sink out_spec, before encode_loop; NULL without */
+	int        (*camera)(struct capture *cap, const char *out_spec, int frames, int raw);
+};
+
+extern const struct encoder encoder_omx, encoder_m2m, encoder_null;
+
+extern char *m2m_device;
+
+#endif /* ENCODER_H */
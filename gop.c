@@ -0,0 +1,108 @@
+/*
+ * GOP cache for late joiners
+ *
+ * Holds references to the last codec config and to every access unit from the
+ * last keyframe on, so a consumer that joins mid-stream can be handed a
+ * decodable start at once instead of waiting for the next IDR. The cache is
+ * bounded by gop_cache_kb: a GOP that outgrows it is dropped and caching
+ * resumes at the next keyframe. Only the thread draining the encoder changes
+ * or replays it, so joiners are queued for that thread (see server.c and
+ * sink.c); gop_cached() is a hint for other threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gop.h"
+
+#define GOP_MAX_UNITS  1024
+
+int gop_cache_kb = 4096;
+
+static struct au     *config;
+static struct au     *units[GOP_MAX_UNITS];
+static int            count, valid;
+static size_t         bytes, peak_bytes;
+static unsigned long  overflows, replays, replayed_units;
+
+static void drop_gop(void)
+{
+	while (count > 0)
+		au_unref(units[--count]);
+	bytes = config ? config->size : 0;
+	valid = 0;
+}
+
+void gop_add(struct au *au)
+{
+	/* the config is kept even with the cache off, consumers waiting for a keyframe need it */
+	if (au->flags & AU_CONFIG) {
+		bytes -= config ? config->size : 0;
+		au_unref(config);
+		config = au_ref(au);
+		bytes += au->size;
+		return;
+	}
+	if (!gop_cache_kb)
+		return;
+
+	if (au->flags & AU_KEYFRAME) {
+		drop_gop();
+		valid = 1;
+	}
+	if (!valid)
+		return;
+
+	if (count == GOP_MAX_UNITS || bytes + au->size > (size_t)gop_cache_kb << 10) {
+		drop_gop();
+		overflows++;
+		return;
+	}
+	units[count++] = au_ref(au);
+	bytes += au->size;
+	if (bytes > peak_bytes)
+		peak_bytes = bytes;
+}
+
+/* hand config and the current GOP to fn in stream order; 0 if there is no decodable start cached */
+int gop_replay(gop_replay_fn fn, void *arg)
+{
+	int i;
+
+	if (!valid || !count)
+		return 0;
+	if (config)
+		fn(config, arg);
+	for (i = 0; i < count; i++)
+		fn(units[i], arg);
+	replays++;
+	replayed_units += count;
+	return 1;
+}
+
+int gop_cached(void)
+{
+	return valid && count;
+}
+
+struct au *gop_config(void)
+{
+	return config;
+}
+
+void gop_clear(void)
+{
+	drop_gop();
+	au_unref(config);
+	config = NULL;
+	bytes = 0;
+}
+
+void gop_report(FILE *out)
+{
+	if (!gop_cache_kb)
+		return;
+	fprintf(out, "gop cache: %d units, %zu KB now, peak %zu KB of %d KB, %lu overflows, %lu replays (%.1f units each)\n",
+		count, bytes >> 10, peak_bytes >> 10, gop_cache_kb, overflows, replays,
+		replays ? (double)replayed_units / replays : 0.0);
+}
@@ -0,0 +1,23 @@
+/*
+ * GOP cache for late joiners
+ */
+
+#ifndef GOP_H
+#define GOP_H
+
+#include <stdio.h>
+
+#include "au.h"
+
+extern int gop_cache_kb;
+
+typedef void (*gop_replay_fn)(struct au *au, void *arg);
+
+void gop_add(struct au *au);
+int gop_replay(gop_replay_fn fn, void *arg);
+int gop_cached(void);
+struct au *gop_config(void);
+void gop_clear(void);
+void gop_report(FILE *out);
+
+#endif /* GOP_H */
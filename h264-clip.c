@@ -0,0 +1,376 @@
+/*
+ * h264-clip: cut a time range out of recorded H.264 without re-encoding
+ *
+ *   h264-clip [-r FPS] [-x] -s START (-e END | -t SECONDS) [-o OUT] FILE...
+ *
+ * FILE is an Annex B recording (capture-encode's stdout, --tst_enc) or a run
+ * of --segments segments in order. Each is looked up in its IDR index,
+ * FILE.idx, which --idr_index writes inline or which is built here (with
+ * timestamps at FPS [30]) if there is none, or anew with -x. The clip runs
+ * from the last IDR at or before START to the first at or after END, so it
+ * plays on its own and covers the whole range; the ranges of bytes that takes
+ * are copied as they are, by copy_file_range into a file (sendfile into a
+ * pipe, plain reads and writes where neither works), to OUT or stdout. Only
+ * the index and the first frame of each range are read, so the time it takes
+ * goes with the size of the clip, not of the recording. Should a range not
+ * start with an SPS (no --psips), the file's first SPS and PPS go in front.
+ *
+ * START and END are seconds from the start of the recording, or local times,
+ * HH:MM:SS (on the recording's first day) or YYYY-mm-dd HH:MM:SS. Wall clock
+ * times come from the index for --idr_index (capture times), from the name
+ * for segments (seg-YYYYmmdd-HHMMSS-mmm.h264); other files follow on from the
+ * one before.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "nal.h"
+
+#define CLIP_COPY   (1 << 30)       /* bytes to a copy call */
+#define CLIP_BUF    (1 << 20)       /* read and write fallback */
+#define CLIP_PARAM  4096            /* first frame read for parameter sets */
+
+struct input {
+	const char             *path;
+	int                     fd;
+	uint64_t                size;
+	struct nal_index_entry *entries;
+	size_t                  count;
+	int64_t                 base;       /* timeline us of timestamp 0 */
+	int                     wall;       /* base is wall clock time */
+};
+
+static enum { COPY_RANGE, SEND_FILE, READ_WRITE } method;
+static const char *method_name[] = { "copy_file_range", "sendfile", "read/write" };
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+/* wall clock us of a segment's name, 0 if it is not one */
+static int64_t segment_time(const char *path)
+{
+	char copy[4096];
+	struct tm tm;
+	const char *rest;
+	int ms;
+
+	snprintf(copy, sizeof(copy), "%s", path);
+	memset(&tm, 0, sizeof(tm));
+	if (strncmp(basename(copy), "seg-", 4) || (rest = strptime(basename(copy) + 4, "%Y%m%d-%H%M%S", &tm)) == NULL ||
+		sscanf(rest, "-%3d.h264", &ms) != 1)
+		return 0;
+	tm.tm_isdst = -1;
+	return mktime(&tm) * (int64_t)1000000 + ms * 1000;
+}
+
+static int load(struct input *in, double fps, int rebuild)
+{
+	char index_path[4096];
+	struct nal_index_header header;
+	struct stat st;
+
+	if ((in->fd = open(in->path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(in->fd, &st) < 0) {
+		perror(in->path);
+		return -1;
+	}
+	in->size = st.st_size;
+	snprintf(index_path, sizeof(index_path), "%s.idx", in->path);
+	if (rebuild || (in->entries = nal_index_load(index_path, &header, &in->count)) == NULL) {
+		if (!rebuild && errno != ENOENT)
+			fprintf(stderr, "%s: %s, indexing again\n", index_path, errno == EINVAL ? "not an IDR index" : strerror(errno));
+		if (nal_index_file(in->path, index_path, fps, stderr) < 0 ||
+			(in->entries = nal_index_load(index_path, &header, &in->count)) == NULL) {
+			fprintf(stderr, "%s: cannot index: %s\n", in->path, strerror(errno));
+			return -1;
+		}
+	}
+	/* a recording cut short since it was indexed */
+	while (in->count && in->entries[in->count - 1].offset >= in->size)
+		in->count--;
+	if (!in->count) {
+		fprintf(stderr, "%s: no IDR frame\n", in->path);
+		return -1;
+	}
+
+	if (!(header.flags & NAL_INDEX_FRAME_TIMES) && header.realtime_offset_us) {
+		in->base = header.realtime_offset_us;
+		in->wall = 1;
+	}
+	else if ((in->base = segment_time(in->path)) != 0) {
+		in->base -= in->entries[0].timestamp;
+		in->wall = 1;
+	}
+	return 0;
+}
+
+/* timeline us of an entry */
+static int64_t entry_time(const struct input *in, size_t i)
+{
+	return in->base + in->entries[i].timestamp;
+}
+
+/* seconds from the start, or a local time on the first day */
+static int parse_time(const char *arg, const struct input *first, int64_t *t)
+{
+	static const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%H:%M:%S" };
+	struct tm tm;
+	time_t day;
+	const char *end;
+	char *rest;
+	double seconds = strtod(arg, &rest);
+	size_t i;
+
+	if (rest != arg && *rest == 0) {
+		*t = entry_time(first, 0) + (int64_t)(seconds * 1000000);
+		return 0;
+	}
+	if (!first->wall) {
+		fprintf(stderr, "%s: no wall clock times for %s, give seconds\n", arg, first->path);
+		return -1;
+	}
+	day = entry_time(first, 0) / 1000000;
+	/* a format that does not match may still have filled in part of tm */
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		localtime_r(&day, &tm);
+		if ((end = strptime(arg, formats[i], &tm)) != NULL && *end == 0) {
+			tm.tm_isdst = -1;
+			*t = mktime(&tm) * (int64_t)1000000;
+			return 0;
+		}
+	}
+	fprintf(stderr, "%s: seconds, HH:MM:SS or YYYY-mm-dd HH:MM:SS\n", arg);
+	return -1;
+}
+
+/* returns 0 or -1 with errno set */
+static int write_all(int fd, const void *data, size_t length)
+{
+	ssize_t n;
+
+	while (length > 0) {
+		if ((n = write(fd, data, length)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data = (const char *)data + n;
+		length -= n;
+	}
+	return 0;
+}
+
+/* the bytes from offset, by the best means out will take */
+static int copy_range(int in, uint64_t offset, uint64_t length, int out)
+{
+	static char *buf;
+	off_t at = offset;
+	ssize_t n;
+
+	while (length > 0) {
+		size_t chunk = length < CLIP_COPY ? length : CLIP_COPY;
+
+		switch (method) {
+		case COPY_RANGE:
+			n = copy_file_range(in, &at, out, NULL, chunk, 0);
+			break;
+		case SEND_FILE:
+			n = sendfile(out, in, &at, chunk);
+			break;
+		default:
+			if (!buf && (buf = malloc(CLIP_BUF)) == NULL)
+				return -1;
+			if ((n = pread(in, buf, chunk < CLIP_BUF ? chunk : CLIP_BUF, at)) > 0) {
+				if (write_all(out, buf, n) < 0)
+					return -1;
+				at += n;
+			}
+			break;
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* not between these two files: fall back, nothing was copied */
+			if (method != READ_WRITE && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+				errno == EOPNOTSUPP || errno == EBADF)) {
+				method++;
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			errno = EIO;        /* the file got shorter */
+			return -1;
+		}
+		length -= n;
+	}
+	return 0;
+}
+
+/* SPS and PPS of the file's first IDR, if the frame at offset has no SPS of its own; their size */
+static size_t parameter_sets(const struct input *in, uint64_t offset, unsigned char *out)
+{
+	unsigned char frame[CLIP_PARAM];
+	const unsigned char *pos, *end, *nal;
+	size_t length, size = 0;
+	ssize_t n;
+
+	if ((n = pread(in->fd, frame, sizeof(frame), offset)) <= 0)
+		return 0;
+	for (pos = frame, end = frame + n; nal_next(&pos, end, &nal, &length); )
+		if ((nal[0] & 0x1f) == 7)
+			return 0;
+		else if ((nal[0] & 0x1f) == 1 || (nal[0] & 0x1f) == 5)
+			break;
+
+	if ((n = pread(in->fd, frame, sizeof(frame), in->entries[0].offset)) <= 0)
+		return 0;
+	for (pos = frame, end = frame + n; nal_next(&pos, end, &nal, &length); )
+		if (((nal[0] & 0x1f) == 7 || (nal[0] & 0x1f) == 8) && size + 4 + length <= CLIP_PARAM) {
+			memcpy(out + size, "\0\0\0\1", 4);
+			memcpy(out + size + 4, nal, length);
+			size += 4 + length;
+		}
+		else if ((nal[0] & 0x1f) == 1 || (nal[0] & 0x1f) == 5)
+			break;
+	return size;
+}
+
+int main(int argc, char **argv)
+{
+	struct input *inputs;
+	const char *start_arg = NULL, *end_arg = NULL, *out_path = NULL;
+	double fps = 30, seconds = 0;
+	int64_t start_t, end_t, started;
+	uint64_t copied = 0, skipped = 0;
+	unsigned char params[CLIP_PARAM];
+	struct stat st;
+	int c, i, n, out = STDOUT_FILENO, rebuild = 0, ranges = 0;
+
+	while ((c = getopt(argc, argv, "r:xs:e:t:o:")) != -1)
+		switch (c) {
+		case 'r':
+			fps = atof(optarg);
+			break;
+		case 'x':
+			rebuild = 1;
+			break;
+		case 's':
+			start_arg = optarg;
+			break;
+		case 'e':
+			end_arg = optarg;
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	if (optind == argc || !start_arg || !end_arg == !(seconds > 0) || fps <= 0) {
+usage:
+		fprintf(stderr, "usage: %s [-r FPS] [-x] -s START (-e END | -t SECONDS) [-o OUT] FILE...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	n = argc - optind;
+	if ((inputs = calloc(n, sizeof(*inputs))) == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < n; i++) {
+		inputs[i].path = argv[optind + i];
+		if (load(&inputs[i], fps, rebuild) < 0)
+			return EXIT_FAILURE;
+		/* no time of its own: it follows on from the file before, a GOP after its last IDR */
+		if (!inputs[i].wall && i > 0) {
+			const struct input *prev = &inputs[i - 1];
+			int64_t gop = prev->count > 1 ? entry_time(prev, prev->count - 1) - entry_time(prev, prev->count - 2) : 0;
+
+			inputs[i].base = entry_time(prev, prev->count - 1) + gop - inputs[i].entries[0].timestamp;
+			inputs[i].wall = prev->wall;
+		}
+	}
+	if (parse_time(start_arg, &inputs[0], &start_t) < 0 ||
+		(end_arg ? parse_time(end_arg, &inputs[0], &end_t) < 0 : (end_t = start_t + (int64_t)(seconds * 1000000), 0)))
+		return EXIT_FAILURE;
+	if (end_t <= start_t) {
+		fprintf(stderr, "%s: the end is not after the start\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (out_path && (out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		perror(out_path);
+		return EXIT_FAILURE;
+	}
+	/* copy_file_range wants a regular file to write to, sendfile takes anything */
+	method = fstat(out, &st) == 0 && S_ISREG(st.st_mode) ? COPY_RANGE : SEND_FILE;
+
+	started = now_us();
+	for (i = 0; i < n; i++) {
+		struct input *in = &inputs[i];
+		int64_t next_t = i + 1 < n ? entry_time(&inputs[i + 1], 0) : INT64_MAX;
+		size_t first, last;
+		uint64_t from, to;
+		size_t size;
+
+		if (start_t >= next_t || end_t <= entry_time(in, 0)) {
+			skipped += in->size;
+			continue;
+		}
+		first = nal_index_find(in->entries, in->count, start_t - in->base);
+		last = nal_index_find(in->entries, in->count, end_t - in->base);
+		if (entry_time(in, last) < end_t)
+			last++;
+		from = in->entries[first].offset;
+		to = last < in->count ? in->entries[last].offset : in->size;
+		if (to <= from)
+			continue;
+
+		if ((size = parameter_sets(in, from, params)) > 0 && write_all(out, params, size) < 0) {
+			perror(out_path ? out_path : "stdout");
+			return EXIT_FAILURE;
+		}
+		if (copy_range(in->fd, from, to - from, out) < 0) {
+			fprintf(stderr, "%s: copying %llu bytes at %llu: %s\n", in->path, (unsigned long long)(to - from),
+				(unsigned long long)from, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		copied += size + (to - from);
+		skipped += in->size - (to - from);
+		ranges++;
+		fprintf(stderr, "%s: from frame %u, %.3f s from %.3f s, bytes %llu to %llu\n", in->path, in->entries[first].frame,
+			((last < in->count ? entry_time(in, last) : end_t < next_t ? end_t : next_t) - entry_time(in, first)) / 1000000.0,
+			(entry_time(in, first) - entry_time(&inputs[0], 0)) / 1000000.0,
+			(unsigned long long)from, (unsigned long long)to);
+	}
+	if (out != STDOUT_FILENO && close(out) < 0) {
+		perror(out_path);
+		return EXIT_FAILURE;
+	}
+	if (!ranges) {
+		fprintf(stderr, "%s: nothing in that range\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "%llu bytes in %d ranges by %s in %.3f s, %llu bytes not read\n", (unsigned long long)copied, ranges,
+		method_name[method], (now_us() - started) / 1000000.0, (unsigned long long)skipped);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+/*
+ * h264-index: IDR seek index of recorded H.264
+ *
+ *   h264-index [-r FPS] [-o INDEX] FILE...
+ *   h264-index -d INDEX
+ *
+ * Scans each Annex B FILE (what capture-encode writes to stdout, or --tst_enc,
+ * or a --segments segment) and writes the sidecar index capture-encode's
+ * --idr_index writes inline, to INDEX or FILE.idx: an entry per IDR access
+ * unit with its byte offset, size and frame number. A file has no capture
+ * times in it, so timestamps are those of frames at FPS [30] from 0. The scan
+ * reads with plain read()s into one buffer and never parses inside a NAL
+ * unit; it reports the rate it got, which on a Pi is the card's. h264-clip
+ * builds the same index itself when a file has none.
+ *
+ * -d prints an index as text: entry, offset, size, frame and timestamp.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nal.h"
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+static int dump(const char *path)
+{
+	struct nal_index_header header;
+	struct nal_index_entry *entries;
+	size_t count, i;
+
+	if ((entries = nal_index_load(path, &header, &count)) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, errno == EINVAL ? "not an IDR index" : strerror(errno));
+		return -1;
+	}
+	printf("# %s: %zu entries, %s timestamps\n# entry offset size frame timestamp_us\n", path, count,
+		header.flags & NAL_INDEX_FRAME_TIMES ? "frame" : "capture");
+	for (i = 0; i < count; i++)
+		printf("%zu %llu %u %u %lld\n", i, (unsigned long long)entries[i].offset, entries[i].size, entries[i].frame,
+			(long long)entries[i].timestamp);
+	free(entries);
+	return 0;
+}
+
+static int index_file(const char *path, const char *index_path, double fps)
+{
+	char name[4096];
+	int64_t start = now_us(), took, total;
+
+	if (!index_path) {
+		snprintf(name, sizeof(name), "%s.idx", path);
+		index_path = name;
+	}
+	if ((total = nal_index_file(path, index_path, fps, stdout)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	took = now_us() - start;
+	printf("%s: %.1f MB in %.3f s, %.1f MB/s\n", path, total / 1048576.0, took / 1000000.0,
+		took > 0 ? total / 1.048576 / took : 0.0);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *index_path = NULL;
+	double fps = 30;
+	int c, i, failed = 0;
+
+	while ((c = getopt(argc, argv, "r:o:d:")) != -1)
+		switch (c) {
+		case 'r':
+			fps = atof(optarg);
+			break;
+		case 'o':
+			index_path = optarg;
+			break;
+		case 'd':
+			return dump(optarg) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "usage: %s [-r FPS] [-o INDEX] FILE... | -d INDEX\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	if (optind == argc || fps <= 0 || (index_path && argc - optind > 1)) {
+		fprintf(stderr, "usage: %s [-r FPS] [-o INDEX] FILE... | -d INDEX (-o with one FILE)\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	for (i = optind; i < argc; i++)
+		if (index_file(argv[i], index_path, fps) < 0)
+			failed = 1;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,550 @@
+/*
+ * HLS and low-latency HLS output
+ *
+ * With hls_dir set, camera 0's H.264 stream is also published as HLS for any
+ * static web server to hand out, hls_dir typically being on a tmpfs:
+ *
+ *   index.m3u8   the playlist, the newest hls_list segments
+ *   init.mp4     the fMP4 init segment
+ *   NNNNNNNN.m4s the segments, cut at the first keyframe hls_sec into one
+ *
+ * The target duration is set once, hls_target or hls_sec + 1 s, since players
+ * reject a playlist whose EXT-X-TARGETDURATION changes. So that a GOP longer
+ * than hls_sec does not take a segment past it, the encoder backends ask
+ * hls_keyframe_due() once a frame and have the encoder make the frame an IDR
+ * when it says so, hls_sec after the last keyframe. Only when the keyframe
+ * does not come in time is the segment cut short at a frame that is not a
+ * keyframe; from then on the playlist no longer claims independent segments.
+ *
+ * With hls_part_ms, segments are written as LL-HLS partial segments of that
+ * length at most, each a moof/mdat of its own appended to the segment file as
+ * soon as it is complete and listed in the playlist as a byte range of it.
+ * Parts are listed for the segment in progress and the two before it.
+ *
+ * The playlist is written to a temporary file and renamed over index.m3u8, so
+ * a reader never sees half of one. The time from capture of the first frame of
+ * each newly listed part (segment without parts) to the rename is the latency
+ * that is reported, into the stats latency histograms too with latency on.
+ * Segments that have left the playlist are deleted HLS_SPARE segments later,
+ * so players still fetching one find it.
+ *
+ * Muxing is mp4.c's, from access unit references straight into writev, and
+ * happens on a writer thread of its own; a writer more than HLS_QUEUE_KB
+ * behind drops what is queued and resumes at the next keyframe. Nothing grows
+ * with the length of the stream: one part (segment) of references, and a fixed
+ * ring of segment records.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "hls.h"
+#include "mp4.h"
+#include "stats.h"
+#include "rt.h"
+
+#define HLS_QUEUE         1024
+#define HLS_QUEUE_KB      8192
+#define HLS_SEGMENTS      64            /* segment records, those listed and the one in progress */
+#define HLS_PARTS         64            /* parts to a segment; later ones are merged into the last */
+#define HLS_SPARE         2             /* segments kept after they leave the playlist */
+#define HLS_PATH          512
+
+char *hls_dir;
+int   hls_sec = 2, hls_part_ms, hls_list = 6, hls_target;
+
+struct hls_part {
+	double          duration;
+	size_t          offset, size;
+	int             independent;
+};
+
+struct hls_segment {
+	double          duration;
+	int             parts;
+	struct hls_part part[HLS_PARTS];
+};
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   cond = PTHREAD_COND_INITIALIZER;
+static pthread_t        thread;
+static int              running;
+
+/* under lock */
+static struct au       *queue[HLS_QUEUE];
+static unsigned int     head, tail;
+static size_t           queued_bytes;
+static int              closing, waiting = 1;
+static int64_t          key_ts;         /* the last keyframe queued */
+static int              key_asked;      /* the next one asked for by hls_keyframe_due() */
+static unsigned long    keys_asked;
+static unsigned long    drops, dropped_units;
+
+/* writer thread only */
+static struct mp4_mux  *mux;
+static struct hls_segment segments[HLS_SEGMENTS];
+static unsigned long    first, next;    /* listed segments, next being in progress with in_segment */
+static int              seg_fd = -1, in_segment, started, init_written, target;
+static size_t           seg_offset;
+static int64_t          seg_start_ts, part_start_ts, last_ts;
+static int              part_independent;
+static unsigned long    parts, playlists, errors, deleted, forced_cuts;
+static uint64_t         total_bytes;
+static int64_t          latency_sum, latency_max, newest_sum, write_max;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+void hls_unit(struct au *au)
+{
+	unsigned int dropped;
+
+	pthread_mutex_lock(&lock);
+	if (!running || closing) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* an empty queue takes any unit, however large */
+	if (head != tail && (tail - head >= HLS_QUEUE || queued_bytes + au->size > (size_t)HLS_QUEUE_KB << 10)) {
+		for (dropped = 0; tail != head; dropped++)
+			au_unref(queue[--tail % HLS_QUEUE]);
+		queued_bytes = 0;
+		drops++;
+		dropped_units += dropped;
+		waiting = 1;
+		stats_event("hls: writer %u units behind, dropped, resuming at the next keyframe", dropped);
+	}
+	if (au->flags & AU_KEYFRAME) {
+		waiting = 0;
+		key_ts = au->timestamp;
+		key_asked = 0;
+	}
+	if (waiting && !(au->flags & AU_CONFIG)) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	queue[tail++ % HLS_QUEUE] = au_ref(au);
+	queued_bytes += au->size;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* returns 0 or -1 with errno set */
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void segment_path(char *path, unsigned long number)
+{
+	snprintf(path, HLS_PATH, "%s/%08lu.m4s", hls_dir, number);
+}
+
+static void delete_segment(unsigned long number)
+{
+	char path[HLS_PATH];
+
+	segment_path(path, number);
+	if (unlink(path) < 0 && errno != ENOENT)
+		stats_event("hls: cannot delete %s: %d, %s", path, errno, strerror(errno));
+	else
+		deleted++;
+}
+
+/* write a file of hls_dir under a temporary name and rename it into place */
+static int replace_file(const char *base, const void *data, size_t size)
+{
+	char path[HLS_PATH], temp[HLS_PATH];
+	struct iovec iov = { (void *)data, size };
+	int fd, err = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", hls_dir, base);
+	snprintf(temp, sizeof(temp), "%s/.%s.tmp", hls_dir, base);
+	if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 || write_all(fd, &iov, 1) < 0)
+		err = errno;
+	if (fd >= 0 && close(fd) < 0 && !err)
+		err = errno;
+	if (!err && rename(temp, path) < 0)
+		err = errno;
+	if (err) {
+		stats_event("hls: cannot write %s: %d, %s", path, err, strerror(err));
+		errors++;
+		unlink(temp);
+		return -1;
+	}
+	return 0;
+}
+
+/* the playlist, listing what is written so far; chunk_ts is the capture time of the first frame it adds */
+static void write_playlist(int64_t chunk_ts, int end)
+{
+	static char text[HLS_SEGMENTS * 64 + 3 * HLS_PARTS * 112 + 512];
+	struct hls_segment *s;
+	unsigned long n;
+	size_t size = 0;
+	int64_t now, latency;
+	int i;
+
+#define ADD(...) (size += snprintf(text + size, size < sizeof(text) ? sizeof(text) - size : 0, __VA_ARGS__))
+	ADD("#EXTM3U\n#EXT-X-VERSION:%d\n#EXT-X-TARGETDURATION:%d\n", hls_part_ms ? 9 : 7, target);
+	if (hls_part_ms)
+		ADD("#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n#EXT-X-PART-INF:PART-TARGET=%.3f\n",
+			3 * hls_part_ms / 1000.0, hls_part_ms / 1000.0);
+	ADD("#EXT-X-MEDIA-SEQUENCE:%lu\n%s#EXT-X-MAP:URI=\"init.mp4\"\n", first,
+		forced_cuts ? "" : "#EXT-X-INDEPENDENT-SEGMENTS\n");
+	for (n = first; n < next || (n == next && in_segment); n++) {
+		s = &segments[n % HLS_SEGMENTS];
+		if (hls_part_ms && n + 2 >= next)
+			for (i = 0; i < s->parts; i++)
+				ADD("#EXT-X-PART:DURATION=%.5f,URI=\"%08lu.m4s\",BYTERANGE=\"%zu@%zu\"%s\n", s->part[i].duration, n,
+					s->part[i].size, s->part[i].offset, s->part[i].independent ? ",INDEPENDENT=YES" : "");
+		if (n < next)
+			ADD("#EXTINF:%.5f,\n%08lu.m4s\n", s->duration, n);
+	}
+	if (end)
+		ADD("#EXT-X-ENDLIST\n");
+#undef ADD
+	if (size >= sizeof(text)) {
+		stats_event("hls: playlist over %zu bytes, not written", sizeof(text));
+		errors++;
+		return;
+	}
+	if (replace_file("index.m3u8", text, size) < 0)
+		return;
+
+	playlists++;
+	now = now_us();
+	latency = now - chunk_ts;
+	latency_sum += latency;
+	newest_sum += now - last_ts;
+	if (latency > latency_max)
+		latency_max = latency;
+	stats_latency(STATS_LATENCY_PLAYLIST, latency);
+}
+
+/* the samples added since the last fragment into the segment file; the bytes written */
+static size_t write_fragment(void)
+{
+	struct iovec *iov;
+	size_t size;
+	int64_t start = now_us(), took;
+	int n;
+
+	if ((n = mp4_mux_fragment(mux, seg_offset == 0, &iov, &size)) == 0)
+		return 0;
+	if (seg_fd >= 0 && write_all(seg_fd, iov, n) < 0) {
+		stats_event("hls: segment %08lu: write error %d, %s", next, errno, strerror(errno));
+		errors++;
+		close(seg_fd);
+		seg_fd = -1;
+	}
+	mp4_mux_clear(mux);
+	seg_offset += size;
+	total_bytes += size;
+	if ((took = now_us() - start) > write_max)
+		write_max = took;
+	return size;
+}
+
+/* write out the part in progress, which ends at end_ts */
+static void end_part(int64_t end_ts)
+{
+	struct hls_segment *s = &segments[next % HLS_SEGMENTS];
+	size_t offset = seg_offset, size;
+	double duration = (end_ts - part_start_ts) / 1000000.0;
+
+	if ((size = write_fragment()) == 0 || !hls_part_ms)
+		return;
+	if (s->parts == HLS_PARTS) {
+		s->part[HLS_PARTS - 1].duration += duration;
+		s->part[HLS_PARTS - 1].size += size;
+	}
+	else {
+		s->part[s->parts].duration = duration;
+		s->part[s->parts].offset = offset;
+		s->part[s->parts].size = size;
+		s->part[s->parts].independent = part_independent;
+		s->parts++;
+	}
+	parts++;
+}
+
+static void start_segment(int64_t timestamp)
+{
+	char path[HLS_PATH];
+
+	segment_path(path, next);
+	if ((seg_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		stats_event("hls: cannot open %s: %d, %s", path, errno, strerror(errno));
+		errors++;
+	}
+	segments[next % HLS_SEGMENTS].parts = 0;
+	seg_offset = 0;
+	seg_start_ts = timestamp;
+	in_segment = 1;
+}
+
+static void end_segment(int64_t end_ts)
+{
+	double duration = (end_ts - seg_start_ts) / 1000000.0;
+
+	if (seg_fd >= 0)
+		close(seg_fd);
+	seg_fd = -1;
+	in_segment = 0;
+	segments[next % HLS_SEGMENTS].duration = duration;
+	next++;
+	while (next - first > (unsigned long)hls_list) {
+		if (first >= HLS_SPARE)
+			delete_segment(first - HLS_SPARE);
+		first++;
+	}
+}
+
+static void write_unit(struct au *au)
+{
+	size_t size;
+	const unsigned char *init;
+
+	if (au->flags & AU_CONFIG) {
+		/* players keep the init segment they fetched, so it is written once */
+		if (init_written)
+			return;
+		if (mp4_mux_config(mux, au) < 0) {
+			stats_event("hls: no SPS and PPS in the codec config, only H.264 goes into HLS");
+			return;
+		}
+		if ((init = mp4_mux_init(mux, &size)) != NULL && replace_file("init.mp4", init, size) == 0)
+			init_written = 1;
+		return;
+	}
+	if (!init_written)
+		return;
+	if (!started) {
+		if (!(au->flags & AU_KEYFRAME))
+			return;
+		started = 1;
+	}
+
+	if (mp4_mux_samples(mux)) {
+		/* at a keyframe within half a frame of hls_sec, so capture jitter does not push the cut a GOP on;
+		 * short of one, before the next frame would take the segment past the target duration */
+		int keyframe_cut = (au->flags & AU_KEYFRAME) &&
+			2 * (au->timestamp - seg_start_ts) + au->timestamp - last_ts >= hls_sec * (int64_t)2000000;
+		int forced_cut = !keyframe_cut && 2 * au->timestamp - last_ts - seg_start_ts > target * (int64_t)1000000;
+
+		if (keyframe_cut || forced_cut) {
+			int64_t chunk_ts = hls_part_ms ? part_start_ts : seg_start_ts;
+
+			if (forced_cut && !forced_cuts++)
+				stats_event("hls: GOP longer than the %d s target duration, segment %08lu cut at a non-keyframe", target,
+					next);
+			end_part(au->timestamp);
+			end_segment(au->timestamp);
+			write_playlist(chunk_ts, 0);
+		}
+		/* a part ends before it would go past the part target */
+		else if (hls_part_ms && 2 * au->timestamp - last_ts - part_start_ts > hls_part_ms * (int64_t)1000) {
+			int64_t chunk_ts = part_start_ts;
+
+			end_part(au->timestamp);
+			write_playlist(chunk_ts, 0);
+		}
+		else if (!mp4_mux_room(mux, au)) {
+			int64_t chunk_ts = part_start_ts;
+
+			end_part(au->timestamp);
+			if (hls_part_ms)
+				write_playlist(chunk_ts, 0);
+		}
+	}
+	if (!mp4_mux_samples(mux)) {
+		if (!in_segment)
+			start_segment(au->timestamp);
+		part_start_ts = au->timestamp;
+		part_independent = (au->flags & AU_KEYFRAME) != 0;
+	}
+	mp4_mux_add(mux, au);
+	last_ts = au->timestamp;
+}
+
+static void *hls_thread(void *arg)
+{
+	struct au *au;
+
+	rt_setup_thread(RT_THREAD_OUTPUT);
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (head == tail && !closing)
+			pthread_cond_wait(&cond, &lock);
+		if (head == tail)
+			break;
+		au = queue[head++ % HLS_QUEUE];
+		queued_bytes -= au->size;
+		pthread_mutex_unlock(&lock);
+
+		write_unit(au);
+		au_unref(au);
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* the stream ends with the segment in progress */
+	if (mp4_mux_samples(mux)) {
+		int64_t chunk_ts = hls_part_ms ? part_start_ts : seg_start_ts, end_ts;
+
+		end_ts = part_start_ts + mp4_mux_duration_us(mux);
+		end_part(end_ts);
+		end_segment(end_ts);
+		write_playlist(chunk_ts, 1);
+	}
+	return NULL;
+}
+
+/* segments of an earlier run would otherwise never be deleted */
+static void delete_stale(void)
+{
+	DIR *dir;
+	struct dirent *d;
+	char path[HLS_PATH];
+	size_t length;
+
+	if ((dir = opendir(hls_dir)) == NULL)
+		return;
+	while ((d = readdir(dir)) != NULL) {
+		length = strlen(d->d_name);
+		if (length == 12 && strspn(d->d_name, "0123456789") == 8 && !strcmp(d->d_name + 8, ".m4s")) {
+			snprintf(path, sizeof(path), "%s/%s", hls_dir, d->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dir);
+}
+
+/*
+ * From the capture loop, once for each frame that is encoded: whether the
+ * frame captured at timestamp should be an IDR, once hls_sec (less half a
+ * frame, as write_unit() cuts) has gone by since the last keyframe. It is
+ * asked for once; a keyframe that still does not come leaves the cut to
+ * write_unit() at the target duration.
+ */
+int hls_keyframe_due(int64_t timestamp)
+{
+	static int64_t previous;
+	int due;
+
+	if (!hls_dir)
+		return 0;
+	pthread_mutex_lock(&lock);
+	due = running && key_ts && !key_asked && previous &&
+		2 * (timestamp - key_ts) + timestamp - previous >= hls_sec * (int64_t)2000000;
+	if (due) {
+		key_asked = 1;
+		keys_asked++;
+	}
+	pthread_mutex_unlock(&lock);
+	previous = timestamp;
+	return due;
+}
+
+void hls_open(void)
+{
+	if (!hls_dir)
+		return;
+
+	if (access(hls_dir, W_OK) < 0) {
+		fprintf(stderr, "Cannot write to '%s': %d, %s\n", hls_dir, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (hls_list < 1 || hls_list > HLS_SEGMENTS - 1)
+		hls_list = hls_list < 1 ? 1 : HLS_SEGMENTS - 1;
+	target = hls_target > 0 ? hls_target : hls_sec + 1;
+	if (target < hls_sec) {
+		fprintf(stderr, "--hls_target %d is under --hls_sec %d, raised to it\n", target, hls_sec);
+		target = hls_sec;
+	}
+	delete_stale();
+
+	if ((mux = mp4_mux_new()) == NULL || (errno = pthread_create(&thread, NULL, hls_thread, NULL)) != 0) {
+		fprintf(stderr, "Cannot start the HLS writer: %d, %s\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	running = 1;
+}
+
+/* write out what is queued, end the playlist */
+void hls_close(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	closing = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	pthread_mutex_unlock(&lock);
+
+	mp4_mux_free(mux);
+	mux = NULL;
+}
+
+void hls_report(FILE *out)
+{
+	size_t queued;
+	unsigned long asked;
+
+	if (!hls_dir)
+		return;
+
+	pthread_mutex_lock(&lock);
+	queued = queued_bytes;
+	asked = keys_asked;
+	pthread_mutex_unlock(&lock);
+	fprintf(out, "hls %s: %lu segments (%lu keyframes asked for, %lu cut short of one), %lu parts, %llu KB, %lu deleted, %lu errors; capture to playlist "
+		"%.1f ms avg (newest frame %.1f ms) %.1f ms max over %lu playlists, write %.1f ms max; "
+		"%zu KB queued, %lu drops (%lu units)\n",
+		hls_dir, next, asked, forced_cuts, parts, (unsigned long long)(total_bytes >> 10), deleted, errors,
+		playlists ? latency_sum / 1000.0 / playlists : 0.0, playlists ? newest_sum / 1000.0 / playlists : 0.0,
+		latency_max / 1000.0, playlists, write_max / 1000.0, queued >> 10, drops, dropped_units);
+}
@@ -0,0 +1,22 @@
+/*
+ * HLS and low-latency HLS output
+ */
+
+#ifndef HLS_H
+#define HLS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "au.h"
+
+extern char *hls_dir;
+extern int   hls_sec, hls_part_ms, hls_list, hls_target;
+
+void hls_open(void);
+void hls_unit(struct au *au);
+int hls_keyframe_due(int64_t timestamp);
+void hls_close(void);
+void hls_report(FILE *out);
+
+#endif /* HLS_H */
@@ -0,0 +1,170 @@
+/*
+ * jpeg-bench: cost of decoding one MJPEG frame at each scale
+ *
+ *   jpeg-bench [-n FRAMES] [-s WIDTHxHEIGHT] [-q QUALITY] [-4] [FILE]
+ *
+ * FILE is a frame as the camera sends it after mjpeg2jpeg_filter(), e.g. the
+ * one capture-encode -o -c 1 writes; without one a 4:2:2 frame (4:2:0 with
+ * -4) of the given size is made up, textured so entropy decoding costs what
+ * it does on a real scene. The frame is decoded FRAMES times in full and at
+ * 1/2, 1/4 and 1/8 with the IDCT scaled down (at 1/8 it only takes the DC
+ * coefficient); for each it reports wall and CPU time per frame, the size of
+ * the planes and the cost relative to the full decode. Huffman decoding of
+ * every coefficient is the part no scale saves, so the noisier the scene,
+ * the less a smaller decode gains.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jpeglib.h>
+
+#include "decode.h"
+
+static int64_t now_us(clockid_t clock)
+{
+	struct timespec now;
+
+	clock_gettime(clock, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+static unsigned char *read_file(const char *path, unsigned long *size)
+{
+	unsigned char *data = NULL;
+	size_t length = 0, n;
+	FILE *f;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	do {
+		if ((data = realloc(data, length + 65536)) == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		n = fread(data + length, 1, 65536, f);
+		length += n;
+	}
+	while (n > 0);
+	fclose(f);
+	*size = length;
+	return data;
+}
+
+/* a gradient with noise and edges on it, chroma at 4:2:2 or 4:2:0 as cameras send it */
+static unsigned char *make_frame(unsigned int width, unsigned int height, int quality, int v_samp, unsigned long *size)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr err;
+	unsigned char *out = NULL, *row;
+	unsigned int x, seed = 1;
+
+	cinfo.err = jpeg_std_error(&err);
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &out, size);
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	cinfo.comp_info[0].h_samp_factor = 2;
+	cinfo.comp_info[0].v_samp_factor = v_samp;
+	jpeg_start_compress(&cinfo, TRUE);
+
+	row = malloc(width * 3);
+	while (cinfo.next_scanline < height) {
+		unsigned int y = cinfo.next_scanline;
+
+		for (x = 0; x < width; x++) {
+			seed = seed * 1103515245 + 12345;
+			row[x * 3] = (x * 160 / width + y * 64 / height + ((x / 40 + y / 40) & 1) * 24 + (seed >> 16) % 24) & 255;
+			row[x * 3 + 1] = 128 + (int)(x * 64 / width) - 32;
+			row[x * 3 + 2] = 128 + (int)(y * 64 / height) - 32;
+		}
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(row);
+	return out;
+}
+
+int main(int argc, char **argv)
+{
+	static const int scales[] = { 1, 2, 4, 8 };
+	struct scaled_decoder *s;
+	struct decode_planes planes;
+	unsigned int width = 1280, height = 720;
+	unsigned char *jpeg;
+	unsigned long size;
+	int c, frames = 200, quality = 80, v_samp = 1, i, n;
+	double full_us = 0;
+
+	while ((c = getopt(argc, argv, "n:s:q:4")) != -1)
+		switch (c) {
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%ux%u", &width, &height) != 2)
+				width = 0;
+			break;
+		case 'q':
+			quality = atoi(optarg);
+			break;
+		case '4':
+			v_samp = 2;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n FRAMES] [-s WIDTHxHEIGHT] [-q QUALITY] [-4 for 4:2:0] [FILE]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	if (frames < 1 || width < 16 || height < 16 || quality < 1 || quality > 100) {
+		fprintf(stderr, "frames above 0, at least 16x16, quality 1..100\n");
+		return EXIT_FAILURE;
+	}
+
+	if (optind < argc)
+		jpeg = read_file(argv[optind], &size);
+	else
+		jpeg = make_frame(width, height, quality, v_samp, &size);
+
+	if ((s = scaled_decoder_new()) == NULL || scaled_decode(s, jpeg, size, 1, &planes) < 0) {
+		fprintf(stderr, "cannot decode the frame (4:2:0, 4:2:2 or grey baseline JPEG only)\n");
+		return EXIT_FAILURE;
+	}
+	printf("%ux%u frame, %lu bytes, %d decodes per scale\n", planes.width, planes.height, size, frames);
+
+	for (i = 0; i < (int)(sizeof(scales) / sizeof(scales[0])); i++) {
+		int64_t start, cpu;
+		double wall_us, cpu_us;
+
+		/* once to size the buffers, outside the timing */
+		scaled_decode(s, jpeg, size, scales[i], &planes);
+		start = now_us(CLOCK_MONOTONIC);
+		cpu = now_us(CLOCK_PROCESS_CPUTIME_ID);
+		for (n = 0; n < frames; n++)
+			scaled_decode(s, jpeg, size, scales[i], &planes);
+		wall_us = (double)(now_us(CLOCK_MONOTONIC) - start) / frames;
+		cpu_us = (double)(now_us(CLOCK_PROCESS_CPUTIME_ID) - cpu) / frames;
+		if (scales[i] == 1)
+			full_us = cpu_us;
+
+		printf("%-8s %5ux%-5u %8.3f ms/frame %8.3f ms cpu/frame %7.1f fps per core %6.1f%% of full\n",
+			scales[i] == 1 ? "full" : scales[i] == 2 ? "1/2" : scales[i] == 4 ? "1/4" : "1/8 (DC)",
+			planes.width, planes.height, wall_us / 1000, cpu_us / 1000,
+			cpu_us > 0 ? 1000000 / cpu_us : 0.0, full_us > 0 ? 100 * cpu_us / full_us : 0.0);
+	}
+
+	scaled_decoder_free(s);
+	free(jpeg);
+	return EXIT_SUCCESS;
+}
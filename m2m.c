@@ -0,0 +1,946 @@
+/*
+ * V4L2 memory-to-memory encoder backend
+ *
+ * Raw capture frames go into the encoder's OUTPUT queue and encoded frames
+ * come back on its CAPTURE queue, which the output stage writes and hands
+ * back. When the camera can export its buffers (VIDIOC_EXPBUF) and the
+ * encoder imports them, the OUTPUT queue is DMABUF and a frame is never
+ * copied: the capture buffer itself stays with the encoder until it is
+ * done with it. Otherwise frames are copied into MMAP OUTPUT buffers.
+ * Single- and multi-planar encoders both work, e.g.
+ *
+ *   capture-encode -n --encoder m2m:/dev/video11 > out.h264     (Pi bcm2835-codec)
+ *   capture-encode -n -d /dev/video0 --encoder m2m:/dev/video3   (vivid into vicodec, FWHT)
+ *
+ * MJPEG capture with --decode_threads is decoded in software straight into
+ * the MMAP OUTPUT buffers as I420 (decode.c), so it never needs a copy either.
+ *
+ * The capture and encode loop runs on the calling thread; encoded frames are
+ * dequeued as soon as poll() reports them.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include "encoder.h"
+#include "output.h"
+#include "abr.h"
+#include "control.h"
+#include "gop.h"
+#include "sink.h"
+#include "server.h"
+#include "shmout.h"
+#include "stats.h"
+#include "decode.h"
+#include "motion.h"
+#include "preroll.h"
+#include "segment.h"
+#include "mp4.h"
+#include "hls.h"
+#include "nal.h"
+
+#define M2M_CODED_BUFFERS   8     /* encoded frames the output stage can hold */
+#define M2M_RAW_BUFFERS     32
+
+char *m2m_device = "/dev/video11";
+
+extern int psips, bitrate, codec, inflight, control_rate, idr_period;
+
+struct m2m_buffer {
+	int     index;
+	void   *start;
+	size_t  length;
+	int     fd;             /* DMABUF OUTPUT: the exported capture buffer */
+	int     busy;           /* MMAP OUTPUT: holds a frame the encoder or decoder has not returned */
+};
+
+static struct capture     *camera;
+static struct decoder     *decoder;
+static struct motion      *gate;        /* --motion */
+static int                 fd = -1, mplane, dmabuf, started, torndown;
+static enum v4l2_buf_type  out_type, cap_type;
+static struct v4l2_format  out_fmt, cap_fmt;
+static struct m2m_buffer   raw[M2M_RAW_BUFFERS], coded[M2M_CODED_BUFFERS];
+static unsigned int        n_raw, n_coded, queued, max_queued, queued_peak;
+static int                 framedivisor = 1;
+static unsigned int        skipcount, rate;
+static unsigned long       framenumber, outframenumber, dropped, skipped;
+static uint64_t            outbytes;
+static int64_t             firstcapture_us, lastout_us, latency_sum, latency_max;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+static void m2m_exit(const char *s)
+{
+	fprintf(stderr, "%s %s error %d, %s\n", m2m_device, s, errno, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+static int xioctl(int fh, unsigned long int request, void *arg)
+{
+	int r;
+
+	do
+		r = ioctl(fh, request, arg);
+	while (-1 == r && EINTR == errno);
+
+	return r;
+}
+
+static unsigned int fmt_pixelformat(const struct v4l2_format *f)
+{
+	return mplane ? f->fmt.pix_mp.pixelformat : f->fmt.pix.pixelformat;
+}
+
+static unsigned int fmt_bytesperline(const struct v4l2_format *f)
+{
+	return mplane ? f->fmt.pix_mp.plane_fmt[0].bytesperline : f->fmt.pix.bytesperline;
+}
+
+static unsigned int fmt_sizeimage(const struct v4l2_format *f)
+{
+	return mplane ? f->fmt.pix_mp.plane_fmt[0].sizeimage : f->fmt.pix.sizeimage;
+}
+
+/* buffer of queue type, with its one plane when the encoder is multi-planar */
+static void buffer_init(struct v4l2_buffer *buf, struct v4l2_plane *plane, enum v4l2_buf_type type, int memory, int index)
+{
+	memset(buf, 0, sizeof(*buf));
+	buf->type = type;
+	buf->memory = memory;
+	buf->index = index;
+	if (mplane) {
+		memset(plane, 0, sizeof(*plane));
+		buf->m.planes = plane;
+		buf->length = 1;
+	}
+}
+
+static int set_control(unsigned int id, int value)
+{
+	struct v4l2_control ctrl;
+
+	memset(&ctrl, 0, sizeof(ctrl));
+	ctrl.id = id;
+	ctrl.value = value;
+	return xioctl(fd, VIDIOC_S_CTRL, &ctrl);
+}
+
+static void setup_control(unsigned int id, int value, const char *name)
+{
+	if (-1 == set_control(id, value))
+		fprintf(stderr, "%s does not take %s %d: %d, %s\n", m2m_device, name, value, errno, strerror(errno));
+}
+
+static void queue_coded(int index)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+
+	buffer_init(&buf, &plane, cap_type, V4L2_MEMORY_MMAP, index);
+	if (mplane)
+		plane.length = coded[index].length;
+	else
+		buf.length = coded[index].length;
+	if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+		fprintf(stderr, "Error queueing encoded buffer %d: %d, %s\n", index, errno, strerror(errno));
+}
+
+/* called from the output thread once an encoded frame is written; a config split off one has no buffer */
+static void release_coded(void *piece)
+{
+	if (piece)
+		queue_coded(((struct m2m_buffer *)piece)->index);
+}
+
+/* bytes of SPS and PPS NAL units an H.264 buffer starts with, 0 if it starts with anything else */
+static size_t leading_config(const unsigned char *data, size_t size)
+{
+	const unsigned char *end = data + size, *p, *next;
+	size_t config = 0;
+
+	/* a start code right at the front, or the buffer is not looked into */
+	if ((p = nal_find_start(data, size > 5 ? data + 5 : end)) >= (size > 5 ? data + 5 : end))
+		return 0;
+	for (; p < end && ((*p & 0x1f) == 7 || (*p & 0x1f) == 8); p = next) {
+		next = nal_find_start(p, end);
+		config = (next < end ? next - 3 : end) - data;
+	}
+	/* the next start code keeps its leading zero; a NAL unit never ends in one */
+	while (config && config < size && !data[config - 1])
+		config--;
+	return config;
+}
+
+static void queue_raw(int index, unsigned int size, int64_t captured_us)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+
+	buffer_init(&buf, &plane, out_type, dmabuf ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP, index);
+	/* the encoder copies it to the encoded frame */
+	buf.timestamp.tv_sec = captured_us / 1000000;
+	buf.timestamp.tv_usec = captured_us % 1000000;
+	if (mplane) {
+		plane.bytesused = size;
+		plane.length = raw[index].length;
+		if (dmabuf)
+			plane.m.fd = raw[index].fd;
+	}
+	else {
+		buf.bytesused = size;
+		buf.length = raw[index].length;
+		if (dmabuf)
+			buf.m.fd = raw[index].fd;
+	}
+	if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+		m2m_exit("VIDIOC_QBUF");
+	if (++queued > queued_peak)
+		queued_peak = queued;
+}
+
+static void map_buffer(struct m2m_buffer *b, enum v4l2_buf_type type, int index)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+
+	buffer_init(&buf, &plane, type, V4L2_MEMORY_MMAP, index);
+	if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
+		m2m_exit("VIDIOC_QUERYBUF");
+
+	b->index = index;
+	b->fd = -1;
+	b->busy = 0;
+	b->length = mplane ? plane.length : buf.length;
+	b->start = mmap(NULL, b->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mplane ? plane.m.mem_offset : buf.m.offset);
+	if (MAP_FAILED == b->start)
+		m2m_exit("mmap");
+}
+
+/* the codec -e asks for if the encoder has it, else the encoder's first coded format */
+static unsigned int coded_format(void)
+{
+	static const unsigned int codecs[] = {
+		V4L2_PIX_FMT_MPEG2, V4L2_PIX_FMT_H263, V4L2_PIX_FMT_MPEG4, 0, 0,
+		V4L2_PIX_FMT_H264, V4L2_PIX_FMT_MJPEG, 0, 0, V4L2_PIX_FMT_VP8,
+	};
+	unsigned int want = codec >= 0 && codec < (int)(sizeof(codecs) / sizeof(codecs[0])) && codecs[codec] ? codecs[codec] : V4L2_PIX_FMT_H264;
+	unsigned int first = 0, i;
+	struct v4l2_fmtdesc desc;
+
+	for (i = 0; ; i++) {
+		memset(&desc, 0, sizeof(desc));
+		desc.index = i;
+		desc.type = cap_type;
+		if (-1 == xioctl(fd, VIDIOC_ENUM_FMT, &desc))
+			break;
+		if (desc.pixelformat == want)
+			return want;
+		if (!first)
+			first = desc.pixelformat;
+	}
+	if (first)
+		fprintf(stderr, "%s cannot encode %.4s, encoding %.4s\n", m2m_device, (char *)&want, (char *)&first);
+	return first;
+}
+
+/* MJPEG capture: I420 at the encoder's own stride, which the decoder writes into */
+static void m2m_open_decoded(struct capture *cap)
+{
+	struct v4l2_pix_format *pix = &cap->v4l2_fmt.fmt.pix;
+	unsigned int stride, slice_height;
+
+	if (mplane) {
+		out_fmt.fmt.pix_mp.width = pix->width;
+		out_fmt.fmt.pix_mp.height = pix->height;
+		out_fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+		out_fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+		out_fmt.fmt.pix_mp.num_planes = 1;
+	}
+	else {
+		out_fmt.fmt.pix.width = pix->width;
+		out_fmt.fmt.pix.height = pix->height;
+		out_fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUV420;
+		out_fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	}
+	if (-1 == xioctl(fd, VIDIOC_S_FMT, &out_fmt))
+		m2m_exit("VIDIOC_S_FMT raw");
+	if (fmt_pixelformat(&out_fmt) != V4L2_PIX_FMT_YUV420 ||
+		(mplane ? out_fmt.fmt.pix_mp.width : out_fmt.fmt.pix.width) != pix->width ||
+		(mplane ? out_fmt.fmt.pix_mp.height : out_fmt.fmt.pix.height) != pix->height) {
+		fprintf(stderr, "%s does not take YU12 %ux%u for the decoded MJPEG from %s\n", m2m_device,
+			pix->width, pix->height, cap->dev_name);
+		exit(EXIT_FAILURE);
+	}
+
+	/* some encoders pad the planes to a macroblock row multiple, which sizeimage gives away */
+	stride = fmt_bytesperline(&out_fmt);
+	slice_height = stride ? fmt_sizeimage(&out_fmt) * 2 / 3 / stride & ~1 : 0;
+	if (slice_height < pix->height)
+		slice_height = pix->height;
+	if ((decoder = decoder_new(decode_threads, pix->width, pix->height, stride, slice_height)) == NULL)
+		exit(EXIT_FAILURE);
+	if (decoder_frame_size(decoder) > fmt_sizeimage(&out_fmt)) {
+		fprintf(stderr, "%s: YU12 buffers of %u bytes are too small for %ux%u\n", m2m_device,
+			fmt_sizeimage(&out_fmt), pix->width, pix->height);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void m2m_open(struct capture *cap)
+{
+	struct v4l2_capability caps;
+	struct v4l2_pix_format *pix = &cap->v4l2_fmt.fmt.pix;
+	unsigned int device_caps, pixelformat;
+
+	if ((fd = open(m2m_device, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", m2m_device, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &caps))
+		m2m_exit("VIDIOC_QUERYCAP");
+	device_caps = caps.capabilities & V4L2_CAP_DEVICE_CAPS ? caps.device_caps : caps.capabilities;
+	if (!(device_caps & (V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE)) || !(device_caps & V4L2_CAP_STREAMING)) {
+		fprintf(stderr, "%s is no memory-to-memory streaming device\n", m2m_device);
+		exit(EXIT_FAILURE);
+	}
+	mplane = (device_caps & V4L2_CAP_VIDEO_M2M_MPLANE) != 0;
+	out_type = mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	cap_type = mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	/* coded format first, the raw formats an encoder takes can depend on it */
+	if (!(pixelformat = coded_format())) {
+		fprintf(stderr, "%s has no coded format\n", m2m_device);
+		exit(EXIT_FAILURE);
+	}
+	memset(&cap_fmt, 0, sizeof(cap_fmt));
+	cap_fmt.type = cap_type;
+	if (mplane) {
+		cap_fmt.fmt.pix_mp.width = pix->width;
+		cap_fmt.fmt.pix_mp.height = pix->height;
+		cap_fmt.fmt.pix_mp.pixelformat = pixelformat;
+		cap_fmt.fmt.pix_mp.num_planes = 1;
+	}
+	else {
+		cap_fmt.fmt.pix.width = pix->width;
+		cap_fmt.fmt.pix.height = pix->height;
+		cap_fmt.fmt.pix.pixelformat = pixelformat;
+	}
+	if (-1 == xioctl(fd, VIDIOC_S_FMT, &cap_fmt))
+		m2m_exit("VIDIOC_S_FMT coded");
+
+	memset(&out_fmt, 0, sizeof(out_fmt));
+	out_fmt.type = out_type;
+	if (cap->v4l2_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG) {
+		m2m_open_decoded(cap);
+		goto controls;
+	}
+
+	/* raw format: the camera's, as it is, since its buffers go in unchanged */
+	if (mplane) {
+		out_fmt.fmt.pix_mp.width = pix->width;
+		out_fmt.fmt.pix_mp.height = pix->height;
+		out_fmt.fmt.pix_mp.pixelformat = pix->pixelformat;
+		out_fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+		out_fmt.fmt.pix_mp.colorspace = pix->colorspace;
+		out_fmt.fmt.pix_mp.num_planes = 1;
+		out_fmt.fmt.pix_mp.plane_fmt[0].bytesperline = pix->bytesperline;
+		out_fmt.fmt.pix_mp.plane_fmt[0].sizeimage = pix->sizeimage;
+	}
+	else
+		out_fmt.fmt.pix = *pix;
+	if (-1 == xioctl(fd, VIDIOC_S_FMT, &out_fmt))
+		m2m_exit("VIDIOC_S_FMT raw");
+	if (fmt_pixelformat(&out_fmt) != pix->pixelformat || fmt_bytesperline(&out_fmt) != pix->bytesperline ||
+		(mplane ? out_fmt.fmt.pix_mp.width : out_fmt.fmt.pix.width) != pix->width ||
+		(mplane ? out_fmt.fmt.pix_mp.height : out_fmt.fmt.pix.height) != pix->height) {
+		fprintf(stderr, "%s does not take %.4s %ux%u (%u bytes per line) from %s\n", m2m_device,
+			(char *)&pix->pixelformat, pix->width, pix->height, pix->bytesperline, cap->dev_name);
+		exit(EXIT_FAILURE);
+	}
+
+controls:
+	/* the encoder's rate control works from the frame rate; not every encoder has it */
+	if ((rate = capture_frame_rate(cap)) != 0) {
+		struct v4l2_streamparm parm;
+
+		memset(&parm, 0, sizeof(parm));
+		parm.type = out_type;
+		parm.parm.output.timeperframe.numerator = 1;
+		parm.parm.output.timeperframe.denominator = rate;
+		xioctl(fd, VIDIOC_S_PARM, &parm);
+	}
+
+	/* control_rate holds OMX_Video_ControlRateVariable (1) or Constant (2) from --rate_control */
+	if (control_rate == 1 || control_rate == 2)
+		setup_control(V4L2_CID_MPEG_VIDEO_BITRATE_MODE,
+			control_rate == 2 ? V4L2_MPEG_VIDEO_BITRATE_MODE_CBR : V4L2_MPEG_VIDEO_BITRATE_MODE_VBR, "rate control");
+	if (bitrate)
+		setup_control(V4L2_CID_MPEG_VIDEO_BITRATE, bitrate, "bitrate");
+	if (idr_period >= 0)
+		setup_control(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, idr_period, "IDR period");
+	if (psips)
+		setup_control(V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, 1, "inline SPS/PPS");
+}
+
+/* the capture buffers themselves as the raw queue, if the camera exports them and the encoder takes them */
+static int share_capture_buffers(struct capture *cap)
+{
+	struct v4l2_requestbuffers req;
+
+	if (cap->n_buffers > M2M_RAW_BUFFERS)
+		return 0;
+
+	memset(&req, 0, sizeof(req));
+	req.count = cap->n_buffers;
+	req.type = out_type;
+	req.memory = V4L2_MEMORY_DMABUF;
+	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
+		return 0;
+
+	for (n_raw = 0; req.count >= cap->n_buffers && n_raw < cap->n_buffers; n_raw++) {
+		raw[n_raw].index = n_raw;
+		raw[n_raw].start = NULL;
+		raw[n_raw].busy = 0;
+		if ((raw[n_raw].fd = capture_export_buffer(cap, n_raw, &raw[n_raw].length)) < 0)
+			break;
+		if (raw[n_raw].length < fmt_sizeimage(&out_fmt)) {
+			close(raw[n_raw].fd);
+			break;
+		}
+	}
+	if (n_raw == cap->n_buffers)
+		return 1;
+
+	while (n_raw > 0)
+		close(raw[--n_raw].fd);
+	req.count = 0;
+	xioctl(fd, VIDIOC_REQBUFS, &req);
+	return 0;
+}
+
+static void m2m_buffers(struct capture *cap)
+{
+	struct v4l2_requestbuffers req;
+	unsigned int i;
+
+	memset(&req, 0, sizeof(req));
+	req.count = M2M_CODED_BUFFERS;
+	req.type = cap_type;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
+		m2m_exit("VIDIOC_REQBUFS coded");
+	n_coded = req.count < M2M_CODED_BUFFERS ? req.count : M2M_CODED_BUFFERS;
+	for (i = 0; i < n_coded; i++) {
+		map_buffer(&coded[i], cap_type, i);
+		queue_coded(i);
+	}
+
+	if (!decoder && (dmabuf = share_capture_buffers(cap)) != 0)
+		/* a capture buffer with the encoder is one the camera cannot fill */
+		max_queued = inflight < n_raw - 1 ? inflight : n_raw - 1;
+	else {
+		memset(&req, 0, sizeof(req));
+		req.count = inflight < M2M_RAW_BUFFERS ? inflight : M2M_RAW_BUFFERS;
+		req.type = out_type;
+		req.memory = V4L2_MEMORY_MMAP;
+		if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
+			m2m_exit("VIDIOC_REQBUFS raw");
+		n_raw = req.count < M2M_RAW_BUFFERS ? req.count : M2M_RAW_BUFFERS;
+		for (i = 0; i < n_raw; i++)
+			map_buffer(&raw[i], out_type, i);
+		max_queued = n_raw;
+	}
+	if (max_queued < 1)
+		max_queued = 1;
+
+	fprintf(stderr, "%s: %.4s %ux%u -> %.4s, %s raw buffers (%u in flight), %u encoded buffers%s\n", m2m_device,
+		(char *)&(unsigned int){ fmt_pixelformat(&out_fmt) }, cap->v4l2_fmt.fmt.pix.width, cap->v4l2_fmt.fmt.pix.height,
+		(char *)&(unsigned int){ fmt_pixelformat(&cap_fmt) },
+		dmabuf ? "shared DMABUF capture" : decoder ? "MJPEG decoded into MMAP" : "copied into MMAP",
+		max_queued, n_coded, mplane ? ", multi-planar" : "");
+}
+
+/* raw buffers the encoder is done with: back to the camera, or free for the next copy */
+static void reclaim_raw(void)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+
+	for (;;) {
+		buffer_init(&buf, &plane, out_type, dmabuf ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP, 0);
+		if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
+			if (EAGAIN == errno || EPIPE == errno)
+				return;
+			m2m_exit("VIDIOC_DQBUF raw");
+		}
+		queued--;
+		if (dmabuf)
+			release_frame_index(camera, buf.index);
+		else
+			raw[buf.index].busy = 0;
+	}
+}
+
+static void adapt_bitrate(void)
+{
+	int target, divisor;
+
+	if (!abr_update(now_us(), output_backlog(), output_written(), &target, &divisor))
+		return;
+	if (-1 == set_control(V4L2_CID_MPEG_VIDEO_BITRATE, target))
+		fprintf(stderr, "%s does not take bitrate %d: %d, %s\n", m2m_device, target, errno, strerror(errno));
+	framedivisor = divisor;
+}
+
+/* encoded frames to the output stage; returns 1 once the encoder has sent its last one */
+static int drain_coded(void)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+	int64_t captured, now;
+	unsigned int offset, size, config;
+	unsigned char *data;
+	int last = 0;
+
+	while (!last) {
+		buffer_init(&buf, &plane, cap_type, V4L2_MEMORY_MMAP, 0);
+		if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
+			if (EPIPE == errno)
+				last = 1;
+			else if (EAGAIN != errno)
+				m2m_exit("VIDIOC_DQBUF encoded");
+			break;
+		}
+		last = (buf.flags & V4L2_BUF_FLAG_LAST) != 0;
+		offset = mplane ? plane.data_offset : 0;
+		size = (mplane ? plane.bytesused : buf.bytesused) - offset;
+		if (size == 0) {
+			queue_coded(buf.index);
+			continue;
+		}
+
+		now = now_us();
+		captured = buf.timestamp.tv_sec * (int64_t)1000000 + buf.timestamp.tv_usec;
+		data = (unsigned char *)coded[buf.index].start + offset;
+		outbytes += size;
+		lastout_us = now;
+
+		/* SPS and PPS go out as a config piece of their own, as the OMX encoder's CODECCONFIG buffers do, so
+		 * the GOP cache, late joiners and the MP4 and HLS muxers get them; some encoders send them alone */
+		config = fmt_pixelformat(&cap_fmt) == V4L2_PIX_FMT_H264 ? leading_config(data, size) : 0;
+		if (config == size) {
+			output_piece(&coded[buf.index], data, size, captured, OUTPUT_CONFIG);
+			continue;
+		}
+		if (config)
+			output_piece(NULL, data, config, captured, OUTPUT_CONFIG);
+
+		latency_sum += now - captured;
+		if (now - captured > latency_max)
+			latency_max = now - captured;
+		outframenumber++;
+		output_piece(&coded[buf.index], data + config, size - config, captured,
+			OUTPUT_END | (buf.flags & V4L2_BUF_FLAG_KEYFRAME ? OUTPUT_KEYFRAME : 0));
+	}
+	output_flush();
+
+	if (abr)
+		adapt_bitrate();
+	return last;
+}
+
+static void feed_frame(void)
+{
+	void *data;
+	unsigned int size, i;
+	int index;
+	int64_t now;
+	struct timespec t;
+
+	if ((index = capture_frame_index(camera, &data, &size)) < 0)
+		return;
+
+	/* frame rate step-down (--abr_fps_step) */
+	if (framedivisor > 1 && skipcount++ % framedivisor) {
+		skipped++;
+		release_frame_index(camera, index);
+		return;
+	}
+	/* --motion: an idle frame is left out, the first one with motion starts a keyframe; with --preroll
+	 * every frame is encoded and motion triggers a recording instead */
+	if (gate && preroll_dir) {
+		motion_gate(gate, &camera->v4l2_fmt.fmt.pix, data, size);
+		if (motion_active(gate))
+			preroll_trigger();
+	}
+	else if (gate) {
+		enum motion_gate g = motion_gate(gate, &camera->v4l2_fmt.fmt.pix, data, size);
+
+		if (g == MOTION_SKIP) {
+			release_frame_index(camera, index);
+			return;
+		}
+		if (g == MOTION_IDR)
+			set_control(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1);
+	}
+	if (queued >= max_queued) {
+		dropped++;
+		release_frame_index(camera, index);
+		return;
+	}
+
+	now = now_us();
+	for (i = 0; !dmabuf && i < n_raw && raw[i].busy; i++)
+		;
+	/* the decoder holds raw buffers too */
+	if (decoder && (i == n_raw || decoder_submit(decoder, data, size, raw[i].start, now, index, &raw[i]) < 0)) {
+		dropped++;
+		release_frame_index(camera, index);
+		return;
+	}
+
+	if (framenumber++ == 0)
+		firstcapture_us = now;
+	/* a GOP longer than an HLS segment */
+	if (hls_keyframe_due(now))
+		set_control(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1);
+	if (dmabuf) {
+		queue_raw(index, size, now);
+		return;
+	}
+	if (decoder) {
+		raw[i].busy = 1;
+		return;
+	}
+
+	if (size > raw[i].length)
+		size = raw[i].length;
+	stats_timer_start(&t);
+	memcpy(raw[i].start, data, size);
+	stats_timer_stop(camera->stats, STATS_FILTER, &t);
+	release_frame_index(camera, index);
+	raw[i].busy = 1;
+	queue_raw(i, size, now);
+}
+
+/* decoded frames, in capture order, to the encoder */
+static void drain_decoded(void)
+{
+	struct decode_job job;
+
+	while (decoder_next(decoder, &job)) {
+		struct m2m_buffer *b = job.arg;
+
+		release_frame_index(camera, job.index);
+		if (job.status < 0) {
+			b->busy = 0;
+			dropped++;
+			continue;
+		}
+		queue_raw(b->index, decoder_frame_size(decoder), job.timestamp);
+	}
+}
+
+static double elapsed_ms(int64_t since_us)
+{
+	return (now_us() - since_us) / 1000.0;
+}
+
+static void m2m_report(FILE *out)
+{
+	double seconds = (lastout_us - firstcapture_us) / 1000000.0;
+
+	fprintf(out, "%s: %lu frames in, %lu out, %lu dropped (encoder busy), %lu skipped, %u of %u in flight at most, "
+		"%llu bytes, %.2f fps sustained, capture to encoded %.1f ms avg %.1f ms max\n", m2m_device,
+		framenumber, outframenumber, dropped, skipped, queued_peak, max_queued, (unsigned long long)outbytes,
+		outframenumber > 1 && seconds > 0 ? (outframenumber - 1) / seconds : 0.0,
+		outframenumber ? latency_sum / 1000.0 / outframenumber : 0.0, latency_max / 1000.0);
+}
+
+/* control socket commands, as for the OMX encoder where the V4L2 encoder has the control */
+static void m2m_command(int argc, char **argv, int64_t received_us, FILE *reply)
+{
+	if (!strcmp(argv[0], "idr") && argc == 1) {
+		if (-1 == set_control(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1))
+			fprintf(reply, "error %s: %s\n", m2m_device, strerror(errno));
+		else {
+			output_watch_keyframe(received_us);
+			fprintf(reply, "ok\n");
+		}
+	}
+
+	else if (!strcmp(argv[0], "bitrate") && argc == 2) {
+		char *end;
+		long target;
+		errno = 0;
+		target = strtol(argv[1], &end, 0);
+		if (errno || end == argv[1] || *end || target <= 0 || target > INT_MAX)
+			fprintf(reply, "error bitrate '%s' is not a positive number of bits per second\n", argv[1]);
+		else if (-1 == set_control(V4L2_CID_MPEG_VIDEO_BITRATE, target))
+			fprintf(reply, "error %s: %s\n", m2m_device, strerror(errno));
+		else {
+			// adaptive bitrate carries on from the new setting
+			if (abr)
+				abr_start(target);
+			stats_event("control: bitrate %ld applied %.1f ms after the command", target, elapsed_ms(received_us));
+			fprintf(reply, "ok %ld\n", target);
+		}
+	}
+
+	else if (!strcmp(argv[0], "record") && argc == 2) {
+		if (!strcmp(argv[1], "off")) {
+			sink_record_stop();
+			fprintf(reply, "ok\n");
+		}
+		else if (sink_record(argv[1], received_us) < 0)
+			fprintf(reply, "error %s: %s\n", argv[1], strerror(errno));
+		else {
+			// the recording starts from the GOP cache; without one, start it on a fresh keyframe
+			if (!gop_cached() && set_control(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1) == 0)
+				output_watch_keyframe(received_us);
+			fprintf(reply, "ok\n");
+		}
+	}
+
+	else if (!strcmp(argv[0], "trigger") && argc == 1) {
+		int started = preroll_trigger();
+		if (started < 0)
+			fprintf(reply, "error no --preroll\n");
+		else
+			fprintf(reply, "ok %s\n", started ? "extended" : "started");
+	}
+
+	else if (!strcmp(argv[0], "sink") && argc == 3 && (!strcmp(argv[1], "add") || !strcmp(argv[1], "remove"))) {
+		if ((argv[1][0] == 'a' ? sink_add(argv[2], received_us) : sink_remove(argv[2])) < 0)
+			fprintf(reply, "error %s: %s\n", argv[2], strerror(errno));
+		else
+			fprintf(reply, "ok\n");
+	}
+
+	else if (!strcmp(argv[0], "stats") && argc == 1) {
+		fprintf(reply, "ok\n");
+		m2m_report(reply);
+		if (decoder)
+			decoder_report(decoder, reply);
+		if (gate)
+			motion_report(gate, reply);
+		output_report(reply);
+		sink_report(reply);
+		server_report(reply);
+		shmout_report(reply);
+		preroll_report(reply);
+		segment_report(reply);
+		mp4_report(reply);
+		hls_report(reply);
+		abr_report(reply);
+		stats_report(reply);
+	}
+
+	else
+		fprintf(reply, "error usage: idr | bitrate BPS | record FILE | record off | trigger | sink add|remove SPEC | stats\n");
+}
+
+static void m2m_teardown(void)
+{
+	enum v4l2_buf_type type;
+	struct v4l2_requestbuffers req;
+	unsigned int i;
+
+	if (!started || torndown)
+		return;
+	torndown = 1;
+
+	control_close();
+
+	// write out what the encoder already produced before the stats are reported
+	output_close();
+	output_report(stderr);
+	sink_close_all(stderr);
+	server_report(stderr);
+	server_close();
+	shmout_report(stderr);
+	shmout_close();
+	preroll_report(stderr);
+	preroll_close();
+	segment_close();
+	segment_report(stderr);
+	mp4_close();
+	mp4_report(stderr);
+	hls_close();
+	hls_report(stderr);
+
+	type = out_type;
+	xioctl(fd, VIDIOC_STREAMOFF, &type);
+	type = cap_type;
+	xioctl(fd, VIDIOC_STREAMOFF, &type);
+
+	decoder_free(decoder, stderr);
+	decoder = NULL;
+	motion_free(gate, stderr);
+	gate = NULL;
+	stop_capturing(camera);
+
+	fprintf(stderr, "\r          \ninput frames: %lu\noutput frames: %lu\n\n", framenumber, outframenumber);
+	m2m_report(stderr);
+	abr_report(stderr);
+
+	memset(&req, 0, sizeof(req));
+	req.type = out_type;
+	req.memory = dmabuf ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+	for (i = 0; i < n_raw; i++)
+		if (dmabuf)
+			close(raw[i].fd);
+		else
+			munmap(raw[i].start, raw[i].length);
+	xioctl(fd, VIDIOC_REQBUFS, &req);
+	req.type = cap_type;
+	req.memory = V4L2_MEMORY_MMAP;
+	for (i = 0; i < n_coded; i++)
+		munmap(coded[i].start, coded[i].length);
+	xioctl(fd, VIDIOC_REQBUFS, &req);
+	close(fd);
+	fd = -1;
+
+	uninit_device(camera, 0);
+	close_device(camera);
+}
+
+static void intHandler(int dummy) { exit(0); }
+
+static int m2m_encode_loop(struct capture *cap, int frames)
+{
+	struct pollfd fds[3];
+	struct v4l2_encoder_cmd cmd;
+	enum v4l2_buf_type type;
+	unsigned int bufsize;
+	int64_t until;
+	int n;
+
+	camera = cap;
+	if (motion && (gate = motion_new(cap->dev_name)) == NULL)
+		m2m_exit("motion_new");
+	if (cap->adaptive) {
+		fprintf(stderr, "--adaptive_buffers does not go with --encoder m2m, off\n");
+		cap->adaptive = 0;
+	}
+
+	open_device(cap);
+	bufsize = init_device(cap);
+	fprintf(stderr, "capture buffer size: %d\n", bufsize);
+	init_buffers(cap, bufsize, NULL);
+
+	m2m_open(cap);
+	m2m_buffers(cap);
+
+	started = 1;
+	atexit(m2m_teardown);
+	signal(SIGINT, intHandler);
+
+	output_open(mp4_raw_fd(), release_coded, n_coded);
+	for (n = 0; n < sink_specs_count; n++)
+		if (sink_add(sink_specs[n], 0) < 0) {
+			fprintf(stderr, "Cannot open sink '%s': %d, %s\n", sink_specs[n], errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	server_open();
+	shmout_open();
+	preroll_open();
+	segment_open();
+	mp4_open();
+	hls_open();
+
+	if (abr) {
+		struct v4l2_control ctrl;
+
+		memset(&ctrl, 0, sizeof(ctrl));
+		ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+		if (-1 == xioctl(fd, VIDIOC_G_CTRL, &ctrl) || ctrl.value <= 0) {
+			fprintf(stderr, "adaptive bitrate needs the encoder's bitrate control, disabled\n");
+			abr = 0;
+		}
+		else
+			abr_start(ctrl.value);
+	}
+
+	type = cap_type;
+	if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+		m2m_exit("VIDIOC_STREAMON coded");
+	type = out_type;
+	if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+		m2m_exit("VIDIOC_STREAMON raw");
+	start_capturing(cap);
+
+	control_open(m2m_command);
+
+	fds[0].fd = cap->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = fd;
+	fds[1].events = POLLIN | POLLOUT;
+	fds[2].fd = decoder ? decoder_fd(decoder) : -1;
+	fds[2].events = POLLIN;
+	while (framenumber < frames) {
+		control_poll();
+
+		if ((n = poll(fds, 3, 5000)) < 0) {
+			if (EINTR == errno)
+				continue;
+			m2m_exit("poll");
+		}
+		if (n == 0) {
+			fprintf(stderr, "nothing captured or encoded for 5 s\n");
+			exit(EXIT_FAILURE);
+		}
+		/* POLLERR only while neither queue has a buffer queued, which the next frame ends */
+		if (fds[1].revents & POLLOUT)
+			reclaim_raw();
+		if (fds[1].revents & POLLIN)
+			drain_coded();
+		if (fds[2].revents & POLLIN)
+			drain_decoded();
+		if (fds[0].revents & POLLIN)
+			feed_frame();
+	}
+
+	// frames still being decoded go to the encoder before it is told to stop
+	while (decoder && decoder_pending(decoder) > 0) {
+		poll(fds + 2, 1, 100);
+		drain_decoded();
+	}
+
+	// let the encoder finish the frames still in flight, up to the last one with the drain command
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = V4L2_ENC_CMD_STOP;
+	n = xioctl(fd, VIDIOC_ENCODER_CMD, &cmd) == 0;
+	until = now_us() + 1000000;
+	while (now_us() < until) {
+		poll(fds + 1, 1, 100);
+		reclaim_raw();
+		if (drain_coded() || (!n && !queued && outframenumber >= framenumber))
+			break;
+	}
+
+	m2m_teardown();
+	return 0;
+}
+
+const struct encoder encoder_m2m = { "m2m", m2m_encode_loop, NULL };
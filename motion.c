@@ -0,0 +1,432 @@
+/*
+ * Motion-gated encoding
+ *
+ * With --motion every captured frame goes through motion_gate() before it is
+ * encoded. At most every MOTION_CHECK_US the frame's luma is reduced to a
+ * plane 1/MOTION_SCALE of its size (block averages for raw YUV, a 1/8 scaled
+ * decode for MJPEG) and compared with the previous plane, cell by cell, as
+ * the sum of absolute differences of each MOTION_CELL x MOTION_CELL cell.
+ * A cell changed when its mean difference is above --motion_threshold; a
+ * zone (--motion_zone, in percent of the frame, the whole frame by default)
+ * has motion when at least its share of cells changed.
+ *
+ * While any zone had motion within --motion_hold, every frame is encoded,
+ * the first one as a keyframe. Otherwise only --motion_idle frames per second
+ * are, each one a keyframe with --motion_idle_idr, so an idle camera sends
+ * next to nothing and its encoder next to idles.
+ *
+ * vivid makes a handy source to try it on: its test pattern stands still or
+ * moves as the horizontal_movement control says.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "motion.h"
+#include "decode.h"
+#include "stats.h"
+
+#define MOTION_SCALE      8         /* frame pixels to a plane pixel, across and down */
+#define MOTION_CELL       8         /* plane pixels to a cell, across and down */
+#define MOTION_CHECK_US   100000    /* at most one comparison per 100 ms, the gate holds in between */
+#define MOTION_AREA       1         /* default share of a zone's cells, percent */
+
+int    motion, motion_threshold = 10, motion_hold_ms = 3000, motion_idle_idr;
+double motion_idle_fps = 1;
+
+struct zone {
+	int             x, y, w, h, percent;
+};
+
+static struct zone zones[MOTION_ZONES];
+static int         zone_count;
+
+struct motion {
+	char                    name[64];
+	struct scaled_decoder  *jpeg;
+	uint8_t                *plane, *reference;
+	uint16_t               *sums;
+	uint8_t                *changed;
+	unsigned int            width, height, cells_x, cells_y;
+	unsigned int            cell_rect[MOTION_ZONES][4];    /* x0, y0, x1, y1 in cells */
+	int                     unsupported, have_reference, active;
+
+	int64_t                 last_check_us, last_motion_us, last_idle_us, active_since_us, active_us;
+	int64_t                 first_us, last_us, check_cpu_us;
+	unsigned long           frames, encoded, idle_encoded, skipped, checks, events;
+	int                     peak_percent[MOTION_ZONES];
+};
+
+static int64_t now_us(clockid_t clock)
+{
+	struct timespec now;
+
+	clock_gettime(clock, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+/* X,Y,W,H[,PERCENT]: a rectangle in percent of the frame and the share of it that has to change */
+int motion_add_zone(const char *spec)
+{
+	struct zone z = { 0, 0, 0, 0, MOTION_AREA };
+
+	if (zone_count == MOTION_ZONES)
+		return -1;
+	if (sscanf(spec, "%d,%d,%d,%d,%d", &z.x, &z.y, &z.w, &z.h, &z.percent) < 4 ||
+	    z.x < 0 || z.y < 0 || z.w < 1 || z.h < 1 || z.x + z.w > 100 || z.y + z.h > 100 ||
+	    z.percent < 1 || z.percent > 100)
+		return -1;
+	zones[zone_count++] = z;
+	return 0;
+}
+
+struct motion *motion_new(const char *name)
+{
+	struct motion *m;
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		return NULL;
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	if (zone_count == 0)
+		zones[zone_count++] = (struct zone){ 0, 0, 100, 100, MOTION_AREA };
+	return m;
+}
+
+/* the cells whose centre is in the zone; at least the one its centre is in */
+static void zone_cells(struct motion *m, const struct zone *z, unsigned int *rect)
+{
+	rect[0] = (z->x * m->width / 100 + MOTION_CELL / 2) / MOTION_CELL;
+	rect[1] = (z->y * m->height / 100 + MOTION_CELL / 2) / MOTION_CELL;
+	rect[2] = ((z->x + z->w) * m->width / 100 + MOTION_CELL / 2) / MOTION_CELL;
+	rect[3] = ((z->y + z->h) * m->height / 100 + MOTION_CELL / 2) / MOTION_CELL;
+	if (rect[2] > m->cells_x)
+		rect[2] = m->cells_x;
+	if (rect[3] > m->cells_y)
+		rect[3] = m->cells_y;
+	if (rect[0] >= rect[2]) {
+		rect[0] = (2 * z->x + z->w) * m->cells_x / 200;
+		rect[2] = rect[0] + 1;
+	}
+	if (rect[1] >= rect[3]) {
+		rect[1] = (2 * z->y + z->h) * m->cells_y / 200;
+		rect[3] = rect[1] + 1;
+	}
+}
+
+static int plane_size(struct motion *m, unsigned int width, unsigned int height)
+{
+	int i;
+
+	if (width == m->width && height == m->height)
+		return 0;
+	if (width < MOTION_CELL || height < MOTION_CELL)
+		return -1;
+	free(m->plane);
+	free(m->reference);
+	free(m->sums);
+	free(m->changed);
+	m->width = width;
+	m->height = height;
+	m->cells_x = width / MOTION_CELL;
+	m->cells_y = height / MOTION_CELL;
+	m->plane = malloc(width * height);
+	m->reference = malloc(width * height);
+	m->sums = malloc(width * sizeof(*m->sums));
+	m->changed = malloc(m->cells_x * m->cells_y);
+	m->have_reference = 0;
+	if (!m->plane || !m->reference || !m->sums || !m->changed)
+		return -1;
+	for (i = 0; i < zone_count; i++)
+		zone_cells(m, &zones[i], m->cell_rect[i]);
+	return 0;
+}
+
+/*
+ * One frame row into the plane row sums: each MOTION_SCALE luma samples
+ * added to sums[x], two plane pixels (16 samples) to a vector. Luma is
+ * every step-th byte of row from byte odd on.
+ */
+static void sum_row(uint16_t *sums, const uint8_t *row, unsigned int width, unsigned int step, unsigned int odd)
+{
+	unsigned int x = 0, i;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	uint8x16_t luma;
+	uint64x2_t sum;
+
+	for (; x + 2 <= width; x += 2) {
+		if (step == 1)
+			luma = vld1q_u8(row + x * MOTION_SCALE);
+		else {
+			uint8x16x2_t pixels = vld2q_u8(row + x * MOTION_SCALE * 2);
+
+			luma = odd ? pixels.val[1] : pixels.val[0];
+		}
+		sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(luma)));
+		sums[x] += vgetq_lane_u64(sum, 0);
+		sums[x + 1] += vgetq_lane_u64(sum, 1);
+	}
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128(), low = _mm_set1_epi16(0xff);
+	__m128i luma, sum;
+
+	for (; x + 2 <= width; x += 2) {
+		if (step == 1)
+			luma = _mm_loadu_si128((const __m128i *)(row + x * MOTION_SCALE));
+		else {
+			/* 16 packed pixels, luma in the low or high byte of each 16 bits, narrowed to 16 bytes */
+			__m128i a = _mm_loadu_si128((const __m128i *)(row + x * MOTION_SCALE * 2));
+			__m128i b = _mm_loadu_si128((const __m128i *)(row + x * MOTION_SCALE * 2 + 16));
+
+			luma = odd ? _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)) :
+				_mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+		}
+		/* against zero, _mm_sad_epu8 sums each 8 bytes */
+		sum = _mm_sad_epu8(luma, zero);
+		sums[x] += _mm_cvtsi128_si32(sum);
+		sums[x + 1] += _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+	}
+#endif
+	for (; x < width; x++)
+		for (i = 0; i < MOTION_SCALE; i++)
+			sums[x] += row[(x * MOTION_SCALE + i) * step + odd];
+}
+
+/* the frame's luma into m->plane; -1 if the format has none to offer */
+static int build_plane(struct motion *m, const struct v4l2_pix_format *pix, const uint8_t *frame, size_t size)
+{
+	unsigned int step, stride, odd = 0, x, y, i;
+
+	switch (pix->pixelformat) {
+	case V4L2_PIX_FMT_MJPEG:
+	case V4L2_PIX_FMT_JPEG: {
+		struct decode_planes planes;
+
+		if ((m->jpeg == NULL && (m->jpeg = scaled_decoder_new()) == NULL) ||
+		    scaled_decode(m->jpeg, frame, size, MOTION_SCALE, &planes) < 0 ||
+		    plane_size(m, planes.width, planes.height) < 0)
+			return -1;
+		for (y = 0; y < m->height; y++)
+			memcpy(m->plane + y * m->width, planes.y + y * planes.stride, m->width);
+		return 0;
+	}
+
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_VYUY:
+		odd = 1;
+		/* fall through */
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+		step = 2;
+		break;
+
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+	case V4L2_PIX_FMT_YUV422P:
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_NV61:
+	case V4L2_PIX_FMT_GREY:
+		step = 1;
+		break;
+
+	default:
+		return -1;
+	}
+
+	stride = pix->bytesperline ? pix->bytesperline : pix->width * step;
+	if (plane_size(m, pix->width / MOTION_SCALE, pix->height / MOTION_SCALE) < 0 ||
+	    (size_t)stride * pix->height > size)
+		return -1;
+
+	/* MOTION_SCALE rows summed a row at a time, then averaged */
+	for (y = 0; y < m->height; y++) {
+		memset(m->sums, 0, m->width * sizeof(*m->sums));
+		for (i = 0; i < MOTION_SCALE; i++)
+			sum_row(m->sums, frame + (size_t)(y * MOTION_SCALE + i) * stride, m->width, step, odd);
+		for (x = 0; x < m->width; x++)
+			m->plane[y * m->width + x] = m->sums[x] / (MOTION_SCALE * MOTION_SCALE);
+	}
+	return 0;
+}
+
+/* sum of absolute differences of an 8x8 cell */
+static unsigned int sad8x8(const uint8_t *a, const uint8_t *b, unsigned int stride)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	uint16x8_t acc = vdupq_n_u16(0);
+	uint64x2_t sum;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		acc = vabal_u8(acc, vld1_u8(a + i * stride), vld1_u8(b + i * stride));
+	sum = vpaddlq_u32(vpaddlq_u16(acc));
+	return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+#elif defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	int i;
+
+	/* two rows to a register, _mm_sad_epu8 sums each half */
+	for (i = 0; i < 8; i += 2) {
+		__m128i x = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(a + i * stride)),
+			_mm_loadl_epi64((const __m128i *)(a + (i + 1) * stride)));
+		__m128i y = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(b + i * stride)),
+			_mm_loadl_epi64((const __m128i *)(b + (i + 1) * stride)));
+
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(x, y));
+	}
+	return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+#else
+	unsigned int sum = 0;
+	int i, j;
+
+	for (i = 0; i < 8; i++)
+		for (j = 0; j < 8; j++)
+			sum += abs(a[i * stride + j] - b[i * stride + j]);
+	return sum;
+#endif
+}
+
+/* 1 if a zone has enough changed cells */
+static int detect(struct motion *m)
+{
+	unsigned int limit = motion_threshold * MOTION_CELL * MOTION_CELL, cx, cy;
+	int z, found = 0;
+
+	for (cy = 0; cy < m->cells_y; cy++)
+		for (cx = 0; cx < m->cells_x; cx++) {
+			unsigned int offset = cy * MOTION_CELL * m->width + cx * MOTION_CELL;
+
+			m->changed[cy * m->cells_x + cx] = sad8x8(m->plane + offset, m->reference + offset, m->width) > limit;
+		}
+
+	for (z = 0; z < zone_count; z++) {
+		unsigned int *r = m->cell_rect[z], count = 0, cells = (r[2] - r[0]) * (r[3] - r[1]);
+		int percent;
+
+		for (cy = r[1]; cy < r[3]; cy++)
+			for (cx = r[0]; cx < r[2]; cx++)
+				count += m->changed[cy * m->cells_x + cx];
+		percent = count * 100 / cells;
+		if (percent > m->peak_percent[z])
+			m->peak_percent[z] = percent;
+		if (count && percent >= zones[z].percent)
+			found = 1;
+	}
+	return found;
+}
+
+enum motion_gate motion_gate(struct motion *m, const struct v4l2_pix_format *pix, const void *frame, size_t size)
+{
+	int64_t now = now_us(CLOCK_MONOTONIC);
+	enum motion_gate gate = MOTION_ENCODE;
+	int active;
+
+	if (m->frames++ == 0)
+		m->first_us = now;
+	m->last_us = now;
+
+	if (!m->unsupported && now - m->last_check_us >= MOTION_CHECK_US) {
+		int64_t cpu = now_us(CLOCK_THREAD_CPUTIME_ID);
+
+		if (build_plane(m, pix, frame, size) < 0) {
+			/* a corrupt MJPEG frame is no reason to give up */
+			if (pix->pixelformat != V4L2_PIX_FMT_MJPEG && pix->pixelformat != V4L2_PIX_FMT_JPEG) {
+				fprintf(stderr, "%s: no motion detection on %.4s %ux%u, every frame is encoded\n",
+					m->name, (char *)&pix->pixelformat, pix->width, pix->height);
+				m->unsupported = 1;
+			}
+		}
+		else {
+			uint8_t *previous = m->reference;
+
+			if (m->have_reference && detect(m))
+				m->last_motion_us = now;
+			m->reference = m->plane;
+			m->plane = previous;
+			m->have_reference = 1;
+		}
+		m->checks++;
+		m->check_cpu_us += now_us(CLOCK_THREAD_CPUTIME_ID) - cpu;
+		m->last_check_us = now;
+	}
+	if (m->unsupported) {
+		m->encoded++;
+		return MOTION_ENCODE;
+	}
+
+	active = m->last_motion_us && now - m->last_motion_us < motion_hold_ms * (int64_t)1000;
+	if (active && !m->active) {
+		m->active = 1;
+		m->active_since_us = now;
+		m->events++;
+		stats_event("motion: %s started", m->name);
+		gate = MOTION_IDR;
+	}
+	else if (!active && m->active) {
+		m->active = 0;
+		m->active_us += now - m->active_since_us;
+		m->last_idle_us = now;
+		stats_event("motion: %s stopped after %.1f s", m->name, (now - m->active_since_us) / 1000000.0);
+	}
+
+	if (m->active) {
+		m->encoded++;
+		return gate;
+	}
+	if (motion_idle_fps > 0 && now - m->last_idle_us >= 1000000 / motion_idle_fps) {
+		m->last_idle_us = now;
+		m->idle_encoded++;
+		return motion_idle_idr ? MOTION_IDR : MOTION_ENCODE;
+	}
+	m->skipped++;
+	return MOTION_SKIP;
+}
+
+/* 1 while there is motion or within --motion_hold of it */
+int motion_active(struct motion *m)
+{
+	return m->active;
+}
+
+void motion_report(struct motion *m, FILE *out)
+{
+	double seconds = (m->last_us - m->first_us) / 1000000.0;
+	int64_t active_us = m->active_us + (m->active ? m->last_us - m->active_since_us : 0);
+	int z;
+
+	fprintf(out, "motion %s: %lu frames, %lu encoded with motion, %lu idle, %lu left out; %lu events, "
+		"active %.1f%% of %.1f s; %lu checks on a %ux%u plane, %.2f ms cpu each\n",
+		m->name, m->frames, m->encoded, m->idle_encoded, m->skipped, m->events,
+		seconds > 0 ? 100 * active_us / 1000000.0 / seconds : 0.0, seconds,
+		m->checks, m->width, m->height, m->checks ? m->check_cpu_us / 1000.0 / m->checks : 0.0);
+	for (z = 0; z < zone_count && m->width; z++)
+		fprintf(out, "  zone %d,%d,%d,%d: cells %u-%u x %u-%u, %d%% to trigger, %d%% changed at most\n",
+			zones[z].x, zones[z].y, zones[z].w, zones[z].h, m->cell_rect[z][0], m->cell_rect[z][2] - 1,
+			m->cell_rect[z][1], m->cell_rect[z][3] - 1, zones[z].percent, m->peak_percent[z]);
+}
+
+/* reports to out unless NULL */
+void motion_free(struct motion *m, FILE *out)
+{
+	if (m == NULL)
+		return;
+	if (out)
+		motion_report(m, out);
+	scaled_decoder_free(m->jpeg);
+	free(m->plane);
+	free(m->reference);
+	free(m->sums);
+	free(m->changed);
+	free(m);
+}
@@ -0,0 +1,33 @@
+/*
+ * Motion-gated encoding
+ */
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/videodev2.h>
+
+#define MOTION_ZONES      8
+
+enum motion_gate {
+	MOTION_SKIP,            /* idle: leave the frame out */
+	MOTION_ENCODE,
+	MOTION_IDR,             /* encode it as a keyframe: motion started, or an idle frame with --motion_idle_idr */
+};
+
+struct motion;
+
+extern int    motion, motion_threshold, motion_hold_ms, motion_idle_idr;
+extern double motion_idle_fps;
+
+int motion_add_zone(const char *spec);
+struct motion *motion_new(const char *name);
+enum motion_gate motion_gate(struct motion *m, const struct v4l2_pix_format *pix, const void *frame, size_t size);
+int motion_active(struct motion *m);
+void motion_report(struct motion *m, FILE *out);
+void motion_free(struct motion *m, FILE *out);
+
+#endif /* MOTION_H */
@@ -0,0 +1,935 @@
+/*
+ * Fragmented MP4 (ISO BMFF) output
+ *
+ * With mp4_spec set, camera 0's H.264 stream is also written as fragmented
+ * MP4: an init segment (ftyp, moov with the avcC built from the encoder's
+ * codec config buffers) and then a moof/mdat fragment per GOP, or per frame
+ * with mp4_per_frame, timed by the capture timestamps at MP4_TIMESCALE.
+ * mp4_spec is one of
+ *
+ *   -        stdout, which then carries fMP4 instead of Annex B
+ *   DIR/     DIR/init.mp4 and a DIR/NNNNNNNN.m4s file per fragment (styp first)
+ *   FILE     a single streamable file
+ *
+ * Nothing grows with the length of the recording: fragments are written as
+ * they close and forgotten, so no sample index is held. Sample data goes out
+ * by writev straight from the access units, start codes swapped for 4 byte
+ * lengths; SPS, PPS and access unit delimiters stay in the init segment.
+ * Every sample's decode time is its capture time (the encoder does not
+ * reorder); a sample's duration is the interval to the next one, and the last
+ * of a fragment takes the interval before it, tfdt keeping the next fragment
+ * exact. The muxer itself (mp4_mux_*) holds no more than one fragment of
+ * references, MP4_SAMPLES units at most, and is there for other writers too.
+ *
+ * Muxing and writing happen on a thread of their own fed by reference, like a
+ * sink; a writer more than MP4_QUEUE_KB behind drops what is queued and
+ * resumes at the next keyframe.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "mp4.h"
+#include "nal.h"
+#include "stats.h"
+#include "rt.h"
+
+#define MP4_SAMPLES       1024      /* units to a fragment at most */
+#define MP4_NALS          4096      /* NAL units to a fragment at most */
+#define MP4_AU_NALS       128       /* NAL units to a sample at most */
+#define MP4_PARAM         256       /* SPS or PPS */
+#define MP4_INIT          1024
+#define MP4_HEADER        (256 + 12 * MP4_SAMPLES)
+#define MP4_QUEUE         1024
+#define MP4_QUEUE_KB      8192
+#define MP4_IOV           1024      /* iovecs to a writev */
+#define MP4_PATH          512
+
+struct sample {
+	struct au      *au;
+	int64_t         timestamp;
+	uint32_t        size;           /* length prefixed NAL units */
+	int             keyframe;
+};
+
+struct mp4_mux {
+	unsigned char   sps[MP4_PARAM], pps[MP4_PARAM];
+	size_t          sps_size, pps_size;
+	unsigned int    width, height, chroma_format, bit_depth_luma, bit_depth_chroma;
+
+	unsigned char   init[MP4_INIT];
+	size_t          init_size;
+
+	struct sample   samples[MP4_SAMPLES];
+	int             count;
+	unsigned int    nals;
+	unsigned char   lengths[MP4_NALS][4];
+	unsigned char   header[MP4_HEADER];
+	struct iovec    iov[1 + 2 * MP4_NALS];
+
+	uint32_t        sequence, last_duration;
+	int64_t         base_ts, prev_ts;
+	int             based;
+};
+
+/* box building into a fixed buffer; an overflow leaves size past max */
+struct buf {
+	unsigned char  *p;
+	size_t          size, max;
+};
+
+static void put(struct buf *b, const void *data, size_t length)
+{
+	if (b->size + length <= b->max)
+		memcpy(b->p + b->size, data, length);
+	b->size += length;
+}
+
+static void put8(struct buf *b, unsigned int v)
+{
+	unsigned char c = v;
+
+	put(b, &c, 1);
+}
+
+static void put16(struct buf *b, unsigned int v)
+{
+	unsigned char c[2] = { v >> 8, v };
+
+	put(b, c, 2);
+}
+
+static void put32(struct buf *b, uint32_t v)
+{
+	unsigned char c[4] = { v >> 24, v >> 16, v >> 8, v };
+
+	put(b, c, 4);
+}
+
+static void put64(struct buf *b, uint64_t v)
+{
+	put32(b, v >> 32);
+	put32(b, v);
+}
+
+static void put_zero(struct buf *b, size_t length)
+{
+	while (length--)
+		put8(b, 0);
+}
+
+static size_t box(struct buf *b, const char *type)
+{
+	size_t at = b->size;
+
+	put32(b, 0);
+	put(b, type, 4);
+	return at;
+}
+
+static size_t full_box(struct buf *b, const char *type, unsigned int version, uint32_t flags)
+{
+	size_t at = box(b, type);
+
+	put32(b, version << 24 | flags);
+	return at;
+}
+
+static void box_end(struct buf *b, size_t at)
+{
+	uint32_t size = b->size - at;
+
+	if (b->size <= b->max) {
+		b->p[at] = size >> 24;
+		b->p[at + 1] = size >> 16;
+		b->p[at + 2] = size >> 8;
+		b->p[at + 3] = size;
+	}
+}
+
+static void put_matrix(struct buf *b)
+{
+	static const uint32_t unity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+	int i;
+
+	for (i = 0; i < 9; i++)
+		put32(b, unity[i]);
+}
+
+/* exp-Golomb reading of an RBSP */
+struct bits {
+	const unsigned char *p;
+	size_t               size, pos;
+};
+
+static unsigned int bit(struct bits *b)
+{
+	unsigned int v;
+
+	if (b->pos >= b->size * 8)
+		return 0;
+	v = b->p[b->pos / 8] >> (7 - b->pos % 8) & 1;
+	b->pos++;
+	return v;
+}
+
+static unsigned int bits_u(struct bits *b, int n)
+{
+	unsigned int v = 0;
+
+	while (n--)
+		v = v << 1 | bit(b);
+	return v;
+}
+
+static unsigned int bits_ue(struct bits *b)
+{
+	int zeros = 0;
+
+	while (!bit(b) && zeros < 31 && b->pos < b->size * 8)
+		zeros++;
+	return ((1u << zeros) - 1) + bits_u(b, zeros);
+}
+
+static int bits_se(struct bits *b)
+{
+	unsigned int k = bits_ue(b);
+
+	return k & 1 ? (int)((k + 1) / 2) : -(int)(k / 2);
+}
+
+static void skip_scaling_list(struct bits *b, int size)
+{
+	int last = 8, next = 8, j;
+
+	for (j = 0; j < size; j++) {
+		if (next)
+			next = (last + bits_se(b) + 256) % 256;
+		last = next ? next : last;
+	}
+}
+
+static int high_profile(unsigned int profile)
+{
+	return profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+		profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+		profile == 139 || profile == 134 || profile == 135;
+}
+
+/* picture size and chroma format from the SPS */
+static int parse_sps(struct mp4_mux *m)
+{
+	unsigned char rbsp[MP4_PARAM];
+	struct bits b = { rbsp, 0, 0 };
+	unsigned int i, zeros = 0, profile, poc_type, width_mbs, height_units, frame_mbs_only;
+	unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0, crop_x, crop_y;
+
+	/* emulation prevention bytes out, NAL header byte too */
+	for (i = 1; i < m->sps_size; i++) {
+		if (zeros >= 2 && m->sps[i] == 3) {
+			zeros = 0;
+			continue;
+		}
+		zeros = m->sps[i] ? 0 : zeros + 1;
+		rbsp[b.size++] = m->sps[i];
+	}
+	if (b.size < 4)
+		return -1;
+
+	profile = bits_u(&b, 8);
+	bits_u(&b, 16);                 /* constraint flags, level */
+	bits_ue(&b);                    /* seq_parameter_set_id */
+	m->chroma_format = 1;
+	m->bit_depth_luma = m->bit_depth_chroma = 8;
+	if (high_profile(profile)) {
+		if ((m->chroma_format = bits_ue(&b)) == 3)
+			bit(&b);                /* separate_colour_plane_flag */
+		m->bit_depth_luma = bits_ue(&b) + 8;
+		m->bit_depth_chroma = bits_ue(&b) + 8;
+		bit(&b);                    /* qpprime_y_zero_transform_bypass_flag */
+		if (bit(&b))
+			for (i = 0; i < (m->chroma_format != 3 ? 8u : 12u); i++)
+				if (bit(&b))
+					skip_scaling_list(&b, i < 6 ? 16 : 64);
+	}
+	bits_ue(&b);                    /* log2_max_frame_num_minus4 */
+	if ((poc_type = bits_ue(&b)) == 0)
+		bits_ue(&b);                /* log2_max_pic_order_cnt_lsb_minus4 */
+	else if (poc_type == 1) {
+		unsigned int cycle;
+
+		bit(&b);
+		bits_se(&b);
+		bits_se(&b);
+		for (cycle = bits_ue(&b); cycle > 0 && b.pos < b.size * 8; cycle--)
+			bits_se(&b);
+	}
+	bits_ue(&b);                    /* max_num_ref_frames */
+	bit(&b);                        /* gaps_in_frame_num_value_allowed_flag */
+	width_mbs = bits_ue(&b) + 1;
+	height_units = bits_ue(&b) + 1;
+	if (!(frame_mbs_only = bit(&b)))
+		bit(&b);                    /* mb_adaptive_frame_field_flag */
+	bit(&b);                        /* direct_8x8_inference_flag */
+	if (bit(&b)) {
+		crop_left = bits_ue(&b);
+		crop_right = bits_ue(&b);
+		crop_top = bits_ue(&b);
+		crop_bottom = bits_ue(&b);
+	}
+	if (b.pos > b.size * 8)
+		return -1;
+
+	crop_x = m->chroma_format == 1 || m->chroma_format == 2 ? 2 : 1;
+	crop_y = (m->chroma_format == 1 ? 2 : 1) * (2 - frame_mbs_only);
+	m->width = width_mbs * 16 - crop_x * (crop_left + crop_right);
+	m->height = (2 - frame_mbs_only) * height_units * 16 - crop_y * (crop_top + crop_bottom);
+	return 0;
+}
+
+static void build_init(struct mp4_mux *m)
+{
+	struct buf b = { m->init, 0, MP4_INIT };
+	size_t moov, trak, mdia, minf, dinf, stbl, stsd, avc1, avcc, mvex, at;
+
+	at = box(&b, "ftyp");
+	put(&b, "isom", 4);
+	put32(&b, 0x200);
+	put(&b, "isomiso6avc1mp41", 16);
+	box_end(&b, at);
+
+	moov = box(&b, "moov");
+	at = full_box(&b, "mvhd", 0, 0);
+	put32(&b, 0);                   /* creation, modification time */
+	put32(&b, 0);
+	put32(&b, 1000);                /* timescale */
+	put32(&b, 0);                   /* duration: fragmented */
+	put32(&b, 0x00010000);          /* rate */
+	put16(&b, 0x0100);              /* volume */
+	put_zero(&b, 10);
+	put_matrix(&b);
+	put_zero(&b, 24);               /* pre_defined */
+	put32(&b, 2);                   /* next_track_ID */
+	box_end(&b, at);
+
+	trak = box(&b, "trak");
+	at = full_box(&b, "tkhd", 0, 3);    /* enabled, in movie */
+	put32(&b, 0);
+	put32(&b, 0);
+	put32(&b, 1);                   /* track_ID */
+	put32(&b, 0);
+	put32(&b, 0);                   /* duration */
+	put_zero(&b, 8);
+	put16(&b, 0);                   /* layer */
+	put16(&b, 0);                   /* alternate_group */
+	put16(&b, 0);                   /* volume */
+	put16(&b, 0);
+	put_matrix(&b);
+	put32(&b, m->width << 16);
+	put32(&b, m->height << 16);
+	box_end(&b, at);
+
+	mdia = box(&b, "mdia");
+	at = full_box(&b, "mdhd", 0, 0);
+	put32(&b, 0);
+	put32(&b, 0);
+	put32(&b, MP4_TIMESCALE);
+	put32(&b, 0);
+	put16(&b, 0x55c4);              /* "und" */
+	put16(&b, 0);
+	box_end(&b, at);
+	at = full_box(&b, "hdlr", 0, 0);
+	put32(&b, 0);
+	put(&b, "vide", 4);
+	put_zero(&b, 12);
+	put(&b, "VideoHandler", 13);
+	box_end(&b, at);
+
+	minf = box(&b, "minf");
+	at = full_box(&b, "vmhd", 0, 1);
+	put_zero(&b, 8);
+	box_end(&b, at);
+	dinf = box(&b, "dinf");
+	at = full_box(&b, "dref", 0, 0);
+	put32(&b, 1);
+	box_end(&b, full_box(&b, "url ", 0, 1));  /* media in the same file */
+	box_end(&b, at);
+	box_end(&b, dinf);
+
+	stbl = box(&b, "stbl");
+	stsd = full_box(&b, "stsd", 0, 0);
+	put32(&b, 1);
+	avc1 = box(&b, "avc1");
+	put_zero(&b, 6);
+	put16(&b, 1);                   /* data_reference_index */
+	put_zero(&b, 16);
+	put16(&b, m->width);
+	put16(&b, m->height);
+	put32(&b, 0x00480000);          /* 72 dpi */
+	put32(&b, 0x00480000);
+	put32(&b, 0);
+	put16(&b, 1);                   /* frame_count */
+	put_zero(&b, 32);               /* compressorname */
+	put16(&b, 0x0018);              /* depth */
+	put16(&b, 0xffff);
+	avcc = box(&b, "avcC");
+	put8(&b, 1);
+	put(&b, m->sps + 1, 3);         /* profile, compatibility, level */
+	put8(&b, 0xff);                 /* 4 byte lengths */
+	put8(&b, 0xe1);                 /* one SPS */
+	put16(&b, m->sps_size);
+	put(&b, m->sps, m->sps_size);
+	put8(&b, 1);                    /* one PPS */
+	put16(&b, m->pps_size);
+	put(&b, m->pps, m->pps_size);
+	if (high_profile(m->sps[1])) {
+		put8(&b, 0xfc | m->chroma_format);
+		put8(&b, 0xf8 | (m->bit_depth_luma - 8));
+		put8(&b, 0xf8 | (m->bit_depth_chroma - 8));
+		put8(&b, 0);
+	}
+	box_end(&b, avcc);
+	box_end(&b, avc1);
+	box_end(&b, stsd);
+	at = full_box(&b, "stts", 0, 0);
+	put32(&b, 0);
+	box_end(&b, at);
+	at = full_box(&b, "stsc", 0, 0);
+	put32(&b, 0);
+	box_end(&b, at);
+	at = full_box(&b, "stsz", 0, 0);
+	put32(&b, 0);
+	put32(&b, 0);
+	box_end(&b, at);
+	at = full_box(&b, "stco", 0, 0);
+	put32(&b, 0);
+	box_end(&b, at);
+	box_end(&b, stbl);
+	box_end(&b, minf);
+	box_end(&b, mdia);
+	box_end(&b, trak);
+
+	mvex = box(&b, "mvex");
+	at = full_box(&b, "trex", 0, 0);
+	put32(&b, 1);                   /* track_ID */
+	put32(&b, 1);                   /* default_sample_description_index */
+	put32(&b, 0);
+	put32(&b, 0);
+	put32(&b, 0);
+	box_end(&b, at);
+	box_end(&b, mvex);
+	box_end(&b, moov);
+
+	m->init_size = b.size <= b.max ? b.size : 0;
+}
+
+struct mp4_mux *mp4_mux_new(void)
+{
+	struct mp4_mux *m = calloc(1, sizeof(*m));
+
+	if (m)
+		m->last_duration = MP4_TIMESCALE / 30;
+	return m;
+}
+
+/* take SPS and PPS from a codec config unit; 1 if the init segment changed, 0 if not, -1 without both */
+int mp4_mux_config(struct mp4_mux *m, const struct au *config)
+{
+	const unsigned char *pos = config->data, *end = config->data + config->size, *nal, *sps = NULL, *pps = NULL;
+	size_t length, sps_size = 0, pps_size = 0;
+
+	while (nal_next(&pos, end, &nal, &length))
+		if ((nal[0] & 0x1f) == 7 && length >= 4 && length <= MP4_PARAM) {
+			sps = nal;
+			sps_size = length;
+		}
+		else if ((nal[0] & 0x1f) == 8 && length <= MP4_PARAM) {
+			pps = nal;
+			pps_size = length;
+		}
+	if (!sps || !pps)
+		return -1;
+	if (m->init_size && sps_size == m->sps_size && pps_size == m->pps_size &&
+		!memcmp(sps, m->sps, sps_size) && !memcmp(pps, m->pps, pps_size))
+		return 0;
+
+	memcpy(m->sps, sps, m->sps_size = sps_size);
+	memcpy(m->pps, pps, m->pps_size = pps_size);
+	if (parse_sps(m) < 0) {
+		m->init_size = 0;
+		return -1;
+	}
+	build_init(m);
+	return m->init_size ? 1 : -1;
+}
+
+/* the init segment, NULL before a codec config */
+const unsigned char *mp4_mux_init(struct mp4_mux *m, size_t *size)
+{
+	*size = m->init_size;
+	return m->init_size ? m->init : NULL;
+}
+
+/* 0 if the fragment has to be written out before au goes in */
+int mp4_mux_room(struct mp4_mux *m, const struct au *au)
+{
+	return m->count < MP4_SAMPLES && m->nals + MP4_AU_NALS <= MP4_NALS;
+}
+
+static uint64_t decode_time(struct mp4_mux *m, int64_t timestamp)
+{
+	return (uint64_t)(timestamp - m->base_ts) * MP4_TIMESCALE / 1000000;
+}
+
+void mp4_mux_add(struct mp4_mux *m, struct au *au)
+{
+	struct sample *s = &m->samples[m->count++];
+	const unsigned char *pos = au->data, *end = au->data + au->size, *nal;
+	size_t length;
+	unsigned int first = m->nals;
+
+	if (!m->based) {
+		m->base_ts = au->timestamp;
+		m->based = 1;
+	}
+	/* the interval before it is the best guess for its own duration, should it end the fragment */
+	if (m->count > 1 || m->sequence) {
+		if (au->timestamp > m->prev_ts)
+			m->last_duration = decode_time(m, au->timestamp) - decode_time(m, m->prev_ts);
+	}
+	m->prev_ts = au->timestamp;
+
+	s->au = au_ref(au);
+	s->timestamp = au->timestamp;
+	s->keyframe = (au->flags & AU_KEYFRAME) != 0;
+	s->size = 0;
+	while (m->nals - first < MP4_AU_NALS && nal_next(&pos, end, &nal, &length)) {
+		unsigned int type = nal[0] & 0x1f;
+
+		/* parameter sets are in the init segment, delimiters have no place in a sample */
+		if (type == 7 || type == 8 || type == 9)
+			continue;
+		m->lengths[m->nals][0] = length >> 24;
+		m->lengths[m->nals][1] = length >> 16;
+		m->lengths[m->nals][2] = length >> 8;
+		m->lengths[m->nals][3] = length;
+		m->iov[1 + 2 * m->nals].iov_base = m->lengths[m->nals];
+		m->iov[1 + 2 * m->nals].iov_len = 4;
+		m->iov[2 + 2 * m->nals].iov_base = (void *)nal;
+		m->iov[2 + 2 * m->nals].iov_len = length;
+		m->nals++;
+		s->size += 4 + length;
+	}
+}
+
+int mp4_mux_samples(struct mp4_mux *m)
+{
+	return m->count;
+}
+
+/* from the first sample's capture time to the end of the last one */
+int64_t mp4_mux_duration_us(struct mp4_mux *m)
+{
+	if (!m->count)
+		return 0;
+	return m->samples[m->count - 1].timestamp - m->samples[0].timestamp +
+		(int64_t)m->last_duration * 1000000 / MP4_TIMESCALE;
+}
+
+/* moof and mdat of the samples added since the last clear, as iovecs into them; their count, 0 if none */
+int mp4_mux_fragment(struct mp4_mux *m, int styp, struct iovec **iov, size_t *size)
+{
+	struct buf b = { m->header, 0, MP4_HEADER };
+	size_t moof, traf, at, offset_at;
+	uint64_t mdat = 8;
+	int i;
+
+	if (!m->count)
+		return 0;
+
+	if (styp) {
+		at = box(&b, "styp");
+		put(&b, "msdh", 4);
+		put32(&b, 0);
+		put(&b, "msdhmsix", 8);
+		box_end(&b, at);
+	}
+
+	moof = box(&b, "moof");
+	at = full_box(&b, "mfhd", 0, 0);
+	put32(&b, ++m->sequence);
+	box_end(&b, at);
+	traf = box(&b, "traf");
+	at = full_box(&b, "tfhd", 0, 0x020000);     /* default-base-is-moof */
+	put32(&b, 1);
+	box_end(&b, at);
+	at = full_box(&b, "tfdt", 1, 0);
+	put64(&b, decode_time(m, m->samples[0].timestamp));
+	box_end(&b, at);
+	at = full_box(&b, "trun", 0, 0x000701);     /* data offset, duration, size and flags per sample */
+	put32(&b, m->count);
+	offset_at = b.size;
+	put32(&b, 0);
+	for (i = 0; i < m->count; i++) {
+		uint64_t duration = i + 1 < m->count ?
+			decode_time(m, m->samples[i + 1].timestamp) - decode_time(m, m->samples[i].timestamp) : m->last_duration;
+
+		put32(&b, duration > 0 ? duration : 1);
+		put32(&b, m->samples[i].size);
+		put32(&b, m->samples[i].keyframe ? 0x02000000 : 0x01010000);
+		mdat += m->samples[i].size;
+	}
+	box_end(&b, at);
+	box_end(&b, traf);
+	box_end(&b, moof);
+	if (b.size > b.max)
+		return 0;
+
+	/* the first sample's data, counted from the start of the moof */
+	at = b.size - moof + 8;
+	m->header[offset_at] = at >> 24;
+	m->header[offset_at + 1] = at >> 16;
+	m->header[offset_at + 2] = at >> 8;
+	m->header[offset_at + 3] = at;
+	put32(&b, mdat);
+	put(&b, "mdat", 4);
+
+	m->iov[0].iov_base = m->header;
+	m->iov[0].iov_len = b.size;
+	*iov = m->iov;
+	*size = b.size + mdat - 8;
+	return 1 + 2 * m->nals;
+}
+
+/* let go of the samples of the fragment just written */
+void mp4_mux_clear(struct mp4_mux *m)
+{
+	while (m->count > 0)
+		au_unref(m->samples[--m->count].au);
+	m->nals = 0;
+}
+
+void mp4_mux_free(struct mp4_mux *m)
+{
+	if (m == NULL)
+		return;
+	mp4_mux_clear(m);
+	free(m);
+}
+
+/* the writer */
+
+char *mp4_spec;
+int   mp4_per_frame;
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   cond = PTHREAD_COND_INITIALIZER;
+static pthread_t        thread;
+static int              running, null_fd = -1;
+
+/* under lock */
+static struct au       *queue[MP4_QUEUE];
+static unsigned int     head, tail;
+static size_t           queued_bytes;
+static int              closing, waiting = 1;
+static unsigned long    drops, dropped_units;
+
+/* writer thread only */
+static struct mp4_mux  *mux;
+static int              out_fd = -1, dir_mode, started, init_written, failed;
+static unsigned long    fragments, samples, inits, max_samples;
+static uint64_t         bytes, max_bytes;
+static int64_t          write_sum, write_max;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+/* where the Annex B stream goes: stdout, unless fMP4 has it (main() refuses --abr and the indexes then) */
+int mp4_raw_fd(void)
+{
+	if (!mp4_spec || strcmp(mp4_spec, "-"))
+		return STDOUT_FILENO;
+	if (null_fd < 0 && (null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "Cannot open '/dev/null': %d, %s\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return null_fd;
+}
+
+void mp4_unit(struct au *au)
+{
+	unsigned int dropped;
+
+	pthread_mutex_lock(&lock);
+	if (!running || closing) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* an empty queue takes any unit, however large */
+	if (head != tail && (tail - head >= MP4_QUEUE || queued_bytes + au->size > (size_t)MP4_QUEUE_KB << 10)) {
+		for (dropped = 0; tail != head; dropped++)
+			au_unref(queue[--tail % MP4_QUEUE]);
+		queued_bytes = 0;
+		drops++;
+		dropped_units += dropped;
+		waiting = 1;
+		stats_event("mp4: writer %u units behind, dropped, resuming at the next keyframe", dropped);
+	}
+	if (au->flags & AU_KEYFRAME)
+		waiting = 0;
+	if (waiting && !(au->flags & AU_CONFIG)) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	queue[tail++ % MP4_QUEUE] = au_ref(au);
+	queued_bytes += au->size;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* returns 0 or -1 with errno set */
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt < MP4_IOV ? iovcnt : MP4_IOV)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* a file of the segment directory */
+static int write_file(const char *base, struct iovec *iov, int iovcnt)
+{
+	char path[MP4_PATH];
+	int fd, err = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", mp4_spec, base);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+		write_all(fd, iov, iovcnt) < 0) {
+		err = errno;
+		stats_event("mp4: %s: %d, %s", path, errno, strerror(errno));
+	}
+	if (fd >= 0)
+		close(fd);
+	return err ? -1 : 0;
+}
+
+static void write_init(void)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)mp4_mux_init(mux, &iov.iov_len);
+	if (dir_mode ? write_file("init.mp4", &iov, 1) < 0 : write_all(out_fd, &iov, 1) < 0) {
+		if (!dir_mode) {
+			stats_event("mp4: write error %d, %s, stopped", errno, strerror(errno));
+			failed = 1;
+		}
+		return;
+	}
+	inits++;
+	init_written = 1;
+}
+
+static void write_fragment(void)
+{
+	struct iovec *iov;
+	char base[32];
+	size_t size;
+	int64_t start = now_us(), took;
+	int n, count = mp4_mux_samples(mux);
+
+	if ((n = mp4_mux_fragment(mux, dir_mode, &iov, &size)) == 0)
+		return;
+	if (!dir_mode && !init_written)
+		write_init();
+	if (dir_mode) {
+		snprintf(base, sizeof(base), "%08lu.m4s", fragments);
+		write_file(base, iov, n);
+	}
+	else if (!failed && write_all(out_fd, iov, n) < 0) {
+		stats_event("mp4: write error %d, %s, stopped", errno, strerror(errno));
+		failed = 1;
+	}
+	mp4_mux_clear(mux);
+
+	took = now_us() - start;
+	write_sum += took;
+	if (took > write_max)
+		write_max = took;
+	fragments++;
+	samples += count;
+	bytes += size;
+	if ((unsigned long)count > max_samples)
+		max_samples = count;
+	if (size > max_bytes)
+		max_bytes = size;
+}
+
+static void mux_unit(struct au *au)
+{
+	size_t size;
+
+	if (au->flags & AU_CONFIG) {
+		/* a stream has one init segment, a directory gets a new one if the config changes */
+		if (!dir_mode && init_written)
+			return;
+		switch (mp4_mux_config(mux, au)) {
+		case -1:
+			if (!mp4_mux_init(mux, &size))
+				stats_event("mp4: no SPS and PPS in the codec config, only H.264 goes into fMP4");
+			break;
+		case 1:
+			if (dir_mode)
+				write_init();
+			break;
+		}
+		return;
+	}
+	if (failed || !mp4_mux_init(mux, &size))
+		return;
+	if (!started) {
+		if (!(au->flags & AU_KEYFRAME))
+			return;
+		started = 1;
+	}
+
+	if (mp4_mux_samples(mux) && ((au->flags & AU_KEYFRAME) || !mp4_mux_room(mux, au)))
+		write_fragment();
+	mp4_mux_add(mux, au);
+	if (mp4_per_frame)
+		write_fragment();
+}
+
+static void *mp4_thread(void *arg)
+{
+	struct au *au;
+	sigset_t pipe;
+
+	rt_setup_thread(RT_THREAD_OUTPUT);
+	/* a reader going away stops the fMP4 stream rather than killing the process */
+	sigemptyset(&pipe);
+	sigaddset(&pipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe, NULL);
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (head == tail && !closing)
+			pthread_cond_wait(&cond, &lock);
+		if (head == tail)
+			break;
+		au = queue[head++ % MP4_QUEUE];
+		queued_bytes -= au->size;
+		pthread_mutex_unlock(&lock);
+
+		mux_unit(au);
+		au_unref(au);
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	write_fragment();
+	return NULL;
+}
+
+void mp4_open(void)
+{
+	struct stat st;
+	size_t length;
+
+	if (!mp4_spec)
+		return;
+
+	length = strlen(mp4_spec);
+	if (!strcmp(mp4_spec, "-"))
+		out_fd = STDOUT_FILENO;
+	else if ((length && mp4_spec[length - 1] == '/') || (stat(mp4_spec, &st) == 0 && S_ISDIR(st.st_mode))) {
+		dir_mode = 1;
+		if (access(mp4_spec, W_OK) < 0) {
+			fprintf(stderr, "Cannot write to '%s': %d, %s\n", mp4_spec, errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	else if ((out_fd = open(mp4_spec, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", mp4_spec, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if ((mux = mp4_mux_new()) == NULL || (errno = pthread_create(&thread, NULL, mp4_thread, NULL)) != 0) {
+		fprintf(stderr, "Cannot start the fMP4 writer: %d, %s\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	running = 1;
+}
+
+/* mux and write out what is queued, the last fragment included */
+void mp4_close(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	closing = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	pthread_mutex_unlock(&lock);
+
+	mp4_mux_free(mux);
+	mux = NULL;
+	if (out_fd >= 0 && out_fd != STDOUT_FILENO)
+		close(out_fd);
+	out_fd = -1;
+}
+
+void mp4_report(FILE *out)
+{
+	size_t queued;
+
+	if (!mp4_spec)
+		return;
+
+	pthread_mutex_lock(&lock);
+	queued = queued_bytes;
+	pthread_mutex_unlock(&lock);
+	fprintf(out, "mp4 %s: %lu fragments of %.1f samples avg, %lu max, %llu KB max, %llu bytes, %lu init segments, "
+		"write %.1f ms avg %.1f ms max; %zu KB queued, %lu drops (%lu units)%s\n",
+		mp4_spec, fragments, fragments ? (double)samples / fragments : 0.0, max_samples,
+		(unsigned long long)(max_bytes >> 10), (unsigned long long)bytes, inits,
+		fragments ? write_sum / 1000.0 / fragments : 0.0, write_max / 1000.0,
+		queued >> 10, drops, dropped_units, failed ? ", stopped" : "");
+}
@@ -0,0 +1,40 @@
+/*
+ * Fragmented MP4 (ISO BMFF) output
+ */
+
+#ifndef MP4_H
+#define MP4_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "au.h"
+
+#define MP4_TIMESCALE     90000
+
+extern char *mp4_spec;
+extern int   mp4_per_frame;
+
+void mp4_open(void);
+int mp4_raw_fd(void);
+void mp4_unit(struct au *au);
+void mp4_close(void);
+void mp4_report(FILE *out);
+
+/* the muxer underneath, one H.264 track, for other writers */
+struct mp4_mux;
+
+struct mp4_mux *mp4_mux_new(void);
+int mp4_mux_config(struct mp4_mux *m, const struct au *config);
+const unsigned char *mp4_mux_init(struct mp4_mux *m, size_t *size);
+int mp4_mux_room(struct mp4_mux *m, const struct au *au);
+void mp4_mux_add(struct mp4_mux *m, struct au *au);
+int mp4_mux_samples(struct mp4_mux *m);
+int64_t mp4_mux_duration_us(struct mp4_mux *m);
+int mp4_mux_fragment(struct mp4_mux *m, int styp, struct iovec **iov, size_t *size);
+void mp4_mux_clear(struct mp4_mux *m);
+void mp4_mux_free(struct mp4_mux *m);
+
+#endif /* MP4_H */
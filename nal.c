@@ -0,0 +1,354 @@
+/*
+ * H.264 Annex B scanning and the IDR seek index
+ *
+ * Start codes are found by looking for a pair of zero bytes a block at a
+ * time, 16 bytes with NEON or SSE2 and a machine word otherwise; only blocks
+ * with a pair in them are looked at byte by byte. Coded slice data has few
+ * zero bytes and next to no pairs (emulation prevention sees to that), so the
+ * scan runs at close to memory speed and never parses inside a NAL unit.
+ *
+ * nal_scan() is the streaming form, fed the stream in pieces of any size as it
+ * is written (or read back); it reports each start code's offset and the two
+ * bytes after it, which is all it takes to tell where access units begin.
+ *
+ * The IDR index built on it is a sidecar file of fixed size entries, one per
+ * IDR access unit: its byte offset (from the SPS that goes with it, so a cut
+ * there plays on its own), capture timestamp, size and frame number. A day of
+ * 30 fps footage with a keyframe a second is about 2 MB of index, and finding
+ * a time in it is a binary search. Entries are flushed as they are made, so
+ * the index of a recording still in progress is good up to its last IDR.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "nal.h"
+
+#define NAL_READ (4 << 20)     /* bytes to a read when indexing a file */
+
+/* 1 if a pair of zero bytes may start in the block at p; p[NAL_BLOCK] is readable */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define NAL_BLOCK 16
+
+static int pair_in_block(const unsigned char *p)
+{
+	const uint8x16_t zero = vdupq_n_u8(0);
+	uint64x2_t pairs = vreinterpretq_u64_u8(vandq_u8(vceqq_u8(vld1q_u8(p), zero), vceqq_u8(vld1q_u8(p + 1), zero)));
+
+	return (vgetq_lane_u64(pairs, 0) | vgetq_lane_u64(pairs, 1)) != 0;
+}
+#elif defined(__SSE2__)
+#define NAL_BLOCK 16
+
+static int pair_in_block(const unsigned char *p)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	return _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), zero),
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), zero))) != 0;
+}
+#else
+#define NAL_BLOCK sizeof(size_t)
+
+/* any zero byte in the word will do */
+static int pair_in_block(const unsigned char *p)
+{
+	const size_t ones = (size_t)-1 / 255;
+	size_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return ((v - ones) & ~v & ones * 0x80) != 0;
+}
+#endif
+
+/* the first zero byte followed by another (or by the end), end if there is none */
+static const unsigned char *zero_pair(const unsigned char *p, const unsigned char *end)
+{
+	const unsigned char *stop;
+
+	while (p < end) {
+		while ((size_t)(end - p) > NAL_BLOCK && !pair_in_block(p))
+			p += NAL_BLOCK;
+		for (stop = (size_t)(end - p) > NAL_BLOCK ? p + NAL_BLOCK : end; p < stop; p++)
+			if (!p[0] && (p + 1 == end || !p[1]))
+				return p;
+	}
+	return end;
+}
+
+/* after the next 00 00 01 at or after p, end if there is none */
+const unsigned char *nal_find_start(const unsigned char *p, const unsigned char *end)
+{
+	for (;;) {
+		p = zero_pair(p, end);
+		if (end - p < 3)
+			return end;
+		if (p[2] == 1)
+			return p + 3;
+		p++;
+	}
+}
+
+/* the next NAL unit of an Annex B buffer, trailing zeros (and a 4 byte start code's first) left out */
+int nal_next(const unsigned char **pos, const unsigned char *end, const unsigned char **nal, size_t *length)
+{
+	const unsigned char *p, *q;
+
+	do {
+		if ((p = nal_find_start(*pos, end)) == end)
+			return 0;
+		if ((q = nal_find_start(p, end)) != end)
+			q -= 3;
+		*pos = q;
+		while (q > p && q[-1] == 0)
+			q--;
+	}
+	while (q == p);
+	*nal = p;
+	*length = q - p;
+	return 1;
+}
+
+void nal_scanner_init(struct nal_scanner *s, nal_fn fn, void *arg)
+{
+	memset(s, 0, sizeof(*s));
+	s->fn = fn;
+	s->arg = arg;
+}
+
+void nal_scan(struct nal_scanner *s, const void *data, size_t length, int64_t timestamp)
+{
+	const unsigned char *p = data, *end = p + length;
+
+	while (p < end) {
+		/* the header of a NAL unit whose start code ended the last piece */
+		if (s->wanted) {
+			s->header[2 - s->wanted--] = *p++;
+			if (!s->wanted) {
+				s->fn(s->arg, s->start, s->header, timestamp);
+				s->zeros = s->header[1] == 0;
+			}
+			continue;
+		}
+		if (!s->zeros && (p = zero_pair(p, end)) == end)
+			break;
+		if (*p == 0) {
+			if (s->zeros < 3)
+				s->zeros++;
+		}
+		else {
+			if (*p == 1 && s->zeros >= 2) {
+				s->start = s->offset + (p - (const unsigned char *)data) - s->zeros;
+				s->wanted = 2;
+			}
+			s->zeros = 0;
+		}
+		p++;
+	}
+	s->offset += length;
+}
+
+struct nal_index {
+	struct nal_scanner scan;
+	FILE              *fp;
+	const char        *path;
+	double             fps;
+	uint64_t           unit_start;
+	int64_t            unit_timestamp;
+	int                unit_open, unit_slices, unit_idr;
+	uint32_t           frames;
+	unsigned long      entries, nals, errors;
+};
+
+/* the access unit gathered so far ends at end */
+static void end_unit(struct nal_index *x, uint64_t end)
+{
+	struct nal_index_entry e;
+
+	if (x->unit_idr) {
+		e.offset = x->unit_start;
+		e.timestamp = x->unit_timestamp;
+		e.size = end - x->unit_start;
+		e.frame = x->frames;
+		if (fwrite(&e, sizeof(e), 1, x->fp) != 1 || fflush(x->fp) != 0)
+			x->errors++;
+		x->entries++;
+	}
+	if (x->unit_slices)
+		x->frames++;
+	x->unit_open = x->unit_slices = x->unit_idr = 0;
+}
+
+static void index_nal(void *arg, uint64_t offset, const unsigned char header[2], int64_t timestamp)
+{
+	struct nal_index *x = arg;
+	unsigned int type = header[0] & 0x1f;
+	int slice = type == 1 || type == 5;
+
+	x->nals++;
+	/* what begins the next access unit once this one has a picture: SEI, SPS, PPS, AUD, prefix NAL units
+	 * and a first slice (first_mb_in_slice 0, a single 1 bit) */
+	if (x->unit_slices && ((type >= 6 && type <= 9) || (type >= 14 && type <= 18) || (slice && (header[1] & 0x80))))
+		end_unit(x, offset);
+	if (!x->unit_open) {
+		x->unit_open = 1;
+		x->unit_start = offset;
+	}
+	if (slice) {
+		if (!x->unit_slices++)
+			x->unit_timestamp = x->fps > 0 ? (int64_t)(x->frames * 1000000.0 / x->fps) : timestamp;
+		if (type == 5)
+			x->unit_idr = 1;
+	}
+}
+
+/* timestamps are those fed, or with fps those of frames at that rate from 0 */
+struct nal_index *nal_index_new(const char *path, double fps)
+{
+	struct nal_index *x;
+	struct nal_index_header h;
+	struct timespec real, mono;
+
+	if ((x = calloc(1, sizeof(*x))) == NULL)
+		return NULL;
+	if ((x->fp = fopen(path, "wb")) == NULL) {
+		free(x);
+		return NULL;
+	}
+	x->path = path;
+	x->fps = fps;
+	nal_scanner_init(&x->scan, index_nal, x);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, NAL_INDEX_MAGIC, sizeof(h.magic));
+	h.entry_size = sizeof(struct nal_index_entry);
+	if (fps > 0)
+		h.flags = NAL_INDEX_FRAME_TIMES;
+	else {
+		clock_gettime(CLOCK_REALTIME, &real);
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		h.realtime_offset_us = (real.tv_sec - mono.tv_sec) * (int64_t)1000000 + (real.tv_nsec - mono.tv_nsec) / 1000;
+	}
+	if (fwrite(&h, sizeof(h), 1, x->fp) != 1 || fflush(x->fp) != 0) {
+		fclose(x->fp);
+		free(x);
+		return NULL;
+	}
+	return x;
+}
+
+void nal_index_feed(struct nal_index *x, const void *data, size_t length, int64_t timestamp)
+{
+	nal_scan(&x->scan, data, length, timestamp);
+}
+
+void nal_index_report(struct nal_index *x, FILE *out)
+{
+	/* the unit in progress counted */
+	fprintf(out, "idr index %s: %lu IDR entries, %lu frames, %lu NAL units in %llu bytes%s\n",
+		x->path, x->entries + x->unit_idr, (unsigned long)x->frames + (x->unit_slices > 0), x->nals,
+		(unsigned long long)x->scan.offset, x->errors ? ", write errors" : "");
+}
+
+/* the last access unit ends with the stream */
+void nal_index_free(struct nal_index *x)
+{
+	if (x == NULL)
+		return;
+	end_unit(x, x->scan.offset);
+	fclose(x->fp);
+	free(x);
+}
+
+/* index an Annex B file, reading it through one buffer; the bytes scanned, -1 with errno set */
+int64_t nal_index_file(const char *path, const char *index_path, double fps, FILE *report)
+{
+	struct nal_index *x;
+	unsigned char *buf;
+	ssize_t n;
+	int fd, err = 0;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if ((buf = malloc(NAL_READ)) == NULL || (x = nal_index_new(index_path, fps)) == NULL) {
+		err = errno;
+		free(buf);
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	while ((n = read(fd, buf, NAL_READ)) != 0)
+		if (n > 0)
+			nal_index_feed(x, buf, n, 0);
+		else if (errno != EINTR) {
+			err = errno;
+			break;
+		}
+	close(fd);
+	free(buf);
+
+	if (report)
+		nal_index_report(x, report);
+	n = x->scan.offset;
+	nal_index_free(x);
+	errno = err;
+	return err ? -1 : n;
+}
+
+struct nal_index_entry *nal_index_load(const char *path, struct nal_index_header *header, size_t *count)
+{
+	struct nal_index_entry *entries = NULL;
+	FILE *fp;
+	off_t size;
+
+	if ((fp = fopen(path, "rb")) == NULL)
+		return NULL;
+	if (fread(header, sizeof(*header), 1, fp) != 1 || memcmp(header->magic, NAL_INDEX_MAGIC, sizeof(header->magic)) ||
+		header->entry_size != sizeof(struct nal_index_entry)) {
+		errno = EINVAL;
+		goto out;
+	}
+	if (fseeko(fp, 0, SEEK_END) < 0 || (size = ftello(fp)) < 0 || fseeko(fp, sizeof(*header), SEEK_SET) < 0)
+		goto out;
+	/* a torn last entry of an index being written is left out */
+	*count = (size - sizeof(*header)) / sizeof(*entries);
+	if ((entries = malloc(*count * sizeof(*entries) + 1)) != NULL && fread(entries, sizeof(*entries), *count, fp) != *count) {
+		free(entries);
+		entries = NULL;
+		errno = EIO;
+	}
+out:
+	fclose(fp);
+	return entries;
+}
+
+/* the last entry at or before timestamp, the first if there is none */
+size_t nal_index_find(const struct nal_index_entry *entries, size_t count, int64_t timestamp)
+{
+	size_t low = 0, high = count;
+
+	while (high - low > 1) {
+		size_t mid = low + (high - low) / 2;
+
+		if (entries[mid].timestamp <= timestamp)
+			low = mid;
+		else
+			high = mid;
+	}
+	return low;
+}
@@ -0,0 +1,63 @@
+/*
+ * H.264 Annex B scanning and the IDR seek index
+ */
+
+#ifndef NAL_H
+#define NAL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NAL_INDEX_MAGIC   "H264IDX1"
+
+/* index file: a header, then an entry per IDR access unit in stream order, both host byte order */
+struct nal_index_header {
+	char     magic[8];
+	uint32_t entry_size;            /* sizeof(struct nal_index_entry) */
+	uint32_t flags;
+	int64_t  realtime_offset_us;    /* CLOCK_REALTIME - CLOCK_MONOTONIC when written, 0 if unknown */
+};
+
+#define NAL_INDEX_FRAME_TIMES 1     /* timestamps are frame numbers at a nominal rate, not capture times */
+
+struct nal_index_entry {
+	uint64_t offset;                /* of the access unit, SPS and PPS included */
+	int64_t  timestamp;             /* us */
+	uint32_t size;                  /* of the access unit */
+	uint32_t frame;                 /* frames before it in the stream */
+};
+
+/* called with the offset of each NAL unit's start code and its first two bytes */
+typedef void (*nal_fn)(void *arg, uint64_t offset, const unsigned char header[2], int64_t timestamp);
+
+/* start codes across buffer boundaries */
+struct nal_scanner {
+	uint64_t       offset;          /* of the next byte fed */
+	uint64_t       start;           /* of the start code whose header is being gathered */
+	unsigned int   zeros, wanted;
+	unsigned char  header[2];
+	nal_fn         fn;
+	void          *arg;
+};
+
+const unsigned char *nal_find_start(const unsigned char *p, const unsigned char *end);
+int nal_next(const unsigned char **pos, const unsigned char *end, const unsigned char **nal, size_t *length);
+
+void nal_scanner_init(struct nal_scanner *s, nal_fn fn, void *arg);
+void nal_scan(struct nal_scanner *s, const void *data, size_t length, int64_t timestamp);
+
+/* IDR index writing, fed the stream as it is written */
+struct nal_index;
+
+struct nal_index *nal_index_new(const char *path, double fps);
+void nal_index_feed(struct nal_index *x, const void *data, size_t length, int64_t timestamp);
+void nal_index_report(struct nal_index *x, FILE *out);
+void nal_index_free(struct nal_index *x);
+int64_t nal_index_file(const char *path, const char *index_path, double fps, FILE *report);
+
+/* an index read back; entries NULL if path is not an index */
+struct nal_index_entry *nal_index_load(const char *path, struct nal_index_header *header, size_t *count);
+size_t nal_index_find(const struct nal_index_entry *entries, size_t count, int64_t timestamp);
+
+#endif /* NAL_H */
@@ -0,0 +1,624 @@
+/*
+ * Stand-in encoder backend
+ *
+ * --encoder null runs capture and everything after the encoder as the others
+ * do, with the encoder left out: each captured frame is handed straight back
+ * to the driver and becomes an H.264-shaped access unit of bitrate / fps
+ * bytes, a filler slice, with a real SPS and PPS for the capture size in
+ * front of every IDR (idr_period frames apart, a second without one). The
+ * stream does not decode. It is there so capture, the output stage, the
+ * muxers and daemon mode can be run and measured on any V4L2 device, vivid
+ * included, without the Pi's encoder, e.g.
+ *
+ *   capture-encode -n --encoder null -d /dev/video0 --camera /dev/video1,out=file:cam1.h264 > cam0.h264
+ *
+ * -d runs on the calling thread with stdout, the output stage and the control
+ * socket as with the other backends; each --camera runs on a thread of its
+ * own with its stream going to a sink of its own (sink_new/sink_put). On exit
+ * every camera reports its frames, bytes and the CPU time of its thread, and
+ * with --camera the process's CPU time and peak RSS follow: the per-camera
+ * cost of capture and output alone, encoder aside.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "encoder.h"
+#include "output.h"
+#include "abr.h"
+#include "control.h"
+#include "gop.h"
+#include "sink.h"
+#include "server.h"
+#include "shmout.h"
+#include "stats.h"
+#include "preroll.h"
+#include "segment.h"
+#include "mp4.h"
+#include "hls.h"
+
+#define NULL_BUFFERS      8         /* access units the output stage can hold, as M2M_CODED_BUFFERS */
+#define NULL_BITRATE      2000000   /* without --bitrate */
+#define NULL_MIN_UNIT     16
+#define NULL_CONFIG       64
+
+extern int bitrate, idr_period;
+
+struct null_buffer {
+	unsigned char  *data;
+	size_t          capacity;
+	int             busy;           /* with the output stage, cleared from its thread */
+};
+
+struct null_camera {
+	int              index;
+	struct capture  *cap;
+	struct sink     *sink;          /* --camera ones */
+	pthread_t        thread;
+	int              frames, running;
+	unsigned int     fps, idr_every;
+	unsigned char    config[NULL_CONFIG];
+	size_t           config_size;
+	unsigned char   *unit;          /* --camera ones: built here, then copied into an access unit */
+	size_t           unit_capacity;
+	unsigned long    framenumber, outframenumber, dropped, skipped;
+	uint64_t         outbytes;
+	int64_t          firstcapture_us, lastout_us;
+	double           cpu_s;
+};
+
+static struct null_camera  cameras[CAMERA_MAX];
+static int                 ncameras = 1, started, torndown;
+static volatile int        stop, idr_requested;
+static struct null_buffer  buffers[NULL_BUFFERS];
+static int                 target_bps = NULL_BITRATE, framedivisor = 1;
+static unsigned int        skipcount;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+/* RBSP bits, for the SPS and PPS */
+struct bits {
+	unsigned char  data[NULL_CONFIG];
+	size_t         bytes;
+	unsigned int   bit;
+};
+
+static void put_bits(struct bits *b, unsigned int value, int count)
+{
+	while (count-- > 0 && b->bytes < sizeof(b->data)) {
+		if (!b->bit)
+			b->data[b->bytes] = 0;
+		b->data[b->bytes] |= ((value >> count) & 1) << (7 - b->bit);
+		if (++b->bit == 8) {
+			b->bit = 0;
+			b->bytes++;
+		}
+	}
+}
+
+static void put_ue(struct bits *b, unsigned int value)
+{
+	int length = 0;
+
+	while ((value + 1) >> (length + 1))
+		length++;
+	put_bits(b, 0, length);
+	put_bits(b, value + 1, length + 1);
+}
+
+static void put_trailing(struct bits *b)
+{
+	put_bits(b, 1, 1);
+	while (b->bit)
+		put_bits(b, 0, 1);
+}
+
+/* a NAL unit with its start code, emulation prevention bytes put in; the bytes it took */
+static size_t put_nal(unsigned char *out, size_t room, unsigned int header, const struct bits *b)
+{
+	size_t n = 0, i, zeros = 0;
+
+	if (room < 5 + b->bytes * 3 / 2)
+		return 0;
+	memcpy(out, "\0\0\0\1", 4);
+	out[4] = header;
+	n = 5;
+	for (i = 0; i < b->bytes; i++) {
+		if (zeros >= 2 && b->data[i] <= 3) {
+			out[n++] = 3;
+			zeros = 0;
+		}
+		zeros = b->data[i] ? 0 : zeros + 1;
+		out[n++] = b->data[i];
+	}
+	return n;
+}
+
+/* baseline SPS and PPS for width x height, cropped from whole macroblocks */
+static size_t make_config(unsigned char *out, size_t room, unsigned int width, unsigned int height)
+{
+	struct bits sps, pps;
+	unsigned int mbs_wide = (width + 15) / 16, mbs_high = (height + 15) / 16;
+	size_t n;
+
+	memset(&sps, 0, sizeof(sps));
+	put_bits(&sps, 66, 8);                  /* profile_idc: baseline */
+	put_bits(&sps, 0xc0, 8);                /* constraint_set0 and 1 */
+	put_bits(&sps, 40, 8);                  /* level_idc 4.0 */
+	put_ue(&sps, 0);                        /* seq_parameter_set_id */
+	put_ue(&sps, 0);                        /* log2_max_frame_num_minus4 */
+	put_ue(&sps, 2);                        /* pic_order_cnt_type */
+	put_ue(&sps, 1);                        /* max_num_ref_frames */
+	put_bits(&sps, 0, 1);                   /* gaps_in_frame_num_value_allowed_flag */
+	put_ue(&sps, mbs_wide - 1);
+	put_ue(&sps, mbs_high - 1);
+	put_bits(&sps, 1, 1);                   /* frame_mbs_only_flag */
+	put_bits(&sps, 1, 1);                   /* direct_8x8_inference_flag */
+	if (mbs_wide * 16 != width || mbs_high * 16 != height) {
+		put_bits(&sps, 1, 1);               /* frame_cropping_flag, in 4:2:0 chroma samples */
+		put_ue(&sps, 0);
+		put_ue(&sps, (mbs_wide * 16 - width) / 2);
+		put_ue(&sps, 0);
+		put_ue(&sps, (mbs_high * 16 - height) / 2);
+	}
+	else
+		put_bits(&sps, 0, 1);
+	put_bits(&sps, 0, 1);                   /* vui_parameters_present_flag */
+	put_trailing(&sps);
+
+	memset(&pps, 0, sizeof(pps));
+	put_ue(&pps, 0);                        /* pic_parameter_set_id */
+	put_ue(&pps, 0);                        /* seq_parameter_set_id */
+	put_bits(&pps, 0, 2);                   /* CAVLC, no bottom_field_pic_order_in_frame_present_flag */
+	put_ue(&pps, 0);                        /* num_slice_groups_minus1 */
+	put_ue(&pps, 0);                        /* num_ref_idx_l0_default_active_minus1 */
+	put_ue(&pps, 0);                        /* num_ref_idx_l1_default_active_minus1 */
+	put_bits(&pps, 0, 3);                   /* weighted_pred_flag, weighted_bipred_idc */
+	put_ue(&pps, 0);                        /* pic_init_qp_minus26, se(0) */
+	put_ue(&pps, 0);                        /* pic_init_qs_minus26 */
+	put_ue(&pps, 0);                        /* chroma_qp_index_offset */
+	put_bits(&pps, 4, 3);                   /* deblocking_filter_control_present_flag only */
+	put_trailing(&pps);
+
+	if ((n = put_nal(out, room, 0x67, &sps)) == 0)
+		return 0;
+	return n + put_nal(out + n, room - n, 0x68, &pps);
+}
+
+/* a filler slice of size bytes: a start code, the NAL header, first_mb_in_slice 0, no zero bytes after */
+static void make_unit(unsigned char *out, size_t size, int idr)
+{
+	memcpy(out, "\0\0\0\1", 4);
+	out[4] = idr ? 0x65 : 0x41;
+	out[5] = 0x88;
+	memset(out + 6, 0x5a, size - 6);
+}
+
+/* bytes a frame gets at the current bitrate */
+static size_t unit_size(struct null_camera *c)
+{
+	/* camera 0 sends every framedivisor-th frame, each one that much bigger */
+	size_t size = (size_t)target_bps * (c->index ? 1 : framedivisor) / 8 / c->fps;
+
+	return size < NULL_MIN_UNIT ? NULL_MIN_UNIT : size;
+}
+
+/* called from the output thread once a unit is written; the config has no buffer */
+static void release_unit(void *piece)
+{
+	if (piece)
+		__sync_lock_release(&((struct null_buffer *)piece)->busy);
+}
+
+static void start_camera(struct null_camera *c)
+{
+	unsigned int bufsize;
+
+	open_device(c->cap);
+	bufsize = init_device(c->cap);
+	fprintf(stderr, "%s: capture buffer size: %d\n", c->cap->dev_name, bufsize);
+	init_buffers(c->cap, bufsize, NULL);
+
+	if ((c->fps = capture_frame_rate(c->cap)) == 0)
+		c->fps = 30;
+	c->idr_every = idr_period > 0 ? (unsigned int)idr_period : c->fps;
+	if ((c->config_size = make_config(c->config, sizeof(c->config), c->cap->v4l2_fmt.fmt.pix.width,
+		c->cap->v4l2_fmt.fmt.pix.height)) == 0) {
+		fprintf(stderr, "%s: no SPS for %ux%u\n", c->cap->dev_name, c->cap->v4l2_fmt.fmt.pix.width,
+			c->cap->v4l2_fmt.fmt.pix.height);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* camera 0's unit to the output stage */
+static void output_unit(struct null_camera *c, size_t size, int idr, int64_t now)
+{
+	struct null_buffer *b;
+	unsigned char *data;
+	int i;
+
+	for (i = 0; i < NULL_BUFFERS && __sync_lock_test_and_set(&buffers[i].busy, 1); i++)
+		;
+	if (i == NULL_BUFFERS) {
+		c->dropped++;
+		return;
+	}
+	b = &buffers[i];
+	if (b->capacity < size) {
+		if ((data = realloc(b->data, size)) == NULL) {
+			__sync_lock_release(&b->busy);
+			c->dropped++;
+			return;
+		}
+		b->data = data;
+		b->capacity = size;
+	}
+	make_unit(b->data, size, idr);
+	if (idr)
+		output_piece(NULL, c->config, c->config_size, now, OUTPUT_CONFIG);
+	output_piece(b, b->data, size, now, OUTPUT_END | (idr ? OUTPUT_KEYFRAME : 0));
+	output_flush();
+}
+
+/* another camera's unit to its sink */
+static void sink_unit_of(struct null_camera *c, size_t size, int idr, int64_t now)
+{
+	struct au *au;
+
+	if (idr && (au = au_append(au_new(c->config_size), c->config, c->config_size)) != NULL) {
+		au->flags = AU_CONFIG;
+		au->timestamp = now;
+		sink_put(c->sink, au);
+		au_unref(au);
+	}
+	if (c->unit_capacity < size) {
+		free(c->unit);
+		if ((c->unit = malloc(size)) == NULL) {
+			c->unit_capacity = 0;
+			c->dropped++;
+			return;
+		}
+		c->unit_capacity = size;
+	}
+	make_unit(c->unit, size, idr);
+	if ((au = au_append(au_new(size), c->unit, size)) == NULL) {
+		c->dropped++;
+		return;
+	}
+	au->flags = idr ? AU_KEYFRAME : 0;
+	au->timestamp = now;
+	sink_put(c->sink, au);
+	au_unref(au);
+}
+
+static void feed_frame(struct null_camera *c)
+{
+	void *data;
+	unsigned int size;
+	size_t bytes;
+	int index, idr;
+	int64_t now;
+
+	if ((index = capture_frame_index(c->cap, &data, &size)) < 0)
+		return;
+	/* the frame itself is never looked at */
+	release_frame_index(c->cap, index);
+	now = now_us();
+	if (c->framenumber++ == 0)
+		c->firstcapture_us = now;
+
+	/* frame rate step-down (--abr_fps_step), camera 0 only */
+	if (!c->index && framedivisor > 1 && skipcount++ % framedivisor) {
+		c->skipped++;
+		return;
+	}
+
+	idr = c->outframenumber % c->idr_every == 0;
+	if (!c->index && hls_keyframe_due(now))
+		idr = 1;
+	if (!c->index && idr_requested) {
+		idr_requested = 0;
+		idr = 1;
+	}
+	bytes = unit_size(c);
+	if (c->index)
+		sink_unit_of(c, bytes, idr, now);
+	else
+		output_unit(c, bytes, idr, now);
+	c->outframenumber++;
+	c->outbytes += bytes + (idr ? c->config_size : 0);
+	c->lastout_us = now;
+}
+
+static void adapt_bitrate(void)
+{
+	int target, divisor;
+
+	if (!abr_update(now_us(), output_backlog(), output_written(), &target, &divisor))
+		return;
+	target_bps = target;
+	framedivisor = divisor;
+}
+
+/* capture until frames, stop or 5 s without a frame */
+static void run_camera(struct null_camera *c)
+{
+	struct pollfd pfd;
+	struct timespec cpu;
+	int n;
+
+	start_capturing(c->cap);
+	pfd.fd = c->cap->fd;
+	pfd.events = POLLIN;
+	while (!stop && c->framenumber < (unsigned long)c->frames) {
+		if (!c->index)
+			control_poll();
+		if ((n = poll(&pfd, 1, 5000)) < 0) {
+			if (EINTR == errno)
+				continue;
+			fprintf(stderr, "%s: poll error %d, %s\n", c->cap->dev_name, errno, strerror(errno));
+			break;
+		}
+		if (n == 0) {
+			fprintf(stderr, "%s: nothing captured for 5 s\n", c->cap->dev_name);
+			break;
+		}
+		feed_frame(c);
+		if (!c->index && abr)
+			adapt_bitrate();
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	c->cpu_s = cpu.tv_sec + cpu.tv_nsec / 1000000000.0;
+}
+
+static void *camera_thread(void *arg)
+{
+	run_camera(arg);
+	return NULL;
+}
+
+static void camera_report(struct null_camera *c, FILE *out)
+{
+	double seconds = (c->lastout_us - c->firstcapture_us) / 1000000.0;
+
+	fprintf(out, "camera %d %s: %lu frames in, %lu out, %lu skipped, %lu dropped, %llu bytes, %.2f fps sustained, "
+		"%.2f s cpu (%.1f us a frame)\n", c->index, c->cap->dev_name, c->framenumber, c->outframenumber, c->skipped,
+		c->dropped, (unsigned long long)c->outbytes,
+		c->outframenumber > 1 && seconds > 0 ? (c->outframenumber - 1) / seconds : 0.0, c->cpu_s,
+		c->framenumber ? c->cpu_s * 1000000 / c->framenumber : 0.0);
+}
+
+static double elapsed_ms(int64_t since_us)
+{
+	return (now_us() - since_us) / 1000.0;
+}
+
+/* control socket commands, as for the other encoders */
+static void null_command(int argc, char **argv, int64_t received_us, FILE *reply)
+{
+	if (!strcmp(argv[0], "idr") && argc == 1) {
+		idr_requested = 1;
+		output_watch_keyframe(received_us);
+		fprintf(reply, "ok\n");
+	}
+
+	else if (!strcmp(argv[0], "bitrate") && argc == 2) {
+		char *end;
+		long target;
+		errno = 0;
+		target = strtol(argv[1], &end, 0);
+		if (errno || end == argv[1] || *end || target <= 0 || target > INT_MAX)
+			fprintf(reply, "error bitrate '%s' is not a positive number of bits per second\n", argv[1]);
+		else {
+			target_bps = target;
+			// adaptive bitrate carries on from the new setting
+			if (abr)
+				abr_start(target);
+			stats_event("control: bitrate %ld applied %.1f ms after the command", target, elapsed_ms(received_us));
+			fprintf(reply, "ok %ld\n", target);
+		}
+	}
+
+	else if (!strcmp(argv[0], "record") && argc == 2) {
+		if (!strcmp(argv[1], "off")) {
+			sink_record_stop();
+			fprintf(reply, "ok\n");
+		}
+		else if (sink_record(argv[1], received_us) < 0)
+			fprintf(reply, "error %s: %s\n", argv[1], strerror(errno));
+		else {
+			// the recording starts from the GOP cache; without one, start it on a fresh keyframe
+			if (!gop_cached()) {
+				idr_requested = 1;
+				output_watch_keyframe(received_us);
+			}
+			fprintf(reply, "ok\n");
+		}
+	}
+
+	else if (!strcmp(argv[0], "trigger") && argc == 1) {
+		int started = preroll_trigger();
+		if (started < 0)
+			fprintf(reply, "error no --preroll\n");
+		else
+			fprintf(reply, "ok %s\n", started ? "extended" : "started");
+	}
+
+	else if (!strcmp(argv[0], "sink") && argc == 3 && (!strcmp(argv[1], "add") || !strcmp(argv[1], "remove"))) {
+		if ((argv[1][0] == 'a' ? sink_add(argv[2], received_us) : sink_remove(argv[2])) < 0)
+			fprintf(reply, "error %s: %s\n", argv[2], strerror(errno));
+		else
+			fprintf(reply, "ok\n");
+	}
+
+	else if (!strcmp(argv[0], "stats") && argc == 1) {
+		fprintf(reply, "ok\n");
+		for (int i = 0; i < ncameras; i++)
+			camera_report(&cameras[i], reply);
+		output_report(reply);
+		sink_report(reply);
+		for (int i = 1; i < ncameras; i++)
+			sink_report_one(cameras[i].sink, reply);
+		server_report(reply);
+		shmout_report(reply);
+		preroll_report(reply);
+		segment_report(reply);
+		mp4_report(reply);
+		hls_report(reply);
+		abr_report(reply);
+		stats_report(reply);
+	}
+
+	else
+		fprintf(reply, "error usage: idr | bitrate BPS | record FILE | record off | trigger | sink add|remove SPEC | stats\n");
+}
+
+static void null_teardown(void)
+{
+	struct rusage usage;
+	double cpu;
+	int i;
+
+	if (!started || torndown)
+		return;
+	torndown = 1;
+
+	stop = 1;
+	for (i = 1; i < ncameras; i++)
+		if (cameras[i].running && !pthread_equal(cameras[i].thread, pthread_self())) {
+			pthread_join(cameras[i].thread, NULL);
+			cameras[i].running = 0;
+		}
+
+	control_close();
+
+	output_close();
+	output_report(stderr);
+	sink_close_all(stderr);
+	server_report(stderr);
+	server_close();
+	shmout_report(stderr);
+	shmout_close();
+	preroll_report(stderr);
+	preroll_close();
+	segment_close();
+	segment_report(stderr);
+	mp4_close();
+	mp4_report(stderr);
+	hls_close();
+	hls_report(stderr);
+	abr_report(stderr);
+
+	for (i = 0; i < ncameras; i++) {
+		struct null_camera *c = &cameras[i];
+
+		stop_capturing(c->cap);
+		if (c->sink) {
+			sink_free(c->sink, stderr);
+			c->sink = NULL;
+		}
+		camera_report(c, stderr);
+		uninit_device(c->cap, 0);
+		close_device(c->cap);
+		free(c->unit);
+	}
+	for (i = 0; i < NULL_BUFFERS; i++)
+		free(buffers[i].data);
+
+	if (ncameras > 1) {
+		getrusage(RUSAGE_SELF, &usage);
+		cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+		fprintf(stderr, "%d cameras, null encoder: %.2f s cpu (%.2f s per camera), %ld KB max resident\n", ncameras,
+			cpu, cpu / ncameras, usage.ru_maxrss);
+	}
+}
+
+static void intHandler(int dummy) { exit(0); }
+
+/* daemon mode: another camera, started on a thread of its own once camera 0 is set up */
+static int null_camera_start(struct capture *cap, const char *out_spec, int frames, int raw)
+{
+	struct null_camera *c;
+
+	if (ncameras == CAMERA_MAX) {
+		fprintf(stderr, "At most %d cameras\n", CAMERA_MAX);
+		return -1;
+	}
+	c = &cameras[ncameras];
+	memset(c, 0, sizeof(*c));
+	c->index = ncameras;
+	c->cap = cap;
+	c->frames = frames;
+	if ((c->sink = sink_new(out_spec)) == NULL) {
+		fprintf(stderr, "Cannot open sink '%s' for %s: %d, %s\n", out_spec, cap->dev_name, errno, strerror(errno));
+		return -1;
+	}
+	start_camera(c);
+	ncameras++;
+	return 0;
+}
+
+static int null_encode_loop(struct capture *cap, int frames)
+{
+	struct null_camera *c = &cameras[0];
+	int i, err;
+
+	c->index = 0;
+	c->cap = cap;
+	c->frames = frames;
+	if (bitrate > 0)
+		target_bps = bitrate;
+	start_camera(c);
+
+	started = 1;
+	atexit(null_teardown);
+	signal(SIGINT, intHandler);
+
+	output_open(mp4_raw_fd(), release_unit, NULL_BUFFERS);
+	for (i = 0; i < sink_specs_count; i++)
+		if (sink_add(sink_specs[i], 0) < 0) {
+			fprintf(stderr, "Cannot open sink '%s': %d, %s\n", sink_specs[i], errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	server_open();
+	shmout_open();
+	preroll_open();
+	segment_open();
+	mp4_open();
+	hls_open();
+	if (abr)
+		abr_start(target_bps);
+
+	for (i = 1; i < ncameras; i++) {
+		if ((err = pthread_create(&cameras[i].thread, NULL, camera_thread, &cameras[i])) != 0) {
+			fprintf(stderr, "cannot start the thread for %s: %s\n", cameras[i].cap->dev_name, strerror(err));
+			exit(EXIT_FAILURE);
+		}
+		cameras[i].running = 1;
+	}
+
+	control_open(null_command);
+	run_camera(c);
+
+	null_teardown();
+	return 0;
+}
+
+const struct encoder encoder_null = { "null", null_encode_loop, null_camera_start };
@@ -0,0 +1,372 @@
+/*
+ * Encoded stream output
+ *
+ * The encoder hands over its output buffers piece by piece and gets each one
+ * back through the release callback once it is written. A separate thread does
+ * the writing, so a slow reader on the pipe holds up the output thread rather
+ * than capture or the OMX callbacks.
+ *
+ * With aggregate set, pieces are gathered until the end of an access unit
+ * (codec config included with the unit that follows) and the whole unit goes
+ * out in a single writev. Without it, whatever the encoder had ready when
+ * output_flush is called goes out at once, which is what low latency wants.
+ * Either way no more than max_held pieces are kept back: the encoder cannot
+ * finish a unit without buffers to put it in.
+ *
+ * output_backlog() adds what the kernel still holds for the reader (pipe
+ * contents or socket send queue) to what is waiting here, for rate control.
+ *
+ * When the GOP cache, sinks, the pre-roll, segments, fMP4 or HLS want them, pieces are also
+ * copied into refcounted access units as they are handed over, one copy per unit however
+ * many sinks there are; stdout keeps writing straight from the encoder buffers.
+ *
+ * With idr_index_file, what goes to stdout is also scanned for start codes on
+ * the output thread, piece by piece as it is written, into the IDR seek index
+ * (nal.c), so a long recording can be cut by seeking rather than scanning.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include "output.h"
+#include "stats.h"
+#include "rt.h"
+#include "au.h"
+#include "gop.h"
+#include "sink.h"
+#include "server.h"
+#include "shmout.h"
+#include "preroll.h"
+#include "segment.h"
+#include "mp4.h"
+#include "hls.h"
+#include "nal.h"
+
+int   aggregate = 1;
+char *au_index_file, *idr_index_file;
+
+struct piece {
+	void       *handle;
+	const void *data;
+	size_t      length;
+	int64_t     timestamp;
+	unsigned    flags;
+};
+
+static struct piece       pieces[OUTPUT_PIECES];
+static unsigned int       head, ready, tail;     /* written < ready to write < handed over */
+static int                out_fd = -1, out_socket, held_max, closing;
+static size_t             queued_bytes;
+static uint64_t           written_bytes;
+static output_release_fn  release_piece;
+static pthread_t          thread;
+static pthread_mutex_t    lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     cond = PTHREAD_COND_INITIALIZER;
+
+static int64_t            keyframe_requested_us;
+
+static struct au         *building;     /* access unit being copied out of the pieces, encoder side */
+static size_t             last_unit_size;
+
+static FILE              *index_fp;
+static struct nal_index   *idr_index;
+static struct access_unit unit;
+static int                frame_open;
+static unsigned long      units, writes, written_pieces, write_errors;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+/* returns 0 or -1 with errno set */
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (fd == out_fd)
+			writes++;
+		/* short write: skip what went out and carry on with the rest */
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void finish_unit(void)
+{
+	last_unit_size = building->size;
+	/* clients joining now get the cache replayed first, so the unit goes in after they have it */
+	server_unit(building);
+	sink_unit(building);
+	shmout_unit(building);
+	preroll_unit(building);
+	segment_unit(building);
+	mp4_unit(building);
+	hls_unit(building);
+	gop_add(building);
+	au_unref(building);
+	building = NULL;
+}
+
+/* copy a piece into the access unit being built; config pieces make a unit of their own */
+static void build_unit(const void *data, size_t length, int64_t timestamp, unsigned int flags)
+{
+	int config = (flags & OUTPUT_CONFIG) != 0;
+
+	if (!gop_cache_kb && !sink_count() && !serve_path && !shm_path && !preroll_dir && !segment_dir && !mp4_spec &&
+		!hls_dir && !config)
+		return;
+	if (building && building->size && ((building->flags & AU_CONFIG) != 0) != config)
+		finish_unit();
+	if (!building) {
+		if ((building = au_new(config ? length : last_unit_size + last_unit_size / 4 + 4096)) == NULL)
+			return;
+		building->flags = config ? AU_CONFIG : 0;
+		building->timestamp = timestamp;
+	}
+	if (flags & OUTPUT_KEYFRAME)
+		building->flags |= AU_KEYFRAME;
+	if ((building = au_append(building, data, length)) != NULL && (flags & OUTPUT_END))
+		finish_unit();
+}
+
+/* account for a written piece: latency, access unit metadata, then give it back */
+static void piece_written(struct piece *p)
+{
+	int64_t now = now_us();
+
+	if (!(p->flags & OUTPUT_CONFIG)) {
+		if (!frame_open) {
+			stats_latency(STATS_LATENCY_FIRST, now - p->timestamp);
+			unit.timestamp = p->timestamp;
+			frame_open = 1;
+		}
+		if (p->flags & OUTPUT_END)
+			stats_latency(STATS_LATENCY_FRAME, now - p->timestamp);
+	}
+	unit.size += p->length;
+	if (p->flags & OUTPUT_KEYFRAME)
+		unit.keyframe = 1;
+
+	if ((p->flags & (OUTPUT_KEYFRAME | OUTPUT_END)) == (OUTPUT_KEYFRAME | OUTPUT_END) && keyframe_requested_us &&
+		p->timestamp >= keyframe_requested_us) {
+		stats_event("control: keyframe written %.1f ms after the request", (now - keyframe_requested_us) / 1000.0);
+		keyframe_requested_us = 0;
+	}
+
+	if (p->flags & OUTPUT_END) {
+		if (index_fp)
+			fprintf(index_fp, "%llu %zu %lld %c\n", (unsigned long long)unit.offset, unit.size,
+				(long long)unit.timestamp, unit.keyframe ? 'K' : '-');
+		units++;
+		unit.offset += unit.size;
+		unit.size = 0;
+		unit.keyframe = 0;
+		frame_open = 0;
+	}
+
+	if (idr_index)
+		nal_index_feed(idr_index, p->data, p->length, p->timestamp);
+
+	written_pieces++;
+	release_piece(p->handle);
+}
+
+static void *output_thread(void *arg)
+{
+	struct iovec iov[OUTPUT_PIECES];
+	unsigned int from, to, i;
+
+	rt_setup_thread(RT_THREAD_OUTPUT);
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (ready == head && !closing)
+			pthread_cond_wait(&cond, &lock);
+		if (ready == head)
+			break;
+		from = head;
+		to = ready;
+		pthread_mutex_unlock(&lock);
+
+		/* pieces between head and ready are not touched by output_piece */
+		for (i = from; i != to; i++) {
+			iov[i - from].iov_base = (void *)pieces[i % OUTPUT_PIECES].data;
+			iov[i - from].iov_len = pieces[i % OUTPUT_PIECES].length;
+		}
+		if (write_all(out_fd, iov, to - from) < 0 && !write_errors++)
+			fprintf(stderr, "writev error %d, %s\n", errno, strerror(errno));
+		for (i = from; i != to; i++)
+			piece_written(&pieces[i % OUTPUT_PIECES]);
+
+		pthread_mutex_lock(&lock);
+		for (i = from; i != to; i++) {
+			queued_bytes -= pieces[i % OUTPUT_PIECES].length;
+			written_bytes += pieces[i % OUTPUT_PIECES].length;
+		}
+		head = to;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+void output_open(int fd, output_release_fn release, int max_held)
+{
+	struct stat st;
+	int err;
+
+	out_fd = fd;
+	out_socket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+	queued_bytes = 0;
+	written_bytes = 0;
+	release_piece = release;
+	held_max = max_held > 0 && max_held < OUTPUT_PIECES ? max_held : OUTPUT_PIECES;
+	head = ready = tail = 0;
+	closing = 0;
+	memset(&unit, 0, sizeof(unit));
+	frame_open = 0;
+
+	if (au_index_file && !(index_fp = fopen(au_index_file, "w")))
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", au_index_file, errno, strerror(errno));
+	else if (index_fp)
+		fprintf(index_fp, "# offset size timestamp_us keyframe\n");
+	if (idr_index_file && !(idr_index = nal_index_new(idr_index_file, 0)))
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", idr_index_file, errno, strerror(errno));
+
+	if ((err = pthread_create(&thread, NULL, output_thread, NULL)) != 0) {
+		fprintf(stderr, "cannot start output thread: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+void output_piece(void *handle, const void *data, size_t length, int64_t timestamp, unsigned int flags)
+{
+	struct piece *p;
+
+	build_unit(data, length, timestamp, flags);
+
+	pthread_mutex_lock(&lock);
+	while (tail - head == OUTPUT_PIECES)
+		pthread_cond_wait(&cond, &lock);
+	p = &pieces[tail++ % OUTPUT_PIECES];
+	p->handle = handle;
+	p->data = data;
+	p->length = length;
+	p->timestamp = timestamp;
+	p->flags = flags;
+	queued_bytes += length;
+	if (aggregate && ((flags & OUTPUT_END) || tail - ready >= held_max)) {
+		ready = tail;
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* end of a batch: without aggregation everything handed over so far goes out now */
+void output_flush(void)
+{
+	pthread_mutex_lock(&lock);
+	if (!aggregate && ready != tail) {
+		ready = tail;
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* bytes handed over but not yet read by the consumer */
+size_t output_backlog(void)
+{
+	size_t backlog;
+	int kernel = 0;
+
+	pthread_mutex_lock(&lock);
+	backlog = queued_bytes;
+	pthread_mutex_unlock(&lock);
+	if (out_fd >= 0 && ioctl(out_fd, out_socket ? SIOCOUTQ : FIONREAD, &kernel) == 0 && kernel > 0)
+		backlog += kernel;
+	return backlog;
+}
+
+uint64_t output_written(void)
+{
+	uint64_t written;
+
+	pthread_mutex_lock(&lock);
+	written = written_bytes;
+	pthread_mutex_unlock(&lock);
+	return written;
+}
+
+/* log how long the next keyframe captured after requested_us takes to be written */
+void output_watch_keyframe(int64_t requested_us)
+{
+	pthread_mutex_lock(&lock);
+	keyframe_requested_us = requested_us;
+	pthread_mutex_unlock(&lock);
+}
+
+void output_close(void)
+{
+	if (out_fd < 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	ready = tail;
+	closing = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+
+	if (index_fp) {
+		fclose(index_fp);
+		index_fp = NULL;
+	}
+	if (idr_index) {
+		nal_index_report(idr_index, stderr);
+		nal_index_free(idr_index);
+		idr_index = NULL;
+	}
+	au_unref(building);
+	building = NULL;
+	gop_clear();
+	out_fd = -1;
+}
+
+void output_report(FILE *out)
+{
+	if (!writes)
+		return;
+	fprintf(out, "output: %lu access units, %lu buffers in %lu writes (%.2f buffers/write), %llu bytes%s\n",
+		units, written_pieces, writes, (double)written_pieces / writes,
+		(unsigned long long)(unit.offset + unit.size), aggregate ? ", aggregated" : "");
+	if (write_errors)
+		fprintf(out, "output: %lu write errors\n", write_errors);
+	gop_report(out);
+}
@@ -0,0 +1,42 @@
+/*
+ * Encoded stream output
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OUTPUT_PIECES     64    /* encoder buffers the output stage can hold at once */
+
+/* piece flags */
+#define OUTPUT_END        1     /* last piece of an access unit */
+#define OUTPUT_KEYFRAME   2
+#define OUTPUT_CONFIG     4     /* codec config (SPS/PPS), goes with the access unit that follows */
+
+/* per access unit metadata, handed to the index file once the unit is written */
+struct access_unit {
+	uint64_t offset;        /* byte offset in the output stream */
+	size_t   size;
+	int64_t  timestamp;     /* capture time, CLOCK_MONOTONIC us */
+	int      keyframe;
+};
+
+/* called from the output thread once the data of a piece is written */
+typedef void (*output_release_fn)(void *piece);
+
+extern int   aggregate;
+extern char *au_index_file, *idr_index_file;
+
+void output_open(int fd, output_release_fn release, int max_held);
+void output_piece(void *piece, const void *data, size_t length, int64_t timestamp, unsigned int flags);
+void output_flush(void);
+size_t output_backlog(void);
+uint64_t output_written(void);
+void output_watch_keyframe(int64_t requested_us);
+void output_close(void);
+void output_report(FILE *out);
+
+#endif /* OUTPUT_H */
@@ -0,0 +1,413 @@
+/*
+ * Pre-roll ring and triggered recording
+ *
+ * With preroll_dir set, camera 0's access units are also kept in a ring of
+ * references bounded by preroll_kb, from a keyframe on and trimmed a whole
+ * GOP at a time, so it always starts decodable and covers at least the last
+ * preroll_sec seconds the bound allows. A trigger (the control socket's
+ * "trigger", or motion with --motion) starts a recording into
+ * preroll_dir/YYYYmmdd-HHMMSS-mmm.h264 that begins with the codec config and the
+ * pre-roll and follows the live stream until postroll_sec after the last
+ * trigger; a trigger within that time extends the same recording.
+ *
+ * The recording is written by a thread of its own, sequentially, in writev
+ * batches straight out of the ring, into a file preallocated for the expected
+ * length (fallocate, the excess released at close). The ring is its queue:
+ * units not written yet are kept past preroll_sec while the bound allows, and
+ * a writer further behind than that loses whole GOPs and resumes at the ring's
+ * first keyframe. The thread feeding the ring only takes a lock for a few
+ * pointer updates, so a slow card never holds up the live output.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+
+#include "preroll.h"
+#include "stats.h"
+#include "rt.h"
+
+#define PREROLL_UNITS     4096      /* units the ring can hold, whatever their size */
+#define PREROLL_GOPS      256       /* keyframes the ring can hold */
+#define PREROLL_BATCH     64        /* units to a writev */
+#define PREROLL_PATH      512
+
+char *preroll_dir;
+int   preroll_kb = 16384, preroll_sec = 10, postroll_sec = 10;
+
+enum rec_state { REC_IDLE, REC_ON, REC_ENDING };
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   cond = PTHREAD_COND_INITIALIZER;
+static pthread_t        thread;
+static int              running;
+
+/* under lock: the ring holds units head..tail-1 by sequence number, keys the sequence numbers of its keyframes */
+static struct au       *ring[PREROLL_UNITS];
+static uint64_t         head, tail, keys[PREROLL_GOPS];
+static unsigned int     key_head, key_tail;
+static struct au       *config;
+static size_t           bytes, peak_bytes;
+static int              valid, closing;
+static unsigned long    overflows;
+
+/* under lock: the recording, written from cursor on up to end once the post-roll has run out */
+static enum rec_state   rec;
+static uint64_t         cursor, end, flush_seq;
+static int64_t          trigger_us, last_trigger_us;
+static size_t           estimate;
+static char             path[PREROLL_PATH];
+static unsigned long    recordings, extensions, lost_units;
+
+/* writer thread only */
+static int64_t          flush_sum, flush_max;
+static unsigned long    flushes;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+/* drop units from the front up to seq; a recording behind loses them */
+static void drop_to(uint64_t seq)
+{
+	while (head < seq) {
+		struct au *au = ring[head++ % PREROLL_UNITS];
+
+		bytes -= au->size;
+		au_unref(au);
+	}
+	while (key_head != key_tail && keys[key_head % PREROLL_GOPS] < head)
+		key_head++;
+	if (rec != REC_IDLE && cursor < head) {
+		lost_units += head - cursor;
+		cursor = head;
+	}
+}
+
+/* make room for au: whole GOPs go from the front while over a bound, or while the
+ * rest still covers preroll_sec and the recording, if any, is past them */
+static void trim(struct au *au)
+{
+	size_t limit = (size_t)preroll_kb << 10;
+
+	for (;;) {
+		int over = bytes + au->size > limit || tail - head >= PREROLL_UNITS ||
+			((au->flags & AU_KEYFRAME) && key_tail - key_head >= PREROLL_GOPS);
+		uint64_t next = key_tail - key_head > 1 ? keys[(key_head + 1) % PREROLL_GOPS] : tail;
+
+		if (!over && (next == tail || au->timestamp - ring[next % PREROLL_UNITS]->timestamp < preroll_sec * (int64_t)1000000 ||
+			(rec != REC_IDLE && cursor < next)))
+			return;
+		if (next == tail) {
+			/* a single GOP over the bound: start again at the next keyframe */
+			if (over && head != tail) {
+				overflows++;
+				valid = 0;
+			}
+			drop_to(tail);
+			return;
+		}
+		drop_to(next);
+	}
+}
+
+void preroll_unit(struct au *au)
+{
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	/* the config goes at the start of every recording */
+	if (au->flags & AU_CONFIG) {
+		au_unref(config);
+		config = au_ref(au);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* the post-roll has run out: the recording ends before this unit */
+	if (rec == REC_ON && au->timestamp - last_trigger_us > postroll_sec * (int64_t)1000000) {
+		rec = REC_ENDING;
+		end = tail;
+	}
+
+	trim(au);
+	if (au->flags & AU_KEYFRAME) {
+		valid = 1;
+		keys[key_tail++ % PREROLL_GOPS] = tail;
+	}
+	if (valid) {
+		ring[tail++ % PREROLL_UNITS] = au_ref(au);
+		bytes += au->size;
+		if (bytes > peak_bytes)
+			peak_bytes = bytes;
+		if (rec != REC_IDLE)
+			pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* start a recording, or keep the current one going; 0 started, 1 extended, -1 without a pre-roll */
+int preroll_trigger(void)
+{
+	int64_t now = now_us(), span = 0;
+	char name[32], file[PREROLL_PATH];
+	double seconds;
+	struct timeval t;
+
+	if (!running) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+	last_trigger_us = now;
+	if (rec != REC_IDLE) {
+		if (rec == REC_ENDING) {
+			rec = REC_ON;
+			extensions++;
+		}
+		pthread_mutex_unlock(&lock);
+		return 1;
+	}
+
+	/* the ring always starts at a keyframe */
+	rec = REC_ON;
+	cursor = head;
+	flush_seq = tail;
+	trigger_us = now;
+	if (tail - head > 1)
+		span = ring[(tail - 1) % PREROLL_UNITS]->timestamp - ring[head % PREROLL_UNITS]->timestamp;
+	seconds = span / 1000000.0;
+	/* the file is preallocated for pre- and post-roll at the rate the ring has seen */
+	estimate = bytes + (span > 0 ? (size_t)((double)bytes * postroll_sec * 1000000 / span) : (size_t)preroll_kb << 10);
+	/* to the millisecond, as segments are: two triggers within a second are two recordings */
+	gettimeofday(&t, NULL);
+	strftime(name, sizeof(name), "%Y%m%d-%H%M%S", localtime(&t.tv_sec));
+	snprintf(path, sizeof(path), "%s/%s-%03d.h264", preroll_dir, name, (int)(t.tv_usec / 1000));
+	snprintf(file, sizeof(file), "%s", path);
+	recordings++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	stats_event("preroll: triggered, %.1f s of pre-roll to %s", seconds, file);
+	return 0;
+}
+
+/* returns 0 or -1 with errno set */
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void finish_file(int fd, const char *name, uint64_t written, unsigned long units, int64_t started_us)
+{
+	/* give back what the preallocation did not use, and have it on the card before saying it is done */
+	if (ftruncate(fd, written) < 0 || fdatasync(fd) < 0)
+		stats_event("preroll: %s: %d, %s", name, errno, strerror(errno));
+	close(fd);
+	stats_event("preroll: %s closed, %lu units, %llu KB, %.1f s", name, units,
+		(unsigned long long)(written >> 10), (now_us() - started_us) / 1000000.0);
+}
+
+static void *preroll_thread(void *arg)
+{
+	struct au *batch[PREROLL_BATCH];
+	struct iovec iov[PREROLL_BATCH];
+	char name[PREROLL_PATH];
+	uint64_t written = 0, limit;
+	unsigned long units = 0;
+	int64_t started_us = 0, latency;
+	int fd = -1, n, i, failed = 0, flushed = 0;
+
+	rt_setup_thread(RT_THREAD_OUTPUT);
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		if (rec == REC_IDLE) {
+			if (closing)
+				break;
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+
+		/* a new recording: open and preallocate it, config first */
+		if (fd < 0 && !failed) {
+			struct au *cfg = config ? au_ref(config) : NULL;
+			size_t length = estimate;
+
+			snprintf(name, sizeof(name), "%s", path);
+			pthread_mutex_unlock(&lock);
+			written = units = 0;
+			flushed = 0;
+			started_us = now_us();
+			/* a recording is never written over */
+			if ((fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0)
+				stats_event("preroll: cannot open %s: %d, %s", name, errno, strerror(errno));
+			else {
+				if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length) < 0 && errno != EOPNOTSUPP)
+					stats_event("preroll: %s: cannot preallocate %zu KB: %d, %s", name, length >> 10, errno, strerror(errno));
+				if (cfg) {
+					iov[0].iov_base = cfg->data;
+					iov[0].iov_len = cfg->size;
+					if (write_all(fd, iov, 1) == 0)
+						written += cfg->size;
+				}
+			}
+			failed = fd < 0;
+			au_unref(cfg);
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+
+		limit = rec == REC_ENDING ? end : tail;
+		if (closing && rec == REC_ON) {
+			rec = REC_ENDING;
+			limit = end = tail;
+		}
+		if (cursor >= limit) {
+			if (rec == REC_ON) {
+				pthread_cond_wait(&cond, &lock);
+				continue;
+			}
+			/* done: a trigger from now on starts a new recording */
+			rec = REC_IDLE;
+			pthread_mutex_unlock(&lock);
+			if (fd >= 0)
+				finish_file(fd, name, written, units, started_us);
+			fd = -1;
+			failed = 0;
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+
+		for (n = 0; cursor < limit && n < PREROLL_BATCH; n++) {
+			batch[n] = au_ref(ring[cursor++ % PREROLL_UNITS]);
+			iov[n].iov_base = batch[n]->data;
+			iov[n].iov_len = batch[n]->size;
+		}
+		if (!flushed && cursor >= flush_seq) {
+			flushed = 1;
+			latency = trigger_us;
+		}
+		else
+			latency = 0;
+		pthread_mutex_unlock(&lock);
+
+		if (fd >= 0) {
+			if (write_all(fd, iov, n) < 0) {
+				stats_event("preroll: %s: write error %d, %s, closed", name, errno, strerror(errno));
+				close(fd);
+				fd = -1;
+				failed = 1;
+			}
+			else {
+				for (i = 0; i < n; i++)
+					written += batch[i]->size;
+				units += n;
+				if (latency) {
+					latency = now_us() - latency;
+					flush_sum += latency;
+					flushes++;
+					if (latency > flush_max)
+						flush_max = latency;
+					stats_event("preroll: pre-roll of %s on disk %.1f ms after the trigger", name, latency / 1000.0);
+				}
+			}
+		}
+		for (i = 0; i < n; i++)
+			au_unref(batch[i]);
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+void preroll_open(void)
+{
+	if (!preroll_dir)
+		return;
+
+	if (access(preroll_dir, W_OK) < 0) {
+		fprintf(stderr, "Cannot write to '%s': %d, %s\n", preroll_dir, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if ((errno = pthread_create(&thread, NULL, preroll_thread, NULL)) != 0) {
+		fprintf(stderr, "Cannot start the pre-roll writer: %d, %s\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	running = 1;
+}
+
+/* write out a recording in progress, up to what the ring holds now, and free the ring */
+void preroll_close(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	closing = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	drop_to(tail);
+	au_unref(config);
+	config = NULL;
+	pthread_mutex_unlock(&lock);
+}
+
+void preroll_report(FILE *out)
+{
+	double seconds = 0;
+
+	if (!preroll_dir)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (tail - head > 1)
+		seconds = (ring[(tail - 1) % PREROLL_UNITS]->timestamp - ring[head % PREROLL_UNITS]->timestamp) / 1000000.0;
+	fprintf(out, "preroll: %llu units, %.1f s, %zu KB now, peak %zu KB of %d KB, %lu overflows; "
+		"%lu recordings%s, %lu extended, %lu units lost behind the ring\n",
+		(unsigned long long)(tail - head), seconds, bytes >> 10, peak_bytes >> 10, preroll_kb, overflows,
+		recordings, rec != REC_IDLE ? " (one in progress)" : "", extensions, lost_units);
+	pthread_mutex_unlock(&lock);
+	if (flushes)
+		fprintf(out, "preroll: pre-roll on disk %.1f ms avg, %.1f ms max after the trigger\n",
+			flush_sum / 1000.0 / flushes, flush_max / 1000.0);
+}
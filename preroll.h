@@ -0,0 +1,21 @@
+/*
+ * Pre-roll ring and triggered recording
+ */
+
+#ifndef PREROLL_H
+#define PREROLL_H
+
+#include <stdio.h>
+
+#include "au.h"
+
+extern char *preroll_dir;
+extern int   preroll_kb, preroll_sec, postroll_sec;
+
+void preroll_open(void);
+void preroll_unit(struct au *au);
+int preroll_trigger(void);
+void preroll_close(void);
+void preroll_report(FILE *out);
+
+#endif /* PREROLL_H */
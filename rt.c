@@ -0,0 +1,145 @@
+/*
+ * Real-time scheduling, CPU pinning and memory locking
+ *
+ * Every option degrades gracefully: when the process lacks the permission
+ * (CAP_SYS_NICE, RLIMIT_RTPRIO, RLIMIT_MEMLOCK) or the core does not exist,
+ * a warning is printed and capture carries on without it.
+ *
+ * Threads inherit their creator's policy and CPU mask, so the capture role is
+ * only taken on once capture starts (start_capturing()), after the encoder,
+ * decoder and output threads exist, and every other role drops back to
+ * SCHED_OTHER on the CPUs the process started with unless pinned itself: a
+ * sink added from the control socket, on the capture thread, would otherwise
+ * run FIFO on the capture core.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+
+int cpu_capture = -1, cpu_omx = -1, cpu_output = -1, rt_priority, lock_memory, prefault_buffers;
+
+static const char *role_name[] = { "capture", "OMX callback", "output" };
+static int         role_pinned[3], role_fifo, memory_locked;
+static cpu_set_t   initial_cpus;
+static int         initial_saved;
+
+/* the mask the process started with, before any thread was pinned */
+static void save_initial_cpus(void)
+{
+	initial_saved = sched_getaffinity(0, sizeof(initial_cpus), &initial_cpus) == 0;
+}
+
+/* whatever the creating thread had: back to SCHED_OTHER on every CPU the process had */
+static void unpin(void)
+{
+	struct sched_param param;
+	int policy;
+
+	if (initial_saved)
+		pthread_setaffinity_np(pthread_self(), sizeof(initial_cpus), &initial_cpus);
+	if (pthread_getschedparam(pthread_self(), &policy, &param) == 0 && policy != SCHED_OTHER) {
+		memset(&param, 0, sizeof(param));
+		pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+	}
+}
+
+static void pin(enum rt_thread role, int cpu)
+{
+	cpu_set_t set;
+	int err;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+		fprintf(stderr, "cannot pin %s thread to cpu %d: %s, left unpinned\n", role_name[role], cpu, strerror(err));
+	else
+		role_pinned[role] = 1;
+}
+
+/*
+ * Apply the options for role to the calling thread. A thread is set up once,
+ * for the first role it is called with, so callers can invoke this on every
+ * callback; a thread that already captures is not re-pinned as output.
+ */
+void rt_setup_thread(enum rt_thread role)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	static __thread int configured;
+	int cpu = role == RT_THREAD_CAPTURE ? cpu_capture : role == RT_THREAD_OMX ? cpu_omx : cpu_output;
+
+	if (configured)
+		return;
+	configured = 1;
+	/* the first caller is the capture thread before it pins itself, or a thread made before that */
+	pthread_once(&once, save_initial_cpus);
+
+	if (role != RT_THREAD_CAPTURE)
+		unpin();
+	if (cpu >= 0)
+		pin(role, cpu);
+
+	if (role == RT_THREAD_CAPTURE && rt_priority > 0) {
+		struct sched_param param;
+		int err;
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = rt_priority;
+		if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+			fprintf(stderr, "cannot set SCHED_FIFO priority %d for the capture thread: %s, using SCHED_OTHER\n",
+				rt_priority, strerror(err));
+		else
+			role_fifo = 1;
+	}
+}
+
+void rt_lock_memory(void)
+{
+	if (!lock_memory)
+		return;
+	if (-1 == mlockall(MCL_CURRENT | MCL_FUTURE))
+		fprintf(stderr, "mlockall failed: %d, %s, memory stays pageable\n", errno, strerror(errno));
+	else
+		memory_locked = 1;
+}
+
+/* touch every page so the first frames do not take the page faults */
+void rt_prefault(void *start, size_t length)
+{
+	volatile char *p = start;
+	size_t page = sysconf(_SC_PAGESIZE), i;
+
+	if (!prefault_buffers || !start)
+		return;
+	for (i = 0; i < length; i += page)
+		p[i] = p[i];
+}
+
+/* one line naming the options in effect, to label jitter reports */
+void rt_describe(FILE *out)
+{
+	int role, any = 0;
+
+	fprintf(out, "real-time options:");
+	for (role = RT_THREAD_CAPTURE; role <= RT_THREAD_OUTPUT; role++)
+		if (role_pinned[role]) {
+			fprintf(out, " %s@cpu%d", role_name[role],
+				role == RT_THREAD_CAPTURE ? cpu_capture : role == RT_THREAD_OMX ? cpu_omx : cpu_output);
+			any = 1;
+		}
+	if (role_fifo)
+		fprintf(out, " SCHED_FIFO/%d", rt_priority), any = 1;
+	if (memory_locked)
+		fprintf(out, " mlockall"), any = 1;
+	if (prefault_buffers)
+		fprintf(out, " prefault"), any = 1;
+	fprintf(out, "%s\n", any ? "" : " none");
+}
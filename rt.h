@@ -0,0 +1,24 @@
+/*
+ * Real-time scheduling, CPU pinning and memory locking
+ */
+
+#ifndef RT_H
+#define RT_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+enum rt_thread {
+	RT_THREAD_CAPTURE,
+	RT_THREAD_OMX,      /* OMX/ilclient callback thread */
+	RT_THREAD_OUTPUT,
+};
+
+extern int cpu_capture, cpu_omx, cpu_output, rt_priority, lock_memory, prefault_buffers;
+
+void rt_setup_thread(enum rt_thread role);
+void rt_lock_memory(void);
+void rt_prefault(void *start, size_t length);
+void rt_describe(FILE *out);
+
+#endif /* RT_H */
@@ -0,0 +1,407 @@
+/*
+ * Segmented rolling recording
+ *
+ * With segment_dir set, camera 0's stream is also recorded natively into
+ * segment_dir/seg-YYYYmmdd-HHMMSS-mmm.h264, a new segment at the first
+ * keyframe segment_sec after the last one started, or once it has grown to
+ * segment_mb. Every segment starts with the codec config and a keyframe, so
+ * each plays on its own and a crash costs the end of one segment at most.
+ * Only the newest segment_keep segments are kept, those of earlier runs
+ * included; the oldest is deleted as a new one starts.
+ *
+ * Units are queued to a writer thread by reference, so the thread draining
+ * the encoder never waits for the card. The writer gathers them into
+ * SEGMENT_BATCH buffers and writes each full one at an offset that is a
+ * multiple of its size, into a segment preallocated with fallocate for the
+ * size the last one reached (the excess is released when it is closed).
+ * Writeback of each batch is started at once (sync_file_range) and waited
+ * for, and the pages dropped, a batch later, so dirty data never piles up
+ * into a long stall and the final fdatasync has next to nothing left to do.
+ * If the writer falls further behind than SEGMENT_QUEUE_KB, what is queued
+ * is dropped and recording resumes at the next keyframe.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "segment.h"
+#include "stats.h"
+#include "rt.h"
+
+#define SEGMENT_QUEUE     1024          /* units queued for the writer, whatever their size */
+#define SEGMENT_QUEUE_KB  8192
+#define SEGMENT_BATCH     (1 << 20)     /* bytes to a write */
+#define SEGMENT_ALIGN     4096
+#define SEGMENT_FIRST_MB  16            /* preallocated before there is a segment to go by */
+#define SEGMENT_NAME      64
+#define SEGMENT_PATH      512
+
+char *segment_dir;
+int   segment_sec = 60, segment_mb, segment_keep = 60;
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   cond = PTHREAD_COND_INITIALIZER;
+static pthread_t        thread;
+static int              running;
+
+/* under lock */
+static struct au       *queue[SEGMENT_QUEUE];
+static unsigned int     head, tail;
+static size_t           queued_bytes;
+static int              closing, waiting = 1;
+static unsigned long    drops, dropped_units;
+
+/* writer thread only */
+static struct au       *config;
+static int              fd = -1;
+static char             name[SEGMENT_PATH];
+static unsigned char   *batch;
+static size_t           filled;
+static uint64_t         offset, size, preallocated, last_size;
+static int64_t          start_ts, opened_us;
+static char           (*kept)[SEGMENT_NAME];   /* segment_keep newest names, oldest at kept_first */
+static int              kept_count, kept_first;
+static unsigned long    segments, deleted, batches, errors;
+static uint64_t         total_bytes;
+static int64_t          write_sum, write_max, sync_max, close_max;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+/* the feeding thread's side: queue a unit for the writer */
+void segment_unit(struct au *au)
+{
+	unsigned int dropped;
+
+	pthread_mutex_lock(&lock);
+	if (!running || closing) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* an empty queue takes any unit, however large */
+	if (head != tail && (tail - head >= SEGMENT_QUEUE || queued_bytes + au->size > (size_t)SEGMENT_QUEUE_KB << 10)) {
+		for (dropped = 0; tail != head; dropped++)
+			au_unref(queue[--tail % SEGMENT_QUEUE]);
+		queued_bytes = 0;
+		drops++;
+		dropped_units += dropped;
+		waiting = 1;
+		stats_event("segment: writer %u units behind, dropped, resuming at the next keyframe", dropped);
+	}
+	if (au->flags & AU_KEYFRAME)
+		waiting = 0;
+	/* the config always goes through, every segment starts with it */
+	if (waiting && !(au->flags & AU_CONFIG)) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	queue[tail++ % SEGMENT_QUEUE] = au_ref(au);
+	queued_bytes += au->size;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static int is_segment(const struct dirent *d)
+{
+	size_t length = strlen(d->d_name);
+
+	return !strncmp(d->d_name, "seg-", 4) && length > 9 && length < SEGMENT_NAME &&
+		!strcmp(d->d_name + length - 5, ".h264");
+}
+
+static void delete_segment(const char *base)
+{
+	char path[SEGMENT_PATH];
+
+	snprintf(path, sizeof(path), "%s/%s", segment_dir, base);
+	if (unlink(path) < 0 && errno != ENOENT)
+		stats_event("segment: cannot delete %s: %d, %s", path, errno, strerror(errno));
+	else
+		deleted++;
+}
+
+/* remember a segment, deleting the oldest beyond segment_keep */
+static void keep_segment(const char *base)
+{
+	if (!segment_keep)
+		return;
+	if (kept_count == segment_keep) {
+		delete_segment(kept[kept_first]);
+		kept_first = (kept_first + 1) % segment_keep;
+		kept_count--;
+	}
+	snprintf(kept[(kept_first + kept_count++) % segment_keep], SEGMENT_NAME, "%s", base);
+}
+
+/* returns 0 or -1 with errno set */
+static int pwrite_all(const unsigned char *data, size_t length, uint64_t at)
+{
+	ssize_t n;
+
+	while (length > 0) {
+		if ((n = pwrite(fd, data, length, at)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += n;
+		length -= n;
+		at += n;
+	}
+	return 0;
+}
+
+static void close_segment(int failed)
+{
+	int64_t start = now_us(), took;
+
+	/* give back what the preallocation did not use */
+	if (ftruncate(fd, size) < 0 || fdatasync(fd) < 0)
+		stats_event("segment: %s: %d, %s", name, errno, strerror(errno));
+	close(fd);
+	fd = -1;
+	took = now_us() - start;
+	if (took > close_max)
+		close_max = took;
+	last_size = size;
+	total_bytes += size;
+	segments++;
+	stats_event("segment: %s %s, %.1f s, %llu KB, closed in %.1f ms", name, failed ? "cut short" : "done",
+		(now_us() - opened_us) / 1000000.0, (unsigned long long)(size >> 10), took / 1000.0);
+}
+
+/* write out the batch; a full one also grows the preallocation when it runs out */
+static void flush_batch(void)
+{
+	int64_t start = now_us(), took;
+
+	if (!filled)
+		return;
+	if (offset + SEGMENT_BATCH > preallocated) {
+		size_t more = last_size ? last_size / 4 : (size_t)SEGMENT_FIRST_MB << 20;
+
+		more = (more + SEGMENT_BATCH - 1) & ~(size_t)(SEGMENT_BATCH - 1);
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, preallocated, more) == 0)
+			preallocated += more;
+	}
+	if (pwrite_all(batch, filled, offset) < 0) {
+		stats_event("segment: %s: write error %d, %s", name, errno, strerror(errno));
+		errors++;
+		filled = 0;
+		size = offset;
+		close_segment(1);
+		return;
+	}
+	took = now_us() - start;
+	write_sum += took;
+	if (took > write_max)
+		write_max = took;
+	batches++;
+
+	/* start writeback of this batch, finish the last one's and drop its pages */
+	sync_file_range(fd, offset, filled, SYNC_FILE_RANGE_WRITE);
+	if (offset >= SEGMENT_BATCH) {
+		start = now_us();
+		sync_file_range(fd, offset - SEGMENT_BATCH, SEGMENT_BATCH,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, offset - SEGMENT_BATCH, SEGMENT_BATCH, POSIX_FADV_DONTNEED);
+		if ((took = now_us() - start) > sync_max)
+			sync_max = took;
+	}
+	offset += filled;
+	filled = 0;
+}
+
+static void append(const unsigned char *data, size_t length)
+{
+	while (length > 0 && fd >= 0) {
+		size_t n = SEGMENT_BATCH - filled < length ? SEGMENT_BATCH - filled : length;
+
+		memcpy(batch + filled, data, n);
+		filled += n;
+		size += n;
+		data += n;
+		length -= n;
+		if (filled == SEGMENT_BATCH)
+			flush_batch();
+	}
+}
+
+static void finish_segment(void)
+{
+	if (fd < 0)
+		return;
+	flush_batch();
+	if (fd >= 0)
+		close_segment(0);
+}
+
+static int start_segment(int64_t timestamp)
+{
+	char base[SEGMENT_NAME], stamp[32];
+	struct timeval now;
+	size_t length;
+
+	gettimeofday(&now, NULL);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now.tv_sec));
+	snprintf(base, sizeof(base), "seg-%s-%03d.h264", stamp, (int)(now.tv_usec / 1000));
+	snprintf(name, sizeof(name), "%s/%s", segment_dir, base);
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		stats_event("segment: cannot open %s: %d, %s", name, errno, strerror(errno));
+		errors++;
+		return -1;
+	}
+
+	/* as large as the last one, or the size bound */
+	length = segment_mb ? (size_t)segment_mb << 20 : last_size ? last_size + last_size / 8 : (size_t)SEGMENT_FIRST_MB << 20;
+	length = (length + SEGMENT_BATCH - 1) & ~(size_t)(SEGMENT_BATCH - 1);
+	preallocated = 0;
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length) == 0)
+		preallocated = length;
+	else if (errno != EOPNOTSUPP)
+		stats_event("segment: %s: cannot preallocate %zu KB: %d, %s", name, length >> 10, errno, strerror(errno));
+
+	offset = size = filled = 0;
+	start_ts = timestamp;
+	opened_us = now_us();
+	keep_segment(base);
+	if (config)
+		append(config->data, config->size);
+	return 0;
+}
+
+static void write_unit(struct au *au)
+{
+	if (au->flags & AU_CONFIG) {
+		au_unref(config);
+		config = au_ref(au);
+		return;
+	}
+	if (fd >= 0 && (au->flags & AU_KEYFRAME) &&
+		(au->timestamp - start_ts >= segment_sec * (int64_t)1000000 || (segment_mb && size >= (uint64_t)segment_mb << 20)))
+		finish_segment();
+	/* segments start at keyframes */
+	if (fd < 0 && (!(au->flags & AU_KEYFRAME) || start_segment(au->timestamp) < 0))
+		return;
+	append(au->data, au->size);
+}
+
+static void *segment_thread(void *arg)
+{
+	struct au *au;
+
+	rt_setup_thread(RT_THREAD_OUTPUT);
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (head == tail && !closing)
+			pthread_cond_wait(&cond, &lock);
+		if (head == tail)
+			break;
+		au = queue[head++ % SEGMENT_QUEUE];
+		queued_bytes -= au->size;
+		pthread_mutex_unlock(&lock);
+
+		write_unit(au);
+		au_unref(au);
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	finish_segment();
+	return NULL;
+}
+
+void segment_open(void)
+{
+	struct dirent **list;
+	int n, i;
+
+	if (!segment_dir)
+		return;
+
+	if (access(segment_dir, W_OK) < 0) {
+		fprintf(stderr, "Cannot write to '%s': %d, %s\n", segment_dir, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if ((segment_keep && (kept = calloc(segment_keep, SEGMENT_NAME)) == NULL) ||
+	    (errno = posix_memalign((void **)&batch, SEGMENT_ALIGN, SEGMENT_BATCH)) != 0) {
+		fprintf(stderr, "Cannot allocate the segment writer: %d, %s\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* segments of earlier runs count against segment_keep, oldest first by name */
+	if ((n = scandir(segment_dir, &list, is_segment, alphasort)) > 0) {
+		for (i = 0; i < n; i++) {
+			keep_segment(list[i]->d_name);
+			free(list[i]);
+		}
+		free(list);
+	}
+
+	if ((errno = pthread_create(&thread, NULL, segment_thread, NULL)) != 0) {
+		fprintf(stderr, "Cannot start the segment writer: %d, %s\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	running = 1;
+}
+
+/* write out what is queued, close the segment in progress */
+void segment_close(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	closing = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	pthread_mutex_unlock(&lock);
+
+	au_unref(config);
+	config = NULL;
+	free(batch);
+	batch = NULL;
+	free(kept);
+	kept = NULL;
+}
+
+void segment_report(FILE *out)
+{
+	size_t queued;
+
+	if (!segment_dir)
+		return;
+
+	pthread_mutex_lock(&lock);
+	queued = queued_bytes;
+	pthread_mutex_unlock(&lock);
+	fprintf(out, "segment: %lu done, %llu KB, %d kept, %lu deleted, %lu errors; %lu batches of %d KB, "
+		"write %.1f ms avg %.1f ms max, writeback wait %.1f ms max, close %.1f ms max; "
+		"%zu KB queued, %lu drops (%lu units)\n",
+		segments, (unsigned long long)(total_bytes >> 10), kept_count, deleted, errors, batches, SEGMENT_BATCH >> 10,
+		batches ? write_sum / 1000.0 / batches : 0.0, write_max / 1000.0, sync_max / 1000.0, close_max / 1000.0,
+		queued >> 10, drops, dropped_units);
+}
@@ -0,0 +1,20 @@
+/*
+ * Segmented rolling recording
+ */
+
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdio.h>
+
+#include "au.h"
+
+extern char *segment_dir;
+extern int   segment_sec, segment_mb, segment_keep;
+
+void segment_open(void);
+void segment_unit(struct au *au);
+void segment_close(void);
+void segment_report(FILE *out);
+
+#endif /* SEGMENT_H */
@@ -0,0 +1,411 @@
+/*
+ * Local stream server
+ *
+ * With serve_path set, the encoded stream is served to any number of local
+ * processes connecting to a Unix-domain stream socket there, e.g.
+ *
+ *   stream-client /tmp/capture-encode.stream | ffplay -
+ *
+ * One thread does all the writing, non-blocking, driven by epoll. Each client
+ * has its own queue of references to the shared access units, so a unit is
+ * never copied per client. A client that lets its queue grow past
+ * serve_queue_kb has it dropped and is resumed at the next keyframe, codec
+ * config in front; the unit it was halfway through is finished first so the
+ * stream it sees stays well formed. New clients start from the GOP cache.
+ *
+ * The encoder side only ever appends to the queues; the server thread alone
+ * moves their heads and drops them.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "server.h"
+#include "gop.h"
+#include "stats.h"
+#include "rt.h"
+
+#define SERVER_CLIENTS    64
+#define SERVER_QUEUE      256   /* units a client can have queued, whatever their size */
+#define SERVER_IOV        64    /* units per write */
+
+char *serve_path;
+int   serve_queue_kb = 2048;
+
+struct client {
+	int            fd, id;
+
+	/* under lock: the encoder side appends at tail, the server thread writes from head */
+	struct au     *queue[SERVER_QUEUE];
+	unsigned int   head, tail;
+	size_t         queued_bytes;
+	int            joining, waiting, overflow;
+	uint64_t       bytes;
+	unsigned long  drops, dropped_units;
+
+	/* server thread only */
+	size_t         offset;       /* of queue[head] already written */
+	int            polling_out, dead;
+};
+
+static struct client   *clients[SERVER_CLIENTS];
+static int              nclients, peak_clients, listen_fd = -1, wake_fd = -1, epoll_fd = -1, closing;
+static unsigned long    served;
+static uint64_t         sent_bytes;
+static unsigned long    drops;
+static int64_t          opened_us;
+static pthread_t        thread;
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+static void client_add(int fd)
+{
+	struct epoll_event ev;
+	struct client *c;
+
+	if (nclients == SERVER_CLIENTS || (c = calloc(1, sizeof(*c))) == NULL) {
+		stats_event("server: client refused, %d connected", nclients);
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->id = ++served;
+	c->joining = 1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		free(c);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	clients[nclients++] = c;
+	if (nclients > peak_clients)
+		peak_clients = nclients;
+	pthread_mutex_unlock(&lock);
+	stats_event("server: client %d connected, %d now", c->id, nclients);
+}
+
+static void client_remove(struct client *c, const char *why)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < nclients; i++)
+		if (clients[i] == c) {
+			clients[i] = clients[--nclients];
+			break;
+		}
+	pthread_mutex_unlock(&lock);
+
+	stats_event("server: client %d %s after %llu bytes, %lu drops", c->id, why, (unsigned long long)c->bytes, c->drops);
+	while (c->head != c->tail)
+		au_unref(c->queue[c->head++ % SERVER_QUEUE]);
+	close(c->fd);
+	free(c);
+}
+
+/* a client that overflowed loses its queue, bar the unit it is halfway through */
+static void client_drop(struct client *c)
+{
+	unsigned int keep = c->offset ? 1 : 0;
+	unsigned long dropped = 0;
+
+	while (c->tail - c->head > keep) {
+		struct au *au = c->queue[--c->tail % SERVER_QUEUE];
+
+		c->queued_bytes -= au->size;
+		au_unref(au);
+		dropped++;
+	}
+	c->overflow = 0;
+	c->waiting = 1;
+	c->drops++;
+	c->dropped_units += dropped;
+	drops++;
+	stats_event("server: client %d too slow, %lu units dropped, resuming at the next keyframe", c->id, dropped);
+}
+
+/* write what is queued until the socket is full; -1 if the client is gone */
+static int client_flush(struct client *c)
+{
+	struct iovec iov[SERVER_IOV];
+	struct msghdr msg;
+	struct epoll_event ev;
+	unsigned int head, tail, i, done;
+	size_t unit_bytes;
+	ssize_t n, sent;
+	int n_iov, full = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		if (c->overflow)
+			client_drop(c);
+		head = c->head;
+		tail = c->tail;
+		pthread_mutex_unlock(&lock);
+		if (head == tail)
+			break;
+
+		/* units between head and tail are not touched by the encoder side */
+		for (n_iov = 0, i = head; i != tail && n_iov < SERVER_IOV; i++, n_iov++) {
+			iov[n_iov].iov_base = c->queue[i % SERVER_QUEUE]->data;
+			iov[n_iov].iov_len = c->queue[i % SERVER_QUEUE]->size;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + c->offset;
+		iov[0].iov_len -= c->offset;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n_iov;
+		if ((n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return -1;
+			full = 1;
+			break;
+		}
+
+		/* give back the units that went out completely */
+		sent = n;
+		for (done = 0, unit_bytes = 0; done < (unsigned int)n_iov && (size_t)n >= iov[done].iov_len; done++) {
+			n -= iov[done].iov_len;
+			unit_bytes += c->queue[(head + done) % SERVER_QUEUE]->size;
+			au_unref(c->queue[(head + done) % SERVER_QUEUE]);
+		}
+		pthread_mutex_lock(&lock);
+		c->head += done;
+		c->queued_bytes -= unit_bytes;
+		c->bytes += sent;
+		sent_bytes += sent;
+		pthread_mutex_unlock(&lock);
+		c->offset = done ? n : c->offset + n;
+	}
+
+	/* have epoll say when there is room again, only while there is something to write */
+	if (full != c->polling_out) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLRDHUP | (full ? EPOLLOUT : 0);
+		ev.data.ptr = c;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->polling_out = full;
+	}
+	return 0;
+}
+
+static void flush_all(void)
+{
+	int i;
+
+	/* only this thread changes the client list */
+	for (i = 0; i < nclients; i++)
+		if (!clients[i]->polling_out && !clients[i]->dead && client_flush(clients[i]) < 0)
+			clients[i]->dead = 1;
+}
+
+static void *server_thread(void *arg)
+{
+	struct epoll_event events[SERVER_CLIENTS + 2];
+	char discard[256];
+	uint64_t wakes;
+	ssize_t got;
+	int i, n, fd;
+
+	rt_setup_thread(RT_THREAD_OUTPUT);
+
+	while (!closing) {
+		if ((n = epoll_wait(epoll_fd, events, SERVER_CLIENTS + 2, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "epoll_wait error %d, %s\n", errno, strerror(errno));
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			struct client *c = events[i].data.ptr;
+
+			if (events[i].data.ptr == &wake_fd) {
+				if (read(wake_fd, &wakes, sizeof(wakes)) > 0)
+					flush_all();
+			}
+			else if (events[i].data.ptr == &listen_fd) {
+				while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+					client_add(fd);
+			}
+			else if (c->dead)
+				continue;
+			else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				/* clients have nothing to say; reading only tells when they hang up */
+				while ((got = read(c->fd, discard, sizeof(discard))) > 0)
+					;
+				if (got == 0 || (errno != EAGAIN && errno != EINTR))
+					c->dead = 1;
+				else if ((events[i].events & EPOLLOUT) && client_flush(c) < 0)
+					c->dead = 1;
+			}
+			else if ((events[i].events & EPOLLOUT) && client_flush(c) < 0)
+				c->dead = 1;
+		}
+		/* events of this round may still point at them, so clients go only now */
+		for (i = nclients - 1; i >= 0; i--)
+			if (clients[i]->dead)
+				client_remove(clients[i], "disconnected");
+	}
+	return NULL;
+}
+
+void server_open(void)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	int err;
+
+	if (!serve_path)
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(serve_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "stream socket path '%s' is too long\n", serve_path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, serve_path);
+	unlink(serve_path);
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+		bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, SERVER_CLIENTS) < 0 ||
+		(wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		fprintf(stderr, "Cannot serve on '%s': %d, %s\n", serve_path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.ptr = &wake_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+	opened_us = now_us();
+	closing = 0;
+	if ((err = pthread_create(&thread, NULL, server_thread, NULL)) != 0) {
+		fprintf(stderr, "cannot start server thread: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void push(struct client *c, struct au *au)
+{
+	struct au *config;
+
+	if (c->overflow)
+		return;
+	if (c->waiting) {
+		if (!(au->flags & AU_KEYFRAME))
+			return;
+		c->waiting = 0;
+		if ((config = gop_config()) != NULL && config != au) {
+			c->queue[c->tail++ % SERVER_QUEUE] = au_ref(config);
+			c->queued_bytes += config->size;
+		}
+	}
+	/* an empty queue takes any unit, however large */
+	if (c->tail - c->head >= SERVER_QUEUE - 1 ||
+		(c->head != c->tail && c->queued_bytes + au->size > (size_t)serve_queue_kb << 10)) {
+		c->overflow = 1;
+		return;
+	}
+	c->queue[c->tail++ % SERVER_QUEUE] = au_ref(au);
+	c->queued_bytes += au->size;
+}
+
+static void replay_unit(struct au *au, void *arg)
+{
+	push(arg, au);
+}
+
+/* hand a finished access unit to every client; call before the unit goes into the GOP cache */
+void server_unit(struct au *au)
+{
+	uint64_t wake = 1;
+	int i, n;
+
+	if (listen_fd < 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < nclients; i++) {
+		struct client *c = clients[i];
+
+		if (c->joining) {
+			c->joining = 0;
+			c->waiting = !gop_replay(replay_unit, c);
+		}
+		push(c, au);
+	}
+	n = nclients;
+	pthread_mutex_unlock(&lock);
+	if (n && write(wake_fd, &wake, sizeof(wake)) < 0)
+		fprintf(stderr, "server wake error %d, %s\n", errno, strerror(errno));
+}
+
+void server_close(void)
+{
+	uint64_t wake = 1;
+
+	if (listen_fd < 0)
+		return;
+
+	closing = 1;
+	if (write(wake_fd, &wake, sizeof(wake)) < 0)
+		fprintf(stderr, "server wake error %d, %s\n", errno, strerror(errno));
+	pthread_join(thread, NULL);
+	while (nclients > 0)
+		client_remove(clients[nclients - 1], "closed");
+
+	close(epoll_fd);
+	close(wake_fd);
+	close(listen_fd);
+	unlink(serve_path);
+	epoll_fd = wake_fd = listen_fd = -1;
+}
+
+void server_report(FILE *out)
+{
+	double seconds;
+	int i;
+
+	if (listen_fd < 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	seconds = (now_us() - opened_us) / 1e6;
+	fprintf(out, "server: %d clients now, %d peak, %lu served, %llu bytes sent (%.2f MB/s aggregate), %lu drops to a keyframe\n",
+		nclients, peak_clients, served, (unsigned long long)sent_bytes,
+		seconds > 0 ? sent_bytes / seconds / (1 << 20) : 0.0, drops);
+	for (i = 0; i < nclients; i++)
+		fprintf(out, "server: client %d: %llu bytes, %zu KB queued, %lu drops (%lu units)\n", clients[i]->id,
+			(unsigned long long)clients[i]->bytes, clients[i]->queued_bytes >> 10, clients[i]->drops, clients[i]->dropped_units);
+	pthread_mutex_unlock(&lock);
+}
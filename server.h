@@ -0,0 +1,20 @@
+/*
+ * Local stream server
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+
+#include "au.h"
+
+extern char *serve_path;
+extern int   serve_queue_kb;
+
+void server_open(void);
+void server_unit(struct au *au);
+void server_close(void);
+void server_report(FILE *out);
+
+#endif /* SERVER_H */
@@ -0,0 +1,251 @@
+/*
+ * shm-bench: deliver the same units to N readers through pipes, Unix sockets
+ * and the shared memory ring, and compare
+ *
+ *   shm-bench [-r READERS] [-u UNITS] [-s BYTES] [-f UNITS_PER_S]
+ *
+ * Readers are threads of this process; for each transport it reports the
+ * rate delivered to all readers together, the latency from publish to a
+ * reader having the unit, and the CPU time (all threads) per MB delivered.
+ * Pipe and socket readers get their own copy written to them, as a stream
+ * server's clients would; ring readers copy the unit out of the mapping.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+#include "shmring.h"
+
+#define MAX_READERS   64
+
+enum transport { PIPE, SOCKET, RING, TRANSPORTS };
+static const char *transport_names[TRANSPORTS] = { "pipe", "socket", "shm ring" };
+
+struct unit_header {
+	uint32_t size;
+	int64_t  timestamp;
+};
+
+struct reader {
+	pthread_t           thread;
+	enum transport      transport;
+	int                 fd;
+	int                 size;
+	unsigned long long  bytes, units;
+	int64_t             latency_sum, latency_max;
+	unsigned long       overruns;
+};
+
+static pthread_barrier_t ready;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * (int64_t)1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int read_full(int fd, void *buf, size_t n)
+{
+	ssize_t got;
+
+	while (n > 0) {
+		if ((got = read(fd, buf, n)) <= 0) {
+			if (got < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (char *)buf + got;
+		n -= got;
+	}
+	return 0;
+}
+
+static void account(struct reader *r, size_t size, int64_t timestamp)
+{
+	int64_t latency = now_us() - timestamp;
+
+	r->bytes += size;
+	r->units++;
+	r->latency_sum += latency;
+	if (latency > r->latency_max)
+		r->latency_max = latency;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct reader *r = arg;
+	struct unit_header h;
+	struct shmring_reader ring;
+	struct shmring_unit unit;
+	char *buf = malloc(r->size);
+	int got, closed;
+
+	if (r->transport != RING) {
+		pthread_barrier_wait(&ready);
+		while (read_full(r->fd, &h, sizeof(h)) == 0 && read_full(r->fd, buf, h.size) == 0)
+			account(r, h.size, h.timestamp);
+		close(r->fd);
+	}
+	else if (shmring_open(&ring, r->fd) == 0) {
+		pthread_barrier_wait(&ready);
+		for (;;) {
+			/* closed is read first: whatever was published before it is still read */
+			closed = ring.header->closed;
+			__sync_synchronize();
+			if ((got = shmring_next(&ring, buf, r->size, &unit)) > 0)
+				account(r, unit.size, unit.timestamp);
+			else if (got < 0 || closed)
+				break;
+			else
+				shmring_wait(&ring, 100);
+		}
+		r->overruns = ring.overruns;
+		shmring_close(&ring);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void run(enum transport t, int readers, int units, int size, int rate)
+{
+	struct reader r[MAX_READERS];
+	struct shmring_writer ring;
+	int fds[MAX_READERS], pair[2], i, u;
+	int64_t start, cpu, elapsed, latency_sum = 0, latency_max = 0;
+	unsigned long long bytes = 0, delivered = 0;
+	unsigned long overruns = 0;
+	char *data = malloc(size);
+	struct unit_header h;
+	struct iovec iov[2];
+
+	memset(data, 0x5a, size);
+	memset(r, 0, sizeof(r));
+	pthread_barrier_init(&ready, NULL, readers + 1);
+	if (t == RING && shmring_create(&ring, "shm-bench", (size_t)size * 64, 1024) < 0) {
+		perror("shmring_create");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < readers; i++) {
+		r[i].transport = t;
+		r[i].size = size;
+		if (t == RING)
+			r[i].fd = dup(ring.fd);
+		else {
+			if ((t == PIPE ? pipe(pair) : socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) < 0) {
+				perror("pipe");
+				exit(EXIT_FAILURE);
+			}
+			r[i].fd = pair[0];
+			fds[i] = pair[1];
+		}
+		pthread_create(&r[i].thread, NULL, reader_thread, &r[i]);
+	}
+
+	/* ring readers start at the next unit, so none is published before they are all there */
+	pthread_barrier_wait(&ready);
+	start = now_us();
+	cpu = cpu_us();
+	for (u = 0; u < units; u++) {
+		if (rate > 0) {
+			int64_t due = start + (int64_t)u * 1000000 / rate, now = now_us();
+
+			if (due > now)
+				usleep(due - now);
+		}
+		h.size = size;
+		h.timestamp = now_us();
+		if (t == RING)
+			/* every unit a place to start, so a reader that overran resumes at once */
+			shmring_publish(&ring, data, size, SHMRING_CONFIG | SHMRING_KEYFRAME, h.timestamp);
+		else
+			for (i = 0; i < readers; i++) {
+				iov[0].iov_base = &h;
+				iov[0].iov_len = sizeof(h);
+				iov[1].iov_base = data;
+				iov[1].iov_len = size;
+				if (writev(fds[i], iov, 2) != (ssize_t)(sizeof(h) + size)) {
+					perror("writev");
+					exit(EXIT_FAILURE);
+				}
+			}
+		bytes += size;
+	}
+	if (t == RING)
+		shmring_destroy(&ring);
+	else
+		for (i = 0; i < readers; i++)
+			close(fds[i]);
+	for (i = 0; i < readers; i++) {
+		pthread_join(r[i].thread, NULL);
+		delivered += r[i].bytes;
+		latency_sum += r[i].latency_sum;
+		if (r[i].latency_max > latency_max)
+			latency_max = r[i].latency_max;
+		overruns += r[i].overruns;
+	}
+	elapsed = now_us() - start;
+	cpu = cpu_us() - cpu;
+
+	printf("%-9s %3d readers: %8.1f MB/s delivered, latency %7.1f us avg %8.1f us max, %6.2f ms cpu/MB, %llu/%llu units%s",
+		transport_names[t], readers, delivered / (elapsed / 1e6) / (1 << 20),
+		delivered ? (double)latency_sum / (delivered / size) : 0.0, (double)latency_max,
+		delivered ? cpu / 1000.0 / (delivered / (double)(1 << 20)) : 0.0,
+		delivered / size, (unsigned long long)units * readers, overruns ? "" : "\n");
+	if (overruns)
+		printf(", %lu overruns\n", overruns);
+	pthread_barrier_destroy(&ready);
+	free(data);
+}
+
+int main(int argc, char **argv)
+{
+	int c, readers = 4, units = 2000, size = 32 << 10, rate = 1000;
+	enum transport t;
+
+	while ((c = getopt(argc, argv, "r:u:s:f:")) != -1)
+		switch (c) {
+		case 'r':
+			readers = atoi(optarg);
+			break;
+		case 'u':
+			units = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'f':
+			rate = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-r READERS] [-u UNITS] [-s BYTES] [-f UNITS_PER_S, 0 for flat out]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	if (readers < 1 || readers > MAX_READERS || units < 1 || size < 1) {
+		fprintf(stderr, "readers 1..%d, units and bytes above 0\n", MAX_READERS);
+		return EXIT_FAILURE;
+	}
+
+	for (t = PIPE; t < TRANSPORTS; t++)
+		run(t, readers, units, size, rate);
+	return EXIT_SUCCESS;
+}
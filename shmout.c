@@ -0,0 +1,155 @@
+/*
+ * Shared-memory ring output
+ *
+ * With shm_path set, every access unit also goes into a shmring (shmring.c)
+ * of shm_kb KB, and a Unix socket at shm_path hands the ring's memfd to
+ * whoever connects. Readers then follow the stream from the mapping with no
+ * syscall and no copy on this side per reader:
+ *
+ *   stream-client -m /tmp/capture-encode.shm > out.h264
+ *
+ * A keyframe always goes in right behind a codec config, repeated from the
+ * GOP cache if the encoder did not send one, so a reader can start at any
+ * keyframe the ring still holds.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shmout.h"
+#include "shmring.h"
+#include "gop.h"
+#include "stats.h"
+#include "rt.h"
+
+#define SHM_SLOTS    1024
+
+char *shm_path;
+int   shm_kb = 8192;
+
+static struct shmring_writer ring;
+static int                   listen_fd = -1, last_flags;
+static pthread_t             thread;
+static unsigned long         units, handed_out, too_large;
+static uint64_t              bytes;
+
+/* hand the memfd to every reader that connects */
+static void *shmout_thread(void *arg)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		char           buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov;
+	char byte = 0;
+	int fd;
+
+	rt_setup_thread(RT_THREAD_OUTPUT);
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+		if (fd < 0)
+			continue;
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &ring.reader_fd, sizeof(int));
+		if (sendmsg(fd, &msg, MSG_NOSIGNAL) > 0)
+			__sync_add_and_fetch(&handed_out, 1);
+		close(fd);
+	}
+	return NULL;
+}
+
+void shmout_open(void)
+{
+	struct sockaddr_un addr;
+	int err;
+
+	if (!shm_path)
+		return;
+
+	if (shmring_create(&ring, "capture-encode", (size_t)shm_kb << 10, SHM_SLOTS) < 0) {
+		fprintf(stderr, "Cannot create shared memory ring: %d, %s\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(shm_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "shared memory socket path '%s' is too long\n", shm_path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, shm_path);
+	unlink(shm_path);
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+		bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+		fprintf(stderr, "Cannot listen on '%s': %d, %s\n", shm_path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if ((err = pthread_create(&thread, NULL, shmout_thread, NULL)) != 0) {
+		fprintf(stderr, "cannot start shared memory thread: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void publish(struct au *au)
+{
+	if (au->size > ring.header->data_size) {
+		if (!too_large++)
+			stats_event("shm: %zu byte unit does not fit the %d KB ring, skipped", au->size, shm_kb);
+		return;
+	}
+	shmring_publish(&ring, au->data, au->size, au->flags, au->timestamp);
+	last_flags = au->flags;
+	units++;
+	bytes += au->size;
+}
+
+void shmout_unit(struct au *au)
+{
+	struct au *config;
+
+	if (listen_fd < 0)
+		return;
+	if ((au->flags & AU_KEYFRAME) && !(last_flags & AU_CONFIG) && (config = gop_config()) != NULL)
+		publish(config);
+	publish(au);
+}
+
+void shmout_close(void)
+{
+	if (listen_fd < 0)
+		return;
+	/* wakes the accept */
+	shutdown(listen_fd, SHUT_RDWR);
+	pthread_join(thread, NULL);
+	close(listen_fd);
+	unlink(shm_path);
+	listen_fd = -1;
+	shmring_destroy(&ring);
+}
+
+void shmout_report(FILE *out)
+{
+	if (listen_fd < 0)
+		return;
+	fprintf(out, "shm: %lu units, %llu bytes published into %d KB, ring handed to %lu readers%s\n",
+		units, (unsigned long long)bytes, shm_kb, handed_out, too_large ? ", some units too large" : "");
+}
@@ -0,0 +1,20 @@
+/*
+ * Shared-memory ring output
+ */
+
+#ifndef SHMOUT_H
+#define SHMOUT_H
+
+#include <stdio.h>
+
+#include "au.h"
+
+extern char *shm_path;
+extern int   shm_kb;
+
+void shmout_open(void);
+void shmout_unit(struct au *au);
+void shmout_close(void);
+void shmout_report(FILE *out);
+
+#endif /* SHMOUT_H */
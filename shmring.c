@@ -0,0 +1,311 @@
+/*
+ * Shared-memory ring of encoded access units
+ *
+ * The writer owns a sealed memfd holding a header, an index of slots and a
+ * data ring. Publishing a unit copies it into the data ring once, fills its
+ * slot under the slot's seqlock and bumps the header sequence; readers map the
+ * memfd read-only and follow the sequence without any syscall, or sleep on the
+ * header's futex word with shmring_wait(). A reader that falls a whole ring
+ * behind notices it from the sequence numbers and resumes at the last sync
+ * point, a codec config followed by a keyframe.
+ *
+ * The memfd is handed to readers over a Unix socket (SCM_RIGHTS), see
+ * shmring_connect(), opened read-only and sealed against writes other than
+ * through the writer's own mapping, so a reader cannot corrupt the ring for
+ * the others.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+#include "shmring.h"
+
+#define HEADER_SIZE   4096
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010      /* Linux 5.1 */
+#endif
+
+static int futex(volatile uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/* data_size and slots are rounded up to powers of two; 0 or -1 with errno set */
+int shmring_create(struct shmring_writer *w, const char *name, size_t data_size, unsigned int slots)
+{
+	struct shmring_header *h;
+	char path[64];
+	size_t size, n;
+	void *map;
+
+	for (n = 4096; n < data_size; n <<= 1)
+		;
+	data_size = n;
+	for (n = 16; n < slots; n <<= 1)
+		;
+	slots = n;
+	size = HEADER_SIZE + ((slots * sizeof(struct shmring_slot) + 4095) & ~(size_t)4095) + data_size;
+
+	if ((w->fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+		return -1;
+	if (ftruncate(w->fd, size) < 0 ||
+		(map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0)) == MAP_FAILED) {
+		int save = errno;
+
+		close(w->fd);
+		errno = save;
+		return -1;
+	}
+	/* readers may rely on the size staying put; no new writable mapping or write(), this one is kept */
+	if (fcntl(w->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0)
+		fcntl(w->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+	/* what readers get: a read-only open file cannot be mapped writable, with or without the seal */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", w->fd);
+	if ((w->reader_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		w->reader_fd = w->fd;
+
+	w->map_size = size;
+	w->header = h = map;
+	memset(h, 0, sizeof(*h));
+	h->magic = SHMRING_MAGIC;
+	h->version = SHMRING_VERSION;
+	h->slots = slots;
+	h->data_size = data_size;
+	h->slots_offset = HEADER_SIZE;
+	h->data_offset = size - data_size;
+	w->slots = (struct shmring_slot *)((char *)map + h->slots_offset);
+	w->data = (unsigned char *)map + h->data_offset;
+	return 0;
+}
+
+/* a unit larger than the data ring is not published */
+void shmring_publish(struct shmring_writer *w, const void *data, size_t size, unsigned int flags, int64_t timestamp)
+{
+	struct shmring_header *h = w->header;
+	uint64_t n = h->seq + 1, pos = h->reserved;
+	struct shmring_slot *slot = &w->slots[n & (h->slots - 1)];
+	size_t at = pos & (h->data_size - 1), first;
+
+	if (size > h->data_size)
+		return;
+
+	/* claim the data and the slot before overwriting either */
+	h->reserved = pos + size;
+	slot->seq = 2 * n - 1;
+	__sync_synchronize();
+
+	first = size < h->data_size - at ? size : h->data_size - at;
+	memcpy(w->data + at, data, first);
+	memcpy(w->data, (const unsigned char *)data + first, size - first);
+	slot->offset = pos;
+	slot->size = size;
+	slot->flags = flags;
+	slot->timestamp = timestamp;
+	__sync_synchronize();
+	slot->seq = 2 * n;
+
+	/* a config followed by a keyframe is where a reader can start */
+	if ((flags & SHMRING_KEYFRAME) && n > 1 && (w->slots[(n - 1) & (h->slots - 1)].flags & SHMRING_CONFIG))
+		h->sync_seq = n - 1;
+	h->seq = n;
+	__sync_synchronize();
+	__sync_add_and_fetch(&h->wake, 1);
+	futex(&h->wake, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+void shmring_destroy(struct shmring_writer *w)
+{
+	if (!w->header)
+		return;
+	w->header->closed = 1;
+	__sync_add_and_fetch(&w->header->wake, 1);
+	futex(&w->header->wake, FUTEX_WAKE, INT_MAX, NULL);
+	munmap(w->header, w->map_size);
+	if (w->reader_fd != w->fd)
+		close(w->reader_fd);
+	close(w->fd);
+	w->header = NULL;
+}
+
+/* connect to the writer's socket and receive the ring's fd; -1 with errno set */
+int shmring_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		char           buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov;
+	char byte;
+	int sock, fd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) > 0 && (cmsg = CMSG_FIRSTHDR(&msg)) != NULL &&
+			cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+		else
+			errno = EPROTO;
+	}
+	close(sock);
+	return fd;
+}
+
+/* map the ring read-only and start at its last sync point; takes over fd */
+int shmring_open(struct shmring_reader *r, int fd)
+{
+	struct stat st;
+	void *map;
+
+	memset(r, 0, sizeof(*r));
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < HEADER_SIZE ||
+		(map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		int save = errno;
+
+		close(fd);
+		errno = save;
+		return -1;
+	}
+	r->fd = fd;
+	r->map_size = st.st_size;
+	r->header = map;
+	if (r->header->magic != SHMRING_MAGIC || r->header->version != SHMRING_VERSION ||
+		r->header->data_offset + r->header->data_size != r->map_size) {
+		munmap(map, r->map_size);
+		close(fd);
+		r->header = NULL;
+		errno = EPROTO;
+		return -1;
+	}
+	r->slots = (const struct shmring_slot *)((const char *)map + r->header->slots_offset);
+	r->data = (const unsigned char *)map + r->header->data_offset;
+	r->next = r->header->sync_seq ? r->header->sync_seq : r->header->seq + 1;
+	r->syncing = 1;
+	return 0;
+}
+
+/* after an overrun: the last sync point, or the next one if that is gone too */
+static void resync(struct shmring_reader *r, uint64_t failed)
+{
+	r->overruns++;
+	r->next = r->header->sync_seq;
+	if (!r->next || r->next <= failed)
+		r->next = r->header->seq + 1;
+	r->syncing = 1;
+}
+
+/*
+ * Copy the next unit into buf: 1 when there was one, 0 when there is nothing
+ * new, -1 with errno EMSGSIZE when buf is too small for it. After an overrun
+ * units are skipped up to the next codec config.
+ */
+int shmring_next(struct shmring_reader *r, void *buf, size_t size, struct shmring_unit *unit)
+{
+	const struct shmring_header *h = r->header;
+	const struct shmring_slot *slot;
+	uint64_t seq, n, offset;
+	size_t at, first;
+
+	for (;;) {
+		seq = h->seq;
+		__sync_synchronize();
+		if ((n = r->next) > seq)
+			return 0;
+		if (seq - n >= h->slots) {
+			resync(r, n);
+			continue;
+		}
+
+		slot = &r->slots[n & (h->slots - 1)];
+		if (slot->seq != 2 * n) {
+			resync(r, n);
+			continue;
+		}
+		__sync_synchronize();
+		unit->seq = n;
+		unit->size = slot->size;
+		unit->flags = slot->flags;
+		unit->timestamp = slot->timestamp;
+		offset = slot->offset;
+		if (r->syncing && !(unit->flags & SHMRING_CONFIG)) {
+			r->next++;
+			continue;
+		}
+		if (unit->size > size) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		at = offset & (h->data_size - 1);
+		first = unit->size < h->data_size - at ? unit->size : h->data_size - at;
+		memcpy(buf, r->data + at, first);
+		memcpy((unsigned char *)buf + first, r->data, unit->size - first);
+		__sync_synchronize();
+
+		/* torn if the slot was reused or the data overwritten while copying */
+		if (slot->seq != 2 * n || h->reserved - offset > h->data_size) {
+			resync(r, n);
+			continue;
+		}
+		r->syncing = 0;
+		r->next = n + 1;
+		return 1;
+	}
+}
+
+/* sleep until there is a unit to read or timeout_ms passes (-1: no timeout); 1 if there is one */
+int shmring_wait(struct shmring_reader *r, int timeout_ms)
+{
+	const struct shmring_header *h = r->header;
+	struct timespec timeout;
+	uint32_t wake = h->wake;
+
+	__sync_synchronize();
+	if (h->seq >= r->next || h->closed)
+		return h->seq >= r->next;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = timeout_ms % 1000 * 1000000L;
+	futex((volatile uint32_t *)&h->wake, FUTEX_WAIT, wake, timeout_ms < 0 ? NULL : &timeout);
+	return h->seq >= r->next;
+}
+
+void shmring_close(struct shmring_reader *r)
+{
+	if (!r->header)
+		return;
+	munmap((void *)r->header, r->map_size);
+	close(r->fd);
+	r->header = NULL;
+}
@@ -0,0 +1,85 @@
+/*
+ * Shared-memory ring of encoded access units
+ *
+ * Layout shared by the writer (capture-encode --shm) and any number of
+ * read-only readers, and the library both sides use. Readers include this
+ * header and link shmring.c; nothing else of capture-encode is needed.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHMRING_MAGIC     0x53484d52u   /* "SHMR" */
+#define SHMRING_VERSION   1
+
+/* unit flags, as in au.h */
+#define SHMRING_KEYFRAME  1
+#define SHMRING_CONFIG    2
+
+struct shmring_header {
+	uint32_t          magic, version;
+	uint32_t          slots;            /* power of two */
+	volatile uint32_t wake;             /* futex word, bumped on every publish */
+	uint64_t          data_size;        /* power of two */
+	uint64_t          slots_offset, data_offset;
+	volatile uint64_t seq;              /* last published unit, 0 before the first */
+	volatile uint64_t sync_seq;         /* last config unit that is followed by a keyframe */
+	volatile uint64_t reserved;         /* data written or being written, in bytes since the start */
+	volatile uint32_t closed;
+};
+
+/*
+ * Seqlock per slot: the writer sets seq to 2n-1 before reusing the slot for
+ * unit n and to 2n once unit n is complete. A reader copies the slot and its
+ * data, then checks that seq is still 2n and the data was not overwritten
+ * since (header reserved).
+ */
+struct shmring_slot {
+	volatile uint64_t seq;
+	uint64_t          offset;           /* of the data, in bytes since the start */
+	uint32_t          size, flags;
+	int64_t           timestamp;        /* capture time, CLOCK_MONOTONIC us */
+};
+
+struct shmring_unit {
+	uint64_t          seq;
+	uint32_t          size, flags;
+	int64_t           timestamp;
+};
+
+/* writer */
+struct shmring_writer {
+	int                    fd;
+	int                    reader_fd;        /* the same memfd opened read-only, for readers; fd if /proc is not there */
+	struct shmring_header *header;
+	struct shmring_slot   *slots;
+	unsigned char         *data;
+	size_t                 map_size;
+};
+
+int shmring_create(struct shmring_writer *w, const char *name, size_t data_size, unsigned int slots);
+void shmring_publish(struct shmring_writer *w, const void *data, size_t size, unsigned int flags, int64_t timestamp);
+void shmring_destroy(struct shmring_writer *w);
+
+/* reader */
+struct shmring_reader {
+	int                          fd;
+	const struct shmring_header *header;
+	const struct shmring_slot   *slots;
+	const unsigned char         *data;
+	size_t                       map_size;
+	uint64_t                     next;       /* unit to read next */
+	int                          syncing;    /* skipping to a codec config */
+	unsigned long                overruns;
+};
+
+int shmring_connect(const char *path);
+int shmring_open(struct shmring_reader *r, int fd);
+int shmring_next(struct shmring_reader *r, void *buf, size_t size, struct shmring_unit *unit);
+int shmring_wait(struct shmring_reader *r, int timeout_ms);
+void shmring_close(struct shmring_reader *r);
+
+#endif /* SHMRING_H */
@@ -0,0 +1,612 @@
+/*
+ * Fan-out of the encoded stream to extra sinks
+ *
+ * Besides stdout, the stream can go to any number of sinks given as
+ *
+ *   file:PATH | fd:N | udp:HOST:PORT | unix:PATH   [,queue=KB] [,drop=gop|close]
+ *
+ * Every finished access unit is handed to each sink by reference, so it is
+ * copied out of the encoder once however many sinks there are. Each sink has
+ * its own queue and writer thread: a slow sink only falls behind itself, never
+ * the others, stdout or the encoder. When a queue would grow past its bound
+ * the drop policy applies: "gop" (default) drops everything queued and resumes
+ * at the next keyframe with the codec config in front, "close" gives up on the
+ * sink. A sink added mid-stream starts from the GOP cache when it holds a
+ * keyframe, otherwise at the next keyframe.
+ *
+ * UDP sinks send each unit as datagrams of at most SINK_DATAGRAM bytes of raw
+ * Annex B; unix sinks connect to a stream socket someone else listens on.
+ *
+ * The list of sinks is under a lock: the control socket adds and removes them
+ * on the capture thread while the thread draining the encoder (the OMX
+ * callback's, in raw mode) feeds them. As with the server's clients, a sink
+ * added is replayed the GOP cache by the draining thread just before its next
+ * unit, so it neither misses a unit nor gets one twice.
+ *
+ * In daemon mode every other camera's stream goes to a sink of its own, made
+ * with sink_new() and fed with sink_put() by that camera, outside the list
+ * above and its GOP cache.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sink.h"
+#include "gop.h"
+#include "stats.h"
+#include "rt.h"
+
+#define SINK_QUEUE        512   /* units a sink can have queued, whatever their size */
+#define SINK_DATAGRAM     1400
+#define SINK_SPEC         256
+#define SINK_CLOSE_MS     2000  /* how long exit waits for a sink to write out its queue */
+
+char *sink_specs[SINK_MAX];
+int   sink_specs_count, sink_queue_kb = 2048;
+
+enum sink_type { SINK_FILE, SINK_FD, SINK_UDP, SINK_UNIX };
+enum sink_drop { SINK_DROP_GOP, SINK_DROP_CLOSE };
+
+struct sink {
+	char             spec[SINK_SPEC];
+	enum sink_type   type;
+	enum sink_drop   drop;
+	int              fd, record;
+	size_t           max_bytes;
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+
+	/* under lock */
+	struct au       *queue[SINK_QUEUE];
+	unsigned int     head, tail;
+	size_t           queued_bytes;
+	int              closing, failed, detached, exited;
+
+	/* feeding thread only */
+	int              waiting;          /* for a keyframe, after joining or a drop */
+	int              own;              /* sink_new(): fed by one camera, not from the GOP cache */
+	int              joining;          /* to be replayed the GOP cache before its next unit, under list_lock */
+	struct au       *config;           /* the last codec config it was given */
+	int64_t          requested_us;
+	unsigned long    drops, dropped_units, skipped_units;
+
+	/* writer thread only */
+	unsigned long    units;
+	uint64_t         bytes;
+	int64_t          lag_sum, lag_max, lag_last;
+};
+
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sink    *sinks[SINK_MAX];
+static int             count;
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+/* returns 0 or -1 with errno set */
+static int sink_write(struct sink *s, const unsigned char *data, size_t length)
+{
+	ssize_t n;
+
+	while (length > 0) {
+		if (s->type == SINK_UDP)
+			n = send(s->fd, data, length < SINK_DATAGRAM ? length : SINK_DATAGRAM, 0);
+		else if (s->type == SINK_UNIX)
+			n = send(s->fd, data, length, MSG_NOSIGNAL);
+		else
+			n = write(s->fd, data, length);
+		if (n < 0) {
+			/* nobody listening on the UDP port yet is not an error */
+			if (errno == EINTR || (s->type == SINK_UDP && errno == ECONNREFUSED))
+				continue;
+			return -1;
+		}
+		data += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static void sink_destroy(struct sink *s)
+{
+	while (s->head != s->tail)
+		au_unref(s->queue[s->head++ % SINK_QUEUE]);
+	au_unref(s->config);
+	close(s->fd);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+}
+
+static void *sink_thread(void *arg)
+{
+	struct sink *s = arg;
+	struct au *au;
+	sigset_t pipe;
+	int64_t lag;
+
+	rt_setup_thread(RT_THREAD_OUTPUT);
+	/* a reader going away fails this sink with EPIPE rather than killing the stream */
+	sigemptyset(&pipe);
+	sigaddset(&pipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe, NULL);
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (s->head == s->tail && !s->closing)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->head == s->tail)
+			break;
+		au = s->queue[s->head++ % SINK_QUEUE];
+		s->queued_bytes -= au->size;
+		pthread_mutex_unlock(&s->lock);
+
+		if (sink_write(s, au->data, au->size) < 0) {
+			stats_event("sink %s: write error %d, %s, closed", s->spec, errno, strerror(errno));
+			au_unref(au);
+			pthread_mutex_lock(&s->lock);
+			s->failed = 1;
+			break;
+		}
+		if (!(au->flags & AU_CONFIG)) {
+			lag = now_us() - au->timestamp;
+			s->lag_sum += lag;
+			if (lag > s->lag_max)
+				s->lag_max = lag;
+			s->lag_last = lag;
+			s->units++;
+		}
+		s->bytes += au->size;
+		au_unref(au);
+
+		pthread_mutex_lock(&s->lock);
+	}
+	s->exited = 1;
+	if (s->detached) {
+		pthread_mutex_unlock(&s->lock);
+		sink_destroy(s);
+		return NULL;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static int open_udp(const char *target)
+{
+	struct addrinfo hints, *res;
+	char host[SINK_SPEC], *port;
+	int fd, err;
+
+	snprintf(host, sizeof(host), "%s", target);
+	if ((port = strrchr(host, ':')) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+		errno = err == EAI_SYSTEM ? errno : EHOSTUNREACH;
+		return -1;
+	}
+	if ((fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) >= 0 &&
+		connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+static int open_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0 &&
+		connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/* parse "type:target[,queue=KB][,drop=gop|close]" and open the target; NULL with errno set on failure */
+static struct sink *sink_open(const char *spec)
+{
+	char buf[SINK_SPEC], *target, *option;
+	struct sink *s;
+	int save;
+
+	if (strlen(spec) >= SINK_SPEC || (target = strchr(strcpy(buf, spec), ':')) == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	*target++ = '\0';
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return NULL;
+	strcpy(s->spec, spec);
+	s->max_bytes = (size_t)sink_queue_kb << 10;
+	s->drop = SINK_DROP_GOP;
+
+	/* options follow the target, comma separated */
+	while ((option = strrchr(target, ',')) != NULL) {
+		*option++ = '\0';
+		if (!strncmp(option, "queue=", 6))
+			s->max_bytes = (size_t)atoi(option + 6) << 10;
+		else if (!strcmp(option, "drop=gop"))
+			s->drop = SINK_DROP_GOP;
+		else if (!strcmp(option, "drop=close"))
+			s->drop = SINK_DROP_CLOSE;
+		else
+			goto invalid;
+	}
+
+	if (!strcmp(buf, "file")) {
+		s->type = SINK_FILE;
+		s->fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+	else if (!strcmp(buf, "fd")) {
+		s->type = SINK_FD;
+		s->fd = fcntl(atoi(target), F_DUPFD_CLOEXEC, 0);
+	}
+	else if (!strcmp(buf, "udp")) {
+		s->type = SINK_UDP;
+		s->fd = open_udp(target);
+	}
+	else if (!strcmp(buf, "unix")) {
+		s->type = SINK_UNIX;
+		s->fd = open_unix(target);
+	}
+	else
+		goto invalid;
+	if (s->fd < 0)
+		goto fail;
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	if ((errno = pthread_create(&s->thread, NULL, sink_thread, s)) != 0) {
+		close(s->fd);
+		pthread_mutex_destroy(&s->lock);
+		pthread_cond_destroy(&s->cond);
+		goto fail;
+	}
+	return s;
+
+invalid:
+	errno = EINVAL;
+fail:
+	save = errno;
+	free(s);
+	errno = save;
+	return NULL;
+}
+
+/* stop taking units and let the writer finish what is queued */
+static void sink_stop(struct sink *s, int detach)
+{
+	pthread_t thread = s->thread;
+	int exited;
+
+	pthread_mutex_lock(&s->lock);
+	s->closing = 1;
+	exited = s->exited;
+	s->detached = detach && !exited;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	if (!detach)
+		return;
+	if (exited) {
+		/* a failed sink's writer is already gone */
+		pthread_join(thread, NULL);
+		sink_destroy(s);
+	}
+	else
+		/* it frees itself once written out, and may be gone by now */
+		pthread_detach(thread);
+}
+
+/* wait up to wait_ms for a stopped sink's writer; 0 if it finished */
+static int sink_join(struct sink *s, int wait_ms)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += wait_ms / 1000;
+	deadline.tv_nsec += wait_ms % 1000 * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	if (pthread_timedjoin_np(s->thread, NULL, &deadline) != 0) {
+		fprintf(stderr, "sink %s: still writing after %d ms, abandoned\n", s->spec, wait_ms);
+		return -1;
+	}
+	return 0;
+}
+
+static void sink_push(struct sink *s, struct au *au)
+{
+	struct au *config;
+	unsigned int dropped;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->failed || s->closing) {
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	if (au->flags & AU_CONFIG) {
+		au_unref(s->config);
+		s->config = au_ref(au);
+	}
+
+	/* an empty queue takes any unit, however large */
+	if (s->head != s->tail && (s->tail - s->head >= SINK_QUEUE - 1 || s->queued_bytes + au->size > s->max_bytes)) {
+		if (s->drop == SINK_DROP_CLOSE) {
+			s->failed = 1;
+			pthread_mutex_unlock(&s->lock);
+			stats_event("sink %s: %zu KB behind, closed", s->spec, s->queued_bytes >> 10);
+			return;
+		}
+		/* units in flight in the writer are not in the queue; the sink still resumes on a unit boundary */
+		for (dropped = 0; s->tail != s->head; dropped++)
+			au_unref(s->queue[--s->tail % SINK_QUEUE]);
+		s->queued_bytes = 0;
+		s->drops++;
+		s->dropped_units += dropped;
+		s->waiting = 1;
+		s->requested_us = now_us();
+		stats_event("sink %s: %u units dropped, resuming at the next keyframe", s->spec, dropped);
+	}
+
+	if (s->waiting) {
+		if (!(au->flags & AU_KEYFRAME)) {
+			if (!(au->flags & AU_CONFIG))
+				s->skipped_units++;
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+		s->waiting = 0;
+		if ((config = s->config ? s->config : s->own ? NULL : gop_config()) != NULL) {
+			s->queue[s->tail++ % SINK_QUEUE] = au_ref(config);
+			s->queued_bytes += config->size;
+		}
+		stats_event("sink %s: started at a keyframe %.1f ms after the request", s->spec,
+			(now_us() - s->requested_us) / 1000.0);
+	}
+
+	s->queue[s->tail++ % SINK_QUEUE] = au_ref(au);
+	s->queued_bytes += au->size;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void replay_unit(struct au *au, void *arg)
+{
+	sink_push(arg, au);
+}
+
+/* add a sink; requested_us is when it was asked for, for the time-to-first-unit event */
+static int add_sink(const char *spec, int64_t requested_us, int record)
+{
+	struct sink *s;
+	int full;
+
+	/* only the control socket and startup add sinks, so the list cannot fill up meanwhile */
+	pthread_mutex_lock(&list_lock);
+	full = count == SINK_MAX;
+	pthread_mutex_unlock(&list_lock);
+	if (full) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if ((s = sink_open(spec)) == NULL)
+		return -1;
+	s->requested_us = requested_us;
+	s->record = record;
+	s->joining = 1;
+	pthread_mutex_lock(&list_lock);
+	sinks[count++] = s;
+	pthread_mutex_unlock(&list_lock);
+	return 0;
+}
+
+int sink_add(const char *spec, int64_t requested_us)
+{
+	return add_sink(spec, requested_us, 0);
+}
+
+/* take sinks[i] off the list, under list_lock; the caller stops it once the lock is dropped */
+static struct sink *unlist(int i)
+{
+	struct sink *s = sinks[i];
+
+	stats_event("sink %s: removed after %llu bytes", s->spec, (unsigned long long)s->bytes);
+	sinks[i] = sinks[--count];
+	return s;
+}
+
+int sink_remove(const char *spec)
+{
+	struct sink *s = NULL;
+	int i;
+
+	pthread_mutex_lock(&list_lock);
+	for (i = 0; i < count && !s; i++)
+		if (!strcmp(sinks[i]->spec, spec))
+			s = unlist(i);
+	pthread_mutex_unlock(&list_lock);
+	if (!s) {
+		errno = ENOENT;
+		return -1;
+	}
+	sink_stop(s, 1);
+	return 0;
+}
+
+int sink_count(void)
+{
+	int n;
+
+	pthread_mutex_lock(&list_lock);
+	n = count;
+	pthread_mutex_unlock(&list_lock);
+	return n;
+}
+
+/* hand a finished access unit to every sink; call before the unit goes into the GOP cache */
+void sink_unit(struct au *au)
+{
+	struct sink *s;
+	int i;
+
+	pthread_mutex_lock(&list_lock);
+	for (i = 0; i < count; i++) {
+		s = sinks[i];
+		if (s->joining) {
+			s->joining = 0;
+			if (gop_replay(replay_unit, s))
+				stats_event("sink %s: started from the GOP cache %.1f ms after the request", s->spec,
+					(now_us() - s->requested_us) / 1000.0);
+			else
+				s->waiting = 1;
+		}
+		sink_push(s, au);
+	}
+	pthread_mutex_unlock(&list_lock);
+}
+
+/* the control socket's recording is a file sink; a new one replaces the last */
+int sink_record(const char *path, int64_t requested_us)
+{
+	char spec[SINK_SPEC];
+
+	sink_record_stop();
+	snprintf(spec, sizeof(spec), "file:%s", path);
+	return add_sink(spec, requested_us, 1);
+}
+
+void sink_record_stop(void)
+{
+	struct sink *s = NULL;
+	int i;
+
+	pthread_mutex_lock(&list_lock);
+	for (i = 0; i < count && !s; i++)
+		if (sinks[i]->record)
+			s = unlist(i);
+	pthread_mutex_unlock(&list_lock);
+	if (s)
+		sink_stop(s, 1);
+}
+
+static void report_sink(struct sink *s, FILE *out)
+{
+	size_t queued;
+
+	pthread_mutex_lock(&s->lock);
+	queued = s->queued_bytes;
+	pthread_mutex_unlock(&s->lock);
+	fprintf(out, "sink %s: %lu units, %llu bytes, lag %.1f ms now, %.1f ms avg, %.1f ms max, %zu KB queued%s\n",
+		s->spec, s->units, (unsigned long long)s->bytes, s->lag_last / 1000.0,
+		s->units ? s->lag_sum / 1000.0 / s->units : 0.0, s->lag_max / 1000.0, queued >> 10,
+		s->failed ? ", closed" : "");
+	if (s->drops)
+		fprintf(out, "sink %s: %lu drops, %lu units dropped, %lu skipped waiting for a keyframe\n",
+			s->spec, s->drops, s->dropped_units, s->skipped_units);
+}
+
+/* write out what every sink has queued, report it to out and free it */
+void sink_close_all(FILE *out)
+{
+	struct sink *closing[SINK_MAX], *s;
+	int i, n;
+
+	pthread_mutex_lock(&list_lock);
+	n = count;
+	memcpy(closing, sinks, n * sizeof(*closing));
+	count = 0;
+	pthread_mutex_unlock(&list_lock);
+
+	for (i = 0; i < n; i++)
+		sink_stop(closing[i], 0);
+	while (n > 0) {
+		s = closing[--n];
+		if (sink_join(s, SINK_CLOSE_MS) < 0)
+			continue;
+		if (out)
+			report_sink(s, out);
+		sink_destroy(s);
+	}
+}
+
+/* a sink for one camera's stream, starting at its first keyframe; NULL with errno set */
+struct sink *sink_new(const char *spec)
+{
+	struct sink *s;
+
+	if ((s = sink_open(spec)) == NULL)
+		return NULL;
+	s->own = 1;
+	s->waiting = 1;
+	s->requested_us = now_us();
+	return s;
+}
+
+void sink_put(struct sink *s, struct au *au)
+{
+	sink_push(s, au);
+}
+
+void sink_report_one(struct sink *s, FILE *out)
+{
+	report_sink(s, out);
+}
+
+/* write out what it has queued, report it to out and free it */
+void sink_free(struct sink *s, FILE *out)
+{
+	sink_stop(s, 0);
+	if (sink_join(s, SINK_CLOSE_MS) < 0)
+		return;
+	if (out)
+		report_sink(s, out);
+	sink_destroy(s);
+}
+
+void sink_report(FILE *out)
+{
+	int i;
+
+	pthread_mutex_lock(&list_lock);
+	for (i = 0; i < count; i++)
+		report_sink(sinks[i], out);
+	pthread_mutex_unlock(&list_lock);
+}
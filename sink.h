@@ -0,0 +1,34 @@
+/*
+ * Fan-out of the encoded stream to extra sinks
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "au.h"
+
+#define SINK_MAX          8
+
+struct sink;
+
+extern char *sink_specs[SINK_MAX];
+extern int   sink_specs_count, sink_queue_kb;
+
+int sink_add(const char *spec, int64_t requested_us);
+int sink_remove(const char *spec);
+int sink_count(void);
+void sink_unit(struct au *au);
+int sink_record(const char *path, int64_t requested_us);
+void sink_record_stop(void);
+void sink_close_all(FILE *out);
+void sink_report(FILE *out);
+
+struct sink *sink_new(const char *spec);
+void sink_put(struct sink *s, struct au *au);
+void sink_free(struct sink *s, FILE *out);
+void sink_report_one(struct sink *s, FILE *out);
+
+#endif /* SINK_H */
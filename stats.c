@@ -0,0 +1,256 @@
+/*
+ * Capture statistics
+ *
+ * DQBUF-to-DQBUF interval histogram in 0.5 ms buckets. Run once with and once
+ * without the real-time options to compare; the report names the options in
+ * effect. Intervals and timers are kept per camera, by its capture thread, and
+ * reported per camera; each camera's are under a lock of its own so a report
+ * from another thread reads them whole.
+ *
+ * Capture-to-output latency uses the same histogram: the time from DQBUF to
+ * the write of the first and of the last encoded buffer of each frame. Those
+ * come from the output and HLS threads, under latency_lock.
+ *
+ * Runtime decisions (bitrate changes and the like) are logged as events: they
+ * are printed when they happen and the last STATS_EVENTS are repeated in the
+ * report. Any thread may log one; the ring is under event_lock.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "rt.h"
+
+#define HIST_BUCKET_US  500
+#define HIST_BUCKETS    400     /* up to 200 ms, longer samples go in the last bucket */
+#define STATS_EVENTS    64
+#define STATS_CAMERAS   8       /* CAMERA_MAX */
+#define EVENT_LENGTH    120
+
+struct histogram {
+	unsigned long   hist[HIST_BUCKETS];
+	unsigned long   samples;
+	double          sum_us, sum_sq_us, min_us, max_us;
+};
+
+struct stats_camera {
+	const char       *name;
+	pthread_mutex_t   lock;
+	struct histogram  intervals;
+	struct timespec   last;
+	double            timer_us[STATS_TIMERS];
+	unsigned long     timer_calls[STATS_TIMERS];
+};
+
+int jitter, timing, latency;
+
+static pthread_mutex_t     camera_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_camera cameras[STATS_CAMERAS];
+static int                 camera_count;
+
+static pthread_mutex_t  latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct histogram latencies[STATS_LATENCIES];
+static const char      *latency_name[STATS_LATENCIES] = { "capture to first output", "capture to end of frame",
+	"capture to HLS playlist" };
+
+static pthread_mutex_t  event_lock = PTHREAD_MUTEX_INITIALIZER;
+static char             events[STATS_EVENTS][EVENT_LENGTH];
+static unsigned long    event_count;
+static struct timespec  first_event;
+
+static const char      *timer_name[STATS_TIMERS] = { "buffer setup", "QBUF", "MJPEG filter/copy" };
+
+static void histogram_add(struct histogram *h, double us)
+{
+	int bucket = us < 0 ? 0 : us / HIST_BUCKET_US;
+
+	h->hist[bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1]++;
+	if (!h->samples || us < h->min_us)
+		h->min_us = us;
+	if (us > h->max_us)
+		h->max_us = us;
+	h->sum_us += us;
+	h->sum_sq_us += us * us;
+	h->samples++;
+}
+
+/* the stats of the camera named, made on first use; NULL once STATS_CAMERAS are in use */
+struct stats_camera *stats_camera(const char *name)
+{
+	struct stats_camera *c = NULL;
+	int i;
+
+	pthread_mutex_lock(&camera_lock);
+	for (i = 0; i < camera_count && !c; i++)
+		if (!strcmp(cameras[i].name, name))
+			c = &cameras[i];
+	if (!c && camera_count < STATS_CAMERAS) {
+		c = &cameras[camera_count++];
+		c->name = name;
+		pthread_mutex_init(&c->lock, NULL);
+	}
+	pthread_mutex_unlock(&camera_lock);
+	return c;
+}
+
+void stats_dqbuf(struct stats_camera *c)
+{
+	struct timespec now;
+
+	if (!jitter || !c)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&c->lock);
+	if (c->last.tv_sec + c->last.tv_nsec > 0)
+		histogram_add(&c->intervals, (now.tv_sec - c->last.tv_sec) * 1000000.0 + (now.tv_nsec - c->last.tv_nsec) / 1000.0);
+	c->last = now;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void stats_latency(enum stats_latency what, long us)
+{
+	if (!latency)
+		return;
+	pthread_mutex_lock(&latency_lock);
+	histogram_add(&latencies[what], us);
+	pthread_mutex_unlock(&latency_lock);
+}
+
+void stats_timer_start(struct timespec *start)
+{
+	if (timing)
+		clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+void stats_timer_stop(struct stats_camera *c, enum stats_timer timer, const struct timespec *start)
+{
+	struct timespec now;
+
+	if (!timing || !c)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&c->lock);
+	c->timer_us[timer] += (now.tv_sec - start->tv_sec) * 1000000.0 + (now.tv_nsec - start->tv_nsec) / 1000.0;
+	c->timer_calls[timer]++;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void stats_event(const char *fmt, ...)
+{
+	struct timespec now;
+	char *event;
+	int n;
+	va_list ap;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&event_lock);
+	event = events[event_count++ % STATS_EVENTS];
+	if (event_count == 1)
+		first_event = now;
+	n = snprintf(event, EVENT_LENGTH, "%8.3f s ",
+		(now.tv_sec - first_event.tv_sec) + (now.tv_nsec - first_event.tv_nsec) / 1000000000.0);
+	va_start(ap, fmt);
+	vsnprintf(event + n, EVENT_LENGTH - n, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "%s\n", event);
+	pthread_mutex_unlock(&event_lock);
+}
+
+static void events_report(FILE *out)
+{
+	unsigned long i;
+
+	pthread_mutex_lock(&event_lock);
+	if (event_count) {
+		i = event_count > STATS_EVENTS ? event_count - STATS_EVENTS : 0;
+		fprintf(out, "events (%lu, last %lu shown):\n", event_count, event_count - i);
+		for (; i < event_count; i++)
+			fprintf(out, "%s\n", events[i % STATS_EVENTS]);
+	}
+	pthread_mutex_unlock(&event_lock);
+}
+
+static double percentile(const struct histogram *h, double p)
+{
+	unsigned long rank = p * h->samples, seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if ((seen += h->hist[i]) > rank)
+			break;
+	return (i + 1) * HIST_BUCKET_US / 1000.0;
+}
+
+static void histogram_report(FILE *out, const char *what, const struct histogram *h)
+{
+	unsigned long peak = 0;
+	double mean;
+	int i;
+
+	if (!h->samples)
+		return;
+
+	mean = h->sum_us / h->samples;
+	fprintf(out, "%s: %lu samples, mean %.2f ms, stddev %.2f ms, min %.2f ms, max %.2f ms, "
+		"p50 <%.1f ms, p99 <%.1f ms, p99.9 <%.1f ms\n",
+		what, h->samples, mean / 1000, sqrt(h->sum_sq_us / h->samples - mean * mean) / 1000, h->min_us / 1000, h->max_us / 1000,
+		percentile(h, 0.5), percentile(h, 0.99), percentile(h, 0.999));
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (h->hist[i] > peak)
+			peak = h->hist[i];
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (h->hist[i])
+			fprintf(out, "%6.1f%s%-6.1f ms %8lu %6.2f%% %.*s\n",
+				i * HIST_BUCKET_US / 1000.0, i < HIST_BUCKETS - 1 ? "-" : "+ ", (i + 1) * HIST_BUCKET_US / 1000.0,
+				h->hist[i], 100.0 * h->hist[i] / h->samples, (int)(50 * h->hist[i] / peak),
+				"##################################################");
+}
+
+static void timing_report(FILE *out, const struct stats_camera *c)
+{
+	int i;
+
+	for (i = 0; i < STATS_TIMERS; i++)
+		if (c->timer_calls[i])
+			fprintf(out, "%s %s: %.1f us/call over %lu calls, %.2f ms total\n", c->name,
+				timer_name[i], c->timer_us[i] / c->timer_calls[i], c->timer_calls[i], c->timer_us[i] / 1000);
+}
+
+void stats_report(FILE *out)
+{
+	struct stats_camera *c;
+	char what[128];
+	int i, n;
+
+	pthread_mutex_lock(&camera_lock);
+	n = camera_count;
+	pthread_mutex_unlock(&camera_lock);
+
+	if (jitter)
+		rt_describe(out);
+	for (i = 0; i < n; i++) {
+		c = &cameras[i];
+		pthread_mutex_lock(&c->lock);
+		if (jitter) {
+			snprintf(what, sizeof(what), "%s DQBUF interval", c->name);
+			histogram_report(out, what, &c->intervals);
+		}
+		if (timing)
+			timing_report(out, c);
+		pthread_mutex_unlock(&c->lock);
+	}
+	if (latency) {
+		pthread_mutex_lock(&latency_lock);
+		for (i = 0; i < STATS_LATENCIES; i++)
+			histogram_report(out, latency_name[i], &latencies[i]);
+		pthread_mutex_unlock(&latency_lock);
+	}
+	events_report(out);
+}
@@ -0,0 +1,38 @@
+/*
+ * Capture statistics
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+enum stats_timer {
+	STATS_SETUP,        /* buffer allocation, REQBUFS, initial QBUF and STREAMON */
+	STATS_QBUF,
+	STATS_FILTER,       /* MJPEG filter / frame copy */
+	STATS_TIMERS
+};
+
+enum stats_latency {
+	STATS_LATENCY_FIRST,    /* capture to first encoded buffer of the frame written */
+	STATS_LATENCY_FRAME,    /* capture to last encoded buffer of the frame written */
+	STATS_LATENCY_PLAYLIST, /* capture to the HLS playlist listing the frame, first of a part or segment */
+	STATS_LATENCIES
+};
+
+/* a camera's DQBUF intervals and timers */
+struct stats_camera;
+
+extern int jitter, timing, latency;
+
+struct stats_camera *stats_camera(const char *name);
+void stats_dqbuf(struct stats_camera *c);
+void stats_latency(enum stats_latency what, long us);
+void stats_event(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void stats_timer_start(struct timespec *start);
+void stats_timer_stop(struct stats_camera *c, enum stats_timer timer, const struct timespec *start);
+void stats_report(FILE *out);
+
+#endif /* STATS_H */
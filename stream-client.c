@@ -0,0 +1,308 @@
+/*
+ * stream-client: read the stream capture-encode --serve PATH serves
+ *
+ *   stream-client PATH > out.h264          copy the stream to stdout
+ *   stream-client -n 50 -t 30 PATH         fan-out benchmark: 50 clients
+ *                                          reading and discarding for 30 s
+ *   stream-client -m PATH > out.h264       copy from the shared memory ring
+ *                                          capture-encode --shm PATH hands out
+ *   stream-client -f -r 1000 -s 50 -t 40 PATH
+ *                                          synthetic feeder: serve 1000 units
+ *                                          a second of 50 KB on PATH for 40 s
+ *                                          with capture-encode's own server
+ *
+ * The benchmark reports what each client received and the aggregate rate;
+ * run it against a server with --serve_queue small enough to see clients
+ * that cannot keep up being dropped (the server logs those). The feeder
+ * stands in for capture-encode where there is no camera or encoder: units
+ * go out on an absolute schedule, a keyframe with codec config in front once
+ * a second, and it reports the rate it actually fed next to the server's
+ * report, which is what a client at full rate gets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shmring.h"
+#include "au.h"
+#include "gop.h"
+#include "server.h"
+
+#define MAX_CLIENTS   256
+#define READ_SIZE     (64 << 10)
+#define UNIT_SIZE     (4 << 20)
+
+static int64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (int64_t)1000000 + now.tv_nsec / 1000;
+}
+
+static int connect_to(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+static int write_out(const char *buf, ssize_t n)
+{
+	ssize_t w, off;
+
+	for (off = 0; off < n; off += w)
+		if ((w = write(STDOUT_FILENO, buf + off, n - off)) < 0) {
+			if (errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			fprintf(stderr, "write error %d, %s\n", errno, strerror(errno));
+			return -1;
+		}
+	return 0;
+}
+
+/* one client, stream to stdout */
+static int copy_stream(int fd)
+{
+	static char buf[READ_SIZE];
+	unsigned long long total = 0;
+	ssize_t n;
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "read error %d, %s\n", errno, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (write_out(buf, n) < 0)
+			return EXIT_FAILURE;
+		total += n;
+	}
+	fprintf(stderr, "%llu bytes\n", total);
+	return EXIT_SUCCESS;
+}
+
+/* shared memory ring, stream to stdout until the writer closes it */
+static int copy_ring(const char *path)
+{
+	static char buf[UNIT_SIZE];
+	struct shmring_reader r;
+	struct shmring_unit unit;
+	unsigned long long total = 0;
+	int fd, got, closed;
+
+	if ((fd = shmring_connect(path)) < 0 || shmring_open(&r, fd) < 0) {
+		fprintf(stderr, "Cannot map the ring from '%s': %d, %s\n", path, errno, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (;;) {
+		/* closed is read first: whatever was published before it is still read */
+		closed = r.header->closed;
+		__sync_synchronize();
+		if ((got = shmring_next(&r, buf, sizeof(buf), &unit)) < 0) {
+			fprintf(stderr, "unit %llu: %d, %s\n", (unsigned long long)unit.seq, errno, strerror(errno));
+			break;
+		}
+		if (got) {
+			if (write_out(buf, unit.size) < 0)
+				break;
+			total += unit.size;
+		}
+		else if (closed)
+			break;
+		else
+			shmring_wait(&r, 1000);
+	}
+	fprintf(stderr, "%llu bytes, %lu overruns\n", total, r.overruns);
+	shmring_close(&r);
+	return EXIT_SUCCESS;
+}
+
+/* n clients reading and discarding for seconds */
+static int bench(const char *path, int n, int seconds)
+{
+	static char buf[READ_SIZE];
+	struct pollfd fds[MAX_CLIENTS];
+	unsigned long long bytes[MAX_CLIENTS], total = 0, lo = ~0ULL, hi = 0;
+	int64_t start, end, now;
+	int i, open, gone = 0;
+	ssize_t got;
+
+	for (i = 0; i < n; i++) {
+		if ((fds[i].fd = connect_to(path)) < 0) {
+			fprintf(stderr, "Cannot connect to '%s': %d, %s\n", path, errno, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		fds[i].events = POLLIN;
+		bytes[i] = 0;
+	}
+
+	start = now_us();
+	end = start + seconds * (int64_t)1000000;
+	open = n;
+	while (open > 0 && (now = now_us()) < end) {
+		if (poll(fds, n, (end - now) / 1000 + 1) < 0 && errno != EINTR)
+			break;
+		for (i = 0; i < n; i++) {
+			if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			if ((got = read(fds[i].fd, buf, sizeof(buf))) > 0)
+				bytes[i] += got;
+			else if (got == 0 || errno != EINTR) {
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				open--;
+				gone++;
+			}
+		}
+	}
+	now = now_us();
+
+	for (i = 0; i < n; i++) {
+		total += bytes[i];
+		if (bytes[i] < lo)
+			lo = bytes[i];
+		if (bytes[i] > hi)
+			hi = bytes[i];
+		if (fds[i].fd >= 0)
+			close(fds[i].fd);
+	}
+	fprintf(stderr, "%d clients, %.1f s: %.2f MB/s aggregate, per client %.3f min %.3f avg %.3f max MB/s, %d disconnected\n",
+		n, (now - start) / 1e6, total / ((now - start) / 1e6) / (1 << 20),
+		lo / ((now - start) / 1e6) / (1 << 20), (double)total / n / ((now - start) / 1e6) / (1 << 20),
+		hi / ((now - start) / 1e6) / (1 << 20), gone);
+	return EXIT_SUCCESS;
+}
+
+/* serve rate units a second of size bytes on path for seconds, as capture-encode --serve would */
+static int feed(const char *path, int rate, size_t size, int seconds)
+{
+	static const unsigned char config[] = { 0, 0, 0, 1, 0x67, 0x42, 0xc0, 0x28, 0, 0, 0, 1, 0x68, 0xce, 0x3c, 0x80 };
+	struct timespec next;
+	struct au *au;
+	unsigned long long bytes = 0;
+	int64_t start, end;
+	long i, units = (long)rate * seconds;
+
+	serve_path = (char *)path;
+	server_open();
+	fprintf(stderr, "feeding %d units/s of %zu bytes (%.2f MB/s) on '%s' for %d s\n", rate, size,
+		(double)rate * size / (1 << 20), path, seconds);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	start = now_us();
+	for (i = 0; i < units; i++) {
+		if (i % rate == 0 && (au = au_append(au_new(sizeof(config)), config, sizeof(config))) != NULL) {
+			au->flags = AU_CONFIG;
+			au->timestamp = now_us();
+			server_unit(au);
+			gop_add(au);
+			au_unref(au);
+		}
+		if ((au = au_new(size)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			break;
+		}
+		memset(au->data, i, size);
+		memcpy(au->data, "\0\0\0\1", 4);
+		au->data[4] = i % rate == 0 ? 0x65 : 0x41;
+		au->size = size;
+		au->flags = i % rate == 0 ? AU_KEYFRAME : 0;
+		au->timestamp = now_us();
+		server_unit(au);
+		gop_add(au);
+		au_unref(au);
+		bytes += size;
+
+		/* on schedule from the start, so time spent feeding is not added to every period */
+		next.tv_nsec += 1000000000L / rate;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+	}
+	end = now_us();
+
+	fprintf(stderr, "fed %ld units, %.1f MB in %.1f s: %.2f MB/s\n", i, bytes / (double)(1 << 20), (end - start) / 1e6,
+		bytes / ((end - start) / 1e6) / (1 << 20));
+	server_report(stderr);
+	server_close();
+	gop_clear();
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	int c, fd, clients = 1, seconds = 10, ring = 0, feeder = 0, rate = 30, size_kb = 50;
+
+	while ((c = getopt(argc, argv, "n:t:mfr:s:")) != -1)
+		switch (c) {
+		case 'm':
+			ring = 1;
+			break;
+		case 'f':
+			feeder = 1;
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 's':
+			size_kb = atoi(optarg);
+			break;
+		case 'n':
+			clients = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	if (optind != argc - 1 || clients < 1 || clients > MAX_CLIENTS || seconds < 1 || rate < 1 || rate > 10000 ||
+		size_kb < 1 || size_kb > (UNIT_SIZE >> 10))
+		goto usage;
+
+	if (feeder)
+		return feed(argv[optind], rate, (size_t)size_kb << 10, seconds);
+	if (ring)
+		return copy_ring(argv[optind]);
+	if (clients > 1)
+		return bench(argv[optind], clients, seconds);
+
+	if ((fd = connect_to(argv[optind])) < 0) {
+		fprintf(stderr, "Cannot connect to '%s': %d, %s\n", argv[optind], errno, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	return copy_stream(fd);
+
+usage:
+	fprintf(stderr, "Usage: %s [-m | -n CLIENTS [-t SECONDS] | -f [-r UNITS] [-s KB] [-t SECONDS]] PATH\n"
+		"Copy the stream served on PATH to stdout, or with -n read it with that many clients\n"
+		"for SECONDS [10] and report the throughput; with -m PATH is capture-encode's --shm;\n"
+		"with -f serve a synthetic stream on PATH, UNITS [30] a second of KB [50] each\n", argv[0]);
+	return EXIT_FAILURE;
+}